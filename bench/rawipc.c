@@ -0,0 +1,360 @@
+/*
+ * rawipc: the bench_sysvipc cases written against the bare system
+ * calls, so the cost of the Ruby binding can be told apart from the
+ * cost of the kernel.
+ *
+ *   cc -O2 -o rawipc bench/rawipc.c     (add -lrt on older glibc)
+ *   ./rawipc [-d seconds] [-o results.json] [case ...]
+ *
+ * Records have the same fields as those of bench_sysvipc, with
+ * "impl" set to "raw" and no allocation count.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/sem.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct result {
+  const char *name;
+  size_t size;
+  uint64_t ops;
+  double ops_per_sec;
+  uint64_t p50, p99, p999;
+};
+
+static double duration = 1.0;
+static const char **only;
+static int nonly;
+static struct result results[64];
+static int nresults;
+
+static uint64_t
+now_ns ()
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static long
+sysctl (name, def)
+     const char *name;
+     long def;
+{
+  char path[128];
+  FILE *f;
+  long v;
+
+  snprintf (path, sizeof (path), "/proc/sys/kernel/%s", name);
+  if (!(f = fopen (path, "r")))
+    return def;
+  if (fscanf (f, "%ld", &v) != 1)
+    v = def;
+  fclose (f);
+  return v;
+}
+
+static void
+die (what)
+     const char *what;
+{
+  perror (what);
+  exit (1);
+}
+
+static int
+wanted (name)
+     const char *name;
+{
+  int i;
+
+  if (!nonly)
+    return 1;
+  for (i = 0; i < nonly; i++)
+    if (!strcmp (only[i], name))
+      return 1;
+  return 0;
+}
+
+static int
+cmp_u64 (a, b)
+     const void *a, *b;
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static uint64_t
+percentile (lat, n, p)
+     uint64_t *lat;
+     size_t n;
+     double p;
+{
+  size_t i = (size_t)(p * n + 0.999999);
+  return lat[i ? i - 1 : 0];
+}
+
+typedef void (*op_func) (void *);
+
+/* Time +op+ repeatedly for +duration+ seconds and record one result. */
+
+static void
+measure (name, size, op, arg)
+     const char *name;
+     size_t size;
+     op_func op;
+     void *arg;
+{
+  size_t n = 0, cap = 1 << 16;
+  uint64_t *lat, start, deadline, t;
+  struct result *r;
+  int i;
+
+  if (!wanted (name))
+    return;
+
+  for (i = 0; i < 10; i++)
+    op (arg);
+
+  if (!(lat = malloc (cap * sizeof (*lat))))
+    die ("malloc");
+  start = now_ns ();
+  deadline = start + (uint64_t)(duration * 1e9);
+  do
+    {
+      t = now_ns ();
+      op (arg);
+      if (n == cap && !(lat = realloc (lat, (cap *= 2) * sizeof (*lat))))
+	die ("realloc");
+      lat[n++] = now_ns () - t;
+    }
+  while (n < 100 || now_ns () < deadline);
+
+  qsort (lat, n, sizeof (*lat), cmp_u64);
+  r = &results[nresults++];
+  r->name = name;
+  r->size = size;
+  r->ops = n;
+  r->ops_per_sec = n / ((now_ns () - start) / 1e9);
+  r->p50 = percentile (lat, n, 0.50);
+  r->p99 = percentile (lat, n, 0.99);
+  r->p999 = percentile (lat, n, 0.999);
+  free (lat);
+
+  printf ("%-18s %9zu %12.0f ops/s %9llu %9llu %9llu ns\n", name, size,
+	  r->ops_per_sec, (unsigned long long)r->p50,
+	  (unsigned long long)r->p99, (unsigned long long)r->p999);
+}
+
+struct msg_arg {
+  int id;
+  size_t size;
+  struct msgbuf *buf;
+};
+
+static void
+msg_pingpong (p)
+     void *p;
+{
+  struct msg_arg *a = p;
+
+  a->buf->mtype = 1;
+  if (msgsnd (a->id, a->buf, a->size, 0) == -1)
+    die ("msgsnd");
+  if (msgrcv (a->id, a->buf, a->size, 2, 0) == -1)
+    die ("msgrcv");
+}
+
+static void
+bench_msg ()
+{
+  static const size_t sizes[] = { 16, 256, 4096, 65536 };
+  long msgmax = sysctl ("msgmax", 8192);
+  struct msg_arg a;
+  pid_t pid;
+  size_t i;
+
+  if ((a.id = msgget (IPC_PRIVATE, IPC_CREAT | 0600)) == -1)
+    die ("msgget");
+  if (!(a.buf = malloc (sizeof (long) + msgmax)))
+    die ("malloc");
+
+  if ((pid = fork ()) == 0)
+    {
+      ssize_t len;
+
+      while ((len = msgrcv (a.id, a.buf, msgmax, 1, 0)) > 0)
+	{
+	  a.buf->mtype = 2;
+	  if (msgsnd (a.id, a.buf, len, 0) == -1)
+	    _exit (1);
+	}
+      _exit (0);
+    }
+
+  for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+    {
+      if (sizes[i] > (size_t)msgmax)
+	{
+	  fprintf (stderr, "msg_pingpong %zu: skipped, exceeds msgmax %ld\n",
+		   sizes[i], msgmax);
+	  continue;
+	}
+      a.size = sizes[i];
+      memset (a.buf->mtext, 'x', a.size);
+      measure ("msg_pingpong", a.size, msg_pingpong, &a);
+    }
+
+  a.buf->mtype = 1;
+  msgsnd (a.id, a.buf, 0, 0);
+  waitpid (pid, NULL, 0);
+  msgctl (a.id, IPC_RMID, 0);
+  free (a.buf);
+}
+
+static void
+sem_lock_unlock (p)
+     void *p;
+{
+  int id = *(int *)p;
+  struct sembuf lock = { 0, -1, 0 }, unlock = { 0, 1, 0 };
+
+  if (semop (id, &lock, 1) == -1 || semop (id, &unlock, 1) == -1)
+    die ("semop");
+}
+
+static void
+bench_sem ()
+{
+  struct sembuf init = { 0, 1, 0 };
+  int id;
+
+  if ((id = semget (IPC_PRIVATE, 1, IPC_CREAT | 0600)) == -1)
+    die ("semget");
+  if (semop (id, &init, 1) == -1)
+    die ("semop");
+  measure ("sem_lock_unlock", 0, sem_lock_unlock, &id);
+  semctl (id, 0, IPC_RMID, 0);
+}
+
+struct shm_arg {
+  char *seg;
+  char *buf;
+  size_t size;
+};
+
+static void
+shm_write (p)
+     void *p;
+{
+  struct shm_arg *a = p;
+  memcpy (a->seg, a->buf, a->size);
+}
+
+static void
+shm_read (p)
+     void *p;
+{
+  struct shm_arg *a = p;
+  memcpy (a->buf, a->seg, a->size);
+}
+
+static void
+bench_shm ()
+{
+  static const size_t sizes[] = { 64, 4096, 65536, 1 << 20, 16 << 20 };
+  long shmmax = sysctl ("shmmax", 32 << 20);
+  size_t i, max = 0;
+  struct shm_arg a;
+  int id;
+
+  for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+    if (sizes[i] <= (size_t)shmmax && sizes[i] > max)
+      max = sizes[i];
+  if ((id = shmget (IPC_PRIVATE, max, IPC_CREAT | 0600)) == -1)
+    die ("shmget");
+  if ((a.seg = shmat (id, 0, 0)) == (void *)-1)
+    die ("shmat");
+  if (!(a.buf = malloc (max)))
+    die ("malloc");
+  memset (a.buf, 'x', max);
+
+  for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+    {
+      if (sizes[i] > max)
+	continue;
+      a.size = sizes[i];
+      measure ("shm_write", a.size, shm_write, &a);
+      measure ("shm_read", a.size, shm_read, &a);
+    }
+
+  shmdt (a.seg);
+  shmctl (id, IPC_RMID, 0);
+  free (a.buf);
+}
+
+static int
+cmp_result (a, b)
+     const void *a, *b;
+{
+  const struct result *x = a, *y = b;
+  int c = strcmp (x->name, y->name);
+  return c ? c : (x->size > y->size) - (x->size < y->size);
+}
+
+int
+main (argc, argv)
+     int argc;
+     char **argv;
+{
+  const char *output = NULL;
+  FILE *f;
+  int i;
+
+  only = (const char **)argv;
+  for (i = 1; i < argc; i++)
+    if (!strcmp (argv[i], "-d") && i + 1 < argc)
+      duration = atof (argv[++i]);
+    else if (!strcmp (argv[i], "-o") && i + 1 < argc)
+      output = argv[++i];
+    else
+      only[nonly++] = argv[i];
+
+  printf ("%-18s %9s %16s %9s %9s %9s\n",
+	  "case", "size", "throughput", "p50", "p99", "p999");
+  bench_msg ();
+  bench_sem ();
+  bench_shm ();
+
+  if (output)
+    {
+      qsort (results, nresults, sizeof (results[0]), cmp_result);
+      if (!(f = fopen (output, "w")))
+	die (output);
+      for (i = 0; i < nresults; i++)
+	fprintf (f, "{\"name\": \"%s\", \"impl\": \"raw\", \"size\": %zu, "
+		 "\"ops\": %llu, \"ops_per_sec\": %.3f, \"p50_ns\": %llu, "
+		 "\"p99_ns\": %llu, \"p999_ns\": %llu, "
+		 "\"allocs_per_op\": null}\n",
+		 results[i].name, results[i].size,
+		 (unsigned long long)results[i].ops, results[i].ops_per_sec,
+		 (unsigned long long)results[i].p50,
+		 (unsigned long long)results[i].p99,
+		 (unsigned long long)results[i].p999);
+      fclose (f);
+    }
+
+  return 0;
+}
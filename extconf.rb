@@ -35,6 +35,43 @@ end
 
 have_type('struct msgbuf', 'sys/msg.h')
 have_type('union semun', 'sys/sem.h')
+have_func('semtimedop', 'sys/sem.h')
+
+have_struct_member('rb_data_type_t', 'flags', 'ruby.h')
+have_func('rb_gc_mark_movable', 'ruby.h')
+have_func('rb_gc_adjust_memory_usage', 'ruby.h')
+
+have_header('ruby/thread.h') and
+  have_func('rb_thread_call_without_gvl', 'ruby/thread.h') and
+  have_func('rb_thread_call_without_gvl2', 'ruby/thread.h')
+have_func('rb_thread_blocking_region', 'ruby.h')
+have_func('rb_thread_check_ints', 'ruby.h')
+have_func('rb_ext_ractor_safe', 'ruby.h')
+have_header('pthread.h')
+have_func('fdatasync', 'unistd.h')
+have_func('memmem', 'string.h')
+have_header('linux/futex.h')
+have_header('sys/syscall.h')
+have_header('immintrin.h')
+have_header('sys/sdt.h')
+have_header('linux/fs.h')
+have_func('rb_str_locktmp', 'ruby.h')
+
+unless have_func('clock_gettime', 'time.h')
+  have_library('rt') and have_func('clock_gettime', 'time.h')
+end
+
+# POSIX IPC lives in librt on older glibc, semaphores in libpthread.
+have_header('mqueue.h') and
+  (have_func('mq_open', 'mqueue.h') or
+   (have_library('rt') and have_func('mq_open', 'mqueue.h')))
+have_header('sys/mman.h') and
+  (have_func('shm_open', 'sys/mman.h') or
+   (have_library('rt') and have_func('shm_open', 'sys/mman.h')))
+have_header('semaphore.h') and
+  (have_func('sem_init', 'semaphore.h') or
+   (have_library('pthread') and have_func('sem_init', 'semaphore.h')))
+have_func('sem_timedwait', 'semaphore.h')
 
 if have_header('sys/types.h') and have_header('sys/ipc.h') and
     have_header('sys/msg.h') and have_func('msgget') and
@@ -64,37 +64,265 @@
  *      PURPOSE.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1		/* semtimedop, memmem */
+#endif
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
 #include <sys/sem.h>
 #include <sys/shm.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
 #include "ruby.h"
 #include "rubysig.h"
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include "ruby/thread.h"
+#endif
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+#if defined(HAVE_LINUX_FUTEX_H) && defined(SYS_futex)
+#include <linux/futex.h>
+#define IPC_HAVE_FUTEX 1
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_MQ_OPEN
+#include <mqueue.h>
+#endif
+#ifdef HAVE_SEM_INIT
+#include <semaphore.h>
+#endif
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#if defined(HAVE_IMMINTRIN_H) && defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define IPC_HAVE_STREAM 1
+#endif
+
+#ifdef HAVE_RB_THREAD_CHECK_INTS
+#define IPC_CHECK_INTS() rb_thread_check_ints ()
+#else
+#define IPC_CHECK_INTS() CHECK_INTS
+#endif
 
 #ifndef EWOULDBLOCK
 #define EWOULDBLOCK EAGAIN
 #endif
 
+#ifdef __GNUC__
+#define IPC_UNLIKELY(x) __builtin_expect (!!(x), 0)
+#else
+#define IPC_UNLIKELY(x) (x)
+#endif
+
+/*
+ * USDT probes of provider "sysvipc", for perf, bpftrace or SystemTap.
+ * A probe is a single nop until a tracer attaches to it.
+ */
+#ifdef HAVE_SYS_SDT_H
+#define IPC_PROBE1(n, a) DTRACE_PROBE1 (sysvipc, n, a)
+#define IPC_PROBE2(n, a, b) DTRACE_PROBE2 (sysvipc, n, a, b)
+#define IPC_PROBE3(n, a, b, c) DTRACE_PROBE3 (sysvipc, n, a, b, c)
+#define IPC_PROBE4(n, a, b, c, d) DTRACE_PROBE4 (sysvipc, n, a, b, c, d)
+#define IPC_PROBE5(n, a, b, c, d, e) \
+  DTRACE_PROBE5 (sysvipc, n, a, b, c, d, e)
+#else
+#define IPC_PROBE1(n, a) ((void) 0)
+#define IPC_PROBE2(n, a, b) ((void) 0)
+#define IPC_PROBE3(n, a, b, c) ((void) 0)
+#define IPC_PROBE4(n, a, b, c, d) ((void) 0)
+#define IPC_PROBE5(n, a, b, c, d, e) ((void) 0)
+#endif
+
+#if !defined(HAVE_RB_DATA_TYPE_T_FLAGS)
+/*
+ * Rubies without typed data objects: keep the same declarations and
+ * fall back to plain data objects.  dsize, dcompact and the type
+ * checks are ignored.
+ */
+typedef struct ipc_data_type {
+  const char *wrap_struct_name;
+  struct {
+    void (*dmark) (void *);
+    void (*dfree) (void *);
+    size_t (*dsize) (const void *);
+    void (*dcompact) (void *);
+  } function;
+  const struct ipc_data_type *parent;
+  void *data;
+  VALUE flags;
+} ipc_data_type_t;
+#define rb_data_type_t ipc_data_type_t
+#undef TypedData_Make_Struct
+#undef TypedData_Wrap_Struct
+#undef TypedData_Get_Struct
+#define TypedData_Make_Struct(klass, type, data_type, sval)		\
+  Data_Make_Struct (klass, type, (data_type)->function.dmark,		\
+		    (data_type)->function.dfree, sval)
+#define TypedData_Wrap_Struct(klass, data_type, sval)			\
+  Data_Wrap_Struct (klass, (data_type)->function.dmark,		\
+		    (data_type)->function.dfree, sval)
+#define TypedData_Get_Struct(obj, type, data_type, sval)		\
+  Data_Get_Struct (obj, type, sval)
+#endif
+
+#ifndef RUBY_TYPED_FREE_IMMEDIATELY
+#define RUBY_TYPED_FREE_IMMEDIATELY 0
+#endif
+#ifndef RUBY_TYPED_FROZEN_SHAREABLE
+#define RUBY_TYPED_FROZEN_SHAREABLE 0
+#endif
+#ifndef RUBY_TYPED_DEFAULT_FREE
+#define RUBY_TYPED_DEFAULT_FREE ((void (*) (void *))-1)
+#endif
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+#define ipc_gc_mark(v) rb_gc_mark_movable (v)
+#define ipc_gc_location(v) rb_gc_location (v)
+#define IPC_DCOMPACT(f) f
+#else
+#define ipc_gc_mark(v) rb_gc_mark (v)
+#define ipc_gc_location(v) (v)
+#define IPC_DCOMPACT(f) 0
+#endif
+
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+#define ipc_adjust_memory_usage(n) rb_gc_adjust_memory_usage (n)
+#else
+#define ipc_adjust_memory_usage(n) ((void)0)
+#endif
+
+#ifndef RB_GC_GUARD
+#define RB_GC_GUARD(v) (*(volatile VALUE *)&(v))
+#endif
+
+#ifndef NUM2SIZET
+#define NUM2SIZET(v) ((size_t)NUM2ULONG (v))
+#endif
+#ifndef SIZET2NUM
+#define SIZET2NUM(v) ULONG2NUM (v)
+#endif
+
+/*
+ * Atomic access to words shared with other processes.  Plain loads
+ * and stores of aligned words are not torn, the macros below add the
+ * ordering.
+ */
+
+#if defined(__ATOMIC_ACQUIRE)
+#define ATOMIC_LOAD(p)		__atomic_load_n ((p), __ATOMIC_RELAXED)
+#define ATOMIC_LOAD_ACQ(p)	__atomic_load_n ((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v)	__atomic_store_n ((p), (v), __ATOMIC_RELAXED)
+#define ATOMIC_STORE_REL(p, v)	__atomic_store_n ((p), (v), __ATOMIC_RELEASE)
+#define ATOMIC_FETCH_ADD(p, v)	__atomic_fetch_add ((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_FETCH_OR(p, v)	__atomic_fetch_or ((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_FETCH_AND(p, v)	__atomic_fetch_and ((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_ADD(p, v)	((void)__atomic_fetch_add ((p), (v), __ATOMIC_RELAXED))
+#define ATOMIC_CAS(p, o, n)	__sync_bool_compare_and_swap ((p), (o), (n))
+#define ATOMIC_ACQUIRE_FENCE()	__atomic_thread_fence (__ATOMIC_ACQUIRE)
+#define ATOMIC_RELEASE_FENCE()	__atomic_thread_fence (__ATOMIC_RELEASE)
+#define ATOMIC_FENCE()		__atomic_thread_fence (__ATOMIC_SEQ_CST)
+#else
+#define ATOMIC_LOAD(p)		(*(volatile __typeof__ (*(p)) *)(p))
+#define ATOMIC_LOAD_ACQ(p)	__sync_fetch_and_add ((p), 0)
+#define ATOMIC_STORE(p, v)	(*(volatile __typeof__ (*(p)) *)(p) = (v))
+#define ATOMIC_STORE_REL(p, v)	(__sync_synchronize (), ATOMIC_STORE (p, v))
+#define ATOMIC_FETCH_ADD(p, v)	__sync_fetch_and_add ((p), (v))
+#define ATOMIC_FETCH_OR(p, v)	__sync_fetch_and_or ((p), (v))
+#define ATOMIC_FETCH_AND(p, v)	__sync_fetch_and_and ((p), (v))
+#define ATOMIC_ADD(p, v)	((void)__sync_fetch_and_add ((p), (v)))
+#define ATOMIC_CAS(p, o, n)	__sync_bool_compare_and_swap ((p), (o), (n))
+#define ATOMIC_ACQUIRE_FENCE()	__sync_synchronize ()
+#define ATOMIC_RELEASE_FENCE()	__sync_synchronize ()
+#define ATOMIC_FENCE()		__sync_synchronize ()
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
+#define IPC_CPU_RELAX() __asm__ __volatile__ ("pause" ::: "memory")
+#elif defined(__aarch64__) || defined(__arm__)
+#define IPC_CPU_RELAX() __asm__ __volatile__ ("yield" ::: "memory")
+#else
+#define IPC_CPU_RELAX() ((void)0)
+#endif
+
+#define IPC_CACHELINE 64
+#define IPC_ALIGN(n, a) (((n) + (a) - 1) & ~(size_t)((a) - 1))
+
+/*
+ * Optional per-object counters.  Latencies are kept in a histogram
+ * of power-of-two nanosecond buckets: bucket i counts operations that
+ * took [2**i, 2**(i+1)) ns, the last one is open ended.  Counters are
+ * added to atomically since Ractors may share an object, and all of
+ * them update the process totals.
+ */
+
+#define IPC_STATS_NBUCKETS 40
+
+struct ipc_stats {
+  uint64_t ops;
+  uint64_t bytes;
+  uint64_t retries;
+  uint64_t polls;
+  uint64_t spins;
+  uint64_t parks;
+  uint64_t blocked_ns;
+  uint64_t hist[IPC_STATS_NBUCKETS];
+};
+
+/*
+ * The result of an IPC_STAT lives on the stack of the caller, not in
+ * the handle, which may be shared between Ractors.
+ */
+
+union ipc_stat {
+  struct msqid_ds msgstat;
+  struct semid_ds semstat;
+  struct shmid_ds shmstat;
+};
+
 struct ipcid_ds {
   int id;
   int flags;
-  union {
-    struct msqid_ds msgstat;
-    struct semid_ds semstat;
-    struct shmid_ds shmstat;
-  } u;
-
-#define msgstat u.msgstat
-#define semstat u.semstat
-#define shmstat u.shmstat
+  pid_t cpid;			/* POSIX objects created by this process */
 
-  void (*stat) (struct ipcid_ds *);
+  void (*stat) (struct ipcid_ds *, union ipc_stat *);
   void (*rmid) (struct ipcid_ds *);
-  struct ipc_perm * (*perm) (struct ipcid_ds *);
+  struct ipc_perm * (*perm) (union ipc_stat *);
 
   void *data;
+  size_t attached;		/* bytes mapped at data */
+  struct ipc_stats *stats;	/* NULL unless enabled */
+
+  char *name;			/* POSIX objects */
+  void *handle;
+  size_t maxsize;
+
+  unsigned long spin_max;	/* busy polling, 0 when disabled */
+  unsigned long spin_limit;	/* current, adaptive, budget */
+  uint64_t spin_ns;
+
+  int copy_threads;		/* SharedMemory, 0 for 1 */
+  unsigned long pins;		/* SharedMemory, GVL-free calls using data */
 };
 
 #if !defined(HAVE_TYPE_STRUCT_MSGBUF)
@@ -113,7 +341,317 @@ union semun {
 };
 #endif
 
-static VALUE cError;
+/*
+ * The control system calls, with a probe on entry and on return;
+ * the return probes carry errno, 0 on success.
+ */
+
+static int
+ipc_msgctl (id, cmd, buf)
+     int id, cmd;
+     struct msqid_ds *buf;
+{
+  int ret;
+
+  IPC_PROBE2 (msgctl__entry, id, cmd);
+  ret = msgctl (id, cmd, buf);
+  IPC_PROBE4 (msgctl__return, id, cmd, ret, ret == -1 ? errno : 0);
+  return ret;
+}
+
+static int
+ipc_semctl (id, num, cmd, arg)
+     int id, num, cmd;
+     union semun *arg;
+{
+  int ret;
+
+  IPC_PROBE3 (semctl__entry, id, num, cmd);
+  ret = arg ? semctl (id, num, cmd, *arg) : semctl (id, num, cmd, 0);
+  IPC_PROBE5 (semctl__return, id, num, cmd, ret, ret == -1 ? errno : 0);
+  return ret;
+}
+
+static int
+ipc_shmctl (id, cmd, buf)
+     int id, cmd;
+     struct shmid_ds *buf;
+{
+  int ret;
+
+  IPC_PROBE2 (shmctl__entry, id, cmd);
+  ret = shmctl (id, cmd, buf);
+  IPC_PROBE4 (shmctl__return, id, cmd, ret, ret == -1 ? errno : 0);
+  return ret;
+}
+
+static void *
+ipc_shmat (id, flags)
+     int id, flags;
+{
+  void *data;
+
+  IPC_PROBE2 (shmat__entry, id, flags);
+  data = shmat (id, 0, flags);
+  IPC_PROBE3 (shmat__return, id, data,
+	      data == (void *)-1 ? errno : 0);
+  return data;
+}
+
+static int
+ipc_shmdt (id, data)
+     int id;
+     void *data;
+{
+  int ret;
+
+  IPC_PROBE2 (shmdt__entry, id, data);
+  ret = shmdt (data);
+  IPC_PROBE2 (shmdt__return, id, ret == -1 ? errno : 0);
+  return ret;
+}
+
+static VALUE cError, cTimeoutError;
+
+static struct ipc_stats ipc_global_stats;
+static int ipc_stats_default;
+
+static uint64_t
+ipc_clock_ns ()
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+static int
+ipc_stats_bucket (ns)
+     uint64_t ns;
+{
+  int i;
+
+#ifdef __GNUC__
+  i = 63 - __builtin_clzll (ns | 1);
+#else
+  for (i = 0; ns > 1; i++)
+    ns >>= 1;
+#endif
+  return i < IPC_STATS_NBUCKETS ? i : IPC_STATS_NBUCKETS - 1;
+}
+
+static void
+ipc_stats_record (st, bytes, t0)
+     struct ipc_stats *st;
+     size_t bytes;
+     uint64_t t0;
+{
+  uint64_t ns = ipc_clock_ns () - t0;
+  int bucket = ipc_stats_bucket (ns);
+
+  ATOMIC_ADD (&st->ops, 1);
+  ATOMIC_ADD (&st->bytes, bytes);
+  ATOMIC_ADD (&st->blocked_ns, ns);
+  ATOMIC_ADD (&st->hist[bucket], 1);
+
+  ATOMIC_ADD (&ipc_global_stats.ops, 1);
+  ATOMIC_ADD (&ipc_global_stats.bytes, bytes);
+  ATOMIC_ADD (&ipc_global_stats.blocked_ns, ns);
+  ATOMIC_ADD (&ipc_global_stats.hist[bucket], 1);
+}
+
+/*
+ * Each hook below costs a single, well predicted branch when
+ * statistics are disabled for the object.
+ */
+
+#define IPC_STATS_BEGIN(ipcid) \
+  (IPC_UNLIKELY ((ipcid)->stats != NULL) ? ipc_clock_ns () : 0)
+
+#define IPC_STATS_END(ipcid, bytes, t0)				\
+  do {								\
+    if (IPC_UNLIKELY ((ipcid)->stats != NULL))			\
+      ipc_stats_record ((ipcid)->stats, (bytes), (t0));		\
+  } while (0)
+
+#define IPC_STATS_RETRY(ipcid)					\
+  do {								\
+    if (IPC_UNLIKELY ((ipcid)->stats != NULL))			\
+      {								\
+	ATOMIC_ADD (&(ipcid)->stats->retries, 1);		\
+	ATOMIC_ADD (&ipc_global_stats.retries, 1);		\
+      }								\
+  } while (0)
+
+#define IPC_STATS_POLL(ipcid)					\
+  do {								\
+    if (IPC_UNLIKELY ((ipcid)->stats != NULL))			\
+      {								\
+	ATOMIC_ADD (&(ipcid)->stats->polls, 1);			\
+	ATOMIC_ADD (&ipc_global_stats.polls, 1);		\
+      }								\
+  } while (0)
+
+static VALUE
+ipc_stats_to_hash (st)
+     struct ipc_stats *st;
+{
+  VALUE hash, hist;
+  int i;
+
+  hist = rb_ary_new2 (IPC_STATS_NBUCKETS);
+  for (i = 0; i < IPC_STATS_NBUCKETS; i++)
+    rb_ary_push (hist, ULL2NUM (st->hist[i]));
+
+  hash = rb_hash_new ();
+  rb_hash_aset (hash, ID2SYM (rb_intern ("ops")), ULL2NUM (st->ops));
+  rb_hash_aset (hash, ID2SYM (rb_intern ("bytes")), ULL2NUM (st->bytes));
+  rb_hash_aset (hash, ID2SYM (rb_intern ("retries")), ULL2NUM (st->retries));
+  rb_hash_aset (hash, ID2SYM (rb_intern ("polls")), ULL2NUM (st->polls));
+  rb_hash_aset (hash, ID2SYM (rb_intern ("spins")), ULL2NUM (st->spins));
+  rb_hash_aset (hash, ID2SYM (rb_intern ("parks")), ULL2NUM (st->parks));
+  rb_hash_aset (hash, ID2SYM (rb_intern ("blocked_ns")),
+		ULL2NUM (st->blocked_ns));
+  rb_hash_aset (hash, ID2SYM (rb_intern ("histogram")), hist);
+
+  return hash;
+}
+
+static void
+ipc_free (ipcid)
+     struct ipcid_ds *ipcid;
+{
+  if (ipcid->stats)
+    xfree (ipcid->stats);
+  if (ipcid->name)
+    xfree (ipcid->name);
+  xfree (ipcid);
+}
+
+/*
+ * A SharedMemory object that is garbage collected while attached
+ * detaches its segment, so dropped handles do not keep mappings
+ * alive until exit; unless a call without the interpreter lock still
+ * uses it.
+ */
+
+static void
+shm_free (shmid)
+     struct ipcid_ds *shmid;
+{
+  if (shmid->data && !ATOMIC_LOAD (&shmid->pins))
+    {
+      ipc_shmdt (shmid->id, shmid->data);
+      ipc_adjust_memory_usage (-(ssize_t)shmid->attached);
+    }
+  ipc_free (shmid);
+}
+
+static size_t
+ipc_memsize (ptr)
+     const void *ptr;
+{
+  const struct ipcid_ds *ipcid = ptr;
+
+  return sizeof (*ipcid) + (ipcid->stats ? sizeof (*ipcid->stats) : 0)
+    + ipcid->attached;
+}
+
+static const rb_data_type_t ipcid_data_type = {
+  "SystemVIPC::IPCObject",
+  { 0, (void (*) (void *))ipc_free, ipc_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static const rb_data_type_t msg_data_type = {
+  "SystemVIPC::MessageQueue",
+  { 0, (void (*) (void *))ipc_free, ipc_memsize, },
+  &ipcid_data_type, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+static const rb_data_type_t sem_data_type = {
+  "SystemVIPC::Semaphore",
+  { 0, (void (*) (void *))ipc_free, ipc_memsize, },
+  &ipcid_data_type, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+static const rb_data_type_t shm_data_type = {
+  "SystemVIPC::SharedMemory",
+  { 0, (void (*) (void *))shm_free, ipc_memsize, },
+  &ipcid_data_type, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+static size_t
+semop_memsize (ptr)
+     const void *ptr;
+{
+  return sizeof (struct sembuf);
+}
+
+static const rb_data_type_t semop_data_type = {
+  "SystemVIPC::SemaphoreOperation",
+  { 0, RUBY_TYPED_DEFAULT_FREE, semop_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/*
+ * A Permission refers to the ipc_perm structure of its IPCObject,
+ * and keeps that object alive.
+ */
+
+struct perm_ds {
+  VALUE ipc;
+};
+
+static void
+perm_mark (perm)
+     struct perm_ds *perm;
+{
+  ipc_gc_mark (perm->ipc);
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+perm_compact (perm)
+     struct perm_ds *perm;
+{
+  perm->ipc = ipc_gc_location (perm->ipc);
+}
+#endif
+
+static size_t
+perm_memsize (ptr)
+     const void *ptr;
+{
+  return sizeof (struct perm_ds);
+}
+
+static const rb_data_type_t perm_data_type = {
+  "SystemVIPC::Permission",
+  { (void (*) (void *))perm_mark, RUBY_TYPED_DEFAULT_FREE, perm_memsize,
+    IPC_DCOMPACT ((void (*) (void *))perm_compact), },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static void
+ipc_enable_stats (ipcid)
+     struct ipcid_ds *ipcid;
+{
+  if (ipcid->stats)
+    return;
+  ipcid->stats = ALLOC (struct ipc_stats);
+  MEMZERO (ipcid->stats, struct ipc_stats, 1);
+}
 
 /*
  * call-seq:
@@ -143,7 +681,7 @@ get_ipcid (obj)
      VALUE obj;
 {
   struct ipcid_ds *ipcid;
-  Data_Get_Struct (obj, struct ipcid_ds, ipcid);
+  TypedData_Get_Struct (obj, struct ipcid_ds, &ipcid_data_type, ipcid);
 
   if (ipcid->id < 0)
     rb_raise (cError, "closed handle");
@@ -151,15 +689,60 @@ get_ipcid (obj)
 }
 
 static struct ipcid_ds *
-get_ipcid_and_stat (obj)
+get_ipcid_and_stat (obj, st)
      VALUE obj;
+     union ipc_stat *st;
 {
   struct ipcid_ds *ipcid;
   ipcid = get_ipcid (obj);
-  ipcid->stat (ipcid);
+  ipcid->stat (ipcid, st);
   return ipcid;
 }
 
+/*
+ * Wrap the existing identifier +v_id+, checking that it is still
+ * valid with an IPC_STAT.
+ */
+
+static VALUE
+ipc_wrap_id (klass, data_type, v_id, stat, perm, rmid)
+     VALUE klass;
+     const rb_data_type_t *data_type;
+     VALUE v_id;
+     void (*stat) (struct ipcid_ds *, union ipc_stat *);
+     struct ipc_perm * (*perm) (union ipc_stat *);
+     void (*rmid) (struct ipcid_ds *);
+{
+  struct ipcid_ds *ipcid;
+  union ipc_stat st;
+  VALUE dst;
+
+  dst = TypedData_Make_Struct (klass, struct ipcid_ds, data_type, ipcid);
+  ipcid->id = NUM2INT (v_id);
+  ipcid->stat = stat;
+  ipcid->perm = perm;
+  ipcid->rmid = rmid;
+  stat (ipcid, &st);
+  if (ATOMIC_LOAD (&ipc_stats_default))
+    ipc_enable_stats (ipcid);
+
+  return dst;
+}
+
+/* call-seq:
+ *   id -> Fixnum
+ *
+ * Return the identifier of the object, to reopen it with .for_id in
+ * another Ractor or process.
+ */
+
+static VALUE
+rb_ipc_id (obj)
+     VALUE obj;
+{
+  return INT2FIX (get_ipcid (obj)->id);
+}
+
 /* call-seq:
  *   remove -> IPCObject
  *
@@ -172,75 +755,902 @@ rb_ipc_remove (obj)
 {
   struct ipcid_ds *ipcid;
 
+  rb_check_frozen (obj);
   ipcid = get_ipcid (obj);
   ipcid->rmid (ipcid);
 
   return obj;
 }
 
-static void
-msg_stat (msgid)
-     struct ipcid_ds *msgid;
+/* call-seq:
+ *   enable_stats -> IPCObject
+ *
+ * Start counting operations, bytes moved, retries, polls and
+ * latencies for this object. Return self.
+ */
+
+static VALUE
+rb_ipc_enable_stats (obj)
+     VALUE obj;
 {
-  if (msgctl (msgid->id, IPC_STAT, &msgid->msgstat) == -1)
-    rb_sys_fail ("msgctl(2)");
+  struct ipcid_ds *ipcid;
+
+  rb_check_frozen (obj);
+  TypedData_Get_Struct (obj, struct ipcid_ds, &ipcid_data_type, ipcid);
+  ipc_enable_stats (ipcid);
+
+  return obj;
 }
 
-static struct ipc_perm *
-msg_perm (msgid)
-     struct ipcid_ds *msgid;
+/* call-seq:
+ *   disable_stats -> IPCObject
+ *
+ * Stop counting and discard the counters of this object. Return self.
+ */
+
+static VALUE
+rb_ipc_disable_stats (obj)
+     VALUE obj;
 {
-  return &msgid->msgstat.msg_perm;
+  struct ipcid_ds *ipcid;
+
+  rb_check_frozen (obj);
+  TypedData_Get_Struct (obj, struct ipcid_ds, &ipcid_data_type, ipcid);
+  if (ipcid->stats)
+    {
+      xfree (ipcid->stats);
+      ipcid->stats = NULL;
+    }
+
+  return obj;
 }
 
-static void
-msg_rmid (msgid)
-     struct ipcid_ds *msgid;
+/* call-seq:
+ *   stats -> Hash or nil
+ *
+ * Return the counters of this object as a Hash with keys :ops,
+ * :bytes, :retries, :polls, :spins, :parks, :blocked_ns and
+ * :histogram, or nil if statistics are disabled. :spins counts the
+ * turns of busy polling loops, :parks the waits that went to sleep
+ * after them. <tt>histogram[i]</tt> is the number of
+ * operations that took between 2**i and 2**(i+1) nanoseconds.
+ */
+
+static VALUE
+rb_ipc_stats (obj)
+     VALUE obj;
 {
-  if (msgid->id < 0)
-    rb_raise (cError, "already removed");
-  if (msgctl (msgid->id, IPC_RMID, 0) == -1)
-    rb_sys_fail ("msgctl(2)");
-  msgid->id = -1;
+  struct ipcid_ds *ipcid;
+
+  TypedData_Get_Struct (obj, struct ipcid_ds, &ipcid_data_type, ipcid);
+  if (!ipcid->stats)
+    return Qnil;
+
+  return ipc_stats_to_hash (ipcid->stats);
 }
 
 /*
  * call-seq:
- *   MessageQueue.new(key, msgflg = 0) -> MessageQueue
+ *   SystemVIPC.stats -> Hash
  *
- * Create a new MessageQueue object associated with the message
- * queue identified by +key+. +msgflg+ is a bitwise OR selected from
- * IPC_CREAT and IPC_EXCL. See msgget(2).
+ * Return the sum of the counters of every object that had
+ * statistics enabled in this process. See IPCObject#stats.
  */
 
 static VALUE
-rb_msg_s_new (argc, argv, klass)
-     int argc;
-     VALUE *argv, klass;
+rb_ipc_s_stats (klass)
+     VALUE klass;
 {
-  struct ipcid_ds msgid_s, *msgid = &msgid_s;
-  VALUE dst, v_key, v_msgflg;
+  return ipc_stats_to_hash (&ipc_global_stats);
+}
 
-  dst = Data_Make_Struct (klass, struct ipcid_ds, NULL, free, msgid);
-  rb_scan_args (argc, argv, "11", &v_key, &v_msgflg);
-  if (!NIL_P (v_msgflg))
-    msgid->flags = NUM2INT (v_msgflg);
-  msgid->id = msgget ((key_t)NUM2INT (v_key), msgid->flags);
-  if (msgid->id == -1)
-    rb_sys_fail ("msgget(2)");
-  msgid->stat = msg_stat;
-  msgid->perm = msg_perm;
-  msgid->rmid = msg_rmid;
+/*
+ * call-seq:
+ *   SystemVIPC.enable_stats -> nil
+ *
+ * Enable statistics for every IPCObject created from now on.
+ */
 
-  return dst;
+static VALUE
+rb_ipc_s_enable_stats (klass)
+     VALUE klass;
+{
+  ATOMIC_STORE (&ipc_stats_default, 1);
+  return Qnil;
 }
 
 /*
  * call-seq:
- *   send(mtype, mtext, msgflg = 0) ->  MessageQueue
+ *   SystemVIPC.disable_stats -> nil
  *
- * Send message +mtext+ of type +mtype+ with flags +msgflg+. Return
- * self.  See msgop(2).
+ * Create new IPCObjects without statistics (the default).
+ */
+
+static VALUE
+rb_ipc_s_disable_stats (klass)
+     VALUE klass;
+{
+  ATOMIC_STORE (&ipc_stats_default, 0);
+  return Qnil;
+}
+
+/* call-seq:
+ *   enable_busy_poll(spins = 1000, usec = nil) -> IPCObject
+ *
+ * Before blocking in a call on this object, or in a wait on shared
+ * memory for a SharedMemory, spin up to +spins+ times, and for at
+ * most +usec+ microseconds, retrying it without blocking. The number
+ * of turns adapts to how often spinning succeeds. Worth it only when
+ * the other side answers within microseconds and a CPU can be spared,
+ * see SystemVIPC.set_affinity. Return self.
+ */
+
+static VALUE
+rb_ipc_enable_busy_poll (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct ipcid_ds *ipcid;
+  VALUE v_spins, v_usec;
+
+  rb_check_frozen (obj);
+  TypedData_Get_Struct (obj, struct ipcid_ds, &ipcid_data_type, ipcid);
+  rb_scan_args (argc, argv, "02", &v_spins, &v_usec);
+  ipcid->spin_max = NIL_P (v_spins) ? 1000 : NUM2ULONG (v_spins);
+  ipcid->spin_limit = ipcid->spin_max;
+  ipcid->spin_ns = NIL_P (v_usec) ? 0 : (uint64_t)(NUM2DBL (v_usec) * 1000);
+
+  return obj;
+}
+
+/* call-seq:
+ *   disable_busy_poll -> IPCObject
+ *
+ * Block straight away (the default). Return self.
+ */
+
+static VALUE
+rb_ipc_disable_busy_poll (obj)
+     VALUE obj;
+{
+  struct ipcid_ds *ipcid;
+
+  rb_check_frozen (obj);
+  TypedData_Get_Struct (obj, struct ipcid_ds, &ipcid_data_type, ipcid);
+  ipcid->spin_max = ipcid->spin_limit = 0;
+  ipcid->spin_ns = 0;
+
+  return obj;
+}
+
+/* call-seq:
+ *   busy_poll -> Array or nil
+ *
+ * Return <tt>[spins, usec]</tt> as given to #enable_busy_poll, usec
+ * being nil if unlimited, or nil if busy polling is disabled.
+ */
+
+static VALUE
+rb_ipc_busy_poll (obj)
+     VALUE obj;
+{
+  struct ipcid_ds *ipcid;
+
+  TypedData_Get_Struct (obj, struct ipcid_ds, &ipcid_data_type, ipcid);
+  if (!ipcid->spin_max)
+    return Qnil;
+
+  return rb_assoc_new (ULONG2NUM (ipcid->spin_max),
+		       ipcid->spin_ns ? rb_float_new (ipcid->spin_ns / 1000.0)
+		       : Qnil);
+}
+
+#define IPC_CPU_WORDS (1024 / (8 * sizeof (unsigned long)))
+#define IPC_CPU_BITS (8 * sizeof (unsigned long))
+
+/*
+ * call-seq:
+ *   SystemVIPC.set_affinity(cpus, pid = 0) -> Array
+ *
+ * Restrict the calling thread, or process +pid+, to the CPUs listed
+ * in the Array +cpus+, typically to keep a busy polling thread on a
+ * core of its own. Return +cpus+. See sched_setaffinity(2).
+ */
+
+static VALUE
+rb_ipc_s_set_affinity (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+#ifdef SYS_sched_setaffinity
+  unsigned long mask[IPC_CPU_WORDS];
+  VALUE v_cpus, v_pid;
+  long i, cpu;
+
+  rb_scan_args (argc, argv, "11", &v_cpus, &v_pid);
+  Check_Type (v_cpus, T_ARRAY);
+  MEMZERO (mask, unsigned long, IPC_CPU_WORDS);
+  for (i = 0; i < RARRAY_LEN (v_cpus); i++)
+    {
+      cpu = NUM2LONG (rb_ary_entry (v_cpus, i));
+      if (cpu < 0 || cpu >= (long)(IPC_CPU_WORDS * IPC_CPU_BITS))
+	rb_raise (cError, "invalid cpu");
+      mask[cpu / IPC_CPU_BITS] |= 1UL << (cpu % IPC_CPU_BITS);
+    }
+  if (syscall (SYS_sched_setaffinity, NIL_P (v_pid) ? 0 : NUM2INT (v_pid),
+	       sizeof (mask), mask) == -1)
+    rb_sys_fail ("sched_setaffinity(2)");
+
+  return v_cpus;
+#else
+  rb_notimplement ();
+  return Qnil;
+#endif
+}
+
+/*
+ * call-seq:
+ *   SystemVIPC.affinity(pid = 0) -> Array
+ *
+ * Return the CPUs the calling thread, or process +pid+, may run on.
+ * See sched_getaffinity(2).
+ */
+
+static VALUE
+rb_ipc_s_affinity (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+#ifdef SYS_sched_getaffinity
+  unsigned long mask[IPC_CPU_WORDS];
+  VALUE v_pid, ary;
+  long n, cpu;
+
+  rb_scan_args (argc, argv, "01", &v_pid);
+  MEMZERO (mask, unsigned long, IPC_CPU_WORDS);
+  n = syscall (SYS_sched_getaffinity, NIL_P (v_pid) ? 0 : NUM2INT (v_pid),
+	       sizeof (mask), mask);
+  if (n == -1)
+    rb_sys_fail ("sched_getaffinity(2)");
+
+  ary = rb_ary_new ();
+  for (cpu = 0; cpu < n * 8; cpu++)
+    if (mask[cpu / IPC_CPU_BITS] & (1UL << (cpu % IPC_CPU_BITS)))
+      rb_ary_push (ary, LONG2NUM (cpu));
+
+  return ary;
+#else
+  rb_notimplement ();
+  return Qnil;
+#endif
+}
+
+/*
+ * Waiting on a word in shared memory.  On Linux this is a futex
+ * shared between processes; elsewhere the waiter sleeps for short
+ * intervals and looks again.  Wakeups may be spurious, callers
+ * recheck their condition.
+ */
+
+#define IPC_FOREVER UINT64_MAX
+#define IPC_POLL_NS 1000000
+
+static uint64_t
+ipc_timeout_ns (v_timeout)
+     VALUE v_timeout;
+{
+  double sec;
+
+  if (NIL_P (v_timeout))
+    return IPC_FOREVER;
+  sec = NUM2DBL (v_timeout);
+  return sec <= 0 ? 0 : (uint64_t)(sec * 1e9);
+}
+
+static uint64_t
+ipc_deadline (timeout_ns)
+     uint64_t timeout_ns;
+{
+  return timeout_ns == IPC_FOREVER ? IPC_FOREVER : ipc_clock_ns () + timeout_ns;
+}
+
+static void
+ipc_futex_wake (addr)
+     uint32_t *addr;
+{
+#ifdef IPC_HAVE_FUTEX
+  syscall (SYS_futex, addr, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#endif
+}
+
+static void
+ipc_futex_wake_one (addr)
+     uint32_t *addr;
+{
+#ifdef IPC_HAVE_FUTEX
+  syscall (SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+struct ipc_wait_arg {
+  uint32_t *addr;
+  uint32_t val;
+  uint64_t timeout_ns;
+  unsigned long spins;
+  uint64_t spin_ns;
+  unsigned long spun;
+  int parked;
+};
+
+/*
+ * Spin for a while before sleeping, as set by
+ * IPCObject#enable_busy_poll: checking the clock every 64 turns keeps
+ * the loop tight.  Return 1 if +done+ says the wait is over.
+ */
+
+#define IPC_SPIN(a, done)						\
+  do {									\
+    uint64_t spin_end = (a)->spin_ns ? ipc_clock_ns () + (a)->spin_ns : 0; \
+    while ((a)->spun < (a)->spins)					\
+      {									\
+	if (done)							\
+	  break;							\
+	(a)->spun++;							\
+	if (spin_end && ((a)->spun & 63) == 0				\
+	    && ipc_clock_ns () >= spin_end)				\
+	  break;							\
+	IPC_CPU_RELAX ();						\
+      }									\
+  } while (0)
+
+static void *
+ipc_futex_wait (ptr)
+     void *ptr;
+{
+  struct ipc_wait_arg *a = ptr;
+  struct timespec ts;
+  uint64_t ns = a->timeout_ns;
+
+  IPC_SPIN (a, ATOMIC_LOAD (a->addr) != a->val);
+  if (ATOMIC_LOAD (a->addr) != a->val)
+    return 0;
+  a->parked = 1;
+
+#ifdef IPC_HAVE_FUTEX
+  if (ns != IPC_FOREVER)
+    {
+      ts.tv_sec = ns / 1000000000;
+      ts.tv_nsec = ns % 1000000000;
+    }
+  syscall (SYS_futex, a->addr, FUTEX_WAIT, a->val,
+	   ns == IPC_FOREVER ? NULL : &ts, NULL, 0);
+#else
+  if (ns > IPC_POLL_NS)
+    ns = IPC_POLL_NS;
+  ts.tv_sec = 0;
+  ts.tv_nsec = ns;
+  if (ATOMIC_LOAD (a->addr) == a->val)
+    nanosleep (&ts, NULL);
+#endif
+  return 0;
+}
+
+/*
+ * Run +func+ with the interpreter lock released, where the
+ * interpreter allows it.  +func+ must not touch Ruby objects and
+ * should return early on EINTR so that interrupts get handled.
+ */
+
+static void
+ipc_blocking (func, arg)
+     void *(*func) (void *);
+     void *arg;
+{
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+  rb_thread_call_without_gvl (func, arg, RUBY_UBF_IO, 0);
+#elif defined(HAVE_RB_THREAD_BLOCKING_REGION)
+  rb_thread_blocking_region ((rb_blocking_function_t *)func, arg,
+			     RUBY_UBF_IO, 0);
+#else
+  TRAP_BEG;
+  func (arg);
+  TRAP_END;
+#endif
+}
+
+/*
+ * Like ipc_blocking, for a system call that takes something: a
+ * message, a semaphore.  Interrupts interrupt the call but are not
+ * handled after it returns, so that what it took is not lost; the
+ * caller handles them on EINTR, and Ruby at its next check otherwise.
+ * +func+ is not run at all if an interrupt is already pending.
+ */
+
+static void
+ipc_blocking_call (func, arg)
+     void *(*func) (void *);
+     void *arg;
+{
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL2)
+  rb_thread_call_without_gvl2 (func, arg, RUBY_UBF_IO, 0);
+#else
+  ipc_blocking (func, arg);
+#endif
+}
+
+/*
+ * Adapt the spin budget of +ipcid+ to how the last wait went, the
+ * way adaptive mutexes do: halve it when spinning did not pay off,
+ * double it back when the wait ended late in the spin.
+ */
+
+static void
+ipc_spin_account (ipcid, spun, parked)
+     struct ipcid_ds *ipcid;
+     unsigned long spun;
+     int parked;
+{
+  unsigned long limit = ATOMIC_LOAD (&ipcid->spin_limit);
+
+  /* a lost update between Ractors only delays the adaptation */
+  if (ipcid->spin_max)
+    {
+      if (parked)
+	{
+	  limit /= 2;
+	  if (limit < ipcid->spin_max / 16 + 1)
+	    limit = ipcid->spin_max / 16 + 1;
+	}
+      else if (spun * 2 > limit)
+	{
+	  limit *= 2;
+	  if (limit > ipcid->spin_max)
+	    limit = ipcid->spin_max;
+	}
+      ATOMIC_STORE (&ipcid->spin_limit, limit);
+    }
+  if (IPC_UNLIKELY (ipcid->stats != NULL))
+    {
+      ATOMIC_ADD (&ipcid->stats->spins, spun);
+      ATOMIC_ADD (&ipcid->stats->parks, parked);
+      ATOMIC_ADD (&ipc_global_stats.spins, spun);
+      ATOMIC_ADD (&ipc_global_stats.parks, parked);
+    }
+}
+
+/*
+ * Sleep while *addr == val, but not past +deadline+, spinning first
+ * if busy polling is enabled on +ipcid+.  Other Ruby threads keep
+ * running meanwhile.  Return 0 once the deadline has passed, 1
+ * otherwise.
+ */
+
+static int
+ipc_wait (ipcid, addr, val, deadline)
+     struct ipcid_ds *ipcid;
+     uint32_t *addr;
+     uint32_t val;
+     uint64_t deadline;
+{
+  struct ipc_wait_arg a;
+  uint64_t now = 0;
+
+  if (deadline != IPC_FOREVER && (now = ipc_clock_ns ()) >= deadline)
+    return 0;
+
+  a.addr = addr;
+  a.val = val;
+  a.timeout_ns = deadline == IPC_FOREVER ? IPC_FOREVER : deadline - now;
+  a.spins = ATOMIC_LOAD (&ipcid->spin_limit);
+  a.spin_ns = ipcid->spin_ns;
+  a.spun = 0;
+  a.parked = 0;
+
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL) \
+  || defined(HAVE_RB_THREAD_BLOCKING_REGION)
+  ipc_blocking (ipc_futex_wait, &a);
+#else
+  if (rb_thread_alone ())
+    ipc_blocking (ipc_futex_wait, &a);
+  else
+    {
+      IPC_SPIN (&a, ATOMIC_LOAD (addr) != val);
+      a.parked = ATOMIC_LOAD (addr) == val;
+      if (a.parked)
+	rb_thread_polling ();
+    }
+#endif
+  ipc_spin_account (ipcid, a.spun, a.parked);
+
+  return 1;
+}
+
+/*
+ * Blocking message queue and semaphore operations.  The caller's
+ * thread first spins on the IPC_NOWAIT form of the call, if busy
+ * polling is enabled, then parks in the blocking form.  Both happen
+ * with the interpreter lock released; without that, other threads
+ * get to run by polling with IPC_NOWAIT instead of parking.
+ */
+
+struct ipc_call {
+  struct ipcid_ds *ipcid;
+  long (*fn) (struct ipc_call *, int);
+  void *buf;
+  size_t len;
+  long type;
+  int flags;
+  short *sem_flg;		/* caller's flags of each semop */
+  const struct timespec *deadline;
+  uint64_t expires;		/* ipc_clock_ns () deadline, 0 for none */
+  int nowait;			/* caller asked for IPC_NOWAIT */
+  long ret;
+  int err;
+  unsigned long tries;		/* system calls made */
+  unsigned long spins;
+  uint64_t spin_ns;
+  unsigned long spun;
+  int parked;
+};
+
+#define IPC_WOULD_BLOCK(e) \
+  ((e) == EAGAIN || (e) == EWOULDBLOCK || (e) == ENOMSG)
+
+/*
+ * Where semtimedop(2) exists and calls can park without the
+ * interpreter lock, a semop with a deadline parks in the kernel
+ * rather than polling.
+ */
+#if defined(HAVE_SEMTIMEDOP) \
+  && (defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL) \
+      || defined(HAVE_RB_THREAD_BLOCKING_REGION))
+#define IPC_SEMTIMEDOP 1
+#define IPC_TIMED_IN_KERNEL(c) ((c)->fn == call_semop)
+#else
+#define IPC_TIMED_IN_KERNEL(c) 0
+#endif
+
+static long
+call_msgsnd (c, nowait)
+     struct ipc_call *c;
+     int nowait;
+{
+  return msgsnd (c->ipcid->id, c->buf, c->len,
+		 c->flags | (nowait ? IPC_NOWAIT : 0));
+}
+
+static long
+call_msgrcv (c, nowait)
+     struct ipc_call *c;
+     int nowait;
+{
+  return msgrcv (c->ipcid->id, c->buf, c->len, c->type,
+		 c->flags | (nowait ? IPC_NOWAIT : 0));
+}
+
+static long
+call_semop (c, nowait)
+     struct ipc_call *c;
+     int nowait;
+{
+  struct sembuf *ops = c->buf;
+  size_t i;
+
+  for (i = 0; i < c->len; i++)
+    ops[i].sem_flg = c->sem_flg[i] | (nowait ? IPC_NOWAIT : 0);
+#ifdef IPC_SEMTIMEDOP
+  if (!nowait && c->expires)
+    {
+      struct timespec ts;
+      uint64_t now = ipc_clock_ns ();
+
+      if (now >= c->expires)
+	{
+	  errno = EAGAIN;
+	  return -1;
+	}
+      ts.tv_sec = (c->expires - now) / 1000000000;
+      ts.tv_nsec = (c->expires - now) % 1000000000;
+      return semtimedop (c->ipcid->id, ops, c->len, &ts);
+    }
+#endif
+  return semop (c->ipcid->id, ops, c->len);
+}
+
+static int
+ipc_call_try (c, nowait)
+     struct ipc_call *c;
+     int nowait;
+{
+  c->ret = c->fn (c, nowait);
+  c->err = c->ret == -1 ? errno : 0;
+  c->tries++;
+  return c->ret != -1 || !IPC_WOULD_BLOCK (c->err);
+}
+
+static void *
+ipc_call_blocking (ptr)
+     void *ptr;
+{
+  struct ipc_call *c = ptr;
+
+  IPC_SPIN (c, ipc_call_try (c, 1));
+  if (c->ret == -1 && IPC_WOULD_BLOCK (c->err))
+    {
+      c->parked = 1;
+      ipc_call_try (c, 0);
+    }
+  return 0;
+}
+
+/*
+ * Sleep between two polls of something that cannot wait in the
+ * kernel, with other threads free to run: +nap+ starts at
+ * IPC_BACKOFF_MIN and doubles up to IPC_BACKOFF_MAX, but no sleep
+ * goes past +deadline+. Return 0, without sleeping, once it has
+ * passed.
+ */
+
+#define IPC_BACKOFF_MIN 16000
+#define IPC_BACKOFF_MAX 1000000
+
+static int
+ipc_backoff (nap, deadline)
+     uint64_t *nap, deadline;
+{
+  uint64_t now = ipc_clock_ns (), ns = *nap;
+  struct timeval tv;
+
+  if (now >= deadline)
+    return 0;
+  if (ns > deadline - now)
+    ns = deadline - now;
+  tv.tv_sec = ns / 1000000000;
+  tv.tv_usec = ns % 1000000000 / 1000;
+  rb_thread_wait_for (tv);
+  if (*nap < IPC_BACKOFF_MAX)
+    *nap *= 2;
+  return 1;
+}
+
+/*
+ * Run +c+ until c->expires. SysV message queues have no timed
+ * operations, so this polls with IPC_NOWAIT and backs off in between.
+ * Fail with ETIMEDOUT once the deadline has passed.
+ */
+
+static void
+ipc_call_timed (c)
+     struct ipc_call *c;
+{
+  uint64_t nap = IPC_BACKOFF_MIN;
+
+  IPC_SPIN (c, ipc_call_try (c, 1));
+  while (!ipc_call_try (c, 1))
+    {
+      if (!ipc_backoff (&nap, c->expires))
+	{
+	  c->err = ETIMEDOUT;
+	  return;
+	}
+      c->parked = 1;
+      IPC_STATS_POLL (c->ipcid);
+    }
+}
+
+/*
+ * Probes around a whole operation, so that the time a process spends
+ * in it, spinning, parked or polling, can be told from the time spent
+ * in Ruby: the id, the message type or first semaphore number, the
+ * byte or operation count, and on return the number of retries and
+ * errno.
+ */
+
+static void
+ipc_call_entry (c)
+     struct ipc_call *c;
+{
+#ifdef HAVE_SYS_SDT_H
+  int id = c->ipcid->id;
+
+  if (c->fn == call_msgsnd)
+    IPC_PROBE3 (msgsnd__entry, id, ((struct msgbuf *)c->buf)->mtype, c->len);
+  else if (c->fn == call_msgrcv)
+    IPC_PROBE3 (msgrcv__entry, id, c->type, c->len);
+  else if (c->fn == call_semop)
+    IPC_PROBE3 (semop__entry, id, ((struct sembuf *)c->buf)->sem_num,
+		c->len);
+#endif
+}
+
+static void
+ipc_call_return (c)
+     struct ipc_call *c;
+{
+#ifdef HAVE_SYS_SDT_H
+  int id = c->ipcid->id;
+  unsigned long retries = c->tries ? c->tries - 1 : 0;
+
+  if (c->fn == call_msgsnd)
+    IPC_PROBE5 (msgsnd__return, id, ((struct msgbuf *)c->buf)->mtype,
+		c->len, retries, c->err);
+  else if (c->fn == call_msgrcv)
+    IPC_PROBE5 (msgrcv__return, id,
+		c->ret == -1 ? c->type : ((struct msgbuf *)c->buf)->mtype,
+		c->ret == -1 ? 0 : c->ret, retries, c->err);
+  else if (c->fn == call_semop)
+    IPC_PROBE5 (semop__return, id, ((struct sembuf *)c->buf)->sem_num,
+		c->len, retries, c->err);
+#endif
+}
+
+/*
+ * Run +c+ to completion, retrying after signals. Return the result
+ * of the system call, with errno set when it is -1.
+ */
+
+static long
+ipc_call (c)
+     struct ipc_call *c;
+{
+  struct ipcid_ds *ipcid = c->ipcid;
+
+  c->tries = 0;
+  ipc_call_entry (c);
+ retry:
+  c->spins = ATOMIC_LOAD (&ipcid->spin_limit);
+  c->spin_ns = ipcid->spin_ns;
+  c->spun = 0;
+  c->parked = 0;
+  c->ret = -1;
+  c->err = EAGAIN;
+  if (c->nowait)
+    ipc_call_try (c, 0);
+  else if (c->expires && !IPC_TIMED_IN_KERNEL (c))
+    ipc_call_timed (c);
+  else
+    {
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL) \
+  || defined(HAVE_RB_THREAD_BLOCKING_REGION)
+      unsigned long tries = c->tries;
+
+      ipc_blocking_call (ipc_call_blocking, c);
+      if (c->tries == tries)
+	c->err = EINTR;		/* not run, an interrupt is pending */
+#else
+      if (rb_thread_alone ())
+	ipc_blocking (ipc_call_blocking, c);
+      else
+	{
+	  IPC_SPIN (c, ipc_call_try (c, 1));
+	  if (!c->spins)
+	    ipc_call_try (c, 1);
+	  while (c->ret == -1 && IPC_WOULD_BLOCK (c->err))
+	    {
+	      c->parked = 1;
+	      IPC_STATS_RETRY (ipcid);
+	      IPC_STATS_POLL (ipcid);
+	      rb_thread_polling ();
+	      ipc_call_try (c, 1);
+	    }
+	}
+#endif
+    }
+  ipc_spin_account (ipcid, c->spun, c->parked);
+  if (c->ret == -1 && c->err == EINTR)
+    {
+      IPC_STATS_RETRY (ipcid);
+      IPC_CHECK_INTS ();
+      goto retry;
+    }
+  if (c->ret == -1 && c->expires && !c->nowait && IPC_WOULD_BLOCK (c->err))
+    c->err = ETIMEDOUT;
+
+  ipc_call_return (c);
+  errno = c->err;
+  return c->ret;
+}
+
+static void
+msg_stat (msgid, st)
+     struct ipcid_ds *msgid;
+     union ipc_stat *st;
+{
+  if (ipc_msgctl (msgid->id, IPC_STAT, &st->msgstat) == -1)
+    rb_sys_fail ("msgctl(2)");
+}
+
+static struct ipc_perm *
+msg_perm (st)
+     union ipc_stat *st;
+{
+  return &st->msgstat.msg_perm;
+}
+
+static void
+msg_rmid (msgid)
+     struct ipcid_ds *msgid;
+{
+  if (msgid->id < 0)
+    rb_raise (cError, "already removed");
+  if (ipc_msgctl (msgid->id, IPC_RMID, 0) == -1)
+    rb_sys_fail ("msgctl(2)");
+  msgid->id = -1;
+}
+
+/*
+ * Deadline of a message queue operation that waits at most
+ * +v_timeout+ seconds: 0 when it is nil.
+ */
+
+static uint64_t
+msg_expires (v_timeout)
+     VALUE v_timeout;
+{
+  uint64_t ns;
+
+  if (NIL_P (v_timeout))
+    return 0;
+  ns = ipc_clock_ns () + ipc_timeout_ns (v_timeout);
+  return ns ? ns : 1;
+}
+
+/*
+ * call-seq:
+ *   MessageQueue.for_id(msqid) -> MessageQueue
+ *
+ * Return a MessageQueue for the existing identifier +msqid+, as
+ * returned by #id, without looking up its key.
+ */
+
+static VALUE
+rb_msg_s_for_id (klass, v_id)
+     VALUE klass, v_id;
+{
+  return ipc_wrap_id (klass, &msg_data_type, v_id,
+		      msg_stat, msg_perm, msg_rmid);
+}
+
+/*
+ * call-seq:
+ *   MessageQueue.new(key, msgflg = 0) -> MessageQueue
+ *
+ * Create a new MessageQueue object associated with the message
+ * queue identified by +key+. +msgflg+ is a bitwise OR selected from
+ * IPC_CREAT and IPC_EXCL. See msgget(2).
+ */
+
+static VALUE
+rb_msg_s_new (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  struct ipcid_ds msgid_s, *msgid = &msgid_s;
+  VALUE dst, v_key, v_msgflg;
+
+  dst = TypedData_Make_Struct (klass, struct ipcid_ds, &msg_data_type, msgid);
+  rb_scan_args (argc, argv, "11", &v_key, &v_msgflg);
+  if (!NIL_P (v_msgflg))
+    msgid->flags = NUM2INT (v_msgflg);
+  msgid->id = msgget ((key_t)NUM2INT (v_key), msgid->flags);
+  if (msgid->id == -1)
+    rb_sys_fail ("msgget(2)");
+  msgid->stat = msg_stat;
+  msgid->perm = msg_perm;
+  msgid->rmid = msg_rmid;
+  if (ATOMIC_LOAD (&ipc_stats_default))
+    ipc_enable_stats (msgid);
+
+  return dst;
+}
+
+/*
+ * call-seq:
+ *   send(mtype, mtext, msgflg = 0, timeout = nil) ->  MessageQueue
+ *
+ * Send message +mtext+ of type +mtype+ with flags +msgflg+. Wait at
+ * most +timeout+ seconds for room, then raise TimeoutError. Return
+ * self.  See msgop(2).
  */
 
 static VALUE
@@ -248,832 +1658,10335 @@ rb_msg_send (argc, argv, obj)
      int argc;
      VALUE *argv, obj;
 {
-  VALUE v_type, v_buf, v_flags;
-  int flags = 0, error, nowait;
-  struct msgbuf *msgp;
-  struct ipcid_ds *msgid;
-  char *buf;
-  size_t len;
+  VALUE v_type, v_buf, v_flags, v_timeout;
+  int flags = 0;
+  struct msgbuf *msgp;
+  struct ipcid_ds *msgid;
+  struct ipc_call c;
+  char *buf;
+  size_t len;
+  uint64_t t0;
+
+  rb_scan_args (argc, argv, "22", &v_type, &v_buf, &v_flags, &v_timeout);
+  if (!NIL_P (v_flags))
+    flags = NUM2INT (v_flags);
+  
+  len = RSTRING_LEN(v_buf);
+  buf = RSTRING_PTR(v_buf);
+
+  msgp = (struct msgbuf *) ALLOCA_N (char, sizeof (long) + len);
+  msgp->mtype = NUM2LONG (v_type);
+  memcpy (msgp->mtext, buf, len);
+
+  msgid = get_ipcid (obj);
+
+  MEMZERO (&c, struct ipc_call, 1);
+  c.ipcid = msgid;
+  c.fn = call_msgsnd;
+  c.buf = msgp;
+  c.len = len;
+  c.flags = flags;
+  c.nowait = flags & IPC_NOWAIT;
+  c.expires = msg_expires (v_timeout);
+
+  t0 = IPC_STATS_BEGIN (msgid);
+  if (ipc_call (&c) == -1)
+    {
+      if (errno == ETIMEDOUT)
+	rb_raise (cTimeoutError, "queue full");
+      rb_sys_fail ("msgsnd(2)");
+    }
+  IPC_STATS_END (msgid, len, t0);
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   recv(mtype, msgsz, msgflg = 0, timeout = nil) ->  String
+ *
+ * Receive up to +msgsz+ bytes of the next message of type +mtype+
+ * with flags +msgflg+. Wait at most +timeout+ seconds, then raise
+ * TimeoutError. See msgop(2).
+ */
+
+static VALUE
+rb_msg_recv (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  VALUE v_type, v_len, v_flags, v_timeout;
+  int flags = 0;
+  struct msgbuf *msgp;
+  struct ipcid_ds *msgid;
+  struct ipc_call c;
+  long type;
+  size_t rlen, len;
+  uint64_t t0;
+  VALUE ret;
+
+  rb_scan_args (argc, argv, "22", &v_type, &v_len, &v_flags, &v_timeout);
+  type = NUM2LONG (v_type);
+  len = NUM2INT (v_len);
+  if (!NIL_P (v_flags))
+    flags = NUM2INT (v_flags);
+
+  msgp = (struct msgbuf *) ALLOCA_N (char, sizeof (long) + len);
+  msgid = get_ipcid (obj);
+
+  MEMZERO (&c, struct ipc_call, 1);
+  c.ipcid = msgid;
+  c.fn = call_msgrcv;
+  c.buf = msgp;
+  c.len = len;
+  c.type = type;
+  c.flags = flags;
+  c.nowait = flags & IPC_NOWAIT;
+  c.expires = msg_expires (v_timeout);
+
+  t0 = IPC_STATS_BEGIN (msgid);
+  rlen = ipc_call (&c);
+  if (rlen == (size_t)-1)
+    {
+      if (errno == ETIMEDOUT)
+	rb_raise (cTimeoutError, "no message");
+      rb_sys_fail ("msgrcv(2)");
+    }
+  IPC_STATS_END (msgid, rlen, t0);
+
+  ret = rb_str_new (msgp->mtext, rlen);
+  return ret;
+}
+
+static void
+sem_stat (semid, st)
+     struct ipcid_ds *semid;
+     union ipc_stat *st;
+{
+  union semun arg;
+
+  arg.buf = &st->semstat;
+  if (ipc_semctl (semid->id, 0, IPC_STAT, &arg) == -1)
+    rb_sys_fail ("semctl(2)");
+}
+
+static struct ipc_perm *
+sem_perm (st)
+     union ipc_stat *st;
+{
+  return &st->semstat.sem_perm;
+}
+
+static void
+sem_rmid (semid)
+     struct ipcid_ds *semid;
+{
+  if (semid->id < 0)
+    rb_raise (cError, "already removed");
+  if (ipc_semctl (semid->id, 0, IPC_RMID, 0) == -1)
+    rb_sys_fail ("semctl(2)");
+  semid->id = -1;
+}
+
+/*
+ * call-seq:
+ *   Semaphore.for_id(semid) -> Semaphore
+ *
+ * Return a Semaphore for the existing identifier +semid+, as returned
+ * by #id, without looking up its key.
+ */
+
+static VALUE
+rb_sem_s_for_id (klass, v_id)
+     VALUE klass, v_id;
+{
+  return ipc_wrap_id (klass, &sem_data_type, v_id,
+		      sem_stat, sem_perm, sem_rmid);
+}
+
+/*
+ * call-seq:
+ *   Semaphore.new(key, nsems, semflg = 0) -> Semaphore
+ *
+ * Create a new Semaphore object encapsulating the semaphore
+ * set identified by +key+. +nsems+ is the number of semaphores
+ * in the set, and +semflg+ is a bitwise OR selected from
+ * IPC_CREAT and IPC_EXCL. See semget(2).
+ */
+
+static VALUE
+rb_sem_s_new (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  struct ipcid_ds *semid;
+  VALUE dst, v_key, v_nsems, v_semflg;
+  int nsems = 0;
+
+  dst = TypedData_Make_Struct (klass, struct ipcid_ds, &sem_data_type, semid);
+  rb_scan_args (argc, argv, "12", &v_key, &v_nsems, &v_semflg);
+  if (!NIL_P (v_nsems))
+    nsems = NUM2INT (v_nsems);
+  if (!NIL_P (v_semflg))
+    semid->flags = NUM2INT (v_semflg);
+  semid->id = semget ((key_t)NUM2INT (v_key), nsems, semid->flags);
+  if (semid->id == -1)
+    rb_sys_fail ("semget(2)");
+  semid->stat = sem_stat;
+  semid->perm = sem_perm;
+  semid->rmid = sem_rmid;
+  if (ATOMIC_LOAD (&ipc_stats_default))
+    ipc_enable_stats (semid);
+
+  return dst;
+}
+
+#define Check_Valid_Semnum(n, st)		\
+  if (n > (st).semstat.sem_nsems)		\
+    rb_raise (cError, "invalid semnum")
+
+/*
+ * call-seq:
+ *   to_a -> Array
+ *
+ * Return values for the semaphore set as an array. See semctl(2).
+ */
+
+static VALUE
+rb_sem_to_a (obj)
+     VALUE obj;
+{
+  struct ipcid_ds *semid;
+  union ipc_stat st;
+  int i, nsems;
+  VALUE dst;
+  union semun arg;
+
+  semid = get_ipcid_and_stat (obj, &st);
+  nsems = st.semstat.sem_nsems;
+  arg.array = (unsigned short int *) ALLOCA_N (unsigned short int, nsems);
+
+  ipc_semctl (semid->id, 0, GETALL, &arg);
+
+  dst = rb_ary_new ();
+  for (i = 0; i < nsems; i++)
+    rb_ary_push (dst, INT2FIX (arg.array[i]));
+
+  return dst;
+}
+
+/*
+ * call-seq:
+ *   set_all(array) -> Semaphore
+ *
+ * Set all values of a semaphore to corresponding values from
+ * +array+. Return self. See semctl(2).
+ */
+
+static VALUE
+rb_sem_set_all (obj, ary)
+     VALUE obj, ary;
+{
+  struct ipcid_ds *semid;
+  union ipc_stat st;
+  union semun arg;
+  int i, nsems;
+
+  semid = get_ipcid_and_stat (obj, &st);
+  nsems = st.semstat.sem_nsems;
+
+  Check_Type (ary, T_ARRAY);
+  if (RARRAY_LEN (ary) != nsems)
+    rb_raise (cError, "doesn't match with semnum");
+
+  arg.array = (unsigned short int *) ALLOCA_N (unsigned short int, nsems);
+  for (i = 0; i < nsems; i++)
+    arg.array[i] = NUM2INT (rb_ary_entry (ary, i));
+  ipc_semctl (semid->id, 0, SETALL, &arg);
+
+  return obj;
+}
+
+/*
+ * call-seq: value(semnum) -> Fixnum
+ *
+ * Return the value of semaphore +semnum+. See semctl(2).
+ */
+
+static VALUE
+rb_sem_value (obj, v_pos)
+     VALUE obj, v_pos;
+{
+  struct ipcid_ds *semid;
+  union ipc_stat st;
+  int pos;
+  int value;
+
+  semid = get_ipcid_and_stat (obj, &st);
+  pos = NUM2INT (v_pos);
+  Check_Valid_Semnum (pos, st);
+  value = ipc_semctl (semid->id, pos, GETVAL, 0);
+  if (value == -1)
+    rb_sys_fail ("semctl(2)");
+  return INT2FIX (value);
+}
+
+/*
+ * call-seq: set_value(semnum, value) -> Semaphore
+ *
+ * Set the value of semaphore +semnum+ to +value+. Return self. See
+ * semctl(2).
+ */
+
+static VALUE
+rb_sem_set_value (obj, v_pos, v_value)
+     VALUE obj, v_pos, v_value;
+{
+  struct ipcid_ds *semid;
+  union ipc_stat st;
+  int pos;
+  union semun arg;
+
+  semid = get_ipcid_and_stat (obj, &st);
+  pos = NUM2INT (v_pos);
+  Check_Valid_Semnum (pos, st);
+  arg.val = NUM2INT(v_value);
+  if (ipc_semctl (semid->id, pos, SETVAL, &arg) == -1)
+    rb_sys_fail ("semctl(2)");
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   n_count(semnum) -> Fixnum
+ *
+ * Return the number of processes waiting for the value semaphore
+ * +semnum+ to increase. See semctl(2).
+ *
+ * *Note*: Ruby threads waiting for a semaphore do not increment
+ * this counter. In a multi-threaded program, the SystemVIPC
+ * module emulates waiting by repeatedly calling the underlying
+ * semop(2) with the IPC_NOWAIT flag set and sleeping between calls.
+ */
+
+static VALUE
+rb_sem_ncnt (obj, v_pos)
+     VALUE obj, v_pos;
+{
+  struct ipcid_ds *semid;
+  union ipc_stat st;
+  int ncnt, pos;
+
+  semid = get_ipcid_and_stat (obj, &st);
+  pos = NUM2INT (v_pos);
+  Check_Valid_Semnum (pos, st);
+  ncnt = ipc_semctl (semid->id, pos, GETNCNT, 0);
+  if (ncnt == -1)
+    rb_sys_fail ("semctl(2)");
+  return INT2FIX (ncnt);
+}
+
+/*
+ * call-seq:
+ *   z_count(semnum) -> Fixnum
+ *
+ * Return the number of processes waiting for the value semaphore
+ * +semnum+ to become zero. See semctl(2).
+ *
+ * *Note*: Ruby threads waiting for a semaphore do not increment
+ * this counter. In a multi-threaded program, the SystemVIPC
+ * module emulates waiting by repeatedly calling the underlying
+ * semop(2) with the IPC_NOWAIT flag set and sleeping between calls.
+ */
+
+static VALUE
+rb_sem_zcnt (obj, v_pos)
+     VALUE obj, v_pos;
+{
+  struct ipcid_ds *semid;
+  union ipc_stat st;
+  int zcnt, pos;
+
+  semid = get_ipcid_and_stat (obj, &st);
+  pos = NUM2INT (v_pos);
+  Check_Valid_Semnum (pos, st);
+  zcnt = ipc_semctl (semid->id, pos, GETZCNT, 0);
+  if (zcnt == -1)
+    rb_sys_fail ("semctl(2)");
+  return INT2FIX (zcnt);
+}
+
+/*
+ * call-seq:
+ *   pid(semnum) -> Fixnum
+ *
+ * Return the PID of the process that executed the last semop()
+ * call for semaphore +semnum+. See semctl(2).
+ */
+
+static VALUE
+rb_sem_pid (obj, v_pos)
+     VALUE obj, v_pos;
+{
+  struct ipcid_ds *semid;
+  union ipc_stat st;
+  int pid, pos;
+
+  semid = get_ipcid_and_stat (obj, &st);
+  pos = NUM2INT (v_pos);
+  Check_Valid_Semnum (pos, st);
+  pid = ipc_semctl (semid->id, pos, GETPID, 0);
+  if (pid == -1)
+    rb_sys_fail ("semctl(2)");
+  return INT2FIX (pid);
+}
+
+/*
+ * call-seq:
+ *   size -> Fixnum
+ *
+ * Return the number of semaphores in the set.  See semctl(2).
+ */
+
+static VALUE
+rb_sem_size (obj)
+     VALUE obj;
+{
+  union ipc_stat st;
+  get_ipcid_and_stat (obj, &st);
+  return INT2FIX (st.semstat.sem_nsems);
+}
+
+/*
+ * call-seq:
+ *   apply(array, timeout = nil) -> Semaphore
+ *
+ * Apply an +array+ of SemaphoreOperation elements.  Wait at most
+ * +timeout+ seconds for them to be possible, then raise
+ * TimeoutError.  See semop(2) and semtimedop(2).
+ */
+
+static VALUE
+rb_sem_apply (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  VALUE ary, v_timeout;
+  struct ipcid_ds *semid;
+  union ipc_stat st;
+  struct sembuf *array;
+  struct ipc_call c;
+  short *sem_flg;
+  int nsops, i, nowait = 0;
+  uint64_t t0;
+
+  rb_scan_args (argc, argv, "11", &ary, &v_timeout);
+  Check_Type (ary, T_ARRAY);
+  semid = get_ipcid_and_stat (obj, &st);
+  nsops = RARRAY_LEN (ary);
+  array = (struct sembuf *) ALLOCA_N (struct sembuf, nsops);
+  sem_flg = ALLOCA_N (short, nsops);
+  for (i = 0; i < nsops; i++)
+    {
+      struct sembuf *op;
+      TypedData_Get_Struct (rb_ary_entry (ary, i), struct sembuf,
+			    &semop_data_type, op);
+      nowait = nowait || (op->sem_flg & IPC_NOWAIT);
+      memcpy (&array[i], op, sizeof (struct sembuf));
+      sem_flg[i] = op->sem_flg;
+      Check_Valid_Semnum (array[i].sem_num, st);
+    }
+
+  MEMZERO (&c, struct ipc_call, 1);
+  c.ipcid = semid;
+  c.fn = call_semop;
+  c.buf = array;
+  c.len = nsops;
+  c.sem_flg = sem_flg;
+  c.nowait = nowait;
+  c.expires = msg_expires (v_timeout);
+
+  t0 = IPC_STATS_BEGIN (semid);
+  if (ipc_call (&c) == -1)
+    {
+      if (errno == ETIMEDOUT)
+	rb_raise (cTimeoutError, "semaphore not available");
+      rb_sys_fail ("semop(2)");
+    }
+  IPC_STATS_END (semid, 0, t0);
+
+  return obj;
+}
+
+static void
+shm_stat (shmid, st)
+     struct ipcid_ds *shmid;
+     union ipc_stat *st;
+{
+  if (ipc_shmctl (shmid->id, IPC_STAT, &st->shmstat) == -1)
+    rb_sys_fail ("shmctl(2)");
+}
+
+static struct ipc_perm *
+shm_perm (st)
+     union ipc_stat *st;
+{
+  return &st->shmstat.shm_perm;
+}
+
+static void
+shm_rmid (shmid)
+     struct ipcid_ds *shmid;
+{
+  if (shmid->id < 0)
+    rb_raise (cError, "already removed");
+  if (ipc_shmctl (shmid->id, IPC_RMID, 0) == -1)
+    rb_sys_fail ("shmctl(2)");
+  shmid->id = -1;
+}
+
+/*
+ * call-seq:
+ *   SharedMemory.for_id(shmid) -> SharedMemory
+ *
+ * Return a detached SharedMemory for the existing identifier
+ * +shmid+, as returned by #id, without looking up its key.
+ */
+
+static VALUE
+rb_shm_s_for_id (klass, v_id)
+     VALUE klass, v_id;
+{
+  return ipc_wrap_id (klass, &shm_data_type, v_id,
+		      shm_stat, shm_perm, shm_rmid);
+}
+
+/*
+ * call-seq:
+ *   SharedMemory.new(key, size = 0, shmflg = 0) -> SharedMemory
+ *
+ * Return a SharedMemory object encapsulating the
+ * shared memory segment associated with +key+. See shmget(2).
+ */
+
+static VALUE
+rb_shm_s_new (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  struct ipcid_ds *shmid;
+  VALUE dst, v_key, v_size, v_shmflg;
+  size_t size = 0;
+
+  dst = TypedData_Make_Struct (klass, struct ipcid_ds, &shm_data_type, shmid);
+  rb_scan_args (argc, argv, "12", &v_key, &v_size, &v_shmflg);
+  if (!NIL_P (v_size))
+    size = NUM2SIZET (v_size);
+  if (!NIL_P (v_shmflg))
+    shmid->flags = NUM2INT (v_shmflg);
+  shmid->id = shmget ((key_t)NUM2INT (v_key), size, shmid->flags);
+  if (shmid->id == -1)
+    rb_sys_fail ("shmget(2)");
+  shmid->stat = shm_stat;
+  shmid->perm = shm_perm;
+  shmid->rmid = shm_rmid;
+  if (ATOMIC_LOAD (&ipc_stats_default))
+    ipc_enable_stats (shmid);
+
+  return dst;
+}
+
+/*
+ * call-seq:
+ *   attach(shmflg = 0) -> SharedMemory
+ *
+ * Attach the shared memory segment. See shmat(2).
+ */
+
+static VALUE
+rb_shm_attach (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  VALUE v_flags;
+  struct ipcid_ds *shmid;
+  union ipc_stat st;
+  int flags = 0;
+  void *data;
+
+  rb_check_frozen (obj);
+  shmid = get_ipcid (obj);
+  if (shmid->data)
+    rb_raise (cError, "already attached");
+
+  rb_scan_args (argc, argv, "01", &v_flags);
+  if (!NIL_P (v_flags))
+    flags = NUM2INT (v_flags);
+
+  data = ipc_shmat (shmid->id, flags);
+  if (data == (void*)-1)
+    rb_sys_fail ("shmat(2)");
+  shmid->data = data;
+
+  shmid->stat (shmid, &st);
+  shmid->attached = st.shmstat.shm_segsz;
+  ipc_adjust_memory_usage ((ssize_t)shmid->attached);
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   detach -> SharedMemory
+ *
+ * Detach the shared memory segment. See shmdt(2). Raise Error while
+ * a copy, transfer or save in another thread still uses it.
+ */
+
+static VALUE
+rb_shm_detach (obj)
+     VALUE obj;
+{
+  struct ipcid_ds *shmid;
+
+  rb_check_frozen (obj);
+  shmid = get_ipcid (obj);
+  if (!shmid->data)
+    rb_raise (cError, "already detached");
+  if (ATOMIC_LOAD (&shmid->pins))
+    rb_raise (cError, "memory in use");
+
+  if (ipc_shmdt (shmid->id, shmid->data) == -1)
+    rb_sys_fail ("shmdt(2)");
+  shmid->data = NULL;
+
+  ipc_adjust_memory_usage (-(ssize_t)shmid->attached);
+  shmid->attached = 0;
+
+  return obj;
+}
+
+/*
+ * The copy engine of SharedMemory#write and #fill.  Large writes go
+ * around the cache with non-temporal stores, the widest the CPU has:
+ * the data is for other processes, and would only evict the working
+ * set of the writer.  Reads copy into a String the caller is about to
+ * use, so they go through the cache.  Copies of a few MiB and more
+ * run without the interpreter lock, split between copy_threads
+ * threads.
+ */
+
+#define COPY_STREAM_MIN (4 << 20)
+#define COPY_NOGVL_MIN (1 << 20)
+#define COPY_PARALLEL_MIN (8 << 20)
+#define COPY_MAX_THREADS 16
+
+#ifdef IPC_HAVE_STREAM
+/*
+ * Copy or fill the 64-byte aligned +dst+ with +store+, which streams
+ * one 64-byte block, then fence so that other processes see it.
+ */
+#define COPY_STREAM_BODY(dst, src, c, len, store)			\
+  do {									\
+    char *d = (dst);							\
+    const char *s = (src);						\
+    size_t head = -(uintptr_t)d & 63, n;				\
+									\
+    if (head > (len))							\
+      head = (len);							\
+    if (s)								\
+      memcpy (d, s, head), s += head;					\
+    else								\
+      memset (d, (c), head);						\
+    d += head;								\
+    for (n = ((len) - head) / 64; n; n--, d += 64)			\
+      {									\
+	store;								\
+	if (s)								\
+	  s += 64;							\
+      }									\
+    _mm_sfence ();							\
+    n = ((len) - head) % 64;						\
+    if (s)								\
+      memcpy (d, s, n);							\
+    else								\
+      memset (d, (c), n);						\
+  } while (0)
+
+static void __attribute__ ((target ("sse2")))
+copy_stream_sse2 (dst, src, c, len)
+     char *dst;
+     const char *src;
+     int c;
+     size_t len;
+{
+  __m128i v = _mm_set1_epi8 ((char)c);
+
+  COPY_STREAM_BODY (dst, src, c, len, {
+    if (s)
+      {
+	_mm_stream_si128 ((__m128i *)d, _mm_loadu_si128 ((const __m128i *)s));
+	_mm_stream_si128 ((__m128i *)d + 1,
+			  _mm_loadu_si128 ((const __m128i *)s + 1));
+	_mm_stream_si128 ((__m128i *)d + 2,
+			  _mm_loadu_si128 ((const __m128i *)s + 2));
+	_mm_stream_si128 ((__m128i *)d + 3,
+			  _mm_loadu_si128 ((const __m128i *)s + 3));
+      }
+    else
+      {
+	_mm_stream_si128 ((__m128i *)d, v);
+	_mm_stream_si128 ((__m128i *)d + 1, v);
+	_mm_stream_si128 ((__m128i *)d + 2, v);
+	_mm_stream_si128 ((__m128i *)d + 3, v);
+      }
+  });
+}
+
+static void __attribute__ ((target ("avx2")))
+copy_stream_avx2 (dst, src, c, len)
+     char *dst;
+     const char *src;
+     int c;
+     size_t len;
+{
+  __m256i v = _mm256_set1_epi8 ((char)c);
+
+  COPY_STREAM_BODY (dst, src, c, len, {
+    if (s)
+      {
+	_mm256_stream_si256 ((__m256i *)d,
+			     _mm256_loadu_si256 ((const __m256i *)s));
+	_mm256_stream_si256 ((__m256i *)d + 1,
+			     _mm256_loadu_si256 ((const __m256i *)s + 1));
+      }
+    else
+      {
+	_mm256_stream_si256 ((__m256i *)d, v);
+	_mm256_stream_si256 ((__m256i *)d + 1, v);
+      }
+  });
+}
+
+static void __attribute__ ((target ("avx512f")))
+copy_stream_avx512 (dst, src, c, len)
+     char *dst;
+     const char *src;
+     int c;
+     size_t len;
+{
+  __m512i v = _mm512_set1_epi32 ((c & 0xff) * 0x01010101);
+
+  COPY_STREAM_BODY (dst, src, c, len, {
+    if (s)
+      _mm512_stream_si512 ((void *)d, _mm512_loadu_si512 ((const void *)s));
+    else
+      _mm512_stream_si512 ((void *)d, v);
+  });
+}
+#endif
+
+/* NULL where there are no non-temporal stores */
+static void (*copy_stream) (char *, const char *, int, size_t);
+
+static void
+copy_init ()
+{
+#ifdef IPC_HAVE_STREAM
+  if (__builtin_cpu_supports ("avx512f"))
+    copy_stream = copy_stream_avx512;
+  else if (__builtin_cpu_supports ("avx2"))
+    copy_stream = copy_stream_avx2;
+  else
+    copy_stream = copy_stream_sse2;
+#endif
+}
+
+struct copy_arg {
+  char *dst;
+  const char *src;		/* NULL to fill with c */
+  int c;
+  size_t len;
+  int stream;
+  int threads;
+};
+
+static void *
+copy_range (ptr)
+     void *ptr;
+{
+  struct copy_arg *a = ptr;
+
+  if (a->stream && copy_stream && a->len >= COPY_STREAM_MIN)
+    copy_stream (a->dst, a->src, a->c, a->len);
+  else if (a->src)
+    memcpy (a->dst, a->src, a->len);
+  else
+    memset (a->dst, a->c, a->len);
+  return 0;
+}
+
+static void *
+copy_parallel (ptr)
+     void *ptr;
+{
+  struct copy_arg *a = ptr;
+#ifdef HAVE_PTHREAD_H
+  struct copy_arg part[COPY_MAX_THREADS];
+  pthread_t tid[COPY_MAX_THREADS];
+  int started[COPY_MAX_THREADS];
+  size_t share, pos = 0;
+  int i;
+
+  share = IPC_ALIGN (a->len / a->threads + 1, 4096);
+  for (i = 0; i < a->threads; i++)
+    {
+      part[i] = *a;
+      part[i].dst = a->dst + pos;
+      part[i].src = a->src ? a->src + pos : NULL;
+      part[i].len = a->len - pos < share ? a->len - pos : share;
+      pos += part[i].len;
+      started[i] = i > 0 && part[i].len
+	&& pthread_create (&tid[i], NULL, copy_range, &part[i]) == 0;
+    }
+  for (i = 0; i < a->threads; i++)
+    if (!started[i])
+      copy_range (&part[i]);
+  for (i = 1; i < a->threads; i++)
+    if (started[i])
+      pthread_join (tid[i], NULL);
+#else
+  copy_range (a);
+#endif
+  return 0;
+}
+
+/*
+ * Run +func+ without the interpreter lock on the data of +shmid+, and
+ * of +other+ if not NULL: they are pinned so that detach refuses to
+ * unmap them, and +v_str+, if not nil, is kept from changing.  Both
+ * are taken inside rb_ensure, and only what was taken is released,
+ * however the call ends: locktmp raises if another thread holds the
+ * String.
+ */
+
+struct shm_blocking_call {
+  struct ipcid_ds *shmid;
+  struct ipcid_ds *other;
+  VALUE v_str;
+  void *(*func) (void *);
+  void *arg;
+  int pinned;
+  int locked;
+};
+
+static VALUE
+shm_blocking_run (ptr)
+     VALUE ptr;
+{
+  struct shm_blocking_call *b = (struct shm_blocking_call *)ptr;
+
+#ifdef HAVE_RB_STR_LOCKTMP
+  if (!NIL_P (b->v_str))
+    {
+      rb_str_locktmp (b->v_str);
+      b->locked = 1;
+    }
+#endif
+  ATOMIC_FETCH_ADD (&b->shmid->pins, 1);
+  if (b->other)
+    ATOMIC_FETCH_ADD (&b->other->pins, 1);
+  b->pinned = 1;
+  ipc_blocking (b->func, b->arg);
+  return Qnil;
+}
+
+static VALUE
+shm_blocking_done (ptr)
+     VALUE ptr;
+{
+  struct shm_blocking_call *b = (struct shm_blocking_call *)ptr;
+
+#ifdef HAVE_RB_STR_LOCKTMP
+  if (b->locked)
+    rb_str_unlocktmp (b->v_str);
+#endif
+  if (b->pinned)
+    {
+      if (b->other)
+	ATOMIC_FETCH_ADD (&b->other->pins, -1);
+      ATOMIC_FETCH_ADD (&b->shmid->pins, -1);
+    }
+  return Qnil;
+}
+
+static void
+shm_blocking (shmid, other, v_str, func, arg)
+     struct ipcid_ds *shmid, *other;
+     VALUE v_str;
+     void *(*func) (void *);
+     void *arg;
+{
+  struct shm_blocking_call b;
+
+  b.shmid = shmid;
+  b.other = other;
+  b.v_str = v_str;
+  b.func = func;
+  b.arg = arg;
+  b.pinned = b.locked = 0;
+  rb_ensure (shm_blocking_run, (VALUE)&b, shm_blocking_done, (VALUE)&b);
+}
+
+/*
+ * Copy +len+ bytes from +src+, or fill them with +c+ if +src+ is
+ * NULL, to +dst+, with non-temporal stores if +stream+. +v_str+ is
+ * the String at +src+ or +dst+, if any, kept from changing while the
+ * interpreter lock is released.
+ */
+
+static void
+shm_copy (shmid, dst, src, c, len, stream, v_str)
+     struct ipcid_ds *shmid;
+     char *dst;
+     const char *src;
+     int c;
+     size_t len;
+     int stream;
+     VALUE v_str;
+{
+  struct copy_arg a;
+
+  a.dst = dst;
+  a.src = src;
+  a.c = c;
+  a.len = len;
+  a.stream = stream;
+  a.threads = shmid->copy_threads ? shmid->copy_threads : 1;
+  if (a.threads > (int)(len / COPY_PARALLEL_MIN) + 1)
+    a.threads = len / COPY_PARALLEL_MIN + 1;
+
+  if (len < COPY_NOGVL_MIN)
+    {
+      copy_range (&a);
+      return;
+    }
+  shm_blocking (shmid, NULL, v_str,
+		a.threads > 1 ? copy_parallel : copy_range, &a);
+}
+
+/*
+ * Check that +len+ bytes at +offset+ lie within the attached segment,
+ * without overflowing, and return their address.
+ */
+
+static char *
+shm_range (shmid, offset, len)
+     struct ipcid_ds *shmid;
+     size_t offset, len;
+{
+  if (!shmid->data)
+    rb_raise (cError, "detached memory");
+  if (len > shmid->attached || offset > shmid->attached - len)
+    rb_raise (cError, "invalid shm_segsz");
+  return (char *)shmid->data + offset;
+}
+
+/*
+ * call-seq:
+ *   read(len = 0, offset = 0) -> String
+ *
+ * Read +len+ bytes from the shared memory segment starting at
+ * optional +offset+.
+ */
+
+static VALUE
+rb_shm_read (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct ipcid_ds *shmid;
+  VALUE v_len, v_offset, ret;
+  size_t len, offset = 0;
+  char *src;
+  uint64_t t0;
+
+  shmid = get_ipcid (obj);
+  len = shmid->attached;
+
+  rb_scan_args (argc, argv, "11", &v_len, &v_offset);
+  if (!NIL_P (v_len))
+    len = NUM2SIZET (v_len);
+  if (!NIL_P (v_offset))
+    offset = NUM2SIZET (v_offset);
+  src = shm_range (shmid, offset, len);
+
+  t0 = IPC_STATS_BEGIN (shmid);
+  if (len < COPY_NOGVL_MIN)
+    ret = rb_str_new (src, len);
+  else
+    {
+      ret = rb_str_new (0, len);
+      shm_copy (shmid, RSTRING_PTR (ret), src, 0, len, 0, Qnil);
+    }
+  IPC_STATS_END (shmid, len, t0);
+
+  return ret;
+}
+
+/*
+ * call-seq:
+ *   read_into(buf, len, offset = 0) -> String
+ *
+ * Read +len+ bytes at +offset+ into the String +buf+, replacing its
+ * contents, and return +buf+. Reading a large segment piece by piece
+ * into the same String allocates nothing once +buf+ is big enough.
+ */
+
+static VALUE
+rb_shm_read_into (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct ipcid_ds *shmid;
+  VALUE v_buf, v_len, v_offset;
+  size_t len, offset = 0;
+  char *src;
+  uint64_t t0;
+
+  rb_scan_args (argc, argv, "21", &v_buf, &v_len, &v_offset);
+  StringValue (v_buf);
+  rb_str_modify (v_buf);
+  len = NUM2SIZET (v_len);
+  if (!NIL_P (v_offset))
+    offset = NUM2SIZET (v_offset);
+  shmid = get_ipcid (obj);
+  src = shm_range (shmid, offset, len);
+
+  rb_str_resize (v_buf, len);
+  t0 = IPC_STATS_BEGIN (shmid);
+  shm_copy (shmid, RSTRING_PTR (v_buf), src, 0, len, 0, v_buf);
+  IPC_STATS_END (shmid, len, t0);
+
+  return v_buf;
+}
+
+/*
+ * call-seq:
+ *   each_chunk(chunk_size = 1048576, offset = 0, len = nil) { |str, off| ... }
+ *     -> SharedMemory
+ *
+ * Yield the +len+ bytes at +offset+ (the rest of the segment if nil)
+ * in Strings of at most +chunk_size+ bytes, with the offset of each,
+ * so that multi-GiB ranges can be streamed without one String
+ * holding them all.
+ */
+
+static VALUE
+rb_shm_each_chunk (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct ipcid_ds *shmid;
+  VALUE v_chunk, v_offset, v_len;
+  size_t chunk = 1 << 20, offset = 0, len, n;
+  uint64_t t0;
+
+  rb_scan_args (argc, argv, "03", &v_chunk, &v_offset, &v_len);
+  rb_need_block ();
+  if (!NIL_P (v_chunk))
+    chunk = NUM2SIZET (v_chunk);
+  if (!chunk)
+    rb_raise (rb_eArgError, "chunk_size must be positive");
+  if (!NIL_P (v_offset))
+    offset = NUM2SIZET (v_offset);
+  shmid = get_ipcid (obj);
+  if (offset > shmid->attached)
+    rb_raise (cError, "invalid shm_segsz");
+  len = NIL_P (v_len) ? shmid->attached - offset : NUM2SIZET (v_len);
+  shm_range (shmid, offset, len);
+
+  while (len)
+    {
+      n = len < chunk ? len : chunk;
+      /* the block may have detached the segment */
+      shmid = get_ipcid (obj);
+      t0 = IPC_STATS_BEGIN (shmid);
+      v_chunk = rb_str_new (shm_range (shmid, offset, n), n);
+      IPC_STATS_END (shmid, n, t0);
+      rb_yield_values (2, v_chunk, SIZET2NUM (offset));
+      offset += n;
+      len -= n;
+    }
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   write(buf, offset = 0) -> SharedMemory
+ *
+ * Write data from +buf+ to the shared memory segment at
+ * optional +offset+ offset.
+ */
+
+static VALUE
+rb_shm_write (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct ipcid_ds *shmid;
+  VALUE v_buf, v_offset;
+  size_t len, offset = 0;
+  char *dst;
+  uint64_t t0;
+
+  rb_scan_args (argc, argv, "11", &v_buf, &v_offset);
+  StringValue (v_buf);
+  if (!NIL_P (v_offset))
+    offset = NUM2SIZET (v_offset);
+  shmid = get_ipcid (obj);
+
+  len = RSTRING_LEN (v_buf);
+  dst = shm_range (shmid, offset, len);
+
+  t0 = IPC_STATS_BEGIN (shmid);
+  shm_copy (shmid, dst, RSTRING_PTR (v_buf), 0, len, 1, v_buf);
+  IPC_STATS_END (shmid, len, t0);
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   fill(byte, offset = 0, len = nil) -> SharedMemory
+ *
+ * Set +len+ bytes at +offset+ (the rest of the segment if nil) to
+ * +byte+.
+ */
+
+static VALUE
+rb_shm_fill (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct ipcid_ds *shmid;
+  VALUE v_byte, v_offset, v_len;
+  size_t len, offset = 0;
+  char *dst;
+  int c;
+  uint64_t t0;
+
+  rb_scan_args (argc, argv, "12", &v_byte, &v_offset, &v_len);
+  c = NUM2INT (v_byte);
+  if (!NIL_P (v_offset))
+    offset = NUM2SIZET (v_offset);
+  shmid = get_ipcid (obj);
+  if (offset > shmid->attached)
+    rb_raise (cError, "invalid shm_segsz");
+  len = NIL_P (v_len) ? shmid->attached - offset : NUM2SIZET (v_len);
+  dst = shm_range (shmid, offset, len);
+
+  t0 = IPC_STATS_BEGIN (shmid);
+  shm_copy (shmid, dst, NULL, c, len, 1, Qnil);
+  IPC_STATS_END (shmid, len, t0);
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   copy_threads = n
+ *
+ * Split reads, writes and fills of more than 8 MiB between up to +n+
+ * threads (at most 16); 1, the default, copies on the calling thread.
+ */
+
+static VALUE
+rb_shm_set_copy_threads (obj, v_n)
+     VALUE obj, v_n;
+{
+  struct ipcid_ds *shmid;
+  int n = NUM2INT (v_n);
+
+  rb_check_frozen (obj);
+  shmid = get_ipcid (obj);
+  if (n < 1)
+    n = 1;
+  if (n > COPY_MAX_THREADS)
+    n = COPY_MAX_THREADS;
+  shmid->copy_threads = n;
+  return v_n;
+}
+
+/*
+ * call-seq:
+ *   copy_threads -> Integer
+ *
+ * Return the number of threads large copies are split between.
+ */
+
+static VALUE
+rb_shm_copy_threads (obj)
+     VALUE obj;
+{
+  struct ipcid_ds *shmid = get_ipcid (obj);
+
+  return INT2FIX (shmid->copy_threads ? shmid->copy_threads : 1);
+}
+
+/*
+ * call-seq:
+ *   size -> Integer
+ *
+ * Return the size of the shared memory segment.
+ */
+
+static VALUE
+rb_shm_size (obj)
+     VALUE obj;
+{
+  union ipc_stat st;
+  get_ipcid_and_stat (obj, &st);
+  return SIZET2NUM (st.shmstat.shm_segsz);
+}
+
+/*
+ * call-seq:
+ *   SemaphoreOperation.new(pos, value, flags = 0) -> SemaphoreOperation
+ *
+ * Create a new SemaphoreOperation. +pos+ is an index identifying
+ * a particular semaphore within a semaphore set. +value+ is the
+ * value to added or subtracted from the semaphore. +flags+ is a
+ * bitwise OR selected from IPC_NOWAIT and SEM_UNDO. See semop(2).
+ */
+
+static VALUE
+rb_semop_s_new (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  struct sembuf *op;
+  VALUE dst, v_pos, v_value, v_flags;
+
+  dst = TypedData_Make_Struct (klass, struct sembuf, &semop_data_type, op);
+  rb_scan_args (argc, argv, "21", &v_pos, &v_value, &v_flags);
+  op->sem_num = NUM2INT (v_pos);
+  op->sem_op = NUM2INT (v_value);
+  if (!NIL_P (v_flags))
+    op->sem_flg = NUM2INT (v_flags);
+
+  return dst;
+}
+
+/*
+ * call-seq:
+ *   pos -> Fixnum
+ *
+ * Return the operation semaphore position. See semop(2).
+ */
+
+static VALUE
+rb_semop_pos (obj)
+     VALUE obj;
+{
+  struct sembuf *op;
+
+  TypedData_Get_Struct (obj, struct sembuf, &semop_data_type, op);
+  return INT2FIX (op->sem_num);
+}
+
+/*
+ * call-seq:
+ *   value -> Fixnum
+ *
+ * Return the operation value. See semop(2).
+ */
+
+static VALUE
+rb_semop_value (obj)
+     VALUE obj;
+{
+  struct sembuf *op;
+
+  TypedData_Get_Struct (obj, struct sembuf, &semop_data_type, op);
+  return INT2FIX (op->sem_op);
+}
+
+/*
+ * call-seq:
+ *   flags -> Fixnum
+ *
+ * Return the operation flags. See semop(2).
+ */
+
+static VALUE
+rb_semop_flags (obj)
+     VALUE obj;
+{
+  struct sembuf *op;
+
+  TypedData_Get_Struct (obj, struct sembuf, &semop_data_type, op);
+  return INT2FIX (op->sem_flg);
+}
+
+/* call-seq:
+ *   Permission.new(ipcobject) -> Permission
+ *
+ * Create a Permission object for +ipcobject+.
+ */
+
+static VALUE
+rb_perm_s_new (klass, v_ipcid)
+     VALUE klass, v_ipcid;
+{
+  struct ipcid_ds *ipcid;
+  struct perm_ds *perm;
+  union ipc_stat st;
+  VALUE dst;
+
+  TypedData_Get_Struct (v_ipcid, struct ipcid_ds, &ipcid_data_type, ipcid);
+  ipcid->stat (ipcid, &st);
+
+  dst = TypedData_Make_Struct (klass, struct perm_ds, &perm_data_type, perm);
+  perm->ipc = v_ipcid;
+
+  return dst;
+}
+
+static struct ipc_perm *
+get_perm (obj, st)
+     VALUE obj;
+     union ipc_stat *st;
+{
+  struct perm_ds *perm;
+  struct ipcid_ds *ipcid;
+
+  TypedData_Get_Struct (obj, struct perm_ds, &perm_data_type, perm);
+  TypedData_Get_Struct (perm->ipc, struct ipcid_ds, &ipcid_data_type, ipcid);
+  ipcid->stat (ipcid, st);
+  return ipcid->perm (st);
+}
+
+/*
+ * call-seq:
+ *   cuid -> Fixnum
+ *
+ * Return effective UID of creator.
+ */
+
+static VALUE
+rb_perm_cuid (obj)
+     VALUE obj;
+{
+  struct ipc_perm *perm;
+  union ipc_stat st;
+
+  perm = get_perm (obj, &st);
+  return INT2FIX (perm->cuid);
+}
+
+/*
+ * call-seq:
+ *   cgid -> Fixnum
+ *
+ * Return effective GID of creator.
+ */
+
+static VALUE
+rb_perm_cgid (obj)
+     VALUE obj;
+{
+  struct ipc_perm *perm;
+  union ipc_stat st;
+
+  perm = get_perm (obj, &st);
+  return INT2FIX (perm->cgid);
+}
+
+/*
+ * call-seq:
+ *   uid -> Fixnum
+ *
+ * Return effective UID of owner.
+ */
+
+static VALUE
+rb_perm_uid (obj)
+     VALUE obj;
+{
+  struct ipc_perm *perm;
+  union ipc_stat st;
+
+  perm = get_perm (obj, &st);
+  return INT2FIX (perm->uid);
+}
+
+/*
+ * call-seq:
+ *   gid -> Fixnum
+ *
+ * Return effective GID of owner.
+ */
+
+static VALUE
+rb_perm_gid (obj)
+     VALUE obj;
+{
+  struct ipc_perm *perm;
+  union ipc_stat st;
+
+  perm = get_perm (obj, &st);
+  return INT2FIX (perm->gid);
+}
+
+/*
+ * call-seq:
+ *   mode -> Fixnum
+ *
+ * Return mode bits.
+ */
+
+static VALUE
+rb_perm_mode (obj)
+     VALUE obj;
+{
+  struct ipc_perm *perm;
+  union ipc_stat st;
+
+  perm = get_perm (obj, &st);
+  return INT2FIX (perm->mode);
+}
+
+/*
+ * Structures that live inside a shared memory segment are reached
+ * through a shm_region: the SharedMemory object (kept alive by the
+ * GC mark function) and the byte range they occupy.  The pointer is
+ * recomputed on every use, so the segment may be detached and
+ * attached again at another address.
+ */
+
+struct shm_region {
+  VALUE shm;
+  struct ipcid_ds *shmid;
+  size_t offset;
+  size_t size;
+};
+
+static void
+region_mark (region)
+     struct shm_region *region;
+{
+  ipc_gc_mark (region->shm);
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+region_compact (region)
+     struct shm_region *region;
+{
+  region->shm = ipc_gc_location (region->shm);
+}
+#endif
+
+static void
+region_init (region, v_shm, offset, size)
+     struct shm_region *region;
+     VALUE v_shm;
+     size_t offset, size;
+{
+  struct ipcid_ds *shmid;
+
+  TypedData_Get_Struct (v_shm, struct ipcid_ds, &shm_data_type, shmid);
+  if (!shmid->data)
+    rb_raise (cError, "detached memory");
+  if (offset % 8)
+    rb_raise (cError, "misaligned offset");
+  if (size > shmid->attached || offset > shmid->attached - size)
+    rb_raise (cError, "invalid shm_segsz");
+
+  region->shm = v_shm;
+  region->shmid = shmid;
+  region->offset = offset;
+  region->size = size;
+}
+
+static char *
+region_ptr (region)
+     struct shm_region *region;
+{
+  struct ipcid_ds *shmid = region->shmid;
+
+  if (!shmid->data)
+    rb_raise (cError, "detached memory");
+  if (region->offset + region->size > shmid->attached)
+    rb_raise (cError, "invalid shm_segsz");
+  return (char *)shmid->data + region->offset;
+}
+
+/*
+ * Bulk transfer between a file descriptor and an attached segment,
+ * without going through a Ruby String.  Regular files are read and
+ * written with pread(2)/pwrite(2) in chunks, split between several
+ * threads when the transfer is large; pipes and sockets with
+ * read(2)/write(2), or vmsplice(2) towards a pipe.
+ */
+
+#define XFER_CHUNK (8 << 20)
+#define XFER_PARALLEL_MIN (64 << 20)
+#define XFER_MAX_THREADS 16
+
+struct xfer_arg {
+  int fd;
+  int dump;			/* segment to file */
+  int positional;		/* pread/pwrite at file_offset */
+  int splice;
+  char *data;
+  size_t len;
+  off_t file_offset;
+  int threads;
+  size_t done;
+  int eof;
+  int err;
+};
+
+static void *
+xfer_range (ptr)
+     void *ptr;
+{
+  struct xfer_arg *x = ptr;
+  ssize_t n;
+  size_t chunk;
+
+  while (x->done < x->len)
+    {
+      chunk = x->len - x->done;
+      if (chunk > XFER_CHUNK)
+	chunk = XFER_CHUNK;
+      if (x->dump)
+	n = pwrite (x->fd, x->data + x->done, chunk,
+		    x->file_offset + x->done);
+      else
+	n = pread (x->fd, x->data + x->done, chunk,
+		   x->file_offset + x->done);
+      if (n == -1 && errno == EINTR)
+	continue;
+      if (n == -1)
+	{
+	  x->err = errno;
+	  break;
+	}
+      if (n == 0)
+	{
+	  x->eof = 1;
+	  break;
+	}
+      x->done += n;
+    }
+  return 0;
+}
+
+static void *
+xfer_parallel (ptr)
+     void *ptr;
+{
+  struct xfer_arg *x = ptr;
+#ifdef HAVE_PTHREAD_H
+  struct xfer_arg part[XFER_MAX_THREADS];
+  pthread_t tid[XFER_MAX_THREADS];
+  int started[XFER_MAX_THREADS];
+  size_t share, pos = 0;
+  int i;
+
+  share = IPC_ALIGN (x->len / x->threads + 1, 4096);
+  for (i = 0; i < x->threads; i++)
+    {
+      part[i] = *x;
+      part[i].data = x->data + pos;
+      part[i].file_offset = x->file_offset + pos;
+      part[i].len = x->len - pos < share ? x->len - pos : share;
+      pos += part[i].len;
+      started[i] = i > 0 && part[i].len
+	&& pthread_create (&tid[i], NULL, xfer_range, &part[i]) == 0;
+    }
+  /* parts that could not get a thread are done here */
+  for (i = 0; i < x->threads; i++)
+    if (!started[i])
+      xfer_range (&part[i]);
+  for (i = 1; i < x->threads; i++)
+    if (started[i])
+      pthread_join (tid[i], NULL);
+
+  /* stop at the first short part, the rest follows a hole */
+  for (i = 0; i < x->threads; i++)
+    {
+      x->done += part[i].done;
+      if (part[i].err && !x->err)
+	x->err = part[i].err;
+      if (part[i].done < part[i].len)
+	{
+	  x->eof = part[i].eof;
+	  break;
+	}
+    }
+#else
+  xfer_range (x);
+#endif
+  return 0;
+}
+
+static void *
+xfer_stream (ptr)
+     void *ptr;
+{
+  struct xfer_arg *x = ptr;
+  ssize_t n;
+  size_t chunk;
+
+  while (x->done < x->len)
+    {
+      chunk = x->len - x->done;
+      if (chunk > XFER_CHUNK)
+	chunk = XFER_CHUNK;
+      if (!x->dump)
+	n = read (x->fd, x->data + x->done, chunk);
+#ifdef SYS_vmsplice
+      else if (x->splice)
+	{
+	  struct iovec iov;
+
+	  iov.iov_base = x->data + x->done;
+	  iov.iov_len = chunk;
+	  n = syscall (SYS_vmsplice, x->fd, &iov, 1UL, 0U);
+	  if (n == -1 && errno != EINTR && errno != EAGAIN)
+	    {
+	      x->splice = 0;	/* not a pipe after all, write instead */
+	      continue;
+	    }
+	}
+#endif
+      else
+	n = write (x->fd, x->data + x->done, chunk);
+      if (n == -1)
+	{
+	  x->err = errno;
+	  break;
+	}
+      if (n == 0)
+	{
+	  x->eof = 1;
+	  break;
+	}
+      x->done += n;
+    }
+  return 0;
+}
+
+struct xfer_call {
+  VALUE obj;
+  struct ipcid_ds *shmid;
+  struct xfer_arg x;
+  size_t offset;
+  int opened;
+  int pinned;
+};
+
+static VALUE
+xfer_run (ptr)
+     VALUE ptr;
+{
+  struct xfer_call *c = (struct xfer_call *)ptr;
+  struct xfer_arg *x = &c->x;
+  uint64_t t0;
+  off_t pos = 0;
+  int seek = 0;
+
+  /* the io calls above may have run Ruby code that detached it */
+  x->data = shm_range (c->shmid, c->offset, x->len);
+  ATOMIC_FETCH_ADD (&c->shmid->pins, 1);
+  c->pinned = 1;
+
+  if (!x->positional)
+    {
+      struct stat st;
+
+      if (fstat (x->fd, &st) == -1)
+	rb_sys_fail ("fstat(2)");
+      if (S_ISREG (st.st_mode))
+	{
+	  /* continue from the current position, and move it on */
+	  if ((pos = lseek (x->fd, 0, SEEK_CUR)) == -1)
+	    rb_sys_fail ("lseek(2)");
+	  x->file_offset = pos;
+	  x->positional = seek = 1;
+	  if (!x->dump && (off_t)x->len > st.st_size - pos)
+	    x->len = st.st_size > pos ? st.st_size - pos : 0;
+	}
+    }
+
+  t0 = IPC_STATS_BEGIN (c->shmid);
+  if (x->positional)
+    {
+      if (x->threads > (int)(x->len / XFER_PARALLEL_MIN) + 1)
+	x->threads = x->len / XFER_PARALLEL_MIN + 1;
+      ipc_blocking (x->threads > 1 ? xfer_parallel : xfer_range, x);
+    }
+  else
+    for (;;)
+      {
+	ipc_blocking (xfer_stream, x);
+	if (x->err != EINTR && x->err != EAGAIN && x->err != EWOULDBLOCK)
+	  break;
+	if (x->err == EINTR)
+	  IPC_CHECK_INTS ();
+	else if (x->dump)
+	  rb_thread_fd_writable (x->fd);
+	else
+	  rb_thread_wait_fd (x->fd);
+	x->err = 0;
+      }
+  IPC_STATS_END (c->shmid, x->done, t0);
+
+  if (seek)
+    lseek (x->fd, pos + x->done, SEEK_SET);
+  if (x->err)
+    {
+      errno = x->err;
+      rb_sys_fail (x->dump ? "write(2)" : "read(2)");
+    }
+
+  return SIZET2NUM (x->done);
+}
+
+static VALUE
+xfer_close (ptr)
+     VALUE ptr;
+{
+  struct xfer_call *c = (struct xfer_call *)ptr;
+
+  if (c->pinned)
+    ATOMIC_FETCH_ADD (&c->shmid->pins, -1);
+  if (c->opened)
+    close (c->x.fd);
+  return Qnil;
+}
+
+static VALUE
+xfer_opt (opts, name)
+     VALUE opts;
+     const char *name;
+{
+  return NIL_P (opts) ? Qnil : rb_hash_aref (opts, ID2SYM (rb_intern (name)));
+}
+
+static VALUE
+shm_xfer (argc, argv, obj, dump)
+     int argc;
+     VALUE *argv, obj;
+     int dump;
+{
+  struct xfer_call c;
+  VALUE v_io, v_opts, v, v_path = Qnil;
+  size_t offset = 0, segsz;
+
+  rb_scan_args (argc, argv, "11", &v_io, &v_opts);
+  if (!NIL_P (v_opts))
+    Check_Type (v_opts, T_HASH);
+
+  memset (&c, 0, sizeof (c));
+  c.obj = obj;
+  c.shmid = get_ipcid (obj);
+  if (!c.shmid->data)
+    rb_raise (cError, "detached memory");
+  segsz = c.shmid->attached;
+
+  if (!NIL_P (v = xfer_opt (v_opts, "offset")))
+    offset = NUM2SIZET (v);
+  if (offset > segsz)
+    rb_raise (cError, "invalid shm_segsz");
+  c.x.len = segsz - offset;
+  if (!NIL_P (v = xfer_opt (v_opts, "length")))
+    {
+      c.x.len = NUM2SIZET (v);
+      shm_range (c.shmid, offset, c.x.len);
+    }
+  if (!NIL_P (v = xfer_opt (v_opts, "file_offset")))
+    {
+      c.x.file_offset = (off_t)NUM2LL (v);
+      c.x.positional = 1;
+    }
+  c.x.threads = 4;
+  if (!NIL_P (v = xfer_opt (v_opts, "threads")))
+    c.x.threads = NUM2INT (v);
+  if (c.x.threads < 1)
+    c.x.threads = 1;
+  if (c.x.threads > XFER_MAX_THREADS)
+    c.x.threads = XFER_MAX_THREADS;
+  c.x.splice = xfer_opt (v_opts, "splice") != Qfalse;
+  c.x.dump = dump;
+  c.offset = offset;
+
+  if (TYPE (v_io) == T_STRING)
+    v_path = v_io;
+  else if (!rb_obj_is_kind_of (v_io, rb_cIO)
+	   && rb_respond_to (v_io, rb_intern ("to_path")))
+    v_path = rb_funcall (v_io, rb_intern ("to_path"), 0);
+
+  if (!NIL_P (v_path))
+    {
+      StringValue (v_path);
+      c.x.fd = open (StringValueCStr (v_path),
+		     dump ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY, 0666);
+      if (c.x.fd == -1)
+	rb_sys_fail (RSTRING_PTR (v_path));
+      c.opened = 1;
+    }
+  else
+    {
+      if (dump && rb_respond_to (v_io, rb_intern ("flush")))
+	rb_funcall (v_io, rb_intern ("flush"), 0);
+      c.x.fd = NUM2INT (rb_funcall (v_io, rb_intern ("fileno"), 0));
+    }
+
+  return rb_ensure (xfer_run, (VALUE)&c, xfer_close, (VALUE)&c);
+}
+
+/*
+ * call-seq:
+ *   load_from(io_or_path, opts = {}) -> Integer
+ *
+ * Read the contents of +io_or_path+ straight into the attached segment
+ * and return the number of bytes read. Options:
+ *
+ * :offset:: where to start in the segment (default 0)
+ * :length:: how many bytes to read (default: up to the end of the
+ *           segment, or of a regular file)
+ * :file_offset:: where to start in the file (default: its current
+ *                position, which is then advanced)
+ * :threads:: how many threads may share a large regular file (default 4)
+ *
+ * Data already buffered by an IO object is not seen. Pipes and sockets
+ * are read until +length+ bytes or end of file.
+ */
+
+static VALUE
+rb_shm_load_from (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  return shm_xfer (argc, argv, obj, 0);
+}
+
+/*
+ * call-seq:
+ *   dump_to(io_or_path, opts = {}) -> Integer
+ *
+ * Write the attached segment to +io_or_path+, which is created or
+ * truncated when given as a path, and return the number of bytes
+ * written. Takes the same options as #load_from.
+ *
+ * Towards a pipe the pages of the segment are handed to the pipe with
+ * vmsplice(2) instead of being copied, so the reader sees any change
+ * made to them before it has read them. Pass <tt>:splice => false</tt>
+ * to copy instead.
+ */
+
+static VALUE
+rb_shm_dump_to (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  return shm_xfer (argc, argv, obj, 1);
+}
+
+/*
+ * Segment images.  An image file starts with a header, then the
+ * CRC32C of each block of the segment, then the blocks themselves,
+ * page aligned, so that restoring is one large sequential read into
+ * the new segment.  Saving over an image of the same geometry only
+ * rewrites the blocks whose checksum changed, in a copy of the image
+ * that replaces it once complete.
+ */
+
+#define IMAGE_MAGIC "SYSVSHM"
+#define IMAGE_VERSION 1
+#define IMAGE_BLOCK (1 << 20)
+#define IMAGE_ALIGN 4096
+
+struct image_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_size;
+  uint64_t segsz;
+  uint64_t nblocks;
+  uint32_t mode;
+  uint32_t table_crc;		/* of the block checksums */
+  uint64_t saved_at;
+  char pad[16];
+};
+
+#define IMAGE_DATA_OFFSET(nblocks) \
+  IPC_ALIGN (sizeof (struct image_header) + (nblocks) * 4, IMAGE_ALIGN)
+
+#ifndef HAVE_FDATASYNC
+#define fdatasync fsync
+#endif
+
+static uint32_t crc32c_table[256];
+
+static uint32_t
+crc32c_sw (crc, buf, len)
+     uint32_t crc;
+     const void *buf;
+     size_t len;
+{
+  const unsigned char *p = buf;
+
+  crc = ~crc;
+  while (len--)
+    crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+/* SSE4.2 has an instruction for this very polynomial */
+static uint32_t __attribute__ ((target ("sse4.2")))
+crc32c_hw (crc, buf, len)
+     uint32_t crc;
+     const void *buf;
+     size_t len;
+{
+  const unsigned char *p = buf;
+  uint64_t c = ~crc;
+
+  for (; len && ((uintptr_t)p & 7); len--)
+    c = __builtin_ia32_crc32qi (c, *p++);
+  for (; len >= 8; len -= 8, p += 8)
+    c = __builtin_ia32_crc32di (c, *(const uint64_t *)p);
+  for (; len; len--)
+    c = __builtin_ia32_crc32qi (c, *p++);
+  return ~(uint32_t)c;
+}
+#endif
+
+static uint32_t (*crc32c) (uint32_t, const void *, size_t) = crc32c_sw;
+
+static void
+crc32c_init ()
+{
+  uint32_t i, j, c;
+
+  for (i = 0; i < 256; i++)
+    {
+      for (c = i, j = 0; j < 8; j++)
+	c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+      crc32c_table[i] = c;
+    }
+#if defined(__GNUC__) && defined(__x86_64__)
+  if (__builtin_cpu_supports ("sse4.2"))
+    crc32c = crc32c_hw;
+#endif
+}
+
+struct image_arg {
+  int fd;
+  int src_fd;			/* image to start from, or -1 */
+  const char *data;
+  size_t segsz;
+  size_t block_size;
+  uint64_t nblocks;
+  uint32_t mode;
+  uint32_t *table;
+  int incremental;		/* table holds what the file has */
+  int sync;
+  size_t written;
+  int err;
+  const char *what;
+};
+
+static int
+image_pwrite (a, buf, len, off)
+     struct image_arg *a;
+     const void *buf;
+     size_t len;
+     off_t off;
+{
+  ssize_t n;
+
+  while (len)
+    {
+      n = pwrite (a->fd, buf, len, off);
+      if (n == -1 && errno == EINTR)
+	continue;
+      if (n == -1)
+	{
+	  a->err = errno;
+	  a->what = "pwrite(2)";
+	  return -1;
+	}
+      buf = (const char *)buf + n;
+      len -= n;
+      off += n;
+    }
+  return 0;
+}
+
+/*
+ * Copy the previous image into the new file, sharing its blocks
+ * where the file system can.
+ */
+
+static int
+image_clone (a, buf)
+     struct image_arg *a;
+     char *buf;
+{
+  struct stat st;
+  off_t off;
+  ssize_t n;
+
+#ifdef FICLONE
+  if (ioctl (a->fd, FICLONE, a->src_fd) == 0)
+    return 0;
+#endif
+  if (fstat (a->src_fd, &st) == -1)
+    {
+      a->err = errno;
+      a->what = "fstat(2)";
+      return -1;
+    }
+  for (off = 0; off < st.st_size; off += n)
+    {
+      n = pread (a->src_fd, buf, a->block_size, off);
+      if (n == -1 && errno == EINTR)
+	n = 0;
+      else if (n <= 0)
+	{
+	  a->err = n ? errno : EIO;
+	  a->what = "pread(2)";
+	  return -1;
+	}
+      else if (image_pwrite (a, buf, n, off))
+	return -1;
+    }
+  return 0;
+}
+
+/*
+ * Each block is copied out of the segment before being checksummed
+ * and written, so the file is consistent with itself even while
+ * other processes keep writing to the segment.
+ */
+
+static void *
+image_save (ptr)
+     void *ptr;
+{
+  struct image_arg *a = ptr;
+  off_t data_off = IMAGE_DATA_OFFSET (a->nblocks);
+  uint64_t i;
+  size_t len;
+  uint32_t crc;
+  char *buf;
+
+  if (!(buf = malloc (a->block_size)))
+    {
+      a->err = ENOMEM;
+      a->what = "malloc(3)";
+      return 0;
+    }
+  if (a->src_fd >= 0 && image_clone (a, buf))
+    {
+      free (buf);
+      return 0;
+    }
+  for (i = 0; i < a->nblocks; i++)
+    {
+      len = a->segsz - i * a->block_size;
+      if (len > a->block_size)
+	len = a->block_size;
+      memcpy (buf, a->data + i * a->block_size, len);
+      crc = crc32c (0, buf, len);
+      if (a->incremental && crc == a->table[i])
+	continue;
+      if (image_pwrite (a, buf, len, data_off + (off_t)(i * a->block_size)))
+	break;
+      a->table[i] = crc;
+      a->written += len;
+    }
+  free (buf);
+
+  /* the blocks must be on disk before the checksums that cover them */
+  if (!a->err && a->sync && fdatasync (a->fd) == -1)
+    {
+      a->err = errno;
+      a->what = "fdatasync(2)";
+    }
+  return 0;
+}
+
+static void *
+image_verify (ptr)
+     void *ptr;
+{
+  struct image_arg *a = ptr;
+  uint64_t i;
+  size_t len;
+
+  for (i = 0; i < a->nblocks; i++)
+    {
+      len = a->segsz - i * a->block_size;
+      if (len > a->block_size)
+	len = a->block_size;
+      if (crc32c (0, a->data + i * a->block_size, len) != a->table[i])
+	{
+	  a->err = -1;
+	  a->written = i;
+	  break;
+	}
+    }
+  return 0;
+}
+
+static int
+image_read_header (fd, hdr)
+     int fd;
+     struct image_header *hdr;
+{
+  return pread (fd, hdr, sizeof (*hdr), 0) == sizeof (*hdr)
+    && !memcmp (hdr->magic, IMAGE_MAGIC, sizeof (hdr->magic))
+    && hdr->version == IMAGE_VERSION
+    && hdr->block_size
+    && hdr->nblocks == (hdr->segsz + hdr->block_size - 1) / hdr->block_size;
+}
+
+struct image_call {
+  struct image_arg a;
+  VALUE v_path;
+  VALUE v_tmp;
+  struct ipcid_ds *shmid;	/* pinned while in use */
+  int pinned;
+};
+
+static VALUE
+image_run_save (ptr)
+     VALUE ptr;
+{
+  struct image_call *c = (struct image_call *)ptr;
+  struct image_arg *a = &c->a;
+  struct image_header hdr;
+  size_t tlen = a->nblocks * 4;
+
+  a->data = shm_range (c->shmid, 0, a->segsz);
+  ATOMIC_FETCH_ADD (&c->shmid->pins, 1);
+  c->pinned = 1;
+  ipc_blocking (image_save, a);
+  if (a->err)
+    {
+      errno = a->err;
+      rb_sys_fail (a->what);
+    }
+
+  memset (&hdr, 0, sizeof (hdr));
+  memcpy (hdr.magic, IMAGE_MAGIC, sizeof (hdr.magic));
+  hdr.version = IMAGE_VERSION;
+  hdr.block_size = a->block_size;
+  hdr.segsz = a->segsz;
+  hdr.nblocks = a->nblocks;
+  hdr.mode = a->mode;
+  hdr.table_crc = crc32c (0, a->table, tlen);
+  hdr.saved_at = time (NULL);
+  if (image_pwrite (a, a->table, tlen, sizeof (hdr))
+      || image_pwrite (a, &hdr, sizeof (hdr), 0)
+      || (a->sync && fsync (a->fd) == -1))
+    rb_sys_fail (a->what ? a->what : "fsync(2)");
+
+  if (rename (RSTRING_PTR (c->v_tmp), RSTRING_PTR (c->v_path)) == -1)
+    rb_sys_fail (RSTRING_PTR (c->v_path));
+  c->v_tmp = Qnil;
+
+  return SIZET2NUM (a->written);
+}
+
+static VALUE
+image_close (ptr)
+     VALUE ptr;
+{
+  struct image_call *c = (struct image_call *)ptr;
+
+  if (c->pinned)
+    ATOMIC_FETCH_ADD (&c->shmid->pins, -1);
+  if (c->a.fd >= 0)
+    close (c->a.fd);
+  if (c->a.src_fd >= 0)
+    close (c->a.src_fd);
+  if (!NIL_P (c->v_tmp))
+    unlink (RSTRING_PTR (c->v_tmp));
+  xfree (c->a.table);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   save(path, opts = {}) -> Integer
+ *
+ * Save the contents of the attached segment to the image file +path+
+ * and return the number of bytes written. If +path+ already holds an
+ * image of a segment of the same size, only the blocks that changed
+ * since are rewritten, unless <tt>:incremental => false</tt>;
+ * otherwise a new image replaces the file once complete. Options:
+ *
+ * :block_size:: granularity of checksums and of incremental saves
+ *               (default 1 MiB)
+ * :sync:: whether to fsync the file (default true)
+ *
+ * Other processes may keep writing to the segment meanwhile: each
+ * block is saved as it was at some point during the save, but blocks
+ * are not saved at the same instant. The image is written to
+ * <tt>path.tmp</tt> and renamed over +path+ once synced, so an
+ * interrupted save leaves the previous image as it was. An
+ * incremental save starts from a copy of the previous image, a
+ * reflink where the file system supports it, and trusts its blocks.
+ */
+
+static VALUE
+rb_shm_save (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct image_call c;
+  struct image_header hdr;
+  struct ipcid_ds *shmid;
+  union ipc_stat st;
+  VALUE v_path, v_opts, v;
+  size_t block_size = IMAGE_BLOCK;
+
+  rb_scan_args (argc, argv, "11", &v_path, &v_opts);
+  StringValue (v_path);
+  if (!NIL_P (v_opts))
+    Check_Type (v_opts, T_HASH);
+  if (!NIL_P (v = xfer_opt (v_opts, "block_size")))
+    block_size = IPC_ALIGN (NUM2SIZET (v), IMAGE_ALIGN);
+  if (!block_size || block_size > 0x80000000UL)
+    rb_raise (cError, "invalid block size");
+
+  shmid = get_ipcid (obj);
+  if (!shmid->data)
+    rb_raise (cError, "detached memory");
+
+  memset (&c, 0, sizeof (c));
+  c.v_path = v_path;
+  c.v_tmp = rb_str_plus (v_path, rb_str_new2 (".tmp"));
+  c.a.src_fd = -1;
+  c.shmid = shmid;
+  shmid->stat (shmid, &st);
+  c.a.segsz = shmid->attached;
+  c.a.mode = st.shmstat.shm_perm.mode & 0777;
+  c.a.block_size = block_size;
+  c.a.nblocks = (c.a.segsz + block_size - 1) / block_size;
+  c.a.sync = xfer_opt (v_opts, "sync") != Qfalse;
+  c.a.table = ALLOC_N (uint32_t, c.a.nblocks + 1);
+
+  c.a.src_fd = open (RSTRING_PTR (v_path), O_RDONLY);
+  if (c.a.src_fd >= 0 && xfer_opt (v_opts, "incremental") != Qfalse
+      && image_read_header (c.a.src_fd, &hdr)
+      && hdr.segsz == c.a.segsz && hdr.block_size == block_size
+      && pread (c.a.src_fd, c.a.table, c.a.nblocks * 4, sizeof (hdr))
+      == (ssize_t)(c.a.nblocks * 4)
+      && crc32c (0, c.a.table, c.a.nblocks * 4) == hdr.table_crc)
+    c.a.incremental = 1;
+  else if (c.a.src_fd >= 0)
+    {
+      close (c.a.src_fd);
+      c.a.src_fd = -1;
+    }
+  c.a.fd = open (RSTRING_PTR (c.v_tmp), O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (c.a.fd == -1)
+    {
+      if (c.a.src_fd >= 0)
+	close (c.a.src_fd);
+      xfree (c.a.table);
+      rb_sys_fail (RSTRING_PTR (c.v_tmp));
+    }
+
+  return rb_ensure (image_run_save, (VALUE)&c, image_close, (VALUE)&c);
+}
+
+struct restore_call {
+  struct image_call c;
+  VALUE klass;
+  VALUE v_key;
+  VALUE v_shmflg;
+  VALUE v_threads;
+  VALUE obj;
+  int created;
+  int done;
+};
+
+static VALUE
+image_run_restore (ptr)
+     VALUE ptr;
+{
+  struct restore_call *r = (struct restore_call *)ptr;
+  struct image_arg *a = &r->c.a;
+  struct image_header hdr;
+  struct ipcid_ds *shmid;
+  union ipc_stat st;
+  struct xfer_arg x;
+  VALUE obj, args[3];
+
+  if (!image_read_header (a->fd, &hdr))
+    rb_raise (cError, "not a segment image");
+  a->segsz = hdr.segsz;
+  a->block_size = hdr.block_size;
+  a->nblocks = hdr.nblocks;
+  a->table = ALLOC_N (uint32_t, a->nblocks + 1);
+  if (pread (a->fd, a->table, a->nblocks * 4, sizeof (hdr))
+      != (ssize_t)(a->nblocks * 4)
+      || crc32c (0, a->table, a->nblocks * 4) != hdr.table_crc)
+    rb_raise (cError, "corrupt segment image");
+
+  args[0] = r->v_key;
+  args[1] = SIZET2NUM (a->segsz);
+  args[2] = NIL_P (r->v_shmflg)
+    ? INT2FIX (IPC_CREAT | (hdr.mode ? hdr.mode : 0600)) : r->v_shmflg;
+  r->obj = obj = rb_funcall2 (r->klass, rb_intern ("new"), 3, args);
+  shmid = get_ipcid_and_stat (obj, &st);
+  /* a segment nobody has attached yet, created by this process */
+  r->created = st.shmstat.shm_cpid == getpid ()
+    && st.shmstat.shm_nattch == 0;
+  rb_funcall (obj, rb_intern ("attach"), 0);
+  if (shmid->attached < a->segsz)
+    rb_raise (cError, "invalid shm_segsz");
+
+  memset (&x, 0, sizeof (x));
+  x.fd = a->fd;
+  x.len = a->segsz;
+  x.file_offset = IMAGE_DATA_OFFSET (a->nblocks);
+  x.positional = 1;
+  x.threads = NIL_P (r->v_threads) ? 4 : NUM2INT (r->v_threads);
+  if (x.threads < 1)
+    x.threads = 1;
+  if (x.threads > (int)(x.len / XFER_PARALLEL_MIN) + 1)
+    x.threads = x.len / XFER_PARALLEL_MIN + 1;
+  if (x.threads > XFER_MAX_THREADS)
+    x.threads = XFER_MAX_THREADS;
+  x.data = shm_range (shmid, 0, x.len);
+  r->c.shmid = shmid;
+  ATOMIC_FETCH_ADD (&shmid->pins, 1);
+  r->c.pinned = 1;
+  ipc_blocking (x.threads > 1 ? xfer_parallel : xfer_range, &x);
+  if (x.err)
+    {
+      errno = x.err;
+      rb_sys_fail ("pread(2)");
+    }
+  if (x.done < x.len)
+    rb_raise (cError, "truncated segment image");
+
+  a->data = shmid->data;
+  ipc_blocking (image_verify, a);
+  if (a->err)
+    rb_raise (cError, "checksum mismatch in block %lu",
+	      (unsigned long)a->written);
+
+  r->done = 1;
+  return obj;
+}
+
+static VALUE
+image_close_restore (ptr)
+     VALUE ptr;
+{
+  struct restore_call *r = (struct restore_call *)ptr;
+  struct ipcid_ds *shmid;
+
+  if (r->c.pinned)
+    {
+      ATOMIC_FETCH_ADD (&r->c.shmid->pins, -1);
+      r->c.pinned = 0;
+    }
+  if (!r->done && r->created)
+    {
+      TypedData_Get_Struct (r->obj, struct ipcid_ds, &shm_data_type, shmid);
+      if (shmid->data)
+	rb_funcall (r->obj, rb_intern ("detach"), 0);
+      shmid->rmid (shmid);
+    }
+  return image_close ((VALUE)&r->c);
+}
+
+/*
+ * call-seq:
+ *   SharedMemory.restore(path, key, shmflg = nil, opts = {})
+ *     -> SharedMemory
+ *
+ * Create the segment of +key+ with the size saved in the image file
+ * +path+ (see #save), and by default the saved permissions, fill it
+ * from the file, check it against the saved checksums and return it
+ * attached. <tt>opts[:threads]</tt> readers share the file (default
+ * 4). Raise Error if the file is not an image, or does not match its
+ * checksums; a segment created for the occasion is removed then.
+ */
+
+static VALUE
+rb_shm_s_restore (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  struct restore_call r;
+  VALUE v_path, v_opts;
+
+  memset (&r, 0, sizeof (r));
+  rb_scan_args (argc, argv, "22", &v_path, &r.v_key, &r.v_shmflg, &v_opts);
+  StringValue (v_path);
+  if (!NIL_P (v_opts))
+    Check_Type (v_opts, T_HASH);
+  r.v_threads = xfer_opt (v_opts, "threads");
+  r.klass = klass;
+  r.c.v_path = v_path;
+  r.c.v_tmp = Qnil;
+  r.c.a.src_fd = -1;
+
+  r.c.a.fd = open (RSTRING_PTR (v_path), O_RDONLY);
+  if (r.c.a.fd == -1)
+    rb_sys_fail (RSTRING_PTR (v_path));
+
+  return rb_ensure (image_run_restore, (VALUE)&r, image_close_restore,
+		    (VALUE)&r);
+}
+
+/*
+ * POSIX IPC.  The classes of SystemVIPC::POSIX have the methods of
+ * their System V counterparts and fill the same stat structures, so
+ * that Permission, statistics and busy polling work unchanged.  Keys
+ * are names such as "/queue"; IPC_CREAT, IPC_EXCL and the mode bits
+ * of the flags keep their meaning.
+ */
+
+#if defined(HAVE_MQ_OPEN) || defined(HAVE_SHM_OPEN)
+
+static char *
+posix_strdup (str)
+     VALUE str;
+{
+  char *name = ALLOC_N (char, RSTRING_LEN (str) + 1);
+
+  memcpy (name, RSTRING_PTR (str), RSTRING_LEN (str) + 1);
+  return name;
+}
+
+static int
+posix_oflag (flags)
+     int flags;
+{
+  return (flags & IPC_CREAT ? O_CREAT : 0) | (flags & IPC_EXCL ? O_EXCL : 0);
+}
+
+static void
+posix_fill_perm (perm, fd, flags)
+     struct ipc_perm *perm;
+     int fd, flags;
+{
+  struct stat st;
+
+  if (fd >= 0 && fstat (fd, &st) == 0)
+    {
+      perm->uid = perm->cuid = st.st_uid;
+      perm->gid = perm->cgid = st.st_gid;
+      perm->mode = st.st_mode & 0777;
+    }
+  else
+    {
+      perm->uid = perm->cuid = geteuid ();
+      perm->gid = perm->cgid = getegid ();
+      perm->mode = flags & 0777;
+    }
+}
+
+/*
+ * Open +name+ with shm_open(3), creating it if +flags+ say so.
+ * *created tells whether this call created it.
+ */
+
+static int
+posix_shm_open (name, flags, created)
+     const char *name;
+     int flags;
+     int *created;
+{
+  int fd;
+
+  *created = 0;
+  if (flags & IPC_CREAT)
+    {
+      fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, flags & 0777);
+      if (fd >= 0 || errno != EEXIST || (flags & IPC_EXCL))
+	{
+	  *created = fd >= 0;
+	  return fd;
+	}
+    }
+  return shm_open (name, O_RDWR, 0);
+}
+
+/*
+ * The absolute CLOCK_REALTIME time +v_timeout+ seconds from now, in
+ * +ts+, for the timed POSIX calls; NULL if +v_timeout+ is nil.
+ */
+
+static struct timespec *
+posix_deadline (v_timeout, ts)
+     VALUE v_timeout;
+     struct timespec *ts;
+{
+  struct timeval tv;
+  uint64_t ns;
+
+  if (NIL_P (v_timeout))
+    return NULL;
+  ns = ipc_timeout_ns (v_timeout);
+  gettimeofday (&tv, NULL);
+  ns += (uint64_t)tv.tv_usec * 1000;
+  ts->tv_sec = tv.tv_sec + ns / 1000000000;
+  ts->tv_nsec = ns % 1000000000;
+  return ts;
+}
+
+#endif
+
+#ifdef HAVE_MQ_OPEN
+
+#define IPC_MQD(ipcid) ((mqd_t)(intptr_t)(ipcid)->handle)
+
+static void
+pmq_free (msgid)
+     struct ipcid_ds *msgid;
+{
+  if (msgid->id >= 0)
+    mq_close (IPC_MQD (msgid));
+  ipc_free (msgid);
+}
+
+static const rb_data_type_t pmq_data_type = {
+  "SystemVIPC::POSIX::MessageQueue",
+  { 0, (void (*) (void *))pmq_free, ipc_memsize, },
+  &ipcid_data_type, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+static void
+pmq_stat (msgid, st)
+     struct ipcid_ds *msgid;
+     union ipc_stat *st;
+{
+  struct mq_attr attr;
+
+  if (mq_getattr (IPC_MQD (msgid), &attr) == -1)
+    rb_sys_fail ("mq_getattr(3)");
+  memset (st, 0, sizeof (*st));
+  st->msgstat.msg_qnum = attr.mq_curmsgs;
+  st->msgstat.msg_qbytes = attr.mq_maxmsg * attr.mq_msgsize;
+#ifdef __linux__
+  posix_fill_perm (&st->msgstat.msg_perm, (int)IPC_MQD (msgid),
+		   msgid->flags);
+#else
+  posix_fill_perm (&st->msgstat.msg_perm, -1, msgid->flags);
+#endif
+}
+
+static void
+pmq_rmid (msgid)
+     struct ipcid_ds *msgid;
+{
+  if (msgid->id < 0)
+    rb_raise (cError, "already removed");
+  if (mq_unlink (msgid->name) == -1)
+    rb_sys_fail ("mq_unlink(3)");
+  mq_close (IPC_MQD (msgid));
+  msgid->id = -1;
+}
+
+/*
+ * call-seq:
+ *   POSIX::MessageQueue.new(name, msgflg = 0, maxmsg = nil, msgsize = nil)
+ *     -> POSIX::MessageQueue
+ *
+ * Open the POSIX message queue +name+. With IPC_CREAT in +msgflg+,
+ * create it if needed with room for +maxmsg+ messages of up to
+ * +msgsize+ bytes (system defaults if nil). See mq_open(3).
+ */
+
+static VALUE
+rb_pmq_s_new (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  struct ipcid_ds *msgid;
+  struct mq_attr attr, *pattr = NULL;
+  VALUE dst, v_name, v_flags, v_maxmsg, v_msgsize;
+  mqd_t mqd;
+
+  dst = TypedData_Make_Struct (klass, struct ipcid_ds, &pmq_data_type, msgid);
+  msgid->id = -1;
+  rb_scan_args (argc, argv, "13", &v_name, &v_flags, &v_maxmsg, &v_msgsize);
+  StringValue (v_name);
+  if (!NIL_P (v_flags))
+    msgid->flags = NUM2INT (v_flags);
+  if (!NIL_P (v_maxmsg) || !NIL_P (v_msgsize))
+    {
+      MEMZERO (&attr, struct mq_attr, 1);
+      attr.mq_maxmsg = NIL_P (v_maxmsg) ? 10 : NUM2LONG (v_maxmsg);
+      attr.mq_msgsize = NIL_P (v_msgsize) ? 8192 : NUM2LONG (v_msgsize);
+      pattr = &attr;
+    }
+
+  mqd = mq_open (StringValueCStr (v_name),
+		 O_RDWR | posix_oflag (msgid->flags), msgid->flags & 0777,
+		 pattr);
+  if (mqd == (mqd_t)-1)
+    rb_sys_fail ("mq_open(3)");
+  msgid->id = 0;
+  msgid->handle = (void *)(intptr_t)mqd;
+  msgid->name = posix_strdup (v_name);
+  msgid->stat = pmq_stat;
+  msgid->perm = msg_perm;
+  msgid->rmid = pmq_rmid;
+  if (mq_getattr (mqd, &attr) == -1)
+    rb_sys_fail ("mq_getattr(3)");
+  msgid->maxsize = attr.mq_msgsize;
+  if (ATOMIC_LOAD (&ipc_stats_default))
+    ipc_enable_stats (msgid);
+
+  return dst;
+}
+
+static const struct timespec posix_now;	/* long gone: do not wait */
+
+static long
+call_mq_send (c, nowait)
+     struct ipc_call *c;
+     int nowait;
+{
+  mqd_t mqd = IPC_MQD (c->ipcid);
+  long ret;
+
+  if (nowait || (c->flags & IPC_NOWAIT))
+    {
+      ret = mq_timedsend (mqd, c->buf, c->len, c->type, &posix_now);
+      if (ret == -1 && errno == ETIMEDOUT)
+	errno = EAGAIN;
+      return ret;
+    }
+  if (c->deadline)
+    return mq_timedsend (mqd, c->buf, c->len, c->type, c->deadline);
+  return mq_send (mqd, c->buf, c->len, c->type);
+}
+
+static long
+call_mq_receive (c, nowait)
+     struct ipc_call *c;
+     int nowait;
+{
+  mqd_t mqd = IPC_MQD (c->ipcid);
+  long ret;
+
+  if (nowait || (c->flags & IPC_NOWAIT))
+    {
+      ret = mq_timedreceive (mqd, c->buf, c->len, NULL, &posix_now);
+      if (ret == -1 && (errno == ETIMEDOUT || errno == EAGAIN))
+	errno = ENOMSG;
+      return ret;
+    }
+  if (c->deadline)
+    return mq_timedreceive (mqd, c->buf, c->len, NULL, c->deadline);
+  return mq_receive (mqd, c->buf, c->len, NULL);
+}
+
+/*
+ * call-seq:
+ *   send(mtype, mtext, msgflg = 0, timeout = nil) -> POSIX::MessageQueue
+ *
+ * Send message +mtext+ with priority +mtype+: messages of higher
+ * priority are received first. Wait at most +timeout+ seconds for
+ * room, then raise TimeoutError. Return self. See mq_send(3).
+ */
+
+static VALUE
+rb_pmq_send (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  VALUE v_type, v_buf, v_flags, v_timeout;
+  struct ipcid_ds *msgid;
+  struct ipc_call c;
+  struct timespec ts;
+  size_t len;
+  char *buf;
+  uint64_t t0;
+
+  rb_scan_args (argc, argv, "22", &v_type, &v_buf, &v_flags, &v_timeout);
+  StringValue (v_buf);
+  msgid = get_ipcid (obj);
+
+  /* mq_send runs without the interpreter lock: send a copy */
+  len = RSTRING_LEN (v_buf);
+  if (len > msgid->maxsize)
+    {
+      errno = EMSGSIZE;
+      rb_sys_fail ("mq_send(3)");
+    }
+  buf = ALLOCA_N (char, len);
+  memcpy (buf, RSTRING_PTR (v_buf), len);
+
+  MEMZERO (&c, struct ipc_call, 1);
+  c.ipcid = msgid;
+  c.fn = call_mq_send;
+  c.buf = buf;
+  c.len = len;
+  c.type = NUM2LONG (v_type);
+  c.flags = NIL_P (v_flags) ? 0 : NUM2INT (v_flags);
+  c.nowait = c.flags & IPC_NOWAIT;
+  c.deadline = posix_deadline (v_timeout, &ts);
+
+  t0 = IPC_STATS_BEGIN (msgid);
+  if (ipc_call (&c) == -1)
+    {
+      if (errno == ETIMEDOUT)
+	rb_raise (cTimeoutError, "queue full");
+      rb_sys_fail ("mq_send(3)");
+    }
+  IPC_STATS_END (msgid, c.len, t0);
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   recv(mtype, msgsz, msgflg = 0, timeout = nil) -> String
+ *
+ * Receive the oldest message of highest priority; POSIX queues cannot
+ * select by type, so +mtype+ is ignored. Raise Errno::E2BIG if it is
+ * longer than +msgsz+. Wait at most +timeout+ seconds, then raise
+ * TimeoutError. See mq_receive(3).
+ */
+
+static VALUE
+rb_pmq_recv (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  VALUE v_type, v_len, v_flags, v_timeout, ret;
+  struct ipcid_ds *msgid;
+  struct ipc_call c;
+  struct timespec ts;
+  size_t len;
+  long rlen;
+  uint64_t t0;
+
+  rb_scan_args (argc, argv, "22", &v_type, &v_len, &v_flags, &v_timeout);
+  len = NUM2SIZET (v_len);
+  msgid = get_ipcid (obj);
+  ret = rb_str_new (0, msgid->maxsize);
+
+  MEMZERO (&c, struct ipc_call, 1);
+  c.ipcid = msgid;
+  c.fn = call_mq_receive;
+  c.buf = RSTRING_PTR (ret);
+  c.len = msgid->maxsize;
+  c.flags = NIL_P (v_flags) ? 0 : NUM2INT (v_flags);
+  c.nowait = c.flags & IPC_NOWAIT;
+  c.deadline = posix_deadline (v_timeout, &ts);
+
+  t0 = IPC_STATS_BEGIN (msgid);
+  rlen = ipc_call (&c);
+  if (rlen == -1)
+    {
+      if (errno == ETIMEDOUT)
+	rb_raise (cTimeoutError, "no message");
+      rb_sys_fail ("mq_receive(3)");
+    }
+  IPC_STATS_END (msgid, rlen, t0);
+  if ((size_t)rlen > len)
+    {
+      errno = E2BIG;
+      rb_sys_fail ("mq_receive(3)");
+    }
+
+  rb_str_resize (ret, rlen);
+  return ret;
+}
+
+/*
+ * call-seq:
+ *   fileno -> Integer
+ *
+ * Return the descriptor of the queue, for select(2) or epoll(7).
+ */
+
+static VALUE
+rb_pmq_fileno (obj)
+     VALUE obj;
+{
+#ifdef __linux__
+  return INT2FIX ((int)IPC_MQD (get_ipcid (obj)));
+#else
+  rb_notimplement ();
+  return Qnil;
+#endif
+}
+
+#endif /* HAVE_MQ_OPEN */
+
+#if defined(HAVE_SHM_OPEN) && defined(HAVE_SEM_INIT)
+
+/*
+ * A POSIX::Semaphore is a set of process-shared unnamed semaphores in
+ * a POSIX shared memory object.  The creator initializes them before
+ * setting the magic number, others wait for it.
+ */
+
+#define PSEM_MAGIC 0x53565053	/* "SPVS" */
+
+struct psem_set {
+  uint32_t magic;
+  uint32_t nsems;
+  char pad[IPC_CACHELINE - 8];
+  sem_t sems[1];
+};
+
+#define PSEM_BYTESIZE(n) \
+  (offsetof (struct psem_set, sems) + (n) * sizeof (sem_t))
+
+static void
+psem_free (semid)
+     struct ipcid_ds *semid;
+{
+  if (semid->id >= 0)
+    {
+      munmap (semid->handle, semid->maxsize);
+      close (semid->id);
+    }
+  ipc_free (semid);
+}
+
+static const rb_data_type_t psem_data_type = {
+  "SystemVIPC::POSIX::Semaphore",
+  { 0, (void (*) (void *))psem_free, ipc_memsize, },
+  &ipcid_data_type, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+static void
+psem_stat (semid, st)
+     struct ipcid_ds *semid;
+     union ipc_stat *st;
+{
+  struct psem_set *set = semid->handle;
+
+  memset (st, 0, sizeof (*st));
+  st->semstat.sem_nsems = set->nsems;
+  posix_fill_perm (&st->semstat.sem_perm, semid->id, semid->flags);
+}
+
+static void
+psem_rmid (semid)
+     struct ipcid_ds *semid;
+{
+  if (semid->id < 0)
+    rb_raise (cError, "already removed");
+  if (shm_unlink (semid->name) == -1)
+    rb_sys_fail ("shm_unlink(3)");
+  munmap (semid->handle, semid->maxsize);
+  close (semid->id);
+  semid->handle = NULL;
+  semid->id = -1;
+}
+
+/*
+ * call-seq:
+ *   POSIX::Semaphore.new(name, nsems = 0, semflg = 0) -> POSIX::Semaphore
+ *
+ * Open the set of semaphores +name+, creating it with +nsems+
+ * semaphores, all 0, if +semflg+ has IPC_CREAT. See sem_init(3).
+ */
+
+static VALUE
+rb_psem_s_new (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  struct ipcid_ds *semid;
+  struct psem_set *set;
+  struct stat st;
+  VALUE dst, v_name, v_nsems, v_semflg;
+  int fd, created, nsems = 0, i, tries;
+
+  dst = TypedData_Make_Struct (klass, struct ipcid_ds, &psem_data_type, semid);
+  semid->id = -1;
+  rb_scan_args (argc, argv, "12", &v_name, &v_nsems, &v_semflg);
+  StringValue (v_name);
+  if (!NIL_P (v_nsems))
+    nsems = NUM2INT (v_nsems);
+  if (!NIL_P (v_semflg))
+    semid->flags = NUM2INT (v_semflg);
+
+  fd = posix_shm_open (StringValueCStr (v_name), semid->flags, &created);
+  if (fd == -1)
+    rb_sys_fail ("shm_open(3)");
+  if (created)
+    {
+      if (nsems <= 0 || ftruncate (fd, PSEM_BYTESIZE (nsems)) == -1)
+	{
+	  int err = nsems <= 0 ? EINVAL : errno;
+	  shm_unlink (RSTRING_PTR (v_name));
+	  close (fd);
+	  errno = err;
+	  rb_sys_fail ("shm_open(3)");
+	}
+    }
+  else
+    {
+      /* wait for the creator to size the object */
+      for (tries = 0; fstat (fd, &st) == 0
+	     && (size_t)st.st_size < PSEM_BYTESIZE (1) && tries < 1000; tries++)
+	usleep (1000);
+      if ((size_t)st.st_size < PSEM_BYTESIZE (1))
+	{
+	  close (fd);
+	  errno = EINVAL;
+	  rb_sys_fail ("shm_open(3)");
+	}
+    }
+
+  if (fstat (fd, &st) == -1)
+    {
+      close (fd);
+      rb_sys_fail ("fstat(2)");
+    }
+  set = mmap (0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (set == MAP_FAILED)
+    {
+      close (fd);
+      rb_sys_fail ("mmap(2)");
+    }
+  semid->id = fd;
+  semid->handle = set;
+  semid->maxsize = st.st_size;
+  semid->name = posix_strdup (v_name);
+  semid->stat = psem_stat;
+  semid->perm = sem_perm;
+  semid->rmid = psem_rmid;
+
+  if (created)
+    {
+      for (i = 0; i < nsems; i++)
+	if (sem_init (&set->sems[i], 1, 0) == -1)
+	  rb_sys_fail ("sem_init(3)");
+      set->nsems = nsems;
+      ATOMIC_STORE_REL (&set->magic, PSEM_MAGIC);
+    }
+  else
+    {
+      for (tries = 0; ATOMIC_LOAD_ACQ (&set->magic) != PSEM_MAGIC
+	     && tries < 1000; tries++)
+	usleep (1000);
+      if (set->magic != PSEM_MAGIC)
+	rb_raise (cError, "not a semaphore set");
+      if ((size_t)st.st_size < PSEM_BYTESIZE (set->nsems)
+	  || nsems > (int)set->nsems)
+	{
+	  errno = EINVAL;
+	  rb_sys_fail ("shm_open(3)");
+	}
+    }
+  if (ATOMIC_LOAD (&ipc_stats_default))
+    ipc_enable_stats (semid);
+
+  return dst;
+}
+
+static sem_t *
+get_psem (obj, v_pos, semid)
+     VALUE obj, v_pos;
+     struct ipcid_ds **semid;
+{
+  struct psem_set *set;
+  int pos = NUM2INT (v_pos);
+
+  *semid = get_ipcid (obj);
+  set = (*semid)->handle;
+  if (pos < 0 || pos >= (int)set->nsems)
+    rb_raise (cError, "invalid semnum");
+  return &set->sems[pos];
+}
+
+static int
+psem_value (sem)
+     sem_t *sem;
+{
+  int value;
+
+  if (sem_getvalue (sem, &value) == -1)
+    rb_sys_fail ("sem_getvalue(3)");
+  return value < 0 ? 0 : value;
+}
+
+/*
+ * Move a semaphore to +value+ by posting or taking it.  Other
+ * processes may move it meanwhile.
+ */
+
+static void
+psem_set_value (sem, value)
+     sem_t *sem;
+     int value;
+{
+  int cur = psem_value (sem);
+
+  for (; cur < value; cur++)
+    if (sem_post (sem) == -1)
+      rb_sys_fail ("sem_post(3)");
+  for (; cur > value && sem_trywait (sem) == 0; cur--)
+    ;
+}
+
+/*
+ * call-seq:
+ *   value(pos) -> Fixnum
+ *
+ * Return the value of semaphore +pos+. See sem_getvalue(3).
+ */
+
+static VALUE
+rb_psem_value (obj, v_pos)
+     VALUE obj, v_pos;
+{
+  struct ipcid_ds *semid;
+
+  return INT2FIX (psem_value (get_psem (obj, v_pos, &semid)));
+}
+
+/*
+ * call-seq:
+ *   set_value(pos, value) -> POSIX::Semaphore
+ *
+ * Set the value of semaphore +pos+, by posting or taking it, so not
+ * atomically. Return self.
+ */
+
+static VALUE
+rb_psem_set_value (obj, v_pos, v_value)
+     VALUE obj, v_pos, v_value;
+{
+  struct ipcid_ds *semid;
+
+  psem_set_value (get_psem (obj, v_pos, &semid), NUM2INT (v_value));
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   to_a -> Array
+ *
+ * Return the values of the set as an array.
+ */
+
+static VALUE
+rb_psem_to_a (obj)
+     VALUE obj;
+{
+  struct ipcid_ds *semid = get_ipcid (obj);
+  struct psem_set *set = semid->handle;
+  VALUE ary = rb_ary_new2 (set->nsems);
+  uint32_t i;
+
+  for (i = 0; i < set->nsems; i++)
+    rb_ary_push (ary, INT2FIX (psem_value (&set->sems[i])));
+  return ary;
+}
+
+/*
+ * call-seq:
+ *   set_all(array) -> POSIX::Semaphore
+ *
+ * Set the values of the set from +array+. Return self.
+ */
+
+static VALUE
+rb_psem_set_all (obj, ary)
+     VALUE obj, ary;
+{
+  struct ipcid_ds *semid = get_ipcid (obj);
+  struct psem_set *set = semid->handle;
+  long i;
+
+  Check_Type (ary, T_ARRAY);
+  if (RARRAY_LEN (ary) != (long)set->nsems)
+    rb_raise (cError, "doesn't match with semnum");
+  for (i = 0; i < RARRAY_LEN (ary); i++)
+    psem_set_value (&set->sems[i], NUM2INT (rb_ary_entry (ary, i)));
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   size -> Fixnum
+ *
+ * Return the number of semaphores in the set.
+ */
+
+static VALUE
+rb_psem_size (obj)
+     VALUE obj;
+{
+  struct ipcid_ds *semid = get_ipcid (obj);
+
+  return INT2FIX (((struct psem_set *)semid->handle)->nsems);
+}
+
+static long
+call_sem_wait (c, nowait)
+     struct ipc_call *c;
+     int nowait;
+{
+  if (nowait || (c->flags & IPC_NOWAIT))
+    return sem_trywait (c->buf);
+#ifdef HAVE_SEM_TIMEDWAIT
+  if (c->deadline)
+    return sem_timedwait (c->buf, c->deadline);
+#endif
+  return sem_wait (c->buf);
+}
+
+/*
+ * call-seq:
+ *   apply(array, timeout = nil) -> POSIX::Semaphore
+ *
+ * Apply an +array+ of SemaphoreOperation elements in order. Unlike
+ * semop(2) they do not take effect at once: if one fails, those
+ * before it are undone. Wait at most +timeout+ seconds for all of
+ * them, then raise TimeoutError. Waiting for zero and SEM_UNDO are
+ * not supported.
+ */
+
+static VALUE
+rb_psem_apply (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct ipcid_ds *semid = get_ipcid (obj);
+  struct psem_set *set = semid->handle;
+  struct sembuf *op;
+  struct ipc_call c;
+  struct timespec *deadline = NULL;
+#ifdef HAVE_SEM_TIMEDWAIT
+  struct timespec ts;
+#endif
+  VALUE ary, v_timeout;
+  uint64_t t0, expires = 0;
+  long i, j, k, n;
+
+  rb_scan_args (argc, argv, "11", &ary, &v_timeout);
+  Check_Type (ary, T_ARRAY);
+  for (i = 0; i < RARRAY_LEN (ary); i++)
+    {
+      TypedData_Get_Struct (rb_ary_entry (ary, i), struct sembuf,
+			    &semop_data_type, op);
+      if (op->sem_num >= set->nsems)
+	rb_raise (cError, "invalid semnum");
+      if (op->sem_op == 0 || (op->sem_flg & SEM_UNDO))
+	rb_raise (cError, "unsupported semaphore operation");
+    }
+  /* one deadline for the whole array */
+#ifdef HAVE_SEM_TIMEDWAIT
+  deadline = posix_deadline (v_timeout, &ts);
+#else
+  expires = msg_expires (v_timeout);
+#endif
+
+  t0 = IPC_STATS_BEGIN (semid);
+  for (i = 0; i < RARRAY_LEN (ary); i++)
+    {
+      TypedData_Get_Struct (rb_ary_entry (ary, i), struct sembuf,
+			    &semop_data_type, op);
+      if (op->sem_op > 0)
+	{
+	  for (n = 0; n < op->sem_op; n++)
+	    sem_post (&set->sems[op->sem_num]);
+	  continue;
+	}
+      MEMZERO (&c, struct ipc_call, 1);
+      c.ipcid = semid;
+      c.fn = call_sem_wait;
+      c.buf = &set->sems[op->sem_num];
+      c.flags = op->sem_flg;
+      c.nowait = op->sem_flg & IPC_NOWAIT;
+      c.deadline = deadline;
+      c.expires = expires;
+      for (n = 0; n < -op->sem_op; n++)
+	if (ipc_call (&c) == -1)
+	  break;
+      if (n == -op->sem_op)
+	continue;
+
+      /* undo this operation so far, and the ones before it */
+      k = errno;
+      while (n--)
+	sem_post (&set->sems[op->sem_num]);
+      for (j = 0; j < i; j++)
+	{
+	  TypedData_Get_Struct (rb_ary_entry (ary, j), struct sembuf,
+				&semop_data_type, op);
+	  for (n = 0; n < (op->sem_op < 0 ? -op->sem_op : op->sem_op); n++)
+	    if (op->sem_op < 0)
+	      sem_post (&set->sems[op->sem_num]);
+	    else
+	      sem_trywait (&set->sems[op->sem_num]);
+	}
+      if (k == ETIMEDOUT)
+	rb_raise (cTimeoutError, "semaphore not available");
+      errno = k;
+      rb_sys_fail ("sem_wait(3)");
+    }
+  IPC_STATS_END (semid, 0, t0);
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   n_count(pos) -> Fixnum
+ *
+ * Not available for POSIX semaphores: raise NotImplementedError. The
+ * same goes for #z_count and #pid.
+ */
+
+static VALUE
+rb_psem_notimplement (obj, v_pos)
+     VALUE obj, v_pos;
+{
+  rb_notimplement ();
+  return Qnil;
+}
+
+#endif /* HAVE_SHM_OPEN && HAVE_SEM_INIT */
+
+#ifdef HAVE_SHM_OPEN
+
+static void
+pshm_free (shmid)
+     struct ipcid_ds *shmid;
+{
+  if (shmid->data && !ATOMIC_LOAD (&shmid->pins))
+    {
+      munmap (shmid->data, shmid->attached);
+      ipc_adjust_memory_usage (-(ssize_t)shmid->attached);
+    }
+  if (shmid->id >= 0)
+    close (shmid->id);
+  ipc_free (shmid);
+}
+
+static const rb_data_type_t pshm_data_type = {
+  "SystemVIPC::POSIX::SharedMemory",
+  { 0, (void (*) (void *))pshm_free, ipc_memsize, },
+  &shm_data_type, 0,
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+static void
+pshm_stat (shmid, buf)
+     struct ipcid_ds *shmid;
+     union ipc_stat *buf;
+{
+  struct stat st;
+
+  if (fstat (shmid->id, &st) == -1)
+    rb_sys_fail ("fstat(2)");
+  memset (buf, 0, sizeof (*buf));
+  buf->shmstat.shm_segsz = st.st_size;
+  buf->shmstat.shm_cpid = shmid->cpid;
+  posix_fill_perm (&buf->shmstat.shm_perm, shmid->id, shmid->flags);
+}
+
+static void
+pshm_rmid (shmid)
+     struct ipcid_ds *shmid;
+{
+  if (shmid->id < 0)
+    rb_raise (cError, "already removed");
+  if (shm_unlink (shmid->name) == -1)
+    rb_sys_fail ("shm_unlink(3)");
+  close (shmid->id);
+  shmid->id = -1;
+}
+
+/*
+ * call-seq:
+ *   POSIX::SharedMemory.new(name, size = 0, shmflg = 0)
+ *     -> POSIX::SharedMemory
+ *
+ * Open the POSIX shared memory object +name+, creating it with
+ * +size+ bytes if +shmflg+ has IPC_CREAT. See shm_open(3).
+ */
+
+static VALUE
+rb_pshm_s_new (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  struct ipcid_ds *shmid;
+  struct stat st;
+  VALUE dst, v_name, v_size, v_shmflg;
+  size_t size = 0;
+  int fd, created, err;
+
+  dst = TypedData_Make_Struct (klass, struct ipcid_ds, &pshm_data_type, shmid);
+  shmid->id = -1;
+  rb_scan_args (argc, argv, "12", &v_name, &v_size, &v_shmflg);
+  StringValue (v_name);
+  if (!NIL_P (v_size))
+    size = NUM2SIZET (v_size);
+  if (!NIL_P (v_shmflg))
+    shmid->flags = NUM2INT (v_shmflg);
+
+  fd = posix_shm_open (StringValueCStr (v_name), shmid->flags, &created);
+  if (fd == -1)
+    rb_sys_fail ("shm_open(3)");
+  err = 0;
+  if (created && ftruncate (fd, size) == -1)
+    err = errno;
+  else if (!created && (fstat (fd, &st) == -1 || (size_t)st.st_size < size))
+    err = EINVAL;
+  if (err)
+    {
+      if (created)
+	shm_unlink (RSTRING_PTR (v_name));
+      close (fd);
+      errno = err;
+      rb_sys_fail ("shm_open(3)");
+    }
+
+  shmid->id = fd;
+  shmid->name = posix_strdup (v_name);
+  shmid->stat = pshm_stat;
+  shmid->perm = shm_perm;
+  shmid->rmid = pshm_rmid;
+  shmid->cpid = created ? getpid () : 0;
+  if (ATOMIC_LOAD (&ipc_stats_default))
+    ipc_enable_stats (shmid);
+
+  return dst;
+}
+
+/*
+ * call-seq:
+ *   attach(shmflg = 0) -> POSIX::SharedMemory
+ *
+ * Map the shared memory object, read-only if +shmflg+ has
+ * SHM_RDONLY. See mmap(2).
+ */
+
+static VALUE
+rb_pshm_attach (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct ipcid_ds *shmid;
+  union ipc_stat st;
+  VALUE v_flags;
+  int flags = 0;
+  void *data;
+
+  rb_check_frozen (obj);
+  shmid = get_ipcid_and_stat (obj, &st);
+  if (shmid->data)
+    rb_raise (cError, "already attached");
+  rb_scan_args (argc, argv, "01", &v_flags);
+  if (!NIL_P (v_flags))
+    flags = NUM2INT (v_flags);
+  if (!st.shmstat.shm_segsz)
+    {
+      errno = EINVAL;
+      rb_sys_fail ("mmap(2)");
+    }
+
+  data = mmap (0, st.shmstat.shm_segsz,
+	       flags & SHM_RDONLY ? PROT_READ : PROT_READ | PROT_WRITE,
+	       MAP_SHARED, shmid->id, 0);
+  if (data == MAP_FAILED)
+    rb_sys_fail ("mmap(2)");
+  shmid->data = data;
+  shmid->attached = st.shmstat.shm_segsz;
+  ipc_adjust_memory_usage ((ssize_t)shmid->attached);
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   detach -> POSIX::SharedMemory
+ *
+ * Unmap the shared memory object. See munmap(2). Raise Error while
+ * a copy, transfer or save in another thread still uses it.
+ */
+
+static VALUE
+rb_pshm_detach (obj)
+     VALUE obj;
+{
+  struct ipcid_ds *shmid;
+
+  rb_check_frozen (obj);
+  shmid = get_ipcid (obj);
+  if (!shmid->data)
+    rb_raise (cError, "already detached");
+  if (ATOMIC_LOAD (&shmid->pins))
+    rb_raise (cError, "memory in use");
+  if (munmap (shmid->data, shmid->attached) == -1)
+    rb_sys_fail ("munmap(2)");
+  shmid->data = NULL;
+  ipc_adjust_memory_usage (-(ssize_t)shmid->attached);
+  shmid->attached = 0;
+
+  return obj;
+}
+
+#endif /* HAVE_SHM_OPEN */
+
+/*
+ * Snapshot: a single writer publishes whole values, any number of
+ * readers copy the latest one.  There are two buffers, each guarded
+ * by its own sequence counter which is odd while the buffer is being
+ * written.  The writer always fills the buffer readers are not
+ * directed to and then flips +current+, so a reader only retries when
+ * it falls two publications behind.  Readers never write to the
+ * segment and never enter the kernel.
+ */
+
+#define SNAPSHOT_MAGIC 0x53565353	/* "SSVS" */
+
+struct snapshot_header {
+  uint32_t magic;
+  uint32_t current;
+  uint64_t capacity;
+  uint64_t version;
+};
+
+struct snapshot_buffer {
+  uint64_t seq;
+  uint64_t length;
+  uint64_t version;
+};
+
+#define SNAPSHOT_STRIDE(cap) (IPC_CACHELINE + IPC_ALIGN (cap, IPC_CACHELINE))
+#define SNAPSHOT_BYTESIZE(cap) (IPC_CACHELINE + 2 * SNAPSHOT_STRIDE (cap))
+#define SNAPSHOT_MAX_CAPACITY ((SIZE_MAX - 8 * IPC_CACHELINE) / 2)
+
+struct snapshot_ds {
+  struct shm_region region;
+  uint64_t capacity;
+};
+
+static size_t
+snapshot_memsize (ptr)
+     const void *ptr;
+{
+  return sizeof (struct snapshot_ds);
+}
+
+static const rb_data_type_t snapshot_data_type = {
+  "SystemVIPC::Snapshot",
+  { (void (*) (void *))region_mark, RUBY_TYPED_DEFAULT_FREE, snapshot_memsize,
+    IPC_DCOMPACT ((void (*) (void *))region_compact), },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static struct snapshot_buffer *
+snapshot_buffer (hdr, capacity, i)
+     struct snapshot_header *hdr;
+     uint64_t capacity;
+     unsigned int i;
+{
+  return (struct snapshot_buffer *)
+    ((char *)hdr + IPC_CACHELINE + i * SNAPSHOT_STRIDE (capacity));
+}
+
+/* Return the bytes used for +capacity+, which must not wrap around. */
+
+static size_t
+snapshot_bytesize (capacity)
+     uint64_t capacity;
+{
+  if (capacity > SNAPSHOT_MAX_CAPACITY)
+    rb_raise (cError, "capacity too large");
+  return SNAPSHOT_BYTESIZE (capacity);
+}
+
+/*
+ * call-seq:
+ *   Snapshot.bytesize(capacity) -> Integer
+ *
+ * Return the number of bytes of shared memory used by a Snapshot
+ * holding values of up to +capacity+ bytes.
+ */
+
+static VALUE
+rb_snapshot_s_bytesize (klass, v_capacity)
+     VALUE klass, v_capacity;
+{
+  return SIZET2NUM (snapshot_bytesize (NUM2SIZET (v_capacity)));
+}
+
+/*
+ * call-seq:
+ *   Snapshot.new(shm, offset = 0, capacity = nil) -> Snapshot
+ *
+ * Return a Snapshot stored in the attached SharedMemory +shm+ at
+ * +offset+. If +capacity+ is given and no Snapshot has been set up
+ * there yet, make room for values of up to +capacity+ bytes;
+ * otherwise use the existing one. See Snapshot.bytesize.
+ */
+
+static VALUE
+rb_snapshot_s_new (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  struct snapshot_ds *snap;
+  struct snapshot_header *hdr;
+  VALUE dst, v_shm, v_offset, v_capacity;
+  size_t offset = 0;
+  uint64_t capacity = 0;
+
+  rb_scan_args (argc, argv, "12", &v_shm, &v_offset, &v_capacity);
+  if (!NIL_P (v_offset))
+    offset = NUM2SIZET (v_offset);
+  if (!NIL_P (v_capacity))
+    capacity = NUM2SIZET (v_capacity);
+
+  dst = TypedData_Make_Struct (klass, struct snapshot_ds,
+			       &snapshot_data_type, snap);
+  region_init (&snap->region, v_shm, offset, sizeof (*hdr));
+  hdr = (struct snapshot_header *)region_ptr (&snap->region);
+
+  if (ATOMIC_LOAD_ACQ (&hdr->magic) != SNAPSHOT_MAGIC)
+    {
+      if (!capacity)
+	rb_raise (cError, "no snapshot");
+      region_init (&snap->region, v_shm, offset, snapshot_bytesize (capacity));
+      memset (hdr, 0, snap->region.size);
+      hdr->capacity = capacity;
+      ATOMIC_STORE_REL (&hdr->magic, SNAPSHOT_MAGIC);
+    }
+  else if (capacity && capacity != hdr->capacity)
+    rb_raise (cError, "capacity mismatch");
+
+  snap->capacity = hdr->capacity;
+  region_init (&snap->region, v_shm, offset,
+	       snapshot_bytesize (snap->capacity));
+
+  return dst;
+}
+
+static struct snapshot_header *
+get_snapshot (obj, snap)
+     VALUE obj;
+     struct snapshot_ds **snap;
+{
+  TypedData_Get_Struct (obj, struct snapshot_ds, &snapshot_data_type, *snap);
+  return (struct snapshot_header *)region_ptr (&(*snap)->region);
+}
+
+/*
+ * call-seq:
+ *   publish(str) -> Integer
+ *
+ * Make +str+ the current value and return its version. Only one
+ * process may publish to a Snapshot at a time; readers are never
+ * blocked.
+ */
+
+static VALUE
+rb_snapshot_publish (obj, v_buf)
+     VALUE obj, v_buf;
+{
+  struct snapshot_ds *snap;
+  struct snapshot_header *hdr;
+  struct snapshot_buffer *buf;
+  unsigned int next;
+  uint64_t seq, version;
+  size_t len;
+
+  StringValue (v_buf);
+  hdr = get_snapshot (obj, &snap);
+  len = RSTRING_LEN (v_buf);
+  if (len > snap->capacity)
+    rb_raise (cError, "value exceeds snapshot capacity");
+
+  next = !ATOMIC_LOAD (&hdr->current);
+  buf = snapshot_buffer (hdr, snap->capacity, next);
+  version = hdr->version + 1;
+
+  seq = ATOMIC_LOAD (&buf->seq);
+  ATOMIC_STORE (&buf->seq, seq + 1);
+  ATOMIC_RELEASE_FENCE ();
+  memcpy ((char *)buf + IPC_CACHELINE, RSTRING_PTR (v_buf), len);
+  ATOMIC_STORE (&buf->length, len);
+  ATOMIC_STORE (&buf->version, version);
+  ATOMIC_STORE_REL (&buf->seq, seq + 2);
+
+  ATOMIC_STORE_REL (&hdr->current, next);
+  ATOMIC_STORE_REL (&hdr->version, version);
+
+  return ULL2NUM (version);
+}
+
+static VALUE
+snapshot_read (obj, version)
+     VALUE obj;
+     uint64_t *version;
+{
+  struct snapshot_ds *snap;
+  struct snapshot_header *hdr;
+  struct snapshot_buffer *buf;
+  uint64_t seq, len;
+  unsigned int tries = 0;
+  VALUE str = Qnil;
+
+  hdr = get_snapshot (obj, &snap);
+
+  for (;; tries++)
+    {
+      if (tries && (tries & 63) == 0)
+	sched_yield ();
+
+      buf = snapshot_buffer (hdr, snap->capacity,
+			     ATOMIC_LOAD_ACQ (&hdr->current) & 1);
+      seq = ATOMIC_LOAD_ACQ (&buf->seq);
+      if (seq & 1)
+	{
+	  IPC_CPU_RELAX ();
+	  continue;
+	}
+      len = ATOMIC_LOAD (&buf->length);
+      *version = ATOMIC_LOAD (&buf->version);
+      if (len > snap->capacity)
+	continue;
+
+      if (NIL_P (str))
+	str = rb_str_new (0, len);
+      else
+	rb_str_resize (str, len);
+      memcpy (RSTRING_PTR (str), (char *)buf + IPC_CACHELINE, len);
+
+      ATOMIC_ACQUIRE_FENCE ();
+      if (ATOMIC_LOAD (&buf->seq) == seq)
+	return str;
+    }
+}
+
+/*
+ * call-seq:
+ *   read -> String
+ *
+ * Return a consistent copy of the current value. A copy that was
+ * overwritten while being taken is retried.
+ */
+
+static VALUE
+rb_snapshot_read (obj)
+     VALUE obj;
+{
+  uint64_t version;
+
+  return snapshot_read (obj, &version);
+}
+
+/*
+ * call-seq:
+ *   read_with_version -> [Integer, String]
+ *
+ * Like read, but also return the version of the copy.
+ */
+
+static VALUE
+rb_snapshot_read_with_version (obj)
+     VALUE obj;
+{
+  uint64_t version;
+  VALUE str;
+
+  str = snapshot_read (obj, &version);
+  return rb_assoc_new (ULL2NUM (version), str);
+}
+
+/*
+ * call-seq:
+ *   version -> Integer
+ *
+ * Return the version of the current value, 0 before the first
+ * publish. Cheap enough to poll for changes.
+ */
+
+static VALUE
+rb_snapshot_version (obj)
+     VALUE obj;
+{
+  struct snapshot_ds *snap;
+  struct snapshot_header *hdr;
+
+  hdr = get_snapshot (obj, &snap);
+  return ULL2NUM (ATOMIC_LOAD_ACQ (&hdr->version));
+}
+
+/*
+ * call-seq:
+ *   capacity -> Integer
+ *
+ * Return the largest value size the Snapshot can hold.
+ */
+
+static VALUE
+rb_snapshot_capacity (obj)
+     VALUE obj;
+{
+  struct snapshot_ds *snap;
+
+  TypedData_Get_Struct (obj, struct snapshot_ds, &snapshot_data_type, snap);
+  return ULL2NUM (snap->capacity);
+}
+
+/*
+ * Broadcast: a ring of variable sized records with one publisher and
+ * up to max_subscribers subscribers, each with its own cursor.
+ * Positions are byte counts since the ring was set up; a record never
+ * straddles the end of the ring, a pad record fills the gap instead.
+ *
+ * The publisher announces the end of the record it is about to write
+ * in +reserve+, copies it, then advances +head+.  A subscriber with
+ * the drop policy copies records without telling anyone and checks
+ * +reserve+ afterwards: if the publisher has lapped it, the copy is
+ * discarded and the cursor jumps to +head+.  Subscribers with the
+ * block policy publish their cursors, and the publisher does not
+ * overwrite what they have not read.  It only looks at their cursors
+ * when its cached minimum (+gate+) says the ring is full, so
+ * publishing costs the same whatever the number of subscribers.
+ */
+
+#define BROADCAST_MAGIC 0x53564243	/* "CBVS" */
+
+#define BROADCAST_FREE 0
+#define BROADCAST_DROP 1
+#define BROADCAST_BLOCK 2
+#define BROADCAST_CLAIMED 3
+
+#define BROADCAST_PAD 0xffffffff
+
+struct broadcast_header {
+  uint32_t magic;
+  uint32_t max_subscribers;
+  uint64_t capacity;
+  char pad0[IPC_CACHELINE - 16];
+  uint64_t head;		/* end of the last complete record */
+  uint64_t reserve;		/* end of the record being written */
+  uint64_t seq;			/* number of records published */
+  uint32_t signal;		/* bumped when there are waiters */
+  uint32_t waiters;
+  char pad1[IPC_CACHELINE - 32];
+  uint64_t gate;		/* publisher's cached minimum cursor */
+  uint32_t space;		/* bumped when the publisher is blocked */
+  uint32_t blocked;
+  char pad2[IPC_CACHELINE - 16];
+};
+
+struct broadcast_slot {
+  uint32_t state;
+  uint32_t pid;
+  uint64_t cursor;
+  char pad[IPC_CACHELINE - 16];
+};
+
+struct broadcast_record {
+  uint32_t len;
+  uint32_t reserved;
+  uint64_t seq;
+};
+
+#define BROADCAST_BYTESIZE(cap, nsubs) \
+  (sizeof (struct broadcast_header) \
+   + (nsubs) * sizeof (struct broadcast_slot) + (cap))
+
+struct broadcast_ds {
+  struct shm_region region;
+  uint64_t capacity;
+  uint32_t max_subscribers;
+};
+
+struct subscriber_ds {
+  struct shm_region region;
+  uint64_t capacity;
+  uint32_t slot;
+  uint32_t state;
+  uint64_t cursor;
+  uint64_t next_seq;
+  uint64_t lost;
+};
+
+static size_t
+broadcast_memsize (ptr)
+     const void *ptr;
+{
+  return sizeof (struct broadcast_ds);
+}
+
+static size_t
+subscriber_memsize (ptr)
+     const void *ptr;
+{
+  return sizeof (struct subscriber_ds);
+}
+
+static const rb_data_type_t broadcast_data_type = {
+  "SystemVIPC::Broadcast",
+  { (void (*) (void *))region_mark, RUBY_TYPED_DEFAULT_FREE,
+    broadcast_memsize, IPC_DCOMPACT ((void (*) (void *))region_compact), },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static const rb_data_type_t subscriber_data_type = {
+  "SystemVIPC::Broadcast::Subscriber",
+  { (void (*) (void *))region_mark, RUBY_TYPED_DEFAULT_FREE,
+    subscriber_memsize, IPC_DCOMPACT ((void (*) (void *))region_compact), },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static struct broadcast_slot *
+broadcast_slots (hdr)
+     struct broadcast_header *hdr;
+{
+  return (struct broadcast_slot *)(hdr + 1);
+}
+
+static char *
+broadcast_ring (hdr)
+     struct broadcast_header *hdr;
+{
+  return (char *)(broadcast_slots (hdr) + hdr->max_subscribers);
+}
+
+/*
+ * call-seq:
+ *   Broadcast.bytesize(capacity, max_subscribers = 64) -> Integer
+ *
+ * Return the number of bytes of shared memory used by a Broadcast
+ * with a ring of +capacity+ bytes.
+ */
+
+static VALUE
+rb_broadcast_s_bytesize (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  VALUE v_capacity, v_nsubs;
+  size_t nsubs = 64;
+
+  rb_scan_args (argc, argv, "11", &v_capacity, &v_nsubs);
+  if (!NIL_P (v_nsubs))
+    nsubs = NUM2SIZET (v_nsubs);
+  return SIZET2NUM (BROADCAST_BYTESIZE (NUM2SIZET (v_capacity), nsubs));
+}
+
+/*
+ * call-seq:
+ *   Broadcast.new(shm, offset = 0, capacity = nil, max_subscribers = 64)
+ *     -> Broadcast
+ *
+ * Return a Broadcast stored in the attached SharedMemory +shm+ at
+ * +offset+. If +capacity+ is given and no Broadcast has been set up
+ * there yet, set one up with a ring of +capacity+ bytes, which must be
+ * a power of two. Records may be up to a quarter of the ring.
+ */
+
+static VALUE
+rb_broadcast_s_new (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  struct broadcast_ds *bc;
+  struct broadcast_header *hdr;
+  VALUE dst, v_shm, v_offset, v_capacity, v_nsubs;
+  size_t offset = 0, capacity = 0, nsubs = 64;
+
+  rb_scan_args (argc, argv, "13", &v_shm, &v_offset, &v_capacity, &v_nsubs);
+  if (!NIL_P (v_offset))
+    offset = NUM2SIZET (v_offset);
+  if (!NIL_P (v_capacity))
+    capacity = NUM2SIZET (v_capacity);
+  if (!NIL_P (v_nsubs))
+    nsubs = NUM2SIZET (v_nsubs);
+  if (capacity & (capacity - 1) || (v_capacity != Qnil && capacity < 64))
+    rb_raise (cError, "capacity must be a power of two");
+  if (nsubs < 1 || nsubs > 0x10000)
+    rb_raise (cError, "invalid number of subscribers");
+
+  dst = TypedData_Make_Struct (klass, struct broadcast_ds,
+			       &broadcast_data_type, bc);
+  region_init (&bc->region, v_shm, offset, sizeof (*hdr));
+  hdr = (struct broadcast_header *)region_ptr (&bc->region);
+
+  if (ATOMIC_LOAD_ACQ (&hdr->magic) != BROADCAST_MAGIC)
+    {
+      if (!capacity)
+	rb_raise (cError, "no broadcast");
+      region_init (&bc->region, v_shm, offset,
+		   BROADCAST_BYTESIZE (capacity, nsubs));
+      memset (hdr, 0, BROADCAST_BYTESIZE (capacity, nsubs));
+      hdr->capacity = capacity;
+      hdr->max_subscribers = nsubs;
+      ATOMIC_STORE_REL (&hdr->magic, BROADCAST_MAGIC);
+    }
+  else if (capacity && capacity != hdr->capacity)
+    rb_raise (cError, "capacity mismatch");
+
+  bc->capacity = hdr->capacity;
+  bc->max_subscribers = hdr->max_subscribers;
+  region_init (&bc->region, v_shm, offset,
+	       BROADCAST_BYTESIZE (bc->capacity, bc->max_subscribers));
+
+  return dst;
+}
+
+static struct broadcast_header *
+get_broadcast (obj, bc)
+     VALUE obj;
+     struct broadcast_ds **bc;
+{
+  TypedData_Get_Struct (obj, struct broadcast_ds, &broadcast_data_type, *bc);
+  return (struct broadcast_header *)region_ptr (&(*bc)->region);
+}
+
+static int
+ipc_pid_alive (pid)
+     pid_t pid;
+{
+  return pid && (kill (pid, 0) == 0 || errno != ESRCH);
+}
+
+/*
+ * Recompute the minimum cursor of the blocking subscribers, freeing
+ * the slots of subscribers whose process has gone away.
+ */
+
+static uint64_t
+broadcast_gate (hdr, head)
+     struct broadcast_header *hdr;
+     uint64_t head;
+{
+  struct broadcast_slot *slot = broadcast_slots (hdr);
+  uint64_t gate = head, cursor;
+  uint32_t i;
+
+  for (i = 0; i < hdr->max_subscribers; i++, slot++)
+    {
+      if (ATOMIC_LOAD_ACQ (&slot->state) != BROADCAST_BLOCK)
+	continue;
+      if (!ipc_pid_alive ((pid_t)ATOMIC_LOAD (&slot->pid)))
+	{
+	  ATOMIC_CAS (&slot->state, BROADCAST_BLOCK, BROADCAST_FREE);
+	  continue;
+	}
+      cursor = ATOMIC_LOAD_ACQ (&slot->cursor);
+      if (cursor < gate)
+	gate = cursor;
+    }
+  ATOMIC_STORE (&hdr->gate, gate);
+  return gate;
+}
+
+/*
+ * Sleep on +word+ while it is +val+, with +flag+, the blocked flag of
+ * the publisher or the count of waiting subscribers if +counted+,
+ * already raised; it is taken down however the wait ends, even by an
+ * interrupt.  Return 0 once +deadline+ has passed.
+ */
+
+struct broadcast_wait_arg {
+  struct ipcid_ds *shmid;
+  uint32_t *word, val, *flag;
+  int counted;
+  uint64_t deadline;
+  int ok;
+};
+
+static VALUE
+broadcast_wait_run (ptr)
+     VALUE ptr;
+{
+  struct broadcast_wait_arg *a = (struct broadcast_wait_arg *)ptr;
+
+  a->ok = ipc_wait (a->shmid, a->word, a->val, a->deadline);
+  return Qnil;
+}
+
+static VALUE
+broadcast_wait_done (ptr)
+     VALUE ptr;
+{
+  struct broadcast_wait_arg *a = (struct broadcast_wait_arg *)ptr;
+
+  if (a->counted)
+    ATOMIC_FETCH_ADD (a->flag, -1);
+  else
+    ATOMIC_STORE (a->flag, 0);
+  return Qnil;
+}
+
+static int
+broadcast_wait (shmid, word, val, flag, counted, deadline)
+     struct ipcid_ds *shmid;
+     uint32_t *word, val, *flag;
+     int counted;
+     uint64_t deadline;
+{
+  struct broadcast_wait_arg a;
+
+  a.shmid = shmid;
+  a.word = word;
+  a.val = val;
+  a.flag = flag;
+  a.counted = counted;
+  a.deadline = deadline;
+  a.ok = 1;
+  rb_ensure (broadcast_wait_run, (VALUE)&a, broadcast_wait_done, (VALUE)&a);
+  return a.ok;
+}
+
+/*
+ * call-seq:
+ *   publish(str, timeout = nil) -> Integer
+ *
+ * Append +str+ to the ring and return its sequence number. Only one
+ * process may publish at a time. If a subscriber with the block
+ * policy has not read far enough to make room, wait for it, at most
+ * +timeout+ seconds, then raise TimeoutError.
+ */
+
+static VALUE
+rb_broadcast_publish (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct broadcast_ds *bc;
+  struct broadcast_header *hdr;
+  struct broadcast_record *rec;
+  VALUE v_buf, v_timeout;
+  uint64_t head, need, room, total, seq, deadline = 0, mask;
+  size_t len;
+  char *ring;
+
+  rb_scan_args (argc, argv, "11", &v_buf, &v_timeout);
+  StringValue (v_buf);
+  hdr = get_broadcast (obj, &bc);
+  len = RSTRING_LEN (v_buf);
+  need = sizeof (*rec) + IPC_ALIGN (len, 8);
+  if (need > bc->capacity / 4)
+    rb_raise (cError, "record exceeds a quarter of the ring");
+
+  mask = bc->capacity - 1;
+  ring = broadcast_ring (hdr);
+  head = hdr->head;
+  room = bc->capacity - (head & mask);
+  total = need + (room < need ? room : 0);
+
+  while (head + total - ATOMIC_LOAD (&hdr->gate) > bc->capacity
+	 && head + total - broadcast_gate (hdr, head) > bc->capacity)
+    {
+      uint32_t space;
+
+      if (!deadline)
+	deadline = ipc_deadline (ipc_timeout_ns (v_timeout));
+      ATOMIC_STORE (&hdr->blocked, 1);
+      space = ATOMIC_LOAD (&hdr->space);
+      ATOMIC_FENCE ();
+      if (head + total - broadcast_gate (hdr, head) <= bc->capacity)
+	break;
+      if (!broadcast_wait (bc->region.shmid, &hdr->space, space,
+			   &hdr->blocked, 0, deadline))
+	rb_raise (cTimeoutError, "subscriber did not make room");
+      hdr = get_broadcast (obj, &bc);
+      ring = broadcast_ring (hdr);
+    }
+  ATOMIC_STORE (&hdr->blocked, 0);
+
+  ATOMIC_STORE (&hdr->reserve, head + total);
+  ATOMIC_RELEASE_FENCE ();
+
+  if (room < need)
+    {
+      rec = (struct broadcast_record *)(ring + (head & mask));
+      rec->len = BROADCAST_PAD;
+      head += room;
+    }
+  seq = hdr->seq++;
+  rec = (struct broadcast_record *)(ring + (head & mask));
+  rec->len = len;
+  rec->seq = seq;
+  memcpy (rec + 1, RSTRING_PTR (v_buf), len);
+
+  ATOMIC_STORE_REL (&hdr->head, head + need);
+  ATOMIC_FENCE ();
+  if (ATOMIC_LOAD (&hdr->waiters))
+    {
+      ATOMIC_FETCH_ADD (&hdr->signal, 1);
+      ipc_futex_wake (&hdr->signal);
+    }
+
+  return ULL2NUM (seq);
+}
+
+/*
+ * call-seq:
+ *   subscribe(policy = :drop) -> Broadcast::Subscriber
+ *
+ * Claim a subscriber slot and return a Subscriber that will see every
+ * record published from now on. With the :drop policy a subscriber
+ * that falls a whole ring behind loses records (see
+ * Subscriber#lost); with :block the publisher waits for it instead.
+ */
+
+static VALUE
+rb_broadcast_subscribe (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct broadcast_ds *bc;
+  struct broadcast_header *hdr;
+  struct broadcast_slot *slot;
+  struct subscriber_ds *sub;
+  VALUE dst, v_policy;
+  uint32_t i, state = BROADCAST_DROP;
+
+  rb_scan_args (argc, argv, "01", &v_policy);
+  if (!NIL_P (v_policy))
+    {
+      if (v_policy == ID2SYM (rb_intern ("block")))
+	state = BROADCAST_BLOCK;
+      else if (v_policy != ID2SYM (rb_intern ("drop")))
+	rb_raise (cError, "policy must be :drop or :block");
+    }
+
+  dst = TypedData_Make_Struct (rb_const_get (CLASS_OF (obj),
+					     rb_intern ("Subscriber")),
+			       struct subscriber_ds,
+			       &subscriber_data_type, sub);
+
+  hdr = get_broadcast (obj, &bc);
+  slot = broadcast_slots (hdr);
+  for (i = 0; i < bc->max_subscribers; i++, slot++)
+    if (ATOMIC_LOAD (&slot->state) == BROADCAST_FREE
+	&& ATOMIC_CAS (&slot->state, BROADCAST_FREE, BROADCAST_CLAIMED))
+      break;
+  if (i == bc->max_subscribers)
+    rb_raise (cError, "too many subscribers");
+
+  sub->region = bc->region;
+  sub->capacity = bc->capacity;
+  sub->slot = i;
+  sub->state = state;
+
+  ATOMIC_STORE (&slot->pid, (uint32_t)getpid ());
+  sub->cursor = ATOMIC_LOAD_ACQ (&hdr->head);
+  ATOMIC_STORE (&slot->cursor, sub->cursor);
+  ATOMIC_STORE_REL (&slot->state, state);
+  /* a record published before the slot was visible is skipped */
+  ATOMIC_FENCE ();
+  sub->cursor = ATOMIC_LOAD_ACQ (&hdr->head);
+  ATOMIC_STORE_REL (&slot->cursor, sub->cursor);
+  sub->next_seq = ATOMIC_LOAD (&hdr->seq);
+
+  return dst;
+}
+
+static struct broadcast_header *
+get_subscriber (obj, sub)
+     VALUE obj;
+     struct subscriber_ds **sub;
+{
+  TypedData_Get_Struct (obj, struct subscriber_ds,
+			&subscriber_data_type, *sub);
+  if ((*sub)->state == BROADCAST_FREE)
+    rb_raise (cError, "closed subscriber");
+  return (struct broadcast_header *)region_ptr (&(*sub)->region);
+}
+
+static void
+subscriber_advance (hdr, sub)
+     struct broadcast_header *hdr;
+     struct subscriber_ds *sub;
+{
+  struct broadcast_slot *slot = broadcast_slots (hdr) + sub->slot;
+
+  ATOMIC_STORE_REL (&slot->cursor, sub->cursor);
+  if (sub->state == BROADCAST_BLOCK)
+    {
+      ATOMIC_FENCE ();
+      if (ATOMIC_LOAD (&hdr->blocked))
+	{
+	  ATOMIC_FETCH_ADD (&hdr->space, 1);
+	  ipc_futex_wake (&hdr->space);
+	}
+    }
+}
+
+/*
+ * Whether the publisher may have overwritten records of a :drop
+ * subscriber since its cursor; what was copied from them is garbage.
+ */
+
+static int
+subscriber_lapped (hdr, sub)
+     struct broadcast_header *hdr;
+     struct subscriber_ds *sub;
+{
+  ATOMIC_ACQUIRE_FENCE ();
+  return sub->state == BROADCAST_DROP
+    && ATOMIC_LOAD (&hdr->reserve) - sub->cursor > sub->capacity;
+}
+
+/*
+ * call-seq:
+ *   read(max = nil, timeout = nil) -> Array
+ *
+ * Return every record published since the last read, or the first
+ * +max+ of them. If there are none, wait up to +timeout+ seconds
+ * (forever if nil) and return an empty Array if none arrives.
+ */
+
+static VALUE
+rb_subscriber_read (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct subscriber_ds *sub;
+  struct broadcast_header *hdr;
+  struct broadcast_record *rec;
+  VALUE v_max, v_timeout, ary;
+  uint64_t head, pos, mask, next_seq, lost, deadline = 0;
+  uint32_t len;
+  long max = -1, n;
+  char *ring;
+
+  rb_scan_args (argc, argv, "02", &v_max, &v_timeout);
+  if (!NIL_P (v_max))
+    max = NUM2LONG (v_max);
+
+  hdr = get_subscriber (obj, &sub);
+  while ((head = ATOMIC_LOAD_ACQ (&hdr->head)) == sub->cursor)
+    {
+      uint32_t signal;
+
+      if (!deadline)
+	deadline = ipc_deadline (ipc_timeout_ns (v_timeout));
+      ATOMIC_FETCH_ADD (&hdr->waiters, 1);
+      signal = ATOMIC_LOAD (&hdr->signal);
+      if (ATOMIC_LOAD_ACQ (&hdr->head) != sub->cursor)
+	ATOMIC_FETCH_ADD (&hdr->waiters, -1);
+      else if (!broadcast_wait (sub->region.shmid, &hdr->signal, signal,
+				&hdr->waiters, 1, deadline))
+	return rb_ary_new ();
+      hdr = get_subscriber (obj, &sub);
+    }
+
+  ring = broadcast_ring (hdr);
+  mask = sub->capacity - 1;
+  next_seq = sub->next_seq;
+  lost = 0;
+  ary = rb_ary_new ();
+  for (pos = sub->cursor, n = 0; pos < head && n != max; n++)
+    {
+      rec = (struct broadcast_record *)(ring + (pos & mask));
+      if (rec->len == BROADCAST_PAD)
+	{
+	  pos += sub->capacity - (pos & mask);
+	  rec = (struct broadcast_record *)ring;
+	}
+      len = ATOMIC_LOAD (&rec->len);
+      if (len > sub->capacity / 4
+	  || (pos & mask) + sizeof (*rec) + len > sub->capacity
+	  || pos + sizeof (*rec) + len > head
+	  || subscriber_lapped (hdr, sub))
+	break;			/* overwritten, caught below */
+      if (rec->seq > next_seq)
+	lost += rec->seq - next_seq;
+      next_seq = rec->seq + 1;
+      rb_ary_push (ary, rb_str_new ((char *)(rec + 1), len));
+      pos += sizeof (*rec) + IPC_ALIGN (len, 8);
+    }
+
+  if (subscriber_lapped (hdr, sub))
+    {
+      /* lapped by the publisher while copying: skip to the newest */
+      sub->cursor = ATOMIC_LOAD_ACQ (&hdr->head);
+      next_seq = ATOMIC_LOAD (&hdr->seq);
+      sub->lost += next_seq - sub->next_seq;
+      sub->next_seq = next_seq;
+      rb_ary_clear (ary);
+    }
+  else
+    {
+      sub->cursor = pos;
+      sub->next_seq = next_seq;
+      sub->lost += lost;
+    }
+  subscriber_advance (hdr, sub);
+
+  return ary;
+}
+
+/*
+ * call-seq:
+ *   lost -> Integer
+ *
+ * Return the number of records this subscriber missed because the
+ * publisher overwrote them before they were read.
+ */
+
+static VALUE
+rb_subscriber_lost (obj)
+     VALUE obj;
+{
+  struct subscriber_ds *sub;
+
+  TypedData_Get_Struct (obj, struct subscriber_ds,
+			&subscriber_data_type, sub);
+  return ULL2NUM (sub->lost);
+}
+
+/*
+ * call-seq:
+ *   lag -> Integer
+ *
+ * Return the number of published bytes not read yet.
+ */
+
+static VALUE
+rb_subscriber_lag (obj)
+     VALUE obj;
+{
+  struct subscriber_ds *sub;
+  struct broadcast_header *hdr;
+
+  hdr = get_subscriber (obj, &sub);
+  return ULL2NUM (ATOMIC_LOAD_ACQ (&hdr->head) - sub->cursor);
+}
+
+/*
+ * call-seq:
+ *   index -> Integer
+ *
+ * Return the slot number of this subscriber, as listed by
+ * Broadcast#slow_subscribers.
+ */
+
+static VALUE
+rb_subscriber_index (obj)
+     VALUE obj;
+{
+  struct subscriber_ds *sub;
+
+  TypedData_Get_Struct (obj, struct subscriber_ds,
+			&subscriber_data_type, sub);
+  return UINT2NUM (sub->slot);
+}
+
+/*
+ * call-seq:
+ *   close -> nil
+ *
+ * Give the subscriber slot back.
+ */
+
+static VALUE
+rb_subscriber_close (obj)
+     VALUE obj;
+{
+  struct subscriber_ds *sub;
+  struct broadcast_header *hdr;
+
+  hdr = get_subscriber (obj, &sub);
+  ATOMIC_STORE_REL (&broadcast_slots (hdr)[sub->slot].state, BROADCAST_FREE);
+  sub->state = BROADCAST_FREE;
+  if (ATOMIC_LOAD (&hdr->blocked))
+    {
+      ATOMIC_FETCH_ADD (&hdr->space, 1);
+      ipc_futex_wake (&hdr->space);
+    }
+
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   slow_subscribers(threshold) -> Array
+ *
+ * Return the slot numbers of subscribers that are more than
+ * +threshold+ bytes behind the publisher.
+ */
+
+static VALUE
+rb_broadcast_slow_subscribers (obj, v_threshold)
+     VALUE obj, v_threshold;
+{
+  struct broadcast_ds *bc;
+  struct broadcast_header *hdr;
+  struct broadcast_slot *slot;
+  uint64_t head, threshold;
+  uint32_t i;
+  VALUE ary;
+
+  threshold = NUM2ULL (v_threshold);
+  hdr = get_broadcast (obj, &bc);
+  head = ATOMIC_LOAD_ACQ (&hdr->head);
+  slot = broadcast_slots (hdr);
+  ary = rb_ary_new ();
+  for (i = 0; i < bc->max_subscribers; i++, slot++)
+    {
+      uint32_t state = ATOMIC_LOAD (&slot->state);
+      if ((state == BROADCAST_DROP || state == BROADCAST_BLOCK)
+	  && head - ATOMIC_LOAD (&slot->cursor) > threshold)
+	rb_ary_push (ary, UINT2NUM (i));
+    }
+
+  return ary;
+}
+
+/*
+ * call-seq:
+ *   subscribers -> Integer
+ *
+ * Return the number of subscriber slots in use.
+ */
+
+static VALUE
+rb_broadcast_subscribers (obj)
+     VALUE obj;
+{
+  struct broadcast_ds *bc;
+  struct broadcast_header *hdr;
+  struct broadcast_slot *slot;
+  uint32_t i, n = 0;
+
+  hdr = get_broadcast (obj, &bc);
+  slot = broadcast_slots (hdr);
+  for (i = 0; i < bc->max_subscribers; i++, slot++)
+    if (ATOMIC_LOAD (&slot->state) != BROADCAST_FREE)
+      n++;
+
+  return UINT2NUM (n);
+}
+
+/*
+ * call-seq:
+ *   capacity -> Integer
+ *
+ * Return the size of the ring in bytes.
+ */
+
+static VALUE
+rb_broadcast_capacity (obj)
+     VALUE obj;
+{
+  struct broadcast_ds *bc;
+
+  TypedData_Get_Struct (obj, struct broadcast_ds, &broadcast_data_type, bc);
+  return ULL2NUM (bc->capacity);
+}
+
+/*
+ * SharedBitmap: a fixed number of bits in shared memory, set and
+ * cleared with atomic operations so that any number of processes may
+ * use it at once.  SharedBloomFilter keeps a blocked Bloom filter in
+ * the same layout: all the bits of a key fall in one 512-bit block,
+ * one cache line, so a lookup reads a single line and never enters
+ * the kernel.
+ */
+
+#define BITMAP_MAGIC 0x53564253	/* "SBVS" */
+#define BLOOM_MAGIC 0x53564642	/* "BFVS" */
+#define BLOOM_BLOCK_BITS 512
+#define BLOOM_MAX_HASHES 7	/* 9 bits each from a 64-bit hash */
+#define BLOOM_BATCH 32
+
+struct bitmap_header {
+  uint32_t magic;
+  uint32_t hashes;		/* Bloom filters only */
+  uint64_t nbits;
+  char pad[IPC_CACHELINE - 16];
+};
+
+#define BITMAP_MAX_NBITS \
+  ((uint64_t)(SIZE_MAX / 16) & ~(uint64_t)(BLOOM_BLOCK_BITS - 1))
+#define BITMAP_NWORDS(nbits) \
+  ((size_t)IPC_ALIGN (nbits, BLOOM_BLOCK_BITS) / 64)
+#define BITMAP_BYTESIZE(nbits) \
+  (sizeof (struct bitmap_header) + BITMAP_NWORDS (nbits) * 8)
+
+struct bitmap_ds {
+  struct shm_region region;
+  uint32_t magic;
+  uint32_t hashes;
+  uint64_t nbits;
+  size_t nwords;
+};
+
+static size_t
+bitmap_memsize (ptr)
+     const void *ptr;
+{
+  return sizeof (struct bitmap_ds);
+}
+
+static const rb_data_type_t bitmap_data_type = {
+  "SystemVIPC::SharedBitmap",
+  { (void (*) (void *))region_mark, RUBY_TYPED_DEFAULT_FREE, bitmap_memsize,
+    IPC_DCOMPACT ((void (*) (void *))region_compact), },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static const rb_data_type_t bloom_data_type = {
+  "SystemVIPC::SharedBloomFilter",
+  { (void (*) (void *))region_mark, RUBY_TYPED_DEFAULT_FREE, bitmap_memsize,
+    IPC_DCOMPACT ((void (*) (void *))region_compact), },
+  &bitmap_data_type, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/*
+ * Population counts, of one bitmap or of the intersection or union
+ * of two.  The words are a multiple of 8, the loop keeps four
+ * independent sums; where the CPU has the popcnt instruction a copy
+ * built for it is used.
+ */
+
+enum { BITMAP_ONE, BITMAP_AND, BITMAP_OR };
+
+#define BITMAP_COUNT_BODY(a, b, n, op)					\
+  do {									\
+    uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;				\
+    size_t i;								\
+									\
+    for (i = 0; i < (n); i += 4)					\
+      {									\
+	uint64_t w0 = (a)[i], w1 = (a)[i + 1];				\
+	uint64_t w2 = (a)[i + 2], w3 = (a)[i + 3];			\
+									\
+	if ((op) == BITMAP_AND)						\
+	  {								\
+	    w0 &= (b)[i]; w1 &= (b)[i + 1];				\
+	    w2 &= (b)[i + 2]; w3 &= (b)[i + 3];				\
+	  }								\
+	else if ((op) == BITMAP_OR)					\
+	  {								\
+	    w0 |= (b)[i]; w1 |= (b)[i + 1];				\
+	    w2 |= (b)[i + 2]; w3 |= (b)[i + 3];				\
+	  }								\
+	c0 += __builtin_popcountll (w0);				\
+	c1 += __builtin_popcountll (w1);				\
+	c2 += __builtin_popcountll (w2);				\
+	c3 += __builtin_popcountll (w3);				\
+      }									\
+    return c0 + c1 + c2 + c3;						\
+  } while (0)
+
+static uint64_t
+bitmap_count_sw (a, b, n, op)
+     const uint64_t *a, *b;
+     size_t n;
+     int op;
+{
+  BITMAP_COUNT_BODY (a, b, n, op);
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+static uint64_t __attribute__ ((target ("popcnt")))
+bitmap_count_hw (a, b, n, op)
+     const uint64_t *a, *b;
+     size_t n;
+     int op;
+{
+  BITMAP_COUNT_BODY (a, b, n, op);
+}
+#endif
+
+static uint64_t (*bitmap_count) (const uint64_t *, const uint64_t *,
+				 size_t, int) = bitmap_count_sw;
+
+static void
+bitmap_init ()
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+  if (__builtin_cpu_supports ("popcnt"))
+    bitmap_count = bitmap_count_hw;
+#endif
+}
+
+/* Return the bytes used for +nbits+, which must not wrap around. */
+
+static size_t
+bitmap_bytesize (nbits)
+     uint64_t nbits;
+{
+  if (nbits > BITMAP_MAX_NBITS)
+    rb_raise (cError, "too many bits");
+  return BITMAP_BYTESIZE (nbits);
+}
+
+static VALUE
+bitmap_setup (klass, data_type, magic, argc, argv)
+     VALUE klass;
+     const rb_data_type_t *data_type;
+     uint32_t magic;
+     int argc;
+     VALUE *argv;
+{
+  struct bitmap_ds *bm;
+  struct bitmap_header *hdr;
+  VALUE dst, v_shm, v_offset, v_nbits, v_hashes;
+  size_t offset = 0;
+  uint64_t nbits = 0;
+  uint32_t hashes = 0;
+
+  rb_scan_args (argc, argv, "13", &v_shm, &v_offset, &v_nbits, &v_hashes);
+  if (!NIL_P (v_offset))
+    offset = NUM2SIZET (v_offset);
+  if (!NIL_P (v_nbits))
+    nbits = NUM2SIZET (v_nbits);
+  if (nbits > BITMAP_MAX_NBITS)
+    rb_raise (cError, "too many bits");
+  if (magic == BLOOM_MAGIC)
+    {
+      hashes = NIL_P (v_hashes) ? BLOOM_MAX_HASHES : NUM2UINT (v_hashes);
+      if (hashes < 1 || hashes > BLOOM_MAX_HASHES)
+	rb_raise (cError, "hashes must be between 1 and %d",
+		  BLOOM_MAX_HASHES);
+      nbits = IPC_ALIGN (nbits, BLOOM_BLOCK_BITS);
+    }
+
+  dst = TypedData_Make_Struct (klass, struct bitmap_ds, data_type, bm);
+  region_init (&bm->region, v_shm, offset, sizeof (*hdr));
+  hdr = (struct bitmap_header *)region_ptr (&bm->region);
+
+  if (ATOMIC_LOAD_ACQ (&hdr->magic) != magic)
+    {
+      if (!nbits)
+	rb_raise (cError, magic == BLOOM_MAGIC ? "no bloom filter" : "no bitmap");
+      region_init (&bm->region, v_shm, offset, bitmap_bytesize (nbits));
+      memset (hdr, 0, bitmap_bytesize (nbits));
+      hdr->nbits = nbits;
+      hdr->hashes = hashes;
+      ATOMIC_STORE_REL (&hdr->magic, magic);
+    }
+  else if (nbits && nbits != hdr->nbits)
+    rb_raise (cError, "size mismatch");
+
+  bm->magic = magic;
+  bm->nbits = hdr->nbits;
+  bm->hashes = hdr->hashes;
+  /* the header is shared memory: check it before trusting it */
+  if (!bm->nbits || bm->nbits > BITMAP_MAX_NBITS
+      || (magic == BLOOM_MAGIC
+	  && (bm->nbits % BLOOM_BLOCK_BITS
+	      || bm->hashes < 1 || bm->hashes > BLOOM_MAX_HASHES)))
+    rb_raise (cError, "corrupt header");
+  bm->nwords = BITMAP_NWORDS (bm->nbits);
+  region_init (&bm->region, v_shm, offset, BITMAP_BYTESIZE (bm->nbits));
+
+  return dst;
+}
+
+static uint64_t *
+get_bitmap (obj, data_type, bm)
+     VALUE obj;
+     const rb_data_type_t *data_type;
+     struct bitmap_ds **bm;
+{
+  TypedData_Get_Struct (obj, struct bitmap_ds, data_type, *bm);
+  return (uint64_t *)(region_ptr (&(*bm)->region)
+		      + sizeof (struct bitmap_header));
+}
+
+static uint64_t
+bitmap_index (bm, v_bit)
+     struct bitmap_ds *bm;
+     VALUE v_bit;
+{
+  uint64_t bit = NUM2ULL (v_bit);
+
+  if (bit >= bm->nbits)
+    rb_raise (cError, "invalid bit");
+  return bit;
+}
+
+/*
+ * call-seq:
+ *   SharedBitmap.bytesize(nbits) -> Integer
+ *
+ * Return the number of bytes of shared memory used by a SharedBitmap
+ * of +nbits+ bits.
+ */
+
+static VALUE
+rb_bitmap_s_bytesize (klass, v_nbits)
+     VALUE klass, v_nbits;
+{
+  return SIZET2NUM (bitmap_bytesize (NUM2SIZET (v_nbits)));
+}
+
+/*
+ * call-seq:
+ *   SharedBitmap.new(shm, offset = 0, nbits = nil) -> SharedBitmap
+ *
+ * Return a SharedBitmap stored in the attached SharedMemory +shm+ at
+ * +offset+. If +nbits+ is given and no SharedBitmap has been set up
+ * there yet, make one of +nbits+ clear bits; otherwise use the
+ * existing one. See SharedBitmap.bytesize.
+ */
+
+static VALUE
+rb_bitmap_s_new (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  if (argc > 3)
+    rb_raise (rb_eArgError, "wrong number of arguments");
+  return bitmap_setup (klass, &bitmap_data_type, BITMAP_MAGIC, argc, argv);
+}
+
+/*
+ * call-seq:
+ *   set(bit) -> true or false
+ *
+ * Set +bit+. Return true if this call changed it, so that of several
+ * processes setting the same bit exactly one gets true.
+ */
+
+static VALUE
+rb_bitmap_set (obj, v_bit)
+     VALUE obj, v_bit;
+{
+  struct bitmap_ds *bm;
+  uint64_t *words = get_bitmap (obj, &bitmap_data_type, &bm);
+  uint64_t bit = bitmap_index (bm, v_bit), mask = 1ULL << (bit & 63);
+
+  return ATOMIC_FETCH_OR (&words[bit / 64], mask) & mask ? Qfalse : Qtrue;
+}
+
+/*
+ * call-seq:
+ *   clear(bit) -> true or false
+ *
+ * Clear +bit+. Return true if this call changed it.
+ */
+
+static VALUE
+rb_bitmap_clear (obj, v_bit)
+     VALUE obj, v_bit;
+{
+  struct bitmap_ds *bm;
+  uint64_t *words = get_bitmap (obj, &bitmap_data_type, &bm);
+  uint64_t bit = bitmap_index (bm, v_bit), mask = 1ULL << (bit & 63);
+
+  return ATOMIC_FETCH_AND (&words[bit / 64], ~mask) & mask ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   bitmap[bit] -> true or false
+ *
+ * Return whether +bit+ is set.
+ */
+
+static VALUE
+rb_bitmap_aref (obj, v_bit)
+     VALUE obj, v_bit;
+{
+  struct bitmap_ds *bm;
+  uint64_t *words = get_bitmap (obj, &bitmap_data_type, &bm);
+  uint64_t bit = bitmap_index (bm, v_bit);
+
+  return ATOMIC_LOAD (&words[bit / 64]) & (1ULL << (bit & 63)) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   set_many(bits) -> Integer
+ *
+ * Set each bit of the array +bits+ and return how many this call
+ * changed.
+ */
+
+static VALUE
+rb_bitmap_set_many (obj, ary)
+     VALUE obj, ary;
+{
+  struct bitmap_ds *bm;
+  uint64_t *words, bit, mask;
+  long i, n = 0;
+
+  Check_Type (ary, T_ARRAY);
+  words = get_bitmap (obj, &bitmap_data_type, &bm);
+  for (i = 0; i < RARRAY_LEN (ary); i++)
+    {
+      bit = bitmap_index (bm, rb_ary_entry (ary, i));
+      mask = 1ULL << (bit & 63);
+      if (!(ATOMIC_LOAD (&words[bit / 64]) & mask)
+	  && !(ATOMIC_FETCH_OR (&words[bit / 64], mask) & mask))
+	n++;
+    }
+
+  return LONG2NUM (n);
+}
+
+/*
+ * call-seq:
+ *   test_many(bits) -> Array
+ *
+ * Return an array telling for each bit of the array +bits+ whether
+ * it is set.
+ */
+
+static VALUE
+rb_bitmap_test_many (obj, ary)
+     VALUE obj, ary;
+{
+  struct bitmap_ds *bm;
+  uint64_t *words, bit;
+  VALUE ret;
+  long i;
+
+  Check_Type (ary, T_ARRAY);
+  words = get_bitmap (obj, &bitmap_data_type, &bm);
+  ret = rb_ary_new2 (RARRAY_LEN (ary));
+  for (i = 0; i < RARRAY_LEN (ary); i++)
+    {
+      bit = bitmap_index (bm, rb_ary_entry (ary, i));
+      rb_ary_push (ret, ATOMIC_LOAD (&words[bit / 64]) & (1ULL << (bit & 63))
+		   ? Qtrue : Qfalse);
+    }
+
+  return ret;
+}
+
+/*
+ * call-seq:
+ *   count -> Integer
+ *
+ * Return the number of bits set. Bits changed meanwhile may or may
+ * not be counted.
+ */
+
+static VALUE
+rb_bitmap_count (obj)
+     VALUE obj;
+{
+  struct bitmap_ds *bm;
+  uint64_t *words = get_bitmap (obj, &bitmap_data_type, &bm);
+
+  return ULL2NUM (bitmap_count (words, NULL, bm->nwords, BITMAP_ONE));
+}
+
+static uint64_t *
+get_other_bitmap (obj, other, bm)
+     VALUE obj, other;
+     struct bitmap_ds *bm;
+{
+  struct bitmap_ds *bm2;
+  uint64_t *words = get_bitmap (other, &bitmap_data_type, &bm2);
+
+  if (bm2->magic != bm->magic || bm2->nbits != bm->nbits
+      || bm2->hashes != bm->hashes)
+    rb_raise (cError, "size mismatch");
+  return words;
+}
+
+/*
+ * call-seq:
+ *   union!(other) -> self
+ *
+ * Set the bits that are set in +other+, which must be of the same
+ * class and size. Only words that change are written, each with one
+ * atomic operation.
+ */
+
+static VALUE
+rb_bitmap_union_bang (obj, other)
+     VALUE obj, other;
+{
+  struct bitmap_ds *bm;
+  uint64_t *a = get_bitmap (obj, &bitmap_data_type, &bm);
+  uint64_t *b = get_other_bitmap (obj, other, bm);
+  size_t i;
+
+  for (i = 0; i < bm->nwords; i++)
+    if (b[i] & ~a[i])
+      ATOMIC_FETCH_OR (&a[i], b[i]);
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   intersect!(other) -> self
+ *
+ * Clear the bits that are clear in +other+, which must be of the
+ * same class and size.
+ */
+
+static VALUE
+rb_bitmap_intersect_bang (obj, other)
+     VALUE obj, other;
+{
+  struct bitmap_ds *bm;
+  uint64_t *a = get_bitmap (obj, &bitmap_data_type, &bm);
+  uint64_t *b = get_other_bitmap (obj, other, bm);
+  size_t i;
+
+  for (i = 0; i < bm->nwords; i++)
+    if (a[i] & ~b[i])
+      ATOMIC_FETCH_AND (&a[i], b[i]);
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   union_count(other) -> Integer
+ *
+ * Return the number of bits set in self or in +other+, without
+ * changing either.
+ */
+
+static VALUE
+rb_bitmap_union_count (obj, other)
+     VALUE obj, other;
+{
+  struct bitmap_ds *bm;
+  uint64_t *a = get_bitmap (obj, &bitmap_data_type, &bm);
+  uint64_t *b = get_other_bitmap (obj, other, bm);
+
+  return ULL2NUM (bitmap_count (a, b, bm->nwords, BITMAP_OR));
+}
+
+/*
+ * call-seq:
+ *   intersection_count(other) -> Integer
+ *
+ * Return the number of bits set in both self and +other+.
+ */
+
+static VALUE
+rb_bitmap_intersection_count (obj, other)
+     VALUE obj, other;
+{
+  struct bitmap_ds *bm;
+  uint64_t *a = get_bitmap (obj, &bitmap_data_type, &bm);
+  uint64_t *b = get_other_bitmap (obj, other, bm);
+
+  return ULL2NUM (bitmap_count (a, b, bm->nwords, BITMAP_AND));
+}
+
+/*
+ * call-seq:
+ *   clear_all -> self
+ *
+ * Clear every bit. Not atomic with respect to concurrent setters.
+ */
+
+static VALUE
+rb_bitmap_clear_all (obj)
+     VALUE obj;
+{
+  struct bitmap_ds *bm;
+  uint64_t *words = get_bitmap (obj, &bitmap_data_type, &bm);
+  size_t i;
+
+  for (i = 0; i < bm->nwords; i++)
+    ATOMIC_STORE (&words[i], 0);
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   size -> Integer
+ *
+ * Return the number of bits.
+ */
+
+static VALUE
+rb_bitmap_size (obj)
+     VALUE obj;
+{
+  struct bitmap_ds *bm;
+
+  TypedData_Get_Struct (obj, struct bitmap_ds, &bitmap_data_type, bm);
+  return ULL2NUM (bm->nbits);
+}
+
+/*
+ * Keys are hashed to 64 bits: Integers by their value, Strings by
+ * their bytes.  The hash picks the block; a second, derived one gives
+ * 9 bits of position in the block per hash function.
+ */
+
+static uint64_t
+bloom_mix (x)
+     uint64_t x;
+{
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+static uint64_t
+bloom_hash (v_key)
+     VALUE v_key;
+{
+  const unsigned char *p;
+  uint64_t h, w;
+  long len;
+
+  if (FIXNUM_P (v_key) || TYPE (v_key) == T_BIGNUM)
+    return bloom_mix ((uint64_t)NUM2LL (v_key) ^ 0x9e3779b97f4a7c15ULL);
+
+  StringValue (v_key);
+  p = (const unsigned char *)RSTRING_PTR (v_key);
+  len = RSTRING_LEN (v_key);
+  h = 0x9e3779b97f4a7c15ULL * (len + 1);
+  for (; len >= 8; len -= 8, p += 8)
+    {
+      memcpy (&w, p, 8);
+      h = (h ^ bloom_mix (w)) * 0x9e3779b97f4a7c15ULL;
+      h = (h << 27) | (h >> 37);
+    }
+  if (len)
+    {
+      w = 0;
+      memcpy (&w, p, len);
+      h ^= bloom_mix (w);
+    }
+  return bloom_mix (h);
+}
+
+/*
+ * Masks of the 8 words of the block of a key, that is of its
+ * +hashes+ bits.
+ */
+
+static uint64_t *
+bloom_masks (bm, words, h, masks)
+     struct bitmap_ds *bm;
+     uint64_t *words;
+     uint64_t h;
+     uint64_t *masks;
+{
+  uint64_t h2 = bloom_mix (h + 0x9e3779b97f4a7c15ULL);
+  unsigned int i, bit;
+
+  memset (masks, 0, 8 * sizeof (*masks));
+  for (i = 0; i < bm->hashes; i++, h2 >>= 9)
+    {
+      bit = h2 & (BLOOM_BLOCK_BITS - 1);
+      masks[bit / 64] |= 1ULL << (bit & 63);
+    }
+  return words + (h % (bm->nwords / 8)) * 8;
+}
+
+static int
+bloom_add (block, masks)
+     uint64_t *block, *masks;
+{
+  int i, added = 0;
+
+  for (i = 0; i < 8; i++)
+    if (masks[i] && (ATOMIC_LOAD (&block[i]) & masks[i]) != masks[i]
+	&& (ATOMIC_FETCH_OR (&block[i], masks[i]) & masks[i]) != masks[i])
+      added = 1;
+  return added;
+}
+
+static int
+bloom_test (block, masks)
+     uint64_t *block, *masks;
+{
+  int i;
+
+  for (i = 0; i < 8; i++)
+    if ((ATOMIC_LOAD (&block[i]) & masks[i]) != masks[i])
+      return 0;
+  return 1;
+}
+
+/*
+ * call-seq:
+ *   SharedBloomFilter.bytesize(nbits) -> Integer
+ *
+ * Return the number of bytes of shared memory used by a
+ * SharedBloomFilter of +nbits+ bits. About 10 bits per expected key
+ * give 1% of false positives.
+ */
+
+static VALUE
+rb_bloom_s_bytesize (klass, v_nbits)
+     VALUE klass, v_nbits;
+{
+  return SIZET2NUM (bitmap_bytesize (NUM2SIZET (v_nbits)));
+}
+
+/*
+ * call-seq:
+ *   SharedBloomFilter.new(shm, offset = 0, nbits = nil, hashes = 7)
+ *     -> SharedBloomFilter
+ *
+ * Return a SharedBloomFilter stored in the attached SharedMemory
+ * +shm+ at +offset+. If +nbits+ is given and no filter has been set
+ * up there yet, make an empty one of +nbits+ bits, rounded up to
+ * whole 512-bit blocks, setting +hashes+ bits per key; otherwise use
+ * the existing one.
+ */
+
+static VALUE
+rb_bloom_s_new (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  return bitmap_setup (klass, &bloom_data_type, BLOOM_MAGIC, argc, argv);
+}
+
+/*
+ * call-seq:
+ *   add(key) -> true or false
+ *
+ * Add +key+, a String or an Integer. Return true if it was not in
+ * the filter. Two processes adding the same new key at the same time
+ * may both get true.
+ */
+
+static VALUE
+rb_bloom_add (obj, v_key)
+     VALUE obj, v_key;
+{
+  struct bitmap_ds *bm;
+  uint64_t *words, *block, masks[8], h = bloom_hash (v_key);
+
+  words = get_bitmap (obj, &bloom_data_type, &bm);
+  block = bloom_masks (bm, words, h, masks);
+  return bloom_add (block, masks) ? Qtrue : Qfalse;
+}
+
+/*
+ * call-seq:
+ *   include?(key) -> true or false
+ *
+ * Return false if +key+ was never added, true if it probably was.
+ */
+
+static VALUE
+rb_bloom_include_p (obj, v_key)
+     VALUE obj, v_key;
+{
+  struct bitmap_ds *bm;
+  uint64_t *words, *block, masks[8], h = bloom_hash (v_key);
+
+  words = get_bitmap (obj, &bloom_data_type, &bm);
+  block = bloom_masks (bm, words, h, masks);
+  return bloom_test (block, masks) ? Qtrue : Qfalse;
+}
+
+/*
+ * Hash a batch of keys and prefetch their blocks, then add or test
+ * them, so that the cache misses overlap.
+ */
+
+static VALUE
+bloom_many (obj, ary, add)
+     VALUE obj, ary;
+     int add;
+{
+  struct bitmap_ds *bm;
+  uint64_t *words, hash[BLOOM_BATCH], masks[8];
+  uint64_t *block[BLOOM_BATCH];
+  VALUE ret;
+  long i, j, n;
+
+  Check_Type (ary, T_ARRAY);
+  ret = rb_ary_new2 (RARRAY_LEN (ary));
+  for (i = 0; i < RARRAY_LEN (ary); i += n)
+    {
+      n = RARRAY_LEN (ary) - i;
+      if (n > BLOOM_BATCH)
+	n = BLOOM_BATCH;
+      for (j = 0; j < n; j++)
+	hash[j] = bloom_hash (rb_ary_entry (ary, i + j));
+
+      words = get_bitmap (obj, &bloom_data_type, &bm);
+      for (j = 0; j < n; j++)
+	{
+	  block[j] = words + (hash[j] % (bm->nwords / 8)) * 8;
+#ifdef __GNUC__
+	  if (add)
+	    __builtin_prefetch (block[j], 1);
+	  else
+	    __builtin_prefetch (block[j], 0);
+#endif
+	}
+      for (j = 0; j < n; j++)
+	{
+	  bloom_masks (bm, words, hash[j], masks);
+	  rb_ary_push (ret, (add ? bloom_add (block[j], masks)
+			     : bloom_test (block[j], masks)) ? Qtrue : Qfalse);
+	}
+    }
+
+  return ret;
+}
+
+/*
+ * call-seq:
+ *   add_many(keys) -> Array
+ *
+ * Add each key of the array +keys+. Return an array telling for each
+ * whether it was new, as #add.
+ */
+
+static VALUE
+rb_bloom_add_many (obj, ary)
+     VALUE obj, ary;
+{
+  return bloom_many (obj, ary, 1);
+}
+
+/*
+ * call-seq:
+ *   include_many(keys) -> Array
+ *
+ * Return an array telling for each key of the array +keys+ whether
+ * it is probably in the filter, as #include?.
+ */
+
+static VALUE
+rb_bloom_include_many (obj, ary)
+     VALUE obj, ary;
+{
+  return bloom_many (obj, ary, 0);
+}
+
+/*
+ * call-seq:
+ *   hashes -> Integer
+ *
+ * Return the number of bits set per key.
+ */
+
+static VALUE
+rb_bloom_hashes (obj)
+     VALUE obj;
+{
+  struct bitmap_ds *bm;
+
+  TypedData_Get_Struct (obj, struct bitmap_ds, &bloom_data_type, bm);
+  return UINT2NUM (bm->hashes);
+}
+
+/*
+ * Metrics: named counters, gauges and histograms shared by the
+ * processes of an application.  Every process updates its own shard,
+ * a run of cache lines no other process writes, and readers add the
+ * shards up.  The directory of names is only written when a metric is
+ * registered, under a lock word; updates take no lock.
+ *
+ * Counters and gauges are single words.  A histogram is the count of
+ * each bucket, the last one open ended, and the sum of the observed
+ * values; its owner bumps the sequence counter of the shard around an
+ * update, so a reader copies a shard as it was between two updates.
+ */
+
+#define METRICS_MAGIC 0x53564d53	/* "SMVS" */
+#define METRICS_NAME_MAX 48
+#define METRICS_MAX_BUCKETS 16
+#define METRICS_MAX_METRICS 65536
+#define METRICS_MAX_PROCESSES 65536
+#define METRICS_MAX_VALUES (1 << 20)
+
+enum { METRIC_COUNTER = 1, METRIC_GAUGE, METRIC_HISTOGRAM };
+
+struct metrics_header {
+  uint32_t magic;
+  uint32_t lock;		/* pid of the registering process */
+  uint32_t nmetrics;
+  uint32_t max_metrics;
+  uint32_t processes;
+  uint32_t values;		/* per shard */
+  uint32_t used;
+  char pad[IPC_CACHELINE - 28];
+};
+
+struct metrics_entry {
+  char name[METRICS_NAME_MAX];
+  uint32_t kind;
+  uint32_t nbuckets;		/* histograms, not counting the last */
+  uint32_t offset;		/* of the first value in a shard */
+  uint32_t pad;
+  double bounds[METRICS_MAX_BUCKETS];
+};
+
+struct metrics_slot {
+  uint32_t pid;
+  uint32_t pad;
+  uint64_t seq;
+  char pad2[IPC_CACHELINE - 16];
+};
+
+#define METRICS_STRIDE(values) \
+  IPC_ALIGN ((size_t)(values) * 8, IPC_CACHELINE)
+#define METRICS_SLOTS_OFFSET(max) \
+  (sizeof (struct metrics_header) \
+   + (size_t)(max) * sizeof (struct metrics_entry))
+#define METRICS_SHARDS_OFFSET(max, procs) \
+  (METRICS_SLOTS_OFFSET (max) + (size_t)(procs) * sizeof (struct metrics_slot))
+#define METRICS_BYTESIZE(max, procs, values) \
+  (METRICS_SHARDS_OFFSET (max, procs) \
+   + (size_t)(procs) * METRICS_STRIDE (values))
+
+struct metrics_ds {
+  struct shm_region region;
+  uint32_t max_metrics;
+  uint32_t processes;
+  uint32_t values;
+  int slot;			/* of this process, -1 until first update */
+  pid_t pid;
+};
+
+struct metric_ds {
+  VALUE metrics;
+  uint32_t kind;
+  uint32_t nbuckets;
+  uint32_t offset;
+  double bounds[METRICS_MAX_BUCKETS];
+};
+
+static size_t
+metrics_memsize (ptr)
+     const void *ptr;
+{
+  return sizeof (struct metrics_ds);
+}
+
+static const rb_data_type_t metrics_data_type = {
+  "SystemVIPC::Metrics",
+  { (void (*) (void *))region_mark, RUBY_TYPED_DEFAULT_FREE, metrics_memsize,
+    IPC_DCOMPACT ((void (*) (void *))region_compact), },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static void
+metric_mark (metric)
+     struct metric_ds *metric;
+{
+  ipc_gc_mark (metric->metrics);
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+metric_compact (metric)
+     struct metric_ds *metric;
+{
+  metric->metrics = ipc_gc_location (metric->metrics);
+}
+#endif
+
+static size_t
+metric_memsize (ptr)
+     const void *ptr;
+{
+  return sizeof (struct metric_ds);
+}
+
+static const rb_data_type_t metric_data_type = {
+  "SystemVIPC::Metrics::Metric",
+  { (void (*) (void *))metric_mark, RUBY_TYPED_DEFAULT_FREE, metric_memsize,
+    IPC_DCOMPACT ((void (*) (void *))metric_compact), },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/*
+ * getpid(2) is a system call with current C libraries; keep it, and
+ * forget it in the child of a fork.
+ */
+
+static pid_t ipc_cached_pid;
+
+static void
+ipc_atfork_child ()
+{
+  ipc_cached_pid = 0;
+}
+
+static pid_t
+ipc_getpid ()
+{
+#ifdef HAVE_PTHREAD_H
+  if (!ipc_cached_pid)
+    ipc_cached_pid = getpid ();
+  return ipc_cached_pid;
+#else
+  return getpid ();
+#endif
+}
+
+static void
+metrics_opts (v_opts, max_metrics, processes, values)
+     VALUE v_opts;
+     uint32_t *max_metrics, *processes, *values;
+{
+  VALUE v;
+
+  if (!NIL_P (v = xfer_opt (v_opts, "metrics")))
+    *max_metrics = NUM2UINT (v);
+  if (!NIL_P (v = xfer_opt (v_opts, "processes")))
+    *processes = NUM2UINT (v);
+  if (!*max_metrics || *max_metrics > METRICS_MAX_METRICS)
+    rb_raise (cError, "metrics must be between 1 and %d",
+	      METRICS_MAX_METRICS);
+  if (!*processes || *processes > METRICS_MAX_PROCESSES)
+    rb_raise (cError, "processes must be between 1 and %d",
+	      METRICS_MAX_PROCESSES);
+  if (!NIL_P (v = xfer_opt (v_opts, "values")))
+    *values = NUM2UINT (v);
+  else
+    *values = *max_metrics * 4;
+  if (!*values || *values > METRICS_MAX_VALUES)
+    rb_raise (cError, "values must be between 1 and %d",
+	      METRICS_MAX_VALUES);
+}
+
+/*
+ * Return the bytes used by a registry, checking each product, which
+ * may wrap around where size_t has 32 bits.
+ */
+
+static size_t
+metrics_bytesize (max_metrics, processes, values)
+     uint32_t max_metrics, processes, values;
+{
+  size_t per_process;
+
+#if SIZE_MAX <= UINT32_MAX
+  /* no product of these uint32_t can wrap a wider size_t */
+  if (max_metrics > (SIZE_MAX - sizeof (struct metrics_header))
+      / sizeof (struct metrics_entry)
+      || values > (SIZE_MAX - IPC_CACHELINE - sizeof (struct metrics_slot)) / 8)
+    rb_raise (cError, "registry too large");
+#endif
+  per_process = sizeof (struct metrics_slot) + METRICS_STRIDE (values);
+  if (processes > (SIZE_MAX - METRICS_SLOTS_OFFSET (max_metrics))
+      / per_process)
+    rb_raise (cError, "registry too large");
+  return METRICS_BYTESIZE (max_metrics, processes, values);
+}
+
+/*
+ * call-seq:
+ *   Metrics.bytesize(opts = {}) -> Integer
+ *
+ * Return the number of bytes of shared memory used by a Metrics
+ * registry. <tt>opts[:metrics]</tt> is the number of names (default
+ * 64), <tt>opts[:processes]</tt> the number of processes that update
+ * them (default 64), <tt>opts[:values]</tt> the number of words of
+ * each process (default 4 per name): one per counter or gauge, two
+ * more than the buckets per histogram. Names and processes are
+ * limited to 65536, values to 2**20.
+ */
+
+static VALUE
+rb_metrics_s_bytesize (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  VALUE v_opts;
+  uint32_t max_metrics = 64, processes = 64, values;
+
+  rb_scan_args (argc, argv, "01", &v_opts);
+  metrics_opts (v_opts, &max_metrics, &processes, &values);
+  return SIZET2NUM (metrics_bytesize (max_metrics, processes, values));
+}
+
+/*
+ * call-seq:
+ *   Metrics.new(shm, offset = 0, opts = nil) -> Metrics
+ *
+ * Return the Metrics registry stored in the attached SharedMemory
+ * +shm+ at +offset+. If +opts+ is given and no registry has been set
+ * up there yet, make an empty one sized by +opts+ as for
+ * Metrics.bytesize; otherwise use the existing one.
+ */
+
+static VALUE
+rb_metrics_s_new (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  struct metrics_ds *m;
+  struct metrics_header *hdr;
+  VALUE dst, v_shm, v_offset, v_opts;
+  size_t offset = 0, size;
+  uint32_t max_metrics = 64, processes = 64, values;
+
+  rb_scan_args (argc, argv, "12", &v_shm, &v_offset, &v_opts);
+  if (!NIL_P (v_offset))
+    offset = NUM2SIZET (v_offset);
+
+  dst = TypedData_Make_Struct (klass, struct metrics_ds,
+			       &metrics_data_type, m);
+  m->slot = -1;
+  region_init (&m->region, v_shm, offset, sizeof (*hdr));
+  hdr = (struct metrics_header *)region_ptr (&m->region);
+
+  if (ATOMIC_LOAD_ACQ (&hdr->magic) != METRICS_MAGIC)
+    {
+      if (NIL_P (v_opts))
+	rb_raise (cError, "no metrics");
+      metrics_opts (v_opts, &max_metrics, &processes, &values);
+      size = metrics_bytesize (max_metrics, processes, values);
+      region_init (&m->region, v_shm, offset, size);
+      memset (hdr, 0, size);
+      hdr->max_metrics = max_metrics;
+      hdr->processes = processes;
+      hdr->values = values;
+      ATOMIC_STORE_REL (&hdr->magic, METRICS_MAGIC);
+    }
+
+  m->max_metrics = hdr->max_metrics;
+  m->processes = hdr->processes;
+  m->values = hdr->values;
+  /* the header is shared memory: check it before trusting it */
+  if (!m->max_metrics || m->max_metrics > METRICS_MAX_METRICS
+      || !m->processes || m->processes > METRICS_MAX_PROCESSES
+      || !m->values || m->values > METRICS_MAX_VALUES)
+    rb_raise (cError, "corrupt header");
+  region_init (&m->region, v_shm, offset,
+	       metrics_bytesize (m->max_metrics, m->processes, m->values));
+
+  return dst;
+}
+
+static struct metrics_header *
+get_metrics (obj, m)
+     VALUE obj;
+     struct metrics_ds **m;
+{
+  TypedData_Get_Struct (obj, struct metrics_ds, &metrics_data_type, *m);
+  return (struct metrics_header *)region_ptr (&(*m)->region);
+}
+
+#define METRICS_ENTRIES(hdr) ((struct metrics_entry *)((hdr) + 1))
+#define METRICS_SLOT(hdr, m, i)						\
+  ((struct metrics_slot *)((char *)(hdr)				\
+			   + METRICS_SLOTS_OFFSET ((m)->max_metrics))	\
+   + (i))
+#define METRICS_SHARD(hdr, m, i)					\
+  ((uint64_t *)((char *)(hdr)						\
+		+ METRICS_SHARDS_OFFSET ((m)->max_metrics, (m)->processes) \
+		+ (size_t)(i) * METRICS_STRIDE ((m)->values)))
+
+/*
+ * The registry lock is only taken to add names and claim shards.  A
+ * holder that died is replaced.
+ */
+
+static void
+metrics_lock (hdr)
+     struct metrics_header *hdr;
+{
+  uint32_t pid = (uint32_t)ipc_getpid (), holder;
+  unsigned int tries;
+
+  for (tries = 0; !ATOMIC_CAS (&hdr->lock, 0, pid); tries++)
+    {
+      holder = ATOMIC_LOAD (&hdr->lock);
+      if (holder && !ipc_pid_alive ((pid_t)holder)
+	  && ATOMIC_CAS (&hdr->lock, holder, pid))
+	break;
+      if (tries & 63)
+	IPC_CPU_RELAX ();
+      else
+	sched_yield ();
+    }
+  ATOMIC_ACQUIRE_FENCE ();
+}
+
+static void
+metrics_unlock (hdr)
+     struct metrics_header *hdr;
+{
+  ATOMIC_STORE_REL (&hdr->lock, 0);
+}
+
+/*
+ * Return the shard of this process, claiming a free slot, or the slot
+ * of a process that has gone away, on first use.  The counters of a
+ * reclaimed shard carry on from where they were; its gauges restart
+ * from 0.
+ */
+
+static uint64_t *
+metrics_shard (hdr, m)
+     struct metrics_header *hdr;
+     struct metrics_ds *m;
+{
+  struct metrics_slot *slot;
+  struct metrics_entry *e;
+  pid_t pid = ipc_getpid ();
+  uint32_t i, j, owner;
+  uint64_t *shard;
+
+  if (IPC_UNLIKELY (m->slot < 0 || m->pid != pid))
+    {
+      metrics_lock (hdr);
+      for (i = 0; i < m->processes; i++)
+	{
+	  slot = METRICS_SLOT (hdr, m, i);
+	  owner = ATOMIC_LOAD (&slot->pid);
+	  if (!owner || owner == (uint32_t)pid)
+	    break;
+	}
+      if (i == m->processes)
+	for (i = 0; i < m->processes; i++)
+	  if (!ipc_pid_alive ((pid_t)ATOMIC_LOAD (&METRICS_SLOT (hdr, m, i)->pid)))
+	    break;
+      if (i == m->processes)
+	{
+	  metrics_unlock (hdr);
+	  rb_raise (cError, "too many processes");
+	}
+      slot = METRICS_SLOT (hdr, m, i);
+      if (ATOMIC_LOAD (&slot->pid) != (uint32_t)pid)
+	{
+	  shard = METRICS_SHARD (hdr, m, i);
+	  e = METRICS_ENTRIES (hdr);
+	  for (j = 0; j < ATOMIC_LOAD (&hdr->nmetrics); j++)
+	    if (e[j].kind == METRIC_GAUGE)
+	      ATOMIC_STORE (&shard[e[j].offset], 0);
+	  ATOMIC_STORE_REL (&slot->pid, (uint32_t)pid);
+	}
+      metrics_unlock (hdr);
+      m->slot = i;
+      m->pid = pid;
+    }
+  return METRICS_SHARD (hdr, m, m->slot);
+}
+
+static VALUE
+metrics_register (obj, v_name, kind, v_bounds)
+     VALUE obj, v_name;
+     uint32_t kind;
+     VALUE v_bounds;
+{
+  struct metrics_ds *m;
+  struct metrics_header *hdr;
+  struct metrics_entry *e;
+  struct metric_ds *metric;
+  double bounds[METRICS_MAX_BUCKETS];
+  const char *klass;
+  uint32_t i, n, nbuckets = 0, need;
+  VALUE dst;
+
+  StringValue (v_name);
+  if (RSTRING_LEN (v_name) == 0 || RSTRING_LEN (v_name) >= METRICS_NAME_MAX
+      || memchr (RSTRING_PTR (v_name), 0, RSTRING_LEN (v_name)))
+    rb_raise (cError, "invalid metric name");
+  if (kind == METRIC_HISTOGRAM)
+    {
+      Check_Type (v_bounds, T_ARRAY);
+      if (RARRAY_LEN (v_bounds) < 1
+	  || RARRAY_LEN (v_bounds) > METRICS_MAX_BUCKETS)
+	rb_raise (cError, "a histogram has 1 to %d bounds",
+		  METRICS_MAX_BUCKETS);
+      nbuckets = RARRAY_LEN (v_bounds);
+      for (i = 0; i < nbuckets; i++)
+	{
+	  bounds[i] = NUM2DBL (rb_ary_entry (v_bounds, i));
+	  if (i && bounds[i] <= bounds[i - 1])
+	    rb_raise (cError, "bounds must increase");
+	}
+    }
+  need = kind == METRIC_HISTOGRAM ? nbuckets + 2 : 1;
+
+  klass = kind == METRIC_COUNTER ? "Counter"
+    : kind == METRIC_GAUGE ? "Gauge" : "Histogram";
+  dst = TypedData_Make_Struct (rb_const_get (CLASS_OF (obj),
+					     rb_intern (klass)),
+			       struct metric_ds, &metric_data_type, metric);
+  metric->metrics = obj;
+
+  hdr = get_metrics (obj, &m);
+  metrics_lock (hdr);
+  e = METRICS_ENTRIES (hdr);
+  n = ATOMIC_LOAD (&hdr->nmetrics);
+  for (i = 0; i < n; i++)
+    if (!strncmp (e[i].name, RSTRING_PTR (v_name), METRICS_NAME_MAX)
+	&& strlen (e[i].name) == (size_t)RSTRING_LEN (v_name))
+      break;
+
+  if (i < n)
+    {
+      if (e[i].kind != kind || e[i].nbuckets != nbuckets
+	  || (nbuckets && memcmp (e[i].bounds, bounds,
+				  nbuckets * sizeof (double))))
+	{
+	  metrics_unlock (hdr);
+	  rb_raise (cError, "metric registered with another type");
+	}
+    }
+  else
+    {
+      if (n == m->max_metrics || hdr->used + need > m->values)
+	{
+	  metrics_unlock (hdr);
+	  rb_raise (cError, "metrics full");
+	}
+      memset (&e[i], 0, sizeof (e[i]));
+      memcpy (e[i].name, RSTRING_PTR (v_name), RSTRING_LEN (v_name));
+      e[i].kind = kind;
+      e[i].nbuckets = nbuckets;
+      e[i].offset = hdr->used;
+      if (nbuckets)
+	memcpy (e[i].bounds, bounds, nbuckets * sizeof (double));
+      hdr->used += need;
+      ATOMIC_STORE_REL (&hdr->nmetrics, n + 1);
+    }
+  metric->kind = kind;
+  metric->nbuckets = nbuckets;
+  metric->offset = e[i].offset;
+  if (nbuckets)
+    memcpy (metric->bounds, bounds, nbuckets * sizeof (double));
+  metrics_unlock (hdr);
+
+  return dst;
+}
+
+/*
+ * call-seq:
+ *   counter(name) -> Metrics::Counter
+ *
+ * Return the counter +name+, registering it if needed.
+ */
+
+static VALUE
+rb_metrics_counter (obj, v_name)
+     VALUE obj, v_name;
+{
+  return metrics_register (obj, v_name, METRIC_COUNTER, Qnil);
+}
+
+/*
+ * call-seq:
+ *   gauge(name) -> Metrics::Gauge
+ *
+ * Return the gauge +name+, registering it if needed. Each process
+ * sets its own value, readers see their sum.
+ */
+
+static VALUE
+rb_metrics_gauge (obj, v_name)
+     VALUE obj, v_name;
+{
+  return metrics_register (obj, v_name, METRIC_GAUGE, Qnil);
+}
+
+/*
+ * call-seq:
+ *   histogram(name, bounds) -> Metrics::Histogram
+ *
+ * Return the histogram +name+, registering it if needed, whose
+ * buckets count the values up to each of the increasing +bounds+,
+ * plus one for the larger values.
+ */
+
+static VALUE
+rb_metrics_histogram (obj, v_name, v_bounds)
+     VALUE obj, v_name, v_bounds;
+{
+  return metrics_register (obj, v_name, METRIC_HISTOGRAM, v_bounds);
+}
+
+static uint64_t *
+get_metric (obj, kind, metric)
+     VALUE obj;
+     uint32_t kind;
+     struct metric_ds **metric;
+{
+  struct metrics_ds *m;
+  struct metrics_header *hdr;
+
+  TypedData_Get_Struct (obj, struct metric_ds, &metric_data_type, *metric);
+  if ((*metric)->kind != kind)
+    rb_raise (cError, "wrong metric type");
+  hdr = get_metrics ((*metric)->metrics, &m);
+  return metrics_shard (hdr, m) + (*metric)->offset;
+}
+
+/*
+ * call-seq:
+ *   increment(n = 1) -> Metrics::Counter
+ *
+ * Add +n+ to the counter. Return self.
+ */
+
+static VALUE
+rb_counter_increment (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct metric_ds *metric;
+  VALUE v_n;
+  uint64_t n, *value;
+
+  rb_scan_args (argc, argv, "01", &v_n);
+  n = NIL_P (v_n) ? 1 : NUM2ULL (v_n);
+  value = get_metric (obj, METRIC_COUNTER, &metric);
+  ATOMIC_ADD (value, n);
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   set(n) -> Metrics::Gauge
+ *
+ * Make +n+ the value of the gauge for this process. Return self.
+ */
+
+static VALUE
+rb_gauge_set (obj, v_n)
+     VALUE obj, v_n;
+{
+  struct metric_ds *metric;
+  int64_t n = NUM2LL (v_n);
+
+  ATOMIC_STORE (get_metric (obj, METRIC_GAUGE, &metric), (uint64_t)n);
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   add(n) -> Metrics::Gauge
+ *
+ * Add +n+, which may be negative, to the value of the gauge for this
+ * process. Return self.
+ */
+
+static VALUE
+rb_gauge_add (obj, v_n)
+     VALUE obj, v_n;
+{
+  struct metric_ds *metric;
+  int64_t n = NUM2LL (v_n);
+
+  ATOMIC_ADD (get_metric (obj, METRIC_GAUGE, &metric), (uint64_t)n);
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   observe(value) -> Metrics::Histogram
+ *
+ * Count +value+ in its bucket and add it to the sum. Return self.
+ */
+
+static VALUE
+rb_histogram_observe (obj, v_value)
+     VALUE obj, v_value;
+{
+  struct metric_ds *metric;
+  struct metrics_ds *m;
+  struct metrics_slot *slot;
+  double value = NUM2DBL (v_value), sum;
+  uint64_t *values, old, new;
+  uint32_t i;
+
+  values = get_metric (obj, METRIC_HISTOGRAM, &metric);
+  TypedData_Get_Struct (metric->metrics, struct metrics_ds,
+			&metrics_data_type, m);
+  slot = METRICS_SLOT (region_ptr (&m->region), m, m->slot);
+  for (i = 0; i < metric->nbuckets && value > metric->bounds[i]; i++)
+    ;
+
+  ATOMIC_FETCH_ADD (&slot->seq, 1);
+  ATOMIC_RELEASE_FENCE ();
+  ATOMIC_ADD (&values[i], 1);
+  do
+    {
+      old = ATOMIC_LOAD (&values[metric->nbuckets + 1]);
+      memcpy (&sum, &old, sizeof (sum));
+      sum += value;
+      memcpy (&new, &sum, sizeof (new));
+    }
+  while (!ATOMIC_CAS (&values[metric->nbuckets + 1], old, new));
+  ATOMIC_FETCH_ADD (&slot->seq, 1);
+
+  return obj;
+}
+
+/*
+ * Copy the used words of shard +i+ as they were between two histogram
+ * updates of its owner.
+ */
+
+static void
+metrics_copy_shard (hdr, m, i, used, buf)
+     struct metrics_header *hdr;
+     struct metrics_ds *m;
+     uint32_t i, used;
+     uint64_t *buf;
+{
+  struct metrics_slot *slot = METRICS_SLOT (hdr, m, i);
+  uint64_t *shard = METRICS_SHARD (hdr, m, i), seq;
+  unsigned int tries;
+  uint32_t j;
+
+  for (tries = 0;; tries++)
+    {
+      seq = ATOMIC_LOAD_ACQ (&slot->seq);
+      if (!(seq & 1))
+	{
+	  for (j = 0; j < used; j++)
+	    buf[j] = ATOMIC_LOAD (&shard[j]);
+	  ATOMIC_ACQUIRE_FENCE ();
+	  if (ATOMIC_LOAD (&slot->seq) == seq)
+	    return;
+	}
+      if (tries & 63)
+	IPC_CPU_RELAX ();
+      else
+	sched_yield ();
+    }
+}
+
+/*
+ * call-seq:
+ *   snapshot -> Hash
+ *
+ * Return the metrics summed over all processes, by name: an Integer
+ * for counters and gauges, and for histograms a Hash with :count,
+ * :sum and :buckets, an array of <tt>[bound, count]</tt> pairs where
+ * count is cumulative and the last bound Float::INFINITY. Each
+ * process's part is copied as it was between two of its histogram
+ * updates; gauges of processes that have gone away are left out. The
+ * processes updating are never waited for.
+ */
+
+static VALUE
+rb_metrics_snapshot (obj)
+     VALUE obj;
+{
+  struct metrics_ds *m;
+  struct metrics_header *hdr;
+  struct metrics_entry *e;
+  uint64_t *buf, *total;
+  uint32_t n, used, i, j, k, pid;
+  double sum, part;
+  VALUE hash, v, buckets, tmp;
+  uint64_t count;
+
+  hdr = get_metrics (obj, &m);
+  n = ATOMIC_LOAD_ACQ (&hdr->nmetrics);
+  used = ATOMIC_LOAD (&hdr->used);
+  e = METRICS_ENTRIES (hdr);
+  /* a String holds the copies, so that nothing leaks on NoMemoryError */
+  tmp = rb_str_new (0, 2 * (used + 1) * sizeof (uint64_t));
+  buf = (uint64_t *)RSTRING_PTR (tmp);
+  total = buf + used + 1;
+  MEMZERO (total, uint64_t, used + 1);
+
+  for (i = 0; i < m->processes; i++)
+    {
+      pid = ATOMIC_LOAD (&METRICS_SLOT (hdr, m, i)->pid);
+      if (!pid)
+	continue;
+      metrics_copy_shard (hdr, m, i, used, buf);
+      for (j = 0; j < n; j++)
+	switch (e[j].kind)
+	  {
+	  case METRIC_GAUGE:
+	    if (!ipc_pid_alive ((pid_t)pid))
+	      break;
+	    /* fall through */
+	  case METRIC_COUNTER:
+	    total[e[j].offset] += buf[e[j].offset];
+	    break;
+	  case METRIC_HISTOGRAM:
+	    for (k = 0; k <= e[j].nbuckets; k++)
+	      total[e[j].offset + k] += buf[e[j].offset + k];
+	    memcpy (&sum, &total[e[j].offset + k], sizeof (sum));
+	    memcpy (&part, &buf[e[j].offset + k], sizeof (part));
+	    sum += part;
+	    memcpy (&total[e[j].offset + k], &sum, sizeof (sum));
+	    break;
+	  }
+    }
+
+  hash = rb_hash_new ();
+  for (j = 0; j < n; j++)
+    {
+      if (e[j].kind == METRIC_COUNTER)
+	v = ULL2NUM (total[e[j].offset]);
+      else if (e[j].kind == METRIC_GAUGE)
+	v = LL2NUM ((int64_t)total[e[j].offset]);
+      else
+	{
+	  buckets = rb_ary_new2 (e[j].nbuckets + 1);
+	  for (count = 0, k = 0; k <= e[j].nbuckets; k++)
+	    {
+	      count += total[e[j].offset + k];
+	      rb_ary_push (buckets,
+			   rb_assoc_new (rb_float_new (k < e[j].nbuckets
+						       ? e[j].bounds[k]
+						       : HUGE_VAL),
+					 ULL2NUM (count)));
+	    }
+	  memcpy (&sum, &total[e[j].offset + k], sizeof (sum));
+	  v = rb_hash_new ();
+	  rb_hash_aset (v, ID2SYM (rb_intern ("count")), ULL2NUM (count));
+	  rb_hash_aset (v, ID2SYM (rb_intern ("sum")), rb_float_new (sum));
+	  rb_hash_aset (v, ID2SYM (rb_intern ("buckets")), buckets);
+	}
+      rb_hash_aset (hash, rb_str_new2 (e[j].name), v);
+    }
+  RB_GC_GUARD (tmp);
+
+  return hash;
+}
+
+/*
+ * RPC: requests and replies over SysV message queues.  A request is
+ * sent with the type of the service, 1 by default; its header carries
+ * an id, the type the client takes its replies with, unique to the
+ * client, and the deadline of the call, after which neither side
+ * bothers with it.  A client may have many requests outstanding and
+ * collect the replies in any order: those it is not waiting for yet
+ * are put aside.  A server takes requests in batches, as many as are
+ * queued up to its batch size, and answers them one by one.
+ *
+ * A body too long for a message goes through a slot of a shared
+ * memory arena, and the message only carries the number of the slot.
+ * The receiver copies the body out and frees the slot.
+ */
+
+#define RPC_ARENA_MAGIC 0x53565250	/* "SVRP" */
+#define RPC_MAX_TYPE 65535
+#define RPC_MAX_BATCH 1024
+
+enum { RPC_SHM = 1, RPC_ERROR = 2 };
+
+struct rpc_header {
+  uint32_t id;
+  uint32_t flags;
+  uint64_t reply_to;		/* mtype of the reply */
+  uint64_t deadline;		/* ipc_clock_ns (), 0 for none */
+  uint32_t slot;		/* of the body, with RPC_SHM */
+  uint32_t len;
+};
+
+struct rpc_arena {
+  uint32_t magic;
+  uint32_t nslots;
+  uint32_t slot_size;
+  uint32_t pad;
+};
+
+#define RPC_BUSY(arena) ((uint32_t *)((arena) + 1))
+#define RPC_SLOTS_OFFSET(n) \
+  IPC_ALIGN (sizeof (struct rpc_arena) + (size_t)(n) * 4, 4096)
+#define RPC_ARENA_BYTESIZE(n, size) \
+  (RPC_SLOTS_OFFSET (n) + (size_t)(n) * (size))
+
+struct rpc_ds {
+  VALUE mq;			/* of requests */
+  VALUE rmq;			/* of replies */
+  struct shm_region arena;	/* arena.shm is nil without one */
+  uint32_t nslots;
+  uint32_t slot_size;
+  long mtype;			/* of requests */
+  long reply_to;		/* clients: mtype of their replies */
+  pid_t pid;
+  uint32_t next_id;
+  size_t msgmax;
+  unsigned int batch;
+  unsigned long expired;
+  VALUE pending;		/* clients: id => reply not taken yet */
+  VALUE inflight;		/* clients: id => deadline */
+};
+
+static VALUE cRemoteError;
+static uint32_t rpc_channels;
+
+static void
+rpc_mark (r)
+     struct rpc_ds *r;
+{
+  ipc_gc_mark (r->mq);
+  ipc_gc_mark (r->rmq);
+  region_mark (&r->arena);
+  ipc_gc_mark (r->pending);
+  ipc_gc_mark (r->inflight);
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+rpc_compact (r)
+     struct rpc_ds *r;
+{
+  r->mq = ipc_gc_location (r->mq);
+  r->rmq = ipc_gc_location (r->rmq);
+  region_compact (&r->arena);
+  r->pending = ipc_gc_location (r->pending);
+  r->inflight = ipc_gc_location (r->inflight);
+}
+#endif
+
+static size_t
+rpc_memsize (ptr)
+     const void *ptr;
+{
+  return sizeof (struct rpc_ds);
+}
+
+static const rb_data_type_t rpc_data_type = {
+  "SystemVIPC::RPC",
+  { (void (*) (void *))rpc_mark, RUBY_TYPED_DEFAULT_FREE, rpc_memsize,
+    IPC_DCOMPACT ((void (*) (void *))rpc_compact), },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static void
+rpc_arena_opts (v_opts, nslots, slot_size)
+     VALUE v_opts;
+     uint32_t *nslots, *slot_size;
+{
+  VALUE v;
+
+  if (!NIL_P (v = xfer_opt (v_opts, "slots")))
+    *nslots = NUM2UINT (v);
+  if (!NIL_P (v = xfer_opt (v_opts, "slot_size")))
+    *slot_size = NUM2UINT (v);
+  if (!*nslots || !*slot_size)
+    rb_raise (cError, "slots and slot_size must be positive");
+  *slot_size = IPC_ALIGN (*slot_size, IPC_CACHELINE);
+}
+
+/*
+ * call-seq:
+ *   RPC.arena_bytesize(opts = {}) -> Integer
+ *
+ * Return the number of bytes of shared memory used by the arena of
+ * large bodies. <tt>opts[:slots]</tt> is the number of bodies in
+ * flight at once (default 16), <tt>opts[:slot_size]</tt> the size of
+ * the largest (default 64 KiB).
+ */
+
+static VALUE
+rb_rpc_s_arena_bytesize (argc, argv, mod)
+     int argc;
+     VALUE *argv, mod;
+{
+  VALUE v_opts;
+  uint32_t nslots = 16, slot_size = 65536;
+
+  rb_scan_args (argc, argv, "01", &v_opts);
+  rpc_arena_opts (v_opts, &nslots, &slot_size);
+  return SIZET2NUM (RPC_ARENA_BYTESIZE (nslots, slot_size));
+}
+
+/* Check that +v_mq+ is a SysV MessageQueue: POSIX ones have no types. */
+
+static VALUE
+rpc_queue (v_mq)
+     VALUE v_mq;
+{
+  struct ipcid_ds *msgid;
+
+  TypedData_Get_Struct (v_mq, struct ipcid_ds, &msg_data_type, msgid);
+  if (msgid->id < 0)
+    rb_raise (cError, "closed handle");
+  return v_mq;
+}
+
+static void
+rpc_init (r, v_mq, v_opts)
+     struct rpc_ds *r;
+     VALUE v_mq, v_opts;
+{
+  struct rpc_arena *arena;
+  size_t offset = 0;
+  VALUE v;
+
+  r->mq = r->rmq = rpc_queue (v_mq);
+  r->arena.shm = Qnil;
+  r->pending = r->inflight = Qnil;
+  r->mtype = 1;
+  r->msgmax = 8192;
+  r->batch = 32;
+  r->nslots = 16;
+  r->slot_size = 65536;
+
+  if (!NIL_P (v = xfer_opt (v_opts, "replies")))
+    r->rmq = rpc_queue (v);
+  if (!NIL_P (v = xfer_opt (v_opts, "mtype")))
+    r->mtype = NUM2LONG (v);
+  if (!NIL_P (v = xfer_opt (v_opts, "msgmax")))
+    r->msgmax = NUM2SIZET (v);
+  if (!NIL_P (v = xfer_opt (v_opts, "batch")))
+    r->batch = NUM2UINT (v);
+  if (r->mtype < 1 || r->mtype > RPC_MAX_TYPE)
+    rb_raise (cError, "mtype must be between 1 and %d", RPC_MAX_TYPE);
+  if (r->msgmax < sizeof (struct rpc_header))
+    rb_raise (cError, "msgmax too small");
+  if (!r->batch || r->batch > RPC_MAX_BATCH)
+    rb_raise (cError, "batch must be between 1 and %d", RPC_MAX_BATCH);
+
+  if (NIL_P (v = xfer_opt (v_opts, "arena")))
+    return;
+  if (!NIL_P (xfer_opt (v_opts, "offset")))
+    offset = NUM2SIZET (xfer_opt (v_opts, "offset"));
+  region_init (&r->arena, v, offset, sizeof (*arena));
+  arena = (struct rpc_arena *)region_ptr (&r->arena);
+  if (ATOMIC_LOAD_ACQ (&arena->magic) != RPC_ARENA_MAGIC)
+    {
+      rpc_arena_opts (v_opts, &r->nslots, &r->slot_size);
+      region_init (&r->arena, v, offset,
+		   RPC_ARENA_BYTESIZE (r->nslots, r->slot_size));
+      memset (arena, 0, RPC_SLOTS_OFFSET (r->nslots));
+      arena->nslots = r->nslots;
+      arena->slot_size = r->slot_size;
+      ATOMIC_STORE_REL (&arena->magic, RPC_ARENA_MAGIC);
+    }
+  r->nslots = arena->nslots;
+  r->slot_size = arena->slot_size;
+  region_init (&r->arena, v, offset,
+	       RPC_ARENA_BYTESIZE (r->nslots, r->slot_size));
+}
+
+static struct rpc_ds *
+get_rpc (obj)
+     VALUE obj;
+{
+  struct rpc_ds *r;
+
+  TypedData_Get_Struct (obj, struct rpc_ds, &rpc_data_type, r);
+  return r;
+}
+
+/*
+ * Claim a free slot of the arena, waiting for one until +expires+ if
+ * they are all taken.
+ */
+
+static uint32_t
+rpc_claim (r, expires)
+     struct rpc_ds *r;
+     uint64_t expires;
+{
+  struct timeval tv;
+  uint32_t *busy, i, start = r->next_id;
+
+  for (;;)
+    {
+      busy = RPC_BUSY ((struct rpc_arena *)region_ptr (&r->arena));
+      for (i = 0; i < r->nslots; i++)
+	if (!ATOMIC_LOAD (&busy[(start + i) % r->nslots])
+	    && ATOMIC_CAS (&busy[(start + i) % r->nslots], 0, 1))
+	  return (start + i) % r->nslots;
+      if (expires && ipc_clock_ns () >= expires)
+	rb_raise (cTimeoutError, "no free slot");
+      tv.tv_sec = 0;
+      tv.tv_usec = 100;
+      rb_thread_wait_for (tv);
+    }
+}
+
+static void
+rpc_release (r, slot)
+     struct rpc_ds *r;
+     uint32_t slot;
+{
+  ATOMIC_STORE_REL (&RPC_BUSY ((struct rpc_arena *)
+			       region_ptr (&r->arena))[slot], 0);
+}
+
+static VALUE
+rpc_call_protected (ptr)
+     VALUE ptr;
+{
+  ipc_call ((struct ipc_call *)ptr);
+  return Qnil;
+}
+
+/*
+ * Send +hdr+ and +v_body+ with type +mtype+ on +v_mq+, waiting at
+ * most until +expires+ for room. Return 0, or -1 with errno set to
+ * ETIMEDOUT.
+ */
+
+static int
+rpc_send (r, v_mq, mtype, hdr, v_body, expires)
+     struct rpc_ds *r;
+     VALUE v_mq;
+     long mtype;
+     struct rpc_header *hdr;
+     VALUE v_body;
+     uint64_t expires;
+{
+  struct ipcid_ds *msgid = get_ipcid (v_mq);
+  struct msgbuf *msgp;
+  struct ipc_call c;
+  size_t len = RSTRING_LEN (v_body), mlen = sizeof (*hdr);
+  int state = 0;
+  uint64_t t0;
+
+  hdr->len = (uint32_t)len;
+  if (sizeof (*hdr) + len <= r->msgmax)
+    mlen += len;
+  else if (NIL_P (r->arena.shm))
+    rb_raise (cError, "body longer than msgmax and no arena");
+  else if (len > r->slot_size)
+    rb_raise (cError, "body longer than slot_size");
+  else
+    {
+      hdr->flags |= RPC_SHM;
+      hdr->slot = rpc_claim (r, expires);
+      memcpy (region_ptr (&r->arena) + RPC_SLOTS_OFFSET (r->nslots)
+	      + (size_t)hdr->slot * r->slot_size, RSTRING_PTR (v_body), len);
+    }
+
+  msgp = (struct msgbuf *) ALLOCA_N (char, sizeof (long) + mlen);
+  msgp->mtype = mtype;
+  memcpy (msgp->mtext, hdr, sizeof (*hdr));
+  if (!(hdr->flags & RPC_SHM))
+    memcpy (msgp->mtext + sizeof (*hdr), RSTRING_PTR (v_body), len);
+
+  MEMZERO (&c, struct ipc_call, 1);
+  c.ipcid = msgid;
+  c.fn = call_msgsnd;
+  c.buf = msgp;
+  c.len = mlen;
+  c.expires = expires;
+
+  t0 = IPC_STATS_BEGIN (msgid);
+  if (hdr->flags & RPC_SHM)
+    {
+      rb_protect (rpc_call_protected, (VALUE)&c, &state);
+      if (state || c.ret == -1)
+	rpc_release (r, hdr->slot);
+      if (state)
+	rb_jump_tag (state);
+    }
+  else
+    ipc_call (&c);
+  if (c.ret == -1)
+    {
+      if (c.err == ETIMEDOUT)
+	{
+	  errno = ETIMEDOUT;
+	  return -1;
+	}
+      errno = c.err;
+      rb_sys_fail ("msgsnd(2)");
+    }
+  IPC_STATS_END (msgid, mlen, t0);
+  return 0;
+}
+
+/*
+ * Receive a message of type +mtype+ from +v_mq+ into +msgp+, waiting
+ * until +expires+, or not at all if +nowait+. Return its length, or
+ * -1 with errno set to ETIMEDOUT or ENOMSG.
+ */
+
+static long
+rpc_recv (r, v_mq, msgp, mtype, expires, nowait)
+     struct rpc_ds *r;
+     VALUE v_mq;
+     struct msgbuf *msgp;
+     long mtype;
+     uint64_t expires;
+     int nowait;
+{
+  struct ipcid_ds *msgid = get_ipcid (v_mq);
+  struct ipc_call c;
+  uint64_t t0;
+
+  MEMZERO (&c, struct ipc_call, 1);
+  c.ipcid = msgid;
+  c.fn = call_msgrcv;
+  c.buf = msgp;
+  c.len = r->msgmax;
+  c.type = mtype;
+  c.flags = nowait ? IPC_NOWAIT : 0;
+  c.nowait = nowait;
+  c.expires = expires;
+
+  t0 = IPC_STATS_BEGIN (msgid);
+  if (ipc_call (&c) == -1)
+    {
+      if (c.err == ETIMEDOUT || IPC_WOULD_BLOCK (c.err))
+	return -1;
+      rb_sys_fail ("msgrcv(2)");
+    }
+  IPC_STATS_END (msgid, c.ret, t0);
+  if ((size_t)c.ret < sizeof (struct rpc_header))
+    rb_raise (cError, "malformed message");
+  return c.ret;
+}
+
+/*
+ * Return the body of the message +msgp+ of length +mlen+ whose header
+ * is +hdr+, freeing its slot.
+ */
+
+static VALUE
+rpc_body (r, hdr, msgp, mlen)
+     struct rpc_ds *r;
+     struct rpc_header *hdr;
+     struct msgbuf *msgp;
+     long mlen;
+{
+  VALUE body;
+
+  if (!(hdr->flags & RPC_SHM))
+    {
+      if (hdr->len != mlen - sizeof (*hdr))
+	rb_raise (cError, "malformed message");
+      return rb_str_new (msgp->mtext + sizeof (*hdr), hdr->len);
+    }
+  if (NIL_P (r->arena.shm))
+    rb_raise (cError, "body in shared memory and no arena");
+  if (hdr->slot >= r->nslots || hdr->len > r->slot_size)
+    rb_raise (cError, "malformed message");
+  body = rb_str_new (region_ptr (&r->arena) + RPC_SLOTS_OFFSET (r->nslots)
+		     + (size_t)hdr->slot * r->slot_size, hdr->len);
+  rpc_release (r, hdr->slot);
+  return body;
+}
+
+static void
+rpc_discard (r, hdr)
+     struct rpc_ds *r;
+     struct rpc_header *hdr;
+{
+  if ((hdr->flags & RPC_SHM) && !NIL_P (r->arena.shm)
+      && hdr->slot < r->nslots)
+    rpc_release (r, hdr->slot);
+}
+
+/*
+ * Pick the mtype of the replies of a client, again in the child of a
+ * fork, where the requests of the parent are not outstanding.
+ */
+
+static void
+rpc_channel (r)
+     struct rpc_ds *r;
+{
+  pid_t pid = ipc_getpid ();
+  uint32_t n;
+
+  if (r->pid == pid)
+    return;
+  n = ATOMIC_FETCH_ADD (&rpc_channels, 1) & 0xffff;
+  r->pid = pid;
+  r->reply_to = (long)(((unsigned long)pid << 16 | n) & LONG_MAX);
+  if (r->reply_to <= RPC_MAX_TYPE)
+    r->reply_to += RPC_MAX_TYPE + 1;
+  rb_hash_clear (r->pending);
+  rb_hash_clear (r->inflight);
+}
+
+/*
+ * call-seq:
+ *   RPC::Client.new(mq, opts = {}) -> RPC::Client
+ *
+ * Return a client of the server taking requests from the
+ * MessageQueue +mq+. Options:
+ *
+ * [<tt>:mtype</tt>] the type of the requests, from 1 (the default) to
+ *                   65535.
+ * [<tt>:replies</tt>] the MessageQueue of the replies, +mq+ by
+ *                     default.
+ * [<tt>:msgmax</tt>] the longest message, header included (default
+ *                    8192); longer bodies go through the arena.
+ * [<tt>:arena</tt>] an attached SharedMemory for long bodies, with
+ *                   <tt>:offset</tt>, <tt>:slots</tt> and
+ *                   <tt>:slot_size</tt> as for RPC.arena_bytesize.
+ *                   The server must be given the same.
+ */
+
+static VALUE
+rb_rpc_client_s_new (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  struct rpc_ds *r;
+  VALUE dst, v_mq, v_opts;
+
+  rb_scan_args (argc, argv, "11", &v_mq, &v_opts);
+  dst = TypedData_Make_Struct (klass, struct rpc_ds, &rpc_data_type, r);
+  rpc_init (r, v_mq, v_opts);
+  r->pending = rb_hash_new ();
+  r->inflight = rb_hash_new ();
+  rpc_channel (r);
+
+  return dst;
+}
+
+/*
+ * call-seq:
+ *   request(body, timeout = nil) -> Integer
+ *
+ * Send the request +body+ and return its id, to be given to
+ * #response. The server drops the request, and the client its reply,
+ * once +timeout+ seconds have passed; sending waits as long for room
+ * in the queue, then raises TimeoutError.
+ */
+
+static VALUE
+rb_rpc_request (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct rpc_ds *r = get_rpc (obj);
+  struct rpc_header hdr;
+  VALUE v_body, v_timeout;
+
+  rb_scan_args (argc, argv, "11", &v_body, &v_timeout);
+  StringValue (v_body);
+  rpc_channel (r);
+
+  MEMZERO (&hdr, struct rpc_header, 1);
+  hdr.id = ++r->next_id;
+  hdr.reply_to = r->reply_to;
+  hdr.deadline = msg_expires (v_timeout);
+  if (rpc_send (r, r->mq, r->mtype, &hdr, v_body, hdr.deadline) == -1)
+    rb_raise (cTimeoutError, "queue full");
+  rb_hash_aset (r->inflight, UINT2NUM (hdr.id), ULL2NUM (hdr.deadline));
+
+  return UINT2NUM (hdr.id);
+}
+
+static VALUE
+rpc_result (v)
+     VALUE v;
+{
+  if (rb_obj_is_kind_of (v, rb_eException))
+    rb_exc_raise (v);
+  return v;
+}
+
+/*
+ * call-seq:
+ *   response(id, timeout = nil) -> String
+ *
+ * Wait for the reply to request +id+, putting aside the replies to
+ * other requests, and return it. Raise RPC::RemoteError if the server
+ * failed to handle the request. Raise TimeoutError once +timeout+
+ * seconds have passed, or the deadline of the request: in that case
+ * the request is forgotten.
+ */
+
+static VALUE
+rb_rpc_response (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct rpc_ds *r = get_rpc (obj);
+  struct rpc_header hdr;
+  struct msgbuf *msgp;
+  VALUE v_id, v_timeout, v, key;
+  uint64_t deadline, expires;
+  uint32_t id;
+  long mlen;
+
+  rb_scan_args (argc, argv, "11", &v_id, &v_timeout);
+  id = NUM2UINT (v_id);
+  rpc_channel (r);
+  v = rb_hash_delete (r->pending, UINT2NUM (id));
+  if (!NIL_P (v))
+    return rpc_result (v);
+  v = rb_hash_aref (r->inflight, UINT2NUM (id));
+  if (NIL_P (v))
+    rb_raise (cError, "no request %u outstanding", id);
+  deadline = NUM2ULL (v);
+  expires = msg_expires (v_timeout);
+  if (!expires || (deadline && deadline < expires))
+    expires = deadline;
+
+  msgp = (struct msgbuf *) ALLOCA_N (char, sizeof (long) + r->msgmax);
+  for (;;)
+    {
+      mlen = rpc_recv (r, r->rmq, msgp, r->reply_to, expires, 0);
+      if (mlen == -1)
+	{
+	  if (deadline && ipc_clock_ns () >= deadline)
+	    rb_hash_delete (r->inflight, UINT2NUM (id));
+	  rb_raise (cTimeoutError, "no reply");
+	}
+      memcpy (&hdr, msgp->mtext, sizeof (hdr));
+      key = UINT2NUM (hdr.id);
+      if (NIL_P (rb_hash_delete (r->inflight, key)))
+	{
+	  rpc_discard (r, &hdr);
+	  continue;
+	}
+      v = rpc_body (r, &hdr, msgp, mlen);
+      if (hdr.flags & RPC_ERROR)
+	v = rb_exc_new3 (cRemoteError, v);
+      if (hdr.id == id)
+	return rpc_result (v);
+      rb_hash_aset (r->pending, key, v);
+    }
+}
+
+/*
+ * call-seq:
+ *   call(body, timeout = nil) -> String
+ *
+ * Send the request +body+ and wait for its reply, as #request then
+ * #response.
+ */
+
+static VALUE
+rb_rpc_call (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  VALUE v_id = rb_rpc_request (argc, argv, obj);
+  return rb_rpc_response (1, &v_id, obj);
+}
+
+/*
+ * call-seq:
+ *   outstanding -> Integer
+ *
+ * Return the number of requests whose replies have not been taken
+ * with #response.
+ */
+
+static VALUE
+rb_rpc_outstanding (obj)
+     VALUE obj;
+{
+  struct rpc_ds *r = get_rpc (obj);
+
+  rpc_channel (r);
+  return SIZET2NUM (RHASH_SIZE (r->inflight) + RHASH_SIZE (r->pending));
+}
+
+/*
+ * call-seq:
+ *   RPC::Server.new(mq, opts = {}) -> RPC::Server
+ *
+ * Return a server of the requests sent to the MessageQueue +mq+, with
+ * the options of RPC::Client.new, and <tt>:batch</tt>, the largest
+ * number of requests taken at once (default 32).
+ */
+
+static VALUE
+rb_rpc_server_s_new (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  struct rpc_ds *r;
+  VALUE dst, v_mq, v_opts;
+
+  rb_scan_args (argc, argv, "11", &v_mq, &v_opts);
+  dst = TypedData_Make_Struct (klass, struct rpc_ds, &rpc_data_type, r);
+  rpc_init (r, v_mq, v_opts);
+
+  return dst;
+}
+
+static VALUE
+rpc_yield (v_body)
+     VALUE v_body;
+{
+  VALUE v = rb_yield (v_body);
+
+  StringValue (v);
+  return v;
+}
+
+static VALUE
+rpc_rescue (ptr, err)
+     VALUE ptr, err;
+{
+  VALUE v = rb_str_dup (rb_class_name (CLASS_OF (err)));
+
+  *(int *)ptr = 1;
+  rb_str_cat2 (v, ": ");
+  return rb_str_append (v, rb_obj_as_string (err));
+}
+
+/*
+ * Take one batch of requests, waiting until +expires+ for the first,
+ * and answer them. Return how many were answered.
+ */
+
+static long
+rpc_serve_batch (r, expires)
+     struct rpc_ds *r;
+     uint64_t expires;
+{
+  struct rpc_header *reqs, hdr;
+  struct msgbuf *msgp;
+  VALUE bodies = rb_ary_new (), v;
+  unsigned int i, n = 0;
+  long mlen, count = 0;
+  int failed;
+
+  reqs = ALLOCA_N (struct rpc_header, r->batch);
+  msgp = (struct msgbuf *) ALLOCA_N (char, sizeof (long) + r->msgmax);
+  for (i = 0; i < r->batch; i++)
+    {
+      mlen = rpc_recv (r, r->mq, msgp, r->mtype, i ? 0 : expires, i > 0);
+      if (mlen == -1)
+	break;
+      memcpy (&reqs[n], msgp->mtext, sizeof (reqs[n]));
+      if (reqs[n].deadline && ipc_clock_ns () >= reqs[n].deadline)
+	{
+	  rpc_discard (r, &reqs[n]);
+	  r->expired++;
+	  continue;
+	}
+      rb_ary_push (bodies, rpc_body (r, &reqs[n], msgp, mlen));
+      n++;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      failed = 0;
+      v = rb_rescue2 (rpc_yield, rb_ary_entry (bodies, i),
+		      rpc_rescue, (VALUE)&failed, rb_eStandardError, 0);
+      MEMZERO (&hdr, struct rpc_header, 1);
+      hdr.flags = failed ? RPC_ERROR : 0;
+      hdr.id = reqs[i].id;
+      hdr.deadline = reqs[i].deadline;
+      if (!reqs[i].reply_to || reqs[i].reply_to > (uint64_t)LONG_MAX
+	  || rpc_send (r, r->rmq, (long)reqs[i].reply_to, &hdr, v,
+		       reqs[i].deadline) == -1)
+	r->expired++;
+      else
+	count++;
+    }
+  RB_GC_GUARD (bodies);
+
+  return count;
+}
+
+/*
+ * call-seq:
+ *   serve_once(timeout = nil) { |body| ... } -> Integer
+ *
+ * Wait at most +timeout+ seconds for a request, then take it and
+ * those queued behind it, up to the batch size, and reply to each
+ * with the String the block returns for its body. A StandardError
+ * raised by the block is sent back as RPC::RemoteError; any other
+ * exception, or +break+, leaves the rest of the batch unanswered.
+ * Requests past their deadline are dropped. Return the number of
+ * requests answered.
+ */
+
+static VALUE
+rb_rpc_serve_once (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  VALUE v_timeout;
+
+  rb_scan_args (argc, argv, "01", &v_timeout);
+  rb_need_block ();
+  return LONG2NUM (rpc_serve_batch (get_rpc (obj), msg_expires (v_timeout)));
+}
+
+/*
+ * call-seq:
+ *   serve { |body| ... }
+ *
+ * Answer requests as #serve_once does, until the block breaks out or
+ * raises an exception that is not a StandardError.
+ */
+
+static VALUE
+rb_rpc_serve (obj)
+     VALUE obj;
+{
+  rb_need_block ();
+  for (;;)
+    rpc_serve_batch (get_rpc (obj), 0);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   expired -> Integer
+ *
+ * Return the number of requests dropped because their deadline had
+ * passed before they were answered.
+ */
+
+static VALUE
+rb_rpc_expired (obj)
+     VALUE obj;
+{
+  return ULONG2NUM (get_rpc (obj)->expired);
+}
+
+/*
+ * TaskPool: work stealing between processes.  Every worker owns a
+ * Chase-Lev deque of 64-bit tasks in shared memory: it pushes and
+ * pops at the bottom without atomic read-modify-write, except for
+ * the last task, while idle workers steal from the top with a CAS.
+ * Workers with nothing to do sleep on a futex word that pushes bump
+ * when someone sleeps.
+ *
+ * The pool is done once it is closed, no worker is busy and every
+ * deque is empty.  A worker counts as busy from the time it goes
+ * looking for a task until it finds none, so a task is only ever
+ * moved by a busy worker.  Each worker keeps its busy flag with its
+ * deque, so that it carries over to another handle; the count of
+ * busy workers shares a word with the number of times it went up,
+ * and an idle worker that sees the same word with no one busy before
+ * and after finding every deque empty knows no task can appear any
+ * more.
+ */
+
+#define TASKPOOL_MAGIC 0x53565450	/* "SVTP" */
+#define TASKPOOL_MAX_CAPACITY (1U << 30)
+#define TASKPOOL_BUSY (((uint64_t)1 << 32) + 1)
+
+struct taskpool_header {
+  uint32_t magic;
+  uint32_t workers;
+  uint32_t capacity;
+  uint32_t closed;
+  uint32_t done;
+  uint32_t signal;		/* futex word of sleeping workers */
+  uint32_t sleepers;
+  uint32_t pad;
+  uint64_t state;		/* busy workers, and times one got busy << 32 */
+  char pad2[IPC_CACHELINE - 40];
+};
+
+struct taskpool_deque {
+  int64_t top;
+  char pad[IPC_CACHELINE - 8];
+  int64_t bottom;
+  uint32_t owner;		/* pid of the last process to use it */
+  uint32_t busy;
+  char pad2[IPC_CACHELINE - 16];
+};
+
+#define TASKPOOL_STRIDE(capacity) \
+  (sizeof (struct taskpool_deque) + (size_t)(capacity) * 8)
+#define TASKPOOL_BYTESIZE(workers, capacity) \
+  (sizeof (struct taskpool_header) \
+   + (size_t)(workers) * TASKPOOL_STRIDE (capacity))
+#define TASKPOOL_DEQUE(hdr, capacity, i)				\
+  ((struct taskpool_deque *)((char *)((hdr) + 1)			\
+			     + (size_t)(i) * TASKPOOL_STRIDE (capacity)))
+#define TASKPOOL_TASKS(d) ((uint64_t *)((d) + 1))
+
+struct taskpool_ds {
+  struct shm_region region;
+  uint32_t workers;
+  uint32_t capacity;
+};
+
+struct taskpool_worker_ds {
+  struct shm_region region;
+  uint32_t index;
+  uint32_t workers;
+  uint32_t capacity;
+  uint32_t rand;		/* picks the first victim */
+  unsigned long steals;
+};
+
+static size_t
+taskpool_memsize (ptr)
+     const void *ptr;
+{
+  return sizeof (struct taskpool_ds);
+}
+
+static const rb_data_type_t taskpool_data_type = {
+  "SystemVIPC::TaskPool",
+  { (void (*) (void *))region_mark, RUBY_TYPED_DEFAULT_FREE, taskpool_memsize,
+    IPC_DCOMPACT ((void (*) (void *))region_compact), },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static size_t
+taskpool_worker_memsize (ptr)
+     const void *ptr;
+{
+  return sizeof (struct taskpool_worker_ds);
+}
+
+static const rb_data_type_t taskpool_worker_data_type = {
+  "SystemVIPC::TaskPool::Worker",
+  { (void (*) (void *))region_mark, RUBY_TYPED_DEFAULT_FREE,
+    taskpool_worker_memsize,
+    IPC_DCOMPACT ((void (*) (void *))region_compact), },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static void
+taskpool_opts (v_opts, workers, capacity)
+     VALUE v_opts;
+     uint32_t *workers, *capacity;
+{
+  VALUE v;
+
+  if (!NIL_P (v = xfer_opt (v_opts, "workers")))
+    *workers = NUM2UINT (v);
+  if (!NIL_P (v = xfer_opt (v_opts, "capacity")))
+    *capacity = NUM2UINT (v);
+  if (!*workers)
+    rb_raise (cError, "workers must be positive");
+  if (*capacity < 2 || *capacity > TASKPOOL_MAX_CAPACITY
+      || (*capacity & (*capacity - 1)))
+    rb_raise (cError, "capacity must be a power of 2");
+}
+
+/*
+ * Return the bytes used by a pool, checking that they do not wrap
+ * around.
+ */
+
+static size_t
+taskpool_bytesize (workers, capacity)
+     uint32_t workers, capacity;
+{
+#if SIZE_MAX <= UINT32_MAX
+  if (capacity > (SIZE_MAX - sizeof (struct taskpool_deque)) / 8)
+    rb_raise (cError, "pool too large");
+#endif
+  if (workers > (SIZE_MAX - sizeof (struct taskpool_header))
+      / TASKPOOL_STRIDE (capacity))
+    rb_raise (cError, "pool too large");
+  return TASKPOOL_BYTESIZE (workers, capacity);
+}
+
+/*
+ * call-seq:
+ *   TaskPool.bytesize(opts = {}) -> Integer
+ *
+ * Return the number of bytes of shared memory used by a TaskPool of
+ * <tt>opts[:workers]</tt> workers (default 64), each holding up to
+ * <tt>opts[:capacity]</tt> tasks (default 1024, a power of 2).
+ */
+
+static VALUE
+rb_taskpool_s_bytesize (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  VALUE v_opts;
+  uint32_t workers = 64, capacity = 1024;
+
+  rb_scan_args (argc, argv, "01", &v_opts);
+  taskpool_opts (v_opts, &workers, &capacity);
+  return SIZET2NUM (taskpool_bytesize (workers, capacity));
+}
+
+/*
+ * call-seq:
+ *   TaskPool.new(shm, offset = 0, opts = nil) -> TaskPool
+ *
+ * Return the TaskPool stored in the attached SharedMemory +shm+ at
+ * +offset+. If +opts+ is given and no pool has been set up there yet,
+ * make an empty one sized by +opts+ as for TaskPool.bytesize;
+ * otherwise use the existing one.
+ */
+
+static VALUE
+rb_taskpool_s_new (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  struct taskpool_ds *pool;
+  struct taskpool_header *hdr;
+  VALUE dst, v_shm, v_offset, v_opts;
+  size_t offset = 0, size;
+  uint32_t workers = 64, capacity = 1024;
+
+  rb_scan_args (argc, argv, "12", &v_shm, &v_offset, &v_opts);
+  if (!NIL_P (v_offset))
+    offset = NUM2SIZET (v_offset);
+
+  dst = TypedData_Make_Struct (klass, struct taskpool_ds,
+			       &taskpool_data_type, pool);
+  region_init (&pool->region, v_shm, offset, sizeof (*hdr));
+  hdr = (struct taskpool_header *)region_ptr (&pool->region);
+
+  if (ATOMIC_LOAD_ACQ (&hdr->magic) != TASKPOOL_MAGIC)
+    {
+      if (NIL_P (v_opts))
+	rb_raise (cError, "no task pool");
+      taskpool_opts (v_opts, &workers, &capacity);
+      size = taskpool_bytesize (workers, capacity);
+      region_init (&pool->region, v_shm, offset, size);
+      memset (hdr, 0, size);
+      hdr->workers = workers;
+      hdr->capacity = capacity;
+      ATOMIC_STORE_REL (&hdr->magic, TASKPOOL_MAGIC);
+    }
+
+  pool->workers = hdr->workers;
+  pool->capacity = hdr->capacity;
+  /* the header is shared memory: check it before trusting it */
+  if (!pool->workers || pool->capacity < 2
+      || pool->capacity > TASKPOOL_MAX_CAPACITY
+      || (pool->capacity & (pool->capacity - 1)))
+    rb_raise (cError, "corrupt header");
+  region_init (&pool->region, v_shm, offset,
+	       taskpool_bytesize (pool->workers, pool->capacity));
+
+  return dst;
+}
+
+static struct taskpool_header *
+get_taskpool (obj, pool)
+     VALUE obj;
+     struct taskpool_ds **pool;
+{
+  TypedData_Get_Struct (obj, struct taskpool_ds, &taskpool_data_type, *pool);
+  return (struct taskpool_header *)region_ptr (&(*pool)->region);
+}
+
+static struct taskpool_header *
+get_taskpool_worker (obj, w)
+     VALUE obj;
+     struct taskpool_worker_ds **w;
+{
+  TypedData_Get_Struct (obj, struct taskpool_worker_ds,
+			&taskpool_worker_data_type, *w);
+  return (struct taskpool_header *)region_ptr (&(*w)->region);
+}
+
+/*
+ * call-seq:
+ *   worker(index) -> TaskPool::Worker
+ *
+ * Return the handle of worker +index+, from 0 to the number of
+ * workers less 1. Only one process at a time may use the handle of a
+ * worker; the usual way is to seed the deques before forking, then
+ * have child i use worker(i).
+ */
+
+static VALUE
+rb_taskpool_worker (obj, v_index)
+     VALUE obj, v_index;
+{
+  struct taskpool_ds *pool;
+  struct taskpool_worker_ds *w;
+  uint32_t index = NUM2UINT (v_index);
+  VALUE dst;
+
+  get_taskpool (obj, &pool);
+  if (index >= pool->workers)
+    rb_raise (rb_eIndexError, "no worker %u", index);
+
+  dst = TypedData_Make_Struct (rb_const_get (CLASS_OF (obj),
+					     rb_intern ("Worker")),
+			       struct taskpool_worker_ds,
+			       &taskpool_worker_data_type, w);
+  w->region = pool->region;
+  w->index = index;
+  w->workers = pool->workers;
+  w->capacity = pool->capacity;
+  w->rand = index * 2654435761U + 1;
+
+  return dst;
+}
+
+static void
+taskpool_wake (hdr, all)
+     struct taskpool_header *hdr;
+     int all;
+{
+  ATOMIC_FETCH_ADD (&hdr->signal, 1);
+  if (all)
+    ipc_futex_wake (&hdr->signal);
+  else
+    ipc_futex_wake_one (&hdr->signal);
+}
+
+/*
+ * call-seq:
+ *   close -> TaskPool
+ *
+ * Tell the workers no more tasks come from outside: once the last
+ * task is done, Worker#pop returns nil in every worker.
+ */
+
+static VALUE
+rb_taskpool_close (obj)
+     VALUE obj;
+{
+  struct taskpool_ds *pool;
+  struct taskpool_header *hdr = get_taskpool (obj, &pool);
+
+  ATOMIC_STORE (&hdr->closed, 1);
+  taskpool_wake (hdr, 1);
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   done? -> true or false
+ *
+ * Return whether the pool is closed and every task has been done.
+ */
+
+static VALUE
+rb_taskpool_done_p (obj)
+     VALUE obj;
+{
+  struct taskpool_ds *pool;
+
+  return ATOMIC_LOAD (&get_taskpool (obj, &pool)->done) ? Qtrue : Qfalse;
+}
+
+static int64_t
+taskpool_deque_size (d)
+     struct taskpool_deque *d;
+{
+  int64_t n = ATOMIC_LOAD_ACQ (&d->bottom) - ATOMIC_LOAD_ACQ (&d->top);
+  return n > 0 ? n : 0;
+}
+
+/*
+ * call-seq:
+ *   size -> Integer
+ *
+ * Return the number of tasks waiting in all deques, as seen one deque
+ * after the other.
+ */
+
+static VALUE
+rb_taskpool_size (obj)
+     VALUE obj;
+{
+  struct taskpool_ds *pool;
+  struct taskpool_header *hdr = get_taskpool (obj, &pool);
+  int64_t n = 0;
+  uint32_t i;
+
+  for (i = 0; i < pool->workers; i++)
+    n += taskpool_deque_size (TASKPOOL_DEQUE (hdr, pool->capacity, i));
+  return LL2NUM (n);
+}
+
+/*
+ * call-seq:
+ *   push(task) -> TaskPool::Worker
+ *
+ * Push +task+, an Integer from 0 to 2**64 - 1, such as an index or an
+ * offset into shared memory, onto the deque of this worker. Raise
+ * Error if it is full.
+ */
+
+static VALUE
+rb_taskpool_push (obj, v_task)
+     VALUE obj, v_task;
+{
+  struct taskpool_worker_ds *w;
+  struct taskpool_header *hdr = get_taskpool_worker (obj, &w);
+  struct taskpool_deque *d = TASKPOOL_DEQUE (hdr, w->capacity, w->index);
+  uint64_t task = NUM2ULL (v_task);
+  int64_t b, t;
+
+  b = ATOMIC_LOAD (&d->bottom);
+  t = ATOMIC_LOAD_ACQ (&d->top);
+  if (b - t >= (int64_t)w->capacity)
+    rb_raise (cError, "deque full");
+  ATOMIC_STORE (&TASKPOOL_TASKS (d)[b & (w->capacity - 1)], task);
+  ATOMIC_STORE_REL (&d->bottom, b + 1);
+
+  ATOMIC_FENCE ();
+  if (ATOMIC_LOAD (&hdr->sleepers))
+    taskpool_wake (hdr, 0);
+  return obj;
+}
+
+/* Take the task at the bottom of the deque of the owner. */
+
+static int
+taskpool_take (w, d, task)
+     struct taskpool_worker_ds *w;
+     struct taskpool_deque *d;
+     uint64_t *task;
+{
+  int64_t b, t;
+  int ok = 1;
+
+  b = ATOMIC_LOAD (&d->bottom) - 1;
+  ATOMIC_STORE (&d->bottom, b);
+  ATOMIC_FENCE ();
+  t = ATOMIC_LOAD (&d->top);
+  if (t > b)
+    {
+      ATOMIC_STORE (&d->bottom, b + 1);
+      return 0;
+    }
+  *task = ATOMIC_LOAD (&TASKPOOL_TASKS (d)[b & (w->capacity - 1)]);
+  if (t == b)
+    {
+      ok = ATOMIC_CAS (&d->top, t, t + 1);
+      ATOMIC_STORE (&d->bottom, b + 1);
+    }
+  return ok;
+}
+
+/* Steal the task at the top of the deque of another worker. */
+
+static int
+taskpool_steal (w, d, task)
+     struct taskpool_worker_ds *w;
+     struct taskpool_deque *d;
+     uint64_t *task;
+{
+  int64_t b, t;
+
+  for (;;)
+    {
+      t = ATOMIC_LOAD_ACQ (&d->top);
+      ATOMIC_FENCE ();
+      b = ATOMIC_LOAD_ACQ (&d->bottom);
+      if (t >= b)
+	return 0;
+      *task = ATOMIC_LOAD (&TASKPOOL_TASKS (d)[t & (w->capacity - 1)]);
+      if (ATOMIC_CAS (&d->top, t, t + 1))
+	return 1;
+      IPC_CPU_RELAX ();
+    }
+}
+
+static int
+taskpool_find (w, hdr, task)
+     struct taskpool_worker_ds *w;
+     struct taskpool_header *hdr;
+     uint64_t *task;
+{
+  uint32_t i, victim;
+
+  if (taskpool_take (w, TASKPOOL_DEQUE (hdr, w->capacity, w->index), task))
+    return 1;
+  w->rand ^= w->rand << 13;
+  w->rand ^= w->rand >> 17;
+  w->rand ^= w->rand << 5;
+  for (i = 0; i < w->workers; i++)
+    {
+      victim = (w->rand + i) % w->workers;
+      if (victim != w->index
+	  && taskpool_steal (w, TASKPOOL_DEQUE (hdr, w->capacity, victim),
+			     task))
+	{
+	  w->steals++;
+	  return 1;
+	}
+    }
+  return 0;
+}
+
+static int
+taskpool_empty (w, hdr)
+     struct taskpool_worker_ds *w;
+     struct taskpool_header *hdr;
+{
+  uint32_t i;
+
+  for (i = 0; i < w->workers; i++)
+    if (taskpool_deque_size (TASKPOOL_DEQUE (hdr, w->capacity, i)))
+      return 0;
+  return 1;
+}
+
+/*
+ * A worker sleeps counted in sleepers, which is given back even when
+ * an interrupt raises out of the wait.
+ */
+
+struct taskpool_sleep {
+  struct taskpool_worker_ds *w;
+  struct taskpool_header *hdr;
+  uint32_t signal;
+  uint64_t deadline;
+  int woken;
+};
+
+static VALUE
+taskpool_sleep (arg)
+     VALUE arg;
+{
+  struct taskpool_sleep *s = (struct taskpool_sleep *)arg;
+
+  if (taskpool_empty (s->w, s->hdr))
+    s->woken = ipc_wait (s->w->region.shmid, &s->hdr->signal, s->signal,
+			 s->deadline);
+  return Qnil;
+}
+
+static VALUE
+taskpool_sleep_done (arg)
+     VALUE arg;
+{
+  struct taskpool_sleep *s = (struct taskpool_sleep *)arg;
+
+  ATOMIC_FETCH_ADD (&s->hdr->sleepers, -1);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   pop(timeout = nil) -> Integer or nil
+ *
+ * Return the newest task of this worker, or else the oldest task of
+ * another one. If there are none, sleep until a task is pushed, for
+ * at most +timeout+ seconds (forever if nil). Return nil on timeout,
+ * or once the pool is done; see TaskPool#close.
+ */
+
+static VALUE
+rb_taskpool_pop (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct taskpool_worker_ds *w;
+  struct taskpool_header *hdr;
+  struct taskpool_deque *d;
+  struct taskpool_sleep s;
+  VALUE v_timeout;
+  uint64_t task, state, deadline = 0;
+  uint32_t signal;
+
+  rb_scan_args (argc, argv, "01", &v_timeout);
+  hdr = get_taskpool_worker (obj, &w);
+  d = TASKPOOL_DEQUE (hdr, w->capacity, w->index);
+  ATOMIC_STORE (&d->owner, (uint32_t)ipc_getpid ());
+
+  for (;;)
+    {
+      if (ATOMIC_LOAD (&hdr->done))
+	return Qnil;
+      if (!d->busy)
+	{
+	  ATOMIC_FETCH_ADD (&hdr->state, TASKPOOL_BUSY);
+	  d->busy = 1;
+	}
+      if (taskpool_find (w, hdr, &task))
+	return ULL2NUM (task);
+
+      /* a close or push after this is seen by ipc_wait */
+      ATOMIC_FETCH_ADD (&hdr->state, (uint64_t)-1);
+      d->busy = 0;
+      signal = ATOMIC_LOAD (&hdr->signal);
+      state = ATOMIC_LOAD (&hdr->state);
+      if (ATOMIC_LOAD (&hdr->closed) && !(uint32_t)state
+	  && taskpool_empty (w, hdr) && ATOMIC_LOAD (&hdr->state) == state)
+	{
+	  ATOMIC_STORE (&hdr->done, 1);
+	  taskpool_wake (hdr, 1);
+	  return Qnil;
+	}
+
+      if (!deadline)
+	deadline = ipc_deadline (ipc_timeout_ns (v_timeout));
+      s.w = w;
+      s.hdr = hdr;
+      s.signal = signal;
+      s.deadline = deadline;
+      s.woken = 1;
+      ATOMIC_FETCH_ADD (&hdr->sleepers, 1);
+      ATOMIC_FENCE ();
+      rb_ensure (taskpool_sleep, (VALUE)&s, taskpool_sleep_done, (VALUE)&s);
+      if (!s.woken)
+	return Qnil;
+      hdr = get_taskpool_worker (obj, &w);
+      d = TASKPOOL_DEQUE (hdr, w->capacity, w->index);
+    }
+}
+
+/*
+ * call-seq:
+ *   index -> Integer
+ *
+ * Return the index of this worker.
+ */
+
+static VALUE
+rb_taskpool_index (obj)
+     VALUE obj;
+{
+  struct taskpool_worker_ds *w;
+
+  get_taskpool_worker (obj, &w);
+  return UINT2NUM (w->index);
+}
+
+/*
+ * call-seq:
+ *   steals -> Integer
+ *
+ * Return the number of tasks this handle took from other workers.
+ */
+
+static VALUE
+rb_taskpool_steals (obj)
+     VALUE obj;
+{
+  struct taskpool_worker_ds *w;
+
+  get_taskpool_worker (obj, &w);
+  return ULONG2NUM (w->steals);
+}
+
+/*
+ * Searching and comparing attached segments in place, without copying
+ * the range out to a String.  Ranges of a MiB and more are scanned
+ * without the interpreter lock.
+ */
+
+enum { SCAN_INDEX, SCAN_COMPARE, SCAN_CHECKSUM, SCAN_DIFF };
+
+struct scan_arg {
+  int op;
+  const char *a;
+  const char *b;		/* needle, or the other side */
+  size_t len;
+  size_t blen;
+  size_t block_size;
+  size_t result;
+  int cmp;
+  uint32_t crc;
+  size_t *ranges;		/* SCAN_DIFF: offset, length pairs */
+  size_t nranges;
+  size_t cap;
+};
+
+static const char *
+scan_memmem (hay, hlen, needle, nlen)
+     const char *hay, *needle;
+     size_t hlen, nlen;
+{
+#ifdef HAVE_MEMMEM
+  return memmem (hay, hlen, needle, nlen);
+#else
+  const char *p, *end;
+
+  if (!nlen)
+    return hay;
+  if (nlen > hlen)
+    return NULL;
+  for (p = hay, end = hay + hlen - nlen + 1;
+       (p = memchr (p, needle[0], end - p)); p++)
+    if (!memcmp (p, needle, nlen))
+      return p;
+  return NULL;
+#endif
+}
+
+static void *
+scan_run (ptr)
+     void *ptr;
+{
+  struct scan_arg *s = ptr;
+  const char *p;
+  size_t pos, n;
+
+  switch (s->op)
+    {
+    case SCAN_INDEX:
+      p = scan_memmem (s->a, s->len, s->b, s->blen);
+      s->result = p ? (size_t)(p - s->a) : (size_t)-1;
+      break;
+    case SCAN_COMPARE:
+      s->cmp = memcmp (s->a, s->b, s->len);
+      break;
+    case SCAN_CHECKSUM:
+      s->crc = crc32c (0, s->a, s->len);
+      break;
+    case SCAN_DIFF:
+      for (pos = 0; pos < s->len; pos += n)
+	{
+	  n = s->len - pos < s->block_size ? s->len - pos : s->block_size;
+	  if (!memcmp (s->a + pos, s->b + pos, n))
+	    continue;
+	  if (s->nranges && s->ranges[2 * s->nranges - 2]
+	      + s->ranges[2 * s->nranges - 1] == pos)
+	    s->ranges[2 * s->nranges - 1] += n;
+	  else
+	    {
+	      if (s->nranges == s->cap)
+		{
+		  size_t *r = realloc (s->ranges, (s->cap * 2 + 16)
+				       * 2 * sizeof (size_t));
+		  if (!r)
+		    {
+		      s->result = (size_t)-1;
+		      return 0;
+		    }
+		  s->ranges = r;
+		  s->cap = s->cap * 2 + 16;
+		}
+	      s->ranges[2 * s->nranges] = pos;
+	      s->ranges[2 * s->nranges + 1] = n;
+	      s->nranges++;
+	    }
+	}
+      break;
+    }
+  return 0;
+}
+
+/*
+ * Run the scan +s+ over the segment of +obj+ and +v_other+, nil, a
+ * String or another SharedMemory.
+ */
+
+static void
+shm_scan (s, obj, v_other)
+     struct scan_arg *s;
+     VALUE obj, v_other;
+{
+  int str = RB_TYPE_P (v_other, T_STRING);
+
+  if (s->len < COPY_NOGVL_MIN)
+    {
+      scan_run (s);
+      return;
+    }
+  shm_blocking (get_ipcid (obj),
+		NIL_P (v_other) || str ? NULL : get_ipcid (v_other),
+		str ? v_other : Qnil, scan_run, s);
+}
+
+/*
+ * Return the +len+ bytes at +offset+ of +obj+, the rest of the
+ * segment if +v_len+ is nil.
+ */
+
+static char *
+shm_span (obj, v_offset, v_len, len)
+     VALUE obj, v_offset, v_len;
+     size_t *len;
+{
+  struct ipcid_ds *shmid = get_ipcid (obj);
+  size_t offset = NIL_P (v_offset) ? 0 : NUM2SIZET (v_offset);
+
+  if (offset > shmid->attached)
+    rb_raise (cError, "invalid shm_segsz");
+  *len = NIL_P (v_len) ? shmid->attached - offset : NUM2SIZET (v_len);
+  return shm_range (shmid, offset, *len);
+}
+
+/*
+ * Return the bytes of +v_other+, a String or a SharedMemory, from
+ * +offset+ on, and their number in +len+.
+ */
+
+static const char *
+shm_other (v_other, offset, len)
+     VALUE v_other;
+     size_t offset, *len;
+{
+  struct ipcid_ds *shmid;
+
+  if (RB_TYPE_P (v_other, T_STRING))
+    {
+      *len = RSTRING_LEN (v_other);
+      return RSTRING_PTR (v_other);
+    }
+  shmid = get_ipcid (v_other);
+  if (!shmid->data)
+    rb_raise (cError, "detached memory");
+  if (offset > shmid->attached)
+    rb_raise (cError, "invalid shm_segsz");
+  *len = shmid->attached - offset;
+  return (const char *)shmid->data + offset;
+}
+
+/*
+ * call-seq:
+ *   index(bytes, opts = {}) -> Integer or nil
+ *
+ * Return the offset of the first occurrence of the String +bytes+ in
+ * the segment, at or after <tt>opts[:offset]</tt> (default 0) and
+ * ending within <tt>opts[:limit]</tt> bytes of it (default the rest
+ * of the segment), or nil if there is none.
+ */
+
+static VALUE
+rb_shm_index (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct scan_arg s;
+  VALUE v_bytes, v_opts, v_offset;
+  size_t offset;
+
+  rb_scan_args (argc, argv, "11", &v_bytes, &v_opts);
+  StringValue (v_bytes);
+  if (!NIL_P (v_opts))
+    Check_Type (v_opts, T_HASH);
+  v_offset = xfer_opt (v_opts, "offset");
+  offset = NIL_P (v_offset) ? 0 : NUM2SIZET (v_offset);
+
+  MEMZERO (&s, struct scan_arg, 1);
+  s.op = SCAN_INDEX;
+  s.a = shm_span (obj, v_offset, xfer_opt (v_opts, "limit"), &s.len);
+  s.b = RSTRING_PTR (v_bytes);
+  s.blen = RSTRING_LEN (v_bytes);
+  shm_scan (&s, obj, v_bytes);
+
+  return s.result == (size_t)-1 ? Qnil : SIZET2NUM (offset + s.result);
+}
+
+/*
+ * call-seq:
+ *   compare(other, offset = 0, len = nil) -> -1, 0 or 1
+ *
+ * Compare +len+ bytes of the segment at +offset+ with +other+, as
+ * memcmp(3) does: a String, compared from its start and for its
+ * length by default, or another attached SharedMemory, compared at
+ * the same offset and for the rest of the shorter segment by default.
+ */
+
+static VALUE
+rb_shm_compare (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct scan_arg s;
+  VALUE v_other, v_offset, v_len;
+  size_t offset, len, olen;
+
+  rb_scan_args (argc, argv, "12", &v_other, &v_offset, &v_len);
+  offset = NIL_P (v_offset) ? 0 : NUM2SIZET (v_offset);
+  v_offset = SIZET2NUM (offset);
+  if (!NIL_P (v_len))
+    len = NUM2SIZET (v_len);
+
+  MEMZERO (&s, struct scan_arg, 1);
+  s.op = SCAN_COMPARE;
+  s.b = shm_other (v_other, offset, &olen);
+  if (NIL_P (v_len))
+    {
+      s.a = shm_span (obj, v_offset, Qnil, &len);
+      len = len < olen ? len : olen;
+    }
+  else if (len > olen)
+    rb_raise (cError, "other is shorter than len");
+  s.a = shm_span (obj, v_offset, SIZET2NUM (len), &s.len);
+  shm_scan (&s, obj, v_other);
+
+  return INT2FIX (s.cmp < 0 ? -1 : s.cmp > 0);
+}
+
+/*
+ * call-seq:
+ *   checksum(offset = 0, len = nil) -> Integer
+ *
+ * Return the CRC32C of +len+ bytes at +offset+ (the rest of the
+ * segment if nil), with the SSE4.2 instruction where there is one.
+ */
+
+static VALUE
+rb_shm_checksum (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct scan_arg s;
+  VALUE v_offset, v_len;
+
+  rb_scan_args (argc, argv, "02", &v_offset, &v_len);
+  MEMZERO (&s, struct scan_arg, 1);
+  s.op = SCAN_CHECKSUM;
+  s.a = shm_span (obj, v_offset, v_len, &s.len);
+  shm_scan (&s, obj, Qnil);
+
+  return UINT2NUM (s.crc);
+}
+
+/*
+ * call-seq:
+ *   diff_ranges(other, block_size = 4096) -> Array
+ *
+ * Compare the segment with +other+, a String or an attached
+ * SharedMemory, block by block over their common length, and return
+ * the ranges that differ as [offset, length] pairs, adjacent blocks
+ * merged.
+ */
+
+static VALUE
+rb_shm_diff_ranges (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct scan_arg s;
+  VALUE v_other, v_block, ary;
+  size_t len, olen, i;
+
+  rb_scan_args (argc, argv, "11", &v_other, &v_block);
+  MEMZERO (&s, struct scan_arg, 1);
+  s.op = SCAN_DIFF;
+  s.block_size = NIL_P (v_block) ? 4096 : NUM2SIZET (v_block);
+  if (!s.block_size)
+    rb_raise (rb_eArgError, "block_size must be positive");
+  s.b = shm_other (v_other, 0, &olen);
+  s.a = shm_span (obj, Qnil, Qnil, &len);
+  s.len = len < olen ? len : olen;
+  shm_scan (&s, obj, v_other);
+
+  if (s.result == (size_t)-1)
+    {
+      free (s.ranges);
+      rb_memerror ();
+    }
+  ary = rb_ary_new2 (s.nranges);
+  for (i = 0; i < s.nranges; i++)
+    rb_ary_push (ary, rb_assoc_new (SIZET2NUM (s.ranges[2 * i]),
+				    SIZET2NUM (s.ranges[2 * i + 1])));
+  free (s.ranges);
+
+  return ary;
+}
+
+/*
+ * SharedStruct: fixed layouts of scalar fields in shared memory.
+ * SharedStruct.define lays the fields out once as a C compiler would
+ * and returns a class with a reader and a writer for each; both look
+ * the field up by the name they were called by and go straight to the
+ * attached segment, one load or store of the field's C type.
+ */
+
+enum {
+  SS_INT8, SS_UINT8, SS_INT16, SS_UINT16, SS_INT32, SS_UINT32,
+  SS_INT64, SS_UINT64, SS_FLOAT, SS_DOUBLE, SS_CHAR
+};
+
+static const struct {
+  const char *name;
+  unsigned size;
+} sstruct_types[] = {
+  { "int8", 1 }, { "uint8", 1 }, { "int16", 2 }, { "uint16", 2 },
+  { "int32", 4 }, { "uint32", 4 }, { "int64", 8 }, { "uint64", 8 },
+  { "float", 4 }, { "double", 8 }, { "char", 1 },
+};
+
+struct sstruct_field {
+  ID name;
+  ID setter;
+  int type;
+  uint32_t offset;
+  uint32_t size;
+};
+
+struct sstruct_layout {
+  size_t size;			/* of one element, padding included */
+  size_t align;
+  int nfields;
+  struct sstruct_field fields[1];
+};
+
+struct sstruct_ds {
+  struct shm_region region;
+  VALUE layout;
+  const struct sstruct_layout *l;
+  size_t count;
+};
+
+static ID id_sstruct_layout;
+
+static size_t
+sstruct_layout_memsize (ptr)
+     const void *ptr;
+{
+  const struct sstruct_layout *l = ptr;
+
+  return sizeof (*l) + l->nfields * sizeof (l->fields[0]);
+}
+
+#ifndef RUBY_TYPED_FROZEN_SHAREABLE
+#define RUBY_TYPED_FROZEN_SHAREABLE 0
+#endif
+
+static const rb_data_type_t sstruct_layout_data_type = {
+  "SystemVIPC::SharedStruct::Layout",
+  { 0, RUBY_TYPED_DEFAULT_FREE, sstruct_layout_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+static void
+sstruct_mark (s)
+     struct sstruct_ds *s;
+{
+  region_mark (&s->region);
+  ipc_gc_mark (s->layout);
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+sstruct_compact (s)
+     struct sstruct_ds *s;
+{
+  region_compact (&s->region);
+  s->layout = ipc_gc_location (s->layout);
+}
+#endif
+
+static size_t
+sstruct_memsize (ptr)
+     const void *ptr;
+{
+  return sizeof (struct sstruct_ds);
+}
+
+static const rb_data_type_t sstruct_data_type = {
+  "SystemVIPC::SharedStruct",
+  { (void (*) (void *))sstruct_mark, RUBY_TYPED_DEFAULT_FREE, sstruct_memsize,
+    IPC_DCOMPACT ((void (*) (void *))sstruct_compact), },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/*
+ * Return the layout of +klass+, a class returned by
+ * SharedStruct.define or one of its subclasses.
+ */
+
+static VALUE
+sstruct_layout (klass)
+     VALUE klass;
+{
+  VALUE k, v;
+
+  for (k = klass; !NIL_P (k); k = rb_class_superclass (k))
+    if (rb_ivar_defined (k, id_sstruct_layout)
+	&& !NIL_P (v = rb_ivar_get (k, id_sstruct_layout)))
+      return v;
+  rb_raise (rb_eTypeError, "%"PRIsVALUE" has no fields", klass);
+  return Qnil;			/* not reached */
+}
+
+static const struct sstruct_layout *
+get_sstruct_layout (klass)
+     VALUE klass;
+{
+  struct sstruct_layout *l;
+
+  TypedData_Get_Struct (sstruct_layout (klass), struct sstruct_layout,
+			&sstruct_layout_data_type, l);
+  return l;
+}
+
+static const struct sstruct_field *
+sstruct_field (l, id)
+     const struct sstruct_layout *l;
+     ID id;
+{
+  int i;
+
+  for (i = 0; i < l->nfields; i++)
+    if (l->fields[i].name == id)
+      return &l->fields[i];
+  return NULL;
+}
+
+/*
+ * call-seq:
+ *   bytesize(count = 1) -> Integer
+ *
+ * Return the number of bytes of shared memory used by +count+
+ * elements.
+ */
+
+static VALUE
+rb_sstruct_s_bytesize (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  VALUE v_count;
+  size_t count;
+
+  rb_scan_args (argc, argv, "01", &v_count);
+  count = NIL_P (v_count) ? 1 : NUM2SIZET (v_count);
+  return SIZET2NUM (get_sstruct_layout (klass)->size * count);
+}
+
+/*
+ * call-seq:
+ *   alignment -> Integer
+ *
+ * Return the alignment of elements, which the offset given to new
+ * must be a multiple of.
+ */
+
+static VALUE
+rb_sstruct_s_alignment (klass)
+     VALUE klass;
+{
+  return SIZET2NUM (get_sstruct_layout (klass)->align);
+}
+
+/*
+ * call-seq:
+ *   members -> Array
+ *
+ * Return the names of the fields, in order.
+ */
+
+static VALUE
+rb_sstruct_s_members (klass)
+     VALUE klass;
+{
+  const struct sstruct_layout *l = get_sstruct_layout (klass);
+  VALUE ary = rb_ary_new2 (l->nfields);
+  int i;
+
+  for (i = 0; i < l->nfields; i++)
+    rb_ary_push (ary, ID2SYM (l->fields[i].name));
+  return ary;
+}
+
+/*
+ * call-seq:
+ *   offsetof(name) -> Integer
+ *
+ * Return the offset of field +name+ from the start of an element.
+ */
+
+static VALUE
+rb_sstruct_s_offsetof (klass, v_name)
+     VALUE klass, v_name;
+{
+  const struct sstruct_field *f;
+
+  if (!(f = sstruct_field (get_sstruct_layout (klass), rb_to_id (v_name))))
+    rb_raise (rb_eArgError, "no field %"PRIsVALUE, v_name);
+  return UINT2NUM (f->offset);
+}
+
+static VALUE
+sstruct_make (klass, layout, v_shm, offset, count)
+     VALUE klass, layout, v_shm;
+     size_t offset, count;
+{
+  struct sstruct_ds *s;
+  struct sstruct_layout *l;
+  VALUE dst;
+
+  TypedData_Get_Struct (layout, struct sstruct_layout,
+			&sstruct_layout_data_type, l);
+
+  if (offset % l->align)
+    rb_raise (cError, "misaligned offset");
+  if (count && l->size > SIZE_MAX / count)
+    rb_raise (cError, "invalid shm_segsz");
+  dst = TypedData_Make_Struct (klass, struct sstruct_ds,
+			       &sstruct_data_type, s);
+  s->layout = layout;
+  s->l = l;
+  s->count = count;
+  if (offset % 8)
+    {
+      /* region_init wants 8-byte alignment, finer layouts do not */
+      struct ipcid_ds *shmid;
+
+      TypedData_Get_Struct (v_shm, struct ipcid_ds, &shm_data_type, shmid);
+      if (!shmid->data)
+	rb_raise (cError, "detached memory");
+      if (l->size * count > shmid->attached
+	  || offset > shmid->attached - l->size * count)
+	rb_raise (cError, "invalid shm_segsz");
+      s->region.shm = v_shm;
+      s->region.shmid = shmid;
+      s->region.offset = offset;
+      s->region.size = l->size * count;
+    }
+  else
+    region_init (&s->region, v_shm, offset, l->size * count);
+  return dst;
+}
+
+/*
+ * call-seq:
+ *   new(shm, offset = 0, count = 1) -> SharedStruct
+ *
+ * Return an array of +count+ elements laid out back to back in the
+ * attached SharedMemory +shm+ from +offset+. Readers and writers
+ * called on it act on element 0; readers take an optional index.
+ */
+
+static VALUE
+rb_sstruct_s_new (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  VALUE v_shm, v_offset, v_count;
+
+  rb_scan_args (argc, argv, "12", &v_shm, &v_offset, &v_count);
+  return sstruct_make (klass, sstruct_layout (klass), v_shm,
+		       NIL_P (v_offset) ? 0 : NUM2SIZET (v_offset),
+		       NIL_P (v_count) ? 1 : NUM2SIZET (v_count));
+}
+
+static char *
+get_sstruct (obj, s, index)
+     VALUE obj;
+     struct sstruct_ds **s;
+     size_t index;
+{
+  TypedData_Get_Struct (obj, struct sstruct_ds, &sstruct_data_type, *s);
+  if (index >= (*s)->count)
+    rb_raise (rb_eIndexError, "index %lu outside of %lu elements",
+	      (unsigned long)index, (unsigned long)(*s)->count);
+  return region_ptr (&(*s)->region) + index * (*s)->l->size;
+}
+
+static VALUE
+sstruct_load (f, p)
+     const struct sstruct_field *f;
+     const char *p;
+{
+  p += f->offset;
+  switch (f->type)
+    {
+    case SS_INT8:
+      return INT2FIX (*(const int8_t *)p);
+    case SS_UINT8:
+      return INT2FIX (*(const uint8_t *)p);
+    case SS_INT16:
+      return INT2FIX (*(const int16_t *)p);
+    case SS_UINT16:
+      return INT2FIX (*(const uint16_t *)p);
+    case SS_INT32:
+      return INT2NUM (*(const int32_t *)p);
+    case SS_UINT32:
+      return UINT2NUM (*(const uint32_t *)p);
+    case SS_INT64:
+      return LL2NUM (*(const int64_t *)p);
+    case SS_UINT64:
+      return ULL2NUM (*(const uint64_t *)p);
+    case SS_FLOAT:
+      return DBL2NUM (*(const float *)p);
+    case SS_DOUBLE:
+      return DBL2NUM (*(const double *)p);
+    default:
+      return rb_str_new (p, strnlen (p, f->size));
+    }
+}
+
+static void
+sstruct_store (f, p, v)
+     const struct sstruct_field *f;
+     char *p;
+     VALUE v;
+{
+  long n;
+
+  p += f->offset;
+  switch (f->type)
+    {
+    case SS_INT8:
+    case SS_INT16:
+    case SS_UINT8:
+    case SS_UINT16:
+      n = NUM2LONG (v);
+      if (f->type == SS_INT8 ? n < -128 || n > 127
+	  : f->type == SS_INT16 ? n < -32768 || n > 32767
+	  : n < 0 || n >= 1L << (8 * f->size))
+	rb_raise (rb_eRangeError, "%ld out of range for field %s",
+		  n, rb_id2name (f->name));
+      if (f->size == 1)
+	*(uint8_t *)p = (uint8_t)n;
+      else
+	*(uint16_t *)p = (uint16_t)n;
+      break;
+    case SS_INT32:
+      *(int32_t *)p = NUM2INT (v);
+      break;
+    case SS_UINT32:
+      *(uint32_t *)p = NUM2UINT (v);
+      break;
+    case SS_INT64:
+      *(int64_t *)p = NUM2LL (v);
+      break;
+    case SS_UINT64:
+      *(uint64_t *)p = NUM2ULL (v);
+      break;
+    case SS_FLOAT:
+      *(float *)p = (float)NUM2DBL (v);
+      break;
+    case SS_DOUBLE:
+      *(double *)p = NUM2DBL (v);
+      break;
+    default:
+      StringValue (v);
+      if ((size_t)RSTRING_LEN (v) > f->size)
+	rb_raise (rb_eArgError, "string longer than %u bytes for field %s",
+		  f->size, rb_id2name (f->name));
+      memcpy (p, RSTRING_PTR (v), RSTRING_LEN (v));
+      memset (p + RSTRING_LEN (v), 0, f->size - RSTRING_LEN (v));
+      break;
+    }
+}
+
+/* The reader of every field, called as field(index = 0). */
+
+static VALUE
+rb_sstruct_get (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct sstruct_ds *s;
+  const struct sstruct_field *f;
+  size_t index = 0;
+  char *p;
+
+  rb_check_arity (argc, 0, 1);
+  if (argc)
+    index = NUM2SIZET (argv[0]);
+  p = get_sstruct (obj, &s, index);
+  if (!(f = sstruct_field (s->l, rb_frame_this_func ())))
+    rb_raise (rb_eNoMethodError, "no such field");
+  return sstruct_load (f, p);
+}
+
+/* The writer of every field, acting on element 0. */
+
+static VALUE
+rb_sstruct_set (obj, v)
+     VALUE obj, v;
+{
+  struct sstruct_ds *s;
+  char *p = get_sstruct (obj, &s, 0);
+  ID id = rb_frame_this_func ();
+  int i;
+
+  for (i = 0; i < s->l->nfields; i++)
+    if (s->l->fields[i].setter == id)
+      {
+	sstruct_store (&s->l->fields[i], p, v);
+	return v;
+      }
+  rb_raise (rb_eNoMethodError, "no such field");
+  return Qnil;			/* not reached */
+}
+
+/*
+ * call-seq:
+ *   SharedStruct.define(fields, opts = {}) -> Class
+ *
+ * Return a new subclass of SharedStruct whose elements hold +fields+,
+ * a Hash from field names to types, in that order. A type is one of
+ * :int8, :uint8, :int16, :uint16, :int32, :uint32, :int64, :uint64,
+ * :float or :double, or <tt>[:char, n]</tt> for a string of up to +n+
+ * bytes. Fields are aligned on their size and the element size is
+ * rounded up to the largest alignment, as in C; with
+ * <tt>opts[:cacheline]</tt> true, elements are also aligned and
+ * padded to a cache line, so that two processes updating adjacent
+ * elements do not contend.
+ *
+ * The class gets a reader and a writer for each field:
+ *
+ *     Point = SharedStruct.define(x: :int64, y: :int64, tag: [:char, 8])
+ *     pt = Point.new(shm, 0)
+ *     pt.x = 3
+ *     pt.x                # => 3
+ */
+
+static VALUE
+rb_sstruct_s_define (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
+{
+  struct sstruct_layout *l;
+  struct sstruct_field *f;
+  VALUE v_fields, v_opts, keys, v_name, v_type, v_n, layout, sub;
+  size_t offset = 0, align = 1;
+  long i, n;
+  int t;
+
+  rb_scan_args (argc, argv, "11", &v_fields, &v_opts);
+  Check_Type (v_fields, T_HASH);
+  if (!NIL_P (v_opts))
+    Check_Type (v_opts, T_HASH);
+  keys = rb_funcall (v_fields, rb_intern ("keys"), 0);
+  if (!(n = RARRAY_LEN (keys)))
+    rb_raise (rb_eArgError, "no fields");
+
+  sub = rb_class_new_instance (1, &klass, rb_cClass);
+  layout = TypedData_Wrap_Struct (rb_cObject, &sstruct_layout_data_type, 0);
+  l = ruby_xcalloc (1, sizeof (*l) + (n - 1) * sizeof (l->fields[0]));
+  DATA_PTR (layout) = l;
+
+  for (i = 0; i < n; i++)
+    {
+      f = &l->fields[i];
+      v_name = rb_ary_entry (keys, i);
+      v_type = rb_hash_aref (v_fields, v_name);
+      v_n = Qnil;
+      if (RB_TYPE_P (v_type, T_ARRAY))
+	{
+	  if (RARRAY_LEN (v_type) != 2)
+	    rb_raise (rb_eArgError, "field type must be [:char, n]");
+	  v_n = rb_ary_entry (v_type, 1);
+	  v_type = rb_ary_entry (v_type, 0);
+	}
+      f->name = rb_to_id (v_name);
+      f->setter = rb_id_attrset (f->name);
+      for (t = 0; t <= SS_CHAR; t++)
+	if (SYMBOL_P (v_type)
+	    && SYM2ID (v_type) == rb_intern (sstruct_types[t].name))
+	  break;
+      if (t > SS_CHAR || (t == SS_CHAR) != !NIL_P (v_n))
+	rb_raise (rb_eArgError, "invalid type for field %"PRIsVALUE, v_name);
+      if (sstruct_field (l, f->name))
+	rb_raise (rb_eArgError, "duplicate field %"PRIsVALUE, v_name);
+      if (rb_method_boundp (sub, f->name, 0)
+	  || rb_method_boundp (sub, f->setter, 0))
+	rb_raise (rb_eArgError, "field %"PRIsVALUE" would hide a method",
+		  v_name);
+
+      f->type = t;
+      f->size = sstruct_types[t].size;
+      if (t == SS_CHAR)
+	{
+	  if (NUM2LONG (v_n) <= 0 || NUM2LONG (v_n) > 65536)
+	    rb_raise (rb_eArgError, "invalid length for field %"PRIsVALUE,
+		      v_name);
+	  f->size = NUM2UINT (v_n);
+	}
+      else if (sstruct_types[t].size > align)
+	align = sstruct_types[t].size;
+      offset = IPC_ALIGN (offset, t == SS_CHAR ? 1 : f->size);
+      f->offset = offset;
+      offset += f->size;
+      l->nfields = i + 1;
+    }
+
+  if (RTEST (xfer_opt (v_opts, "cacheline")))
+    align = IPC_CACHELINE;
+  l->align = align;
+  l->size = IPC_ALIGN (offset, align);
+
+  for (i = 0; i < n; i++)
+    {
+      f = &l->fields[i];
+      rb_define_method_id (sub, f->name, rb_sstruct_get, -1);
+      rb_define_method_id (sub, f->setter, rb_sstruct_set, 1);
+    }
+  rb_obj_freeze (layout);
+  rb_ivar_set (sub, id_sstruct_layout, layout);
+
+  return sub;
+}
+
+/*
+ * call-seq:
+ *   self[index] -> SharedStruct
+ *
+ * Return element +index+ as a SharedStruct of its own, whose writers
+ * then act on it.
+ */
+
+static VALUE
+rb_sstruct_aref (obj, v_index)
+     VALUE obj, v_index;
+{
+  struct sstruct_ds *s;
+  long index = NUM2LONG (v_index);
+
+  TypedData_Get_Struct (obj, struct sstruct_ds, &sstruct_data_type, s);
+  if (index < 0)
+    index += s->count;
+  if (index < 0 || (size_t)index >= s->count)
+    return Qnil;
+  return sstruct_make (CLASS_OF (obj), s->layout, s->region.shm,
+		       s->region.offset + index * s->l->size, 1);
+}
+
+/*
+ * call-seq:
+ *   size -> Integer
+ *
+ * Return the number of elements.
+ */
+
+static VALUE
+rb_sstruct_size (obj)
+     VALUE obj;
+{
+  struct sstruct_ds *s;
+
+  TypedData_Get_Struct (obj, struct sstruct_ds, &sstruct_data_type, s);
+  return SIZET2NUM (s->count);
+}
+
+/*
+ * call-seq:
+ *   offset -> Integer
+ *
+ * Return the offset of element 0 in the segment.
+ */
+
+static VALUE
+rb_sstruct_offset (obj)
+     VALUE obj;
+{
+  struct sstruct_ds *s;
+
+  TypedData_Get_Struct (obj, struct sstruct_ds, &sstruct_data_type, s);
+  return SIZET2NUM (s->region.offset);
+}
+
+/*
+ * call-seq:
+ *   each { |element| ... } -> self
+ *
+ * Yield every element in turn, as self[index] returns it.
+ */
+
+static VALUE
+rb_sstruct_each (obj)
+     VALUE obj;
+{
+  struct sstruct_ds *s;
+  size_t i;
+
+  RETURN_ENUMERATOR (obj, 0, 0);
+  TypedData_Get_Struct (obj, struct sstruct_ds, &sstruct_data_type, s);
+  for (i = 0; i < s->count; i++)
+    rb_yield (sstruct_make (CLASS_OF (obj), s->layout, s->region.shm,
+			    s->region.offset + i * s->l->size, 1));
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   to_h(index = 0) -> Hash
+ *
+ * Return the fields of element +index+ as a Hash.
+ */
+
+static VALUE
+rb_sstruct_to_h (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct sstruct_ds *s;
+  VALUE v_index, hash;
+  char *p;
+  int i;
+
+  rb_scan_args (argc, argv, "01", &v_index);
+  p = get_sstruct (obj, &s, NIL_P (v_index) ? 0 : NUM2SIZET (v_index));
+  hash = rb_hash_new ();
+  for (i = 0; i < s->l->nfields; i++)
+    rb_hash_aset (hash, ID2SYM (s->l->fields[i].name),
+		  sstruct_load (&s->l->fields[i], p));
+  return hash;
+}
+
+/*
+ * Compound operations on a SharedMemory under a lock, one semaphore
+ * of a set used as a mutex: 1 when free, 0 when held.  Arguments are
+ * checked and result Strings allocated beforehand, so that the lock
+ * is only held across the copies themselves; the addresses are only
+ * resolved once it is held.  While the lock is waited for without the
+ * interpreter lock the segment stays pinned, so that detach refuses
+ * to unmap it, and the source Strings locked against change.  All of
+ * it is taken inside rb_ensure, and the semop keeps its ipc_call in
+ * the shm_lock:
+ * should an interrupt raise out of ipc_call after the semop took the
+ * semaphore, as rb_thread_call_without_gvl does where the interpreter
+ * lacks rb_thread_call_without_gvl2, the ensure still sees it taken
+ * and gives it back.
+ */
+
+#define LOCKED_MAX_RANGES 1024
+
+struct shm_lock {
+  struct ipcid_ds *semid;
+  struct sembuf op;
+  short sem_flg;
+  uint64_t expires;
+  struct ipc_call c;		/* of the last semop */
+  VALUE (*func) (VALUE);	/* run under the lock */
+  VALUE arg;
+  struct ipcid_ds *shmid;	/* pinned meanwhile, if not NULL */
+  int pinned;
+  VALUE *strs;			/* kept from changing meanwhile */
+  long nstrs, nlocked;
+};
+
+struct shm_locked_range {
+  size_t offset;
+  VALUE str;
+  size_t len;
+  int write;
+};
+
+/*
+ * Split the options Hash, if any, off the end of +argv+.
+ */
+
+static VALUE
+locked_opts (argc, argv)
+     int *argc;
+     VALUE *argv;
+{
+  if (*argc && RB_TYPE_P (argv[*argc - 1], T_HASH))
+    return argv[--*argc];
+  return Qnil;
+}
+
+static void
+shm_lock_init (lk, v_sem, v_index, v_opts)
+     struct shm_lock *lk;
+     VALUE v_sem, v_index, v_opts;
+{
+  TypedData_Get_Struct (v_sem, struct ipcid_ds, &sem_data_type, lk->semid);
+  if (lk->semid->id < 0)
+    rb_raise (cError, "closed handle");
+  lk->op.sem_num = NIL_P (v_index) ? 0 : NUM2USHORT (v_index);
+  lk->op.sem_op = 0;
+  lk->sem_flg = RTEST (xfer_opt (v_opts, "undo")) ? SEM_UNDO : 0;
+  lk->expires = msg_expires (xfer_opt (v_opts, "timeout"));
+  lk->c.ret = -1;
+  lk->shmid = NULL;
+  lk->pinned = 0;
+  lk->strs = NULL;
+  lk->nstrs = lk->nlocked = 0;
+}
+
+/* Apply +delta+ to the lock semaphore; return 0, or -1 and errno. */
+
+static int
+shm_lock_op (lk, delta)
+     struct shm_lock *lk;
+     int delta;
+{
+  struct ipc_call *c = &lk->c;
+
+  lk->op.sem_op = delta;
+  lk->op.sem_flg = lk->sem_flg;
+  MEMZERO (c, struct ipc_call, 1);
+  c->ipcid = lk->semid;
+  c->fn = call_semop;
+  c->buf = &lk->op;
+  c->len = 1;
+  c->sem_flg = &lk->sem_flg;
+  c->nowait = delta > 0;
+  c->expires = delta > 0 ? 0 : lk->expires;
+  c->ret = -1;
+  return ipc_call (c) == -1 ? -1 : 0;
+}
+
+static VALUE
+shm_locked_run (ptr)
+     VALUE ptr;
+{
+  struct shm_lock *lk = (struct shm_lock *)ptr;
+
+  if (lk->shmid)
+    {
+      ATOMIC_FETCH_ADD (&lk->shmid->pins, 1);
+      lk->pinned = 1;
+    }
+#ifdef HAVE_RB_STR_LOCKTMP
+  for (; lk->nlocked < lk->nstrs; lk->nlocked++)
+    rb_str_locktmp (lk->strs[lk->nlocked]);
+#endif
+  if (shm_lock_op (lk, -1) == -1)
+    {
+      if (errno == ETIMEDOUT)
+	rb_raise (cTimeoutError, "lock not acquired");
+      rb_sys_fail ("semop(2)");
+    }
+  return lk->func (lk->arg);
+}
+
+static VALUE
+shm_unlock (ptr)
+     VALUE ptr;
+{
+  struct shm_lock *lk = (struct shm_lock *)ptr;
+  int failed;
+
+  /* held if the last semop took it, whether or not ipc_call returned */
+  failed = lk->op.sem_op < 0 && lk->c.ret != -1
+    && shm_lock_op (lk, 1) == -1;
+#ifdef HAVE_RB_STR_LOCKTMP
+  while (lk->nlocked > 0)
+    rb_str_unlocktmp (lk->strs[--lk->nlocked]);
+#endif
+  if (lk->pinned)
+    {
+      ATOMIC_FETCH_ADD (&lk->shmid->pins, -1);
+      lk->pinned = 0;
+    }
+  if (failed)
+    rb_sys_fail ("semop(2)");
+  return Qnil;
+}
+
+/*
+ * Keep +v_str+ from changing while the lock is waited for and held,
+ * once, however often the ranges name it.
+ */
+
+static void
+shm_lock_string (lk, v_str)
+     struct shm_lock *lk;
+     VALUE v_str;
+{
+  long i;
+
+  for (i = 0; i < lk->nstrs; i++)
+    if (lk->strs[i] == v_str)
+      return;
+  lk->strs[lk->nstrs++] = v_str;
+}
+
+/* Take the lock, run +func+ with +arg+, give the lock back. */
+
+static VALUE
+shm_locked (lk, func, arg)
+     struct shm_lock *lk;
+     VALUE (*func) (VALUE);
+     VALUE arg;
+{
+  lk->func = func;
+  lk->arg = arg;
+  return rb_ensure (shm_locked_run, (VALUE)lk, shm_unlock, (VALUE)lk);
+}
+
+/*
+ * call-seq:
+ *   synchronize(sem, index = 0, opts = {}) { ... } -> obj
+ *
+ * Take semaphore +index+ of the Semaphore +sem+ as a lock, run the
+ * block and give the lock back, even if the block raises. With
+ * <tt>opts[:undo]</tt> true, the kernel gives the lock back if the
+ * process dies holding it (SEM_UNDO); with <tt>opts[:timeout]</tt>,
+ * wait at most that many seconds for it, then raise TimeoutError.
+ * The semaphore must have been set to 1. Return the value of the
+ * block.
+ */
+
+static VALUE
+rb_shm_synchronize (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct shm_lock lk;
+  VALUE v_opts, v_sem, v_index;
+
+  v_opts = locked_opts (&argc, argv);
+  rb_scan_args (argc, argv, "11", &v_sem, &v_index);
+  rb_need_block ();
+  shm_lock_init (&lk, v_sem, v_index, v_opts);
+  return shm_locked (&lk, rb_yield, obj);
+}
+
+/*
+ * Take the lock, copy every range, in the order given, give the lock
+ * back.
+ */
+
+struct shm_locked_copy_arg {
+  struct ipcid_ds *shmid;
+  struct shm_locked_range *r;
+  long n;
+};
+
+static VALUE
+shm_locked_copy_run (ptr)
+     VALUE ptr;
+{
+  struct shm_locked_copy_arg *a = (struct shm_locked_copy_arg *)ptr;
+  struct shm_locked_range *r = a->r;
+  char *shm;
+  long i;
+
+  for (i = 0; i < a->n; i++)
+    {
+      shm = shm_range (a->shmid, r[i].offset, r[i].len);
+      if (r[i].write)
+	memcpy (shm, RSTRING_PTR (r[i].str), r[i].len);
+      else
+	memcpy (RSTRING_PTR (r[i].str), shm, r[i].len);
+    }
+  return Qnil;
+}
+
+static void
+shm_locked_copy (shmid, lk, r, n, bytes)
+     struct ipcid_ds *shmid;
+     struct shm_lock *lk;
+     struct shm_locked_range *r;
+     long n;
+     size_t bytes;
+{
+  struct shm_locked_copy_arg a;
+  uint64_t t0;
+
+  a.shmid = lk->shmid = shmid;
+  a.r = r;
+  a.n = n;
+  t0 = IPC_STATS_BEGIN (shmid);
+  shm_locked (lk, shm_locked_copy_run, (VALUE)&a);
+  IPC_STATS_END (shmid, bytes, t0);
+}
+
+static long
+locked_ranges (v_ranges)
+     VALUE v_ranges;
+{
+  long n = RARRAY_LEN (v_ranges);
+
+  if (n > LOCKED_MAX_RANGES)
+    rb_raise (cError, "too many ranges");
+  return n;
+}
+
+/*
+ * call-seq:
+ *   locked_read(sem, index, len, offset = 0, opts = {}) -> String
+ *   locked_read(sem, index, [[len, offset], ...], opts = {}) -> Array
+ *
+ * Read +len+ bytes at +offset+, or several ranges, under the lock
+ * taken as by synchronize, and return them. See synchronize for
+ * +opts+.
+ */
+
+static VALUE
+rb_shm_locked_read (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct ipcid_ds *shmid = get_ipcid (obj);
+  struct shm_locked_range *r;
+  struct shm_lock lk;
+  VALUE v_opts, v_sem, v_index, v_len, v_offset, v_pair, ret;
+  size_t len, offset, bytes = 0;
+  long i, n = 1;
+
+  v_opts = locked_opts (&argc, argv);
+  rb_scan_args (argc, argv, "31", &v_sem, &v_index, &v_len, &v_offset);
+  shm_lock_init (&lk, v_sem, v_index, v_opts);
+  if (RB_TYPE_P (v_len, T_ARRAY))
+    n = locked_ranges (v_len);
+  r = ALLOCA_N (struct shm_locked_range, n);
+  ret = RB_TYPE_P (v_len, T_ARRAY) ? rb_ary_new2 (n) : Qnil;
+  for (i = 0; i < n; i++)
+    {
+      if (NIL_P (ret))
+	v_pair = Qnil;
+      else
+	{
+	  v_pair = rb_ary_entry (v_len, i);
+	  Check_Type (v_pair, T_ARRAY);
+	  v_offset = rb_ary_entry (v_pair, 1);
+	}
+      len = NUM2SIZET (NIL_P (v_pair) ? v_len : rb_ary_entry (v_pair, 0));
+      offset = NIL_P (v_offset) ? 0 : NUM2SIZET (v_offset);
+      shm_range (shmid, offset, len);
+      r[i].offset = offset;
+      r[i].len = len;
+      r[i].write = 0;
+      bytes += len;
+      v_pair = rb_str_new (0, len);
+      r[i].str = v_pair;
+      if (NIL_P (ret))
+	ret = v_pair;
+      else
+	rb_ary_push (ret, v_pair);
+    }
+  shm_locked_copy (shmid, &lk, r, n, bytes);
+
+  return ret;
+}
+
+/*
+ * call-seq:
+ *   locked_write(sem, index, str, offset = 0, opts = {}) -> SharedMemory
+ *   locked_write(sem, index, [[str, offset], ...], opts = {}) -> SharedMemory
+ *
+ * Write +str+ at +offset+, or several Strings at their offsets, under
+ * the lock taken as by synchronize. See synchronize for +opts+.
+ */
+
+static VALUE
+rb_shm_locked_write (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct ipcid_ds *shmid = get_ipcid (obj);
+  struct shm_locked_range *r;
+  struct shm_lock lk;
+  VALUE v_opts, v_sem, v_index, v_str, v_offset, v_pair, v;
+  size_t offset, bytes = 0;
+  long i, n = 1;
+
+  v_opts = locked_opts (&argc, argv);
+  rb_scan_args (argc, argv, "31", &v_sem, &v_index, &v_str, &v_offset);
+  shm_lock_init (&lk, v_sem, v_index, v_opts);
+  if (RB_TYPE_P (v_str, T_ARRAY))
+    n = locked_ranges (v_str);
+  r = ALLOCA_N (struct shm_locked_range, n);
+  lk.strs = ALLOCA_N (VALUE, n);
+  for (i = 0; i < n; i++)
+    {
+      v = v_str;
+      if (RB_TYPE_P (v_str, T_ARRAY))
+	{
+	  v_pair = rb_ary_entry (v_str, i);
+	  Check_Type (v_pair, T_ARRAY);
+	  v = rb_ary_entry (v_pair, 0);
+	  v_offset = rb_ary_entry (v_pair, 1);
+	}
+      StringValue (v);
+      offset = NIL_P (v_offset) ? 0 : NUM2SIZET (v_offset);
+      r[i].len = RSTRING_LEN (v);
+      shm_range (shmid, offset, r[i].len);
+      r[i].offset = offset;
+      r[i].str = v;
+      r[i].write = 1;
+      bytes += r[i].len;
+      shm_lock_string (&lk, v);
+    }
+  shm_locked_copy (shmid, &lk, r, n, bytes);
+  RB_GC_GUARD (v_str);
+
+  return obj;
+}
+
+/*
+ * call-seq:
+ *   locked_swap(sem, index, str, offset = 0, opts = {}) -> String
+ *
+ * Replace the bytes at +offset+ with +str+ under the lock taken as by
+ * synchronize, and return what they were. See synchronize for +opts+.
+ */
+
+static VALUE
+rb_shm_locked_swap (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct ipcid_ds *shmid = get_ipcid (obj);
+  struct shm_locked_range r[2];
+  struct shm_lock lk;
+  VALUE v_opts, v_sem, v_index, v_str, v_offset, ret;
+  size_t offset;
+
+  v_opts = locked_opts (&argc, argv);
+  rb_scan_args (argc, argv, "31", &v_sem, &v_index, &v_str, &v_offset);
+  shm_lock_init (&lk, v_sem, v_index, v_opts);
+  StringValue (v_str);
+  offset = NIL_P (v_offset) ? 0 : NUM2SIZET (v_offset);
+  r[0].len = r[1].len = RSTRING_LEN (v_str);
+  ret = rb_str_new (0, r[0].len);
+  shm_range (shmid, offset, r[0].len);
+  r[0].offset = r[1].offset = offset;
+  r[0].str = ret;
+  r[0].write = 0;
+  r[1].str = v_str;
+  r[1].write = 1;
+  lk.strs = &v_str;
+  lk.nstrs = 1;
+  shm_locked_copy (shmid, &lk, r, 2, 2 * r[0].len);
+  RB_GC_GUARD (v_str);
+
+  return ret;
+}
+
+struct shm_locked_increment_arg {
+  struct ipcid_ds *shmid;
+  size_t offset;
+  int64_t delta;
+  int64_t value;
+};
+
+static VALUE
+shm_locked_increment_run (ptr)
+     VALUE ptr;
+{
+  struct shm_locked_increment_arg *a = (struct shm_locked_increment_arg *)ptr;
+  int64_t *p = (int64_t *)shm_range (a->shmid, a->offset, 8);
+
+  a->value = *p = (int64_t)((uint64_t)*p + (uint64_t)a->delta);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *   locked_increment(sem, index, offset, delta = 1, opts = {}) -> Integer
+ *
+ * Add +delta+ to the native-endian 64-bit integer at +offset+, a
+ * multiple of 8, under the lock taken as by synchronize, and return
+ * the new value. See synchronize for +opts+.
+ */
+
+static VALUE
+rb_shm_locked_increment (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct ipcid_ds *shmid = get_ipcid (obj);
+  struct shm_locked_increment_arg a;
+  struct shm_lock lk;
+  VALUE v_opts, v_sem, v_index, v_offset, v_delta;
+  size_t offset;
+  uint64_t t0;
+
+  v_opts = locked_opts (&argc, argv);
+  rb_scan_args (argc, argv, "31", &v_sem, &v_index, &v_offset, &v_delta);
+  shm_lock_init (&lk, v_sem, v_index, v_opts);
+  offset = NUM2SIZET (v_offset);
+  if (offset % 8)
+    rb_raise (cError, "misaligned offset");
+  a.delta = NIL_P (v_delta) ? 1 : NUM2LL (v_delta);
+  shm_range (shmid, offset, 8);
+  a.shmid = lk.shmid = shmid;
+  a.offset = offset;
+
+  t0 = IPC_STATS_BEGIN (shmid);
+  shm_locked (&lk, shm_locked_increment_run, (VALUE)&a);
+  IPC_STATS_END (shmid, 8, t0);
+
+  return LL2NUM (a.value);
+}
+
+/*
+ * Barrier and CountDownLatch: phase synchronization of processes in
+ * shared memory.  A Barrier keeps the generation and the number of
+ * parties arrived in it in one 64-bit word, so that arriving, and
+ * taking an arrival back on timeout, are a single CAS; the last
+ * party to arrive starts the next generation and wakes the others,
+ * who sleep on a 32-bit copy of the generation.  Each party records
+ * the last generation it arrived in, which tells who is late.  No
+ * party makes more than one futex call per crossing, and none at
+ * all when nobody had to sleep.
+ */
+
+#define BARRIER_MAGIC 0x53564252	/* "SVBR" */
+#define LATCH_MAGIC 0x5356434c		/* "SVCL" */
+#define SYNC_MAX_PARTIES (1U << 24)
+
+struct barrier_header {
+  uint32_t magic;
+  uint32_t parties;
+  uint32_t generation;		/* futex word, follows state >> 32 */
+  uint32_t sleepers;
+  uint64_t state;		/* generation << 32 | parties arrived */
+  char pad[IPC_CACHELINE - 24];
+};
+
+struct latch_header {
+  uint32_t magic;
+  uint32_t parties;
+  uint32_t count;		/* futex word */
+  uint32_t sleepers;
+  char pad[IPC_CACHELINE - 16];
+};
+
+/* after either header, the generation each party arrived in, or 1
+   once it counted down */
+#define SYNC_SLOTS(hdr) ((uint32_t *)((hdr) + 1))
+#define BARRIER_BYTESIZE(parties) \
+  (sizeof (struct barrier_header) + IPC_ALIGN ((size_t)(parties) * 4, 8))
+#define LATCH_BYTESIZE(parties) \
+  (sizeof (struct latch_header) + IPC_ALIGN ((size_t)(parties) * 4, 8))
+
+struct barrier_ds {
+  struct shm_region region;
+  uint32_t parties;
+};
+
+static size_t
+barrier_memsize (ptr)
+     const void *ptr;
+{
+  return sizeof (struct barrier_ds);
+}
+
+static const rb_data_type_t barrier_data_type = {
+  "SystemVIPC::Barrier",
+  { (void (*) (void *))region_mark, RUBY_TYPED_DEFAULT_FREE, barrier_memsize,
+    IPC_DCOMPACT ((void (*) (void *))region_compact), },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static const rb_data_type_t latch_data_type = {
+  "SystemVIPC::CountDownLatch",
+  { (void (*) (void *))region_mark, RUBY_TYPED_DEFAULT_FREE, barrier_memsize,
+    IPC_DCOMPACT ((void (*) (void *))region_compact), },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static uint32_t
+sync_parties (v_parties)
+     VALUE v_parties;
+{
+  uint32_t parties = NUM2UINT (v_parties);
+
+  if (!parties || parties > SYNC_MAX_PARTIES)
+    rb_raise (cError, "invalid number of parties");
+  return parties;
+}
+
+/*
+ * Set up the barrier or latch at +offset+ of +v_shm+, of +v_parties+
+ * unless one is there already.  The header starts with magic and
+ * parties for both.
+ */
+
+static VALUE
+sync_new (klass, type, magic, header, argc, argv)
+     VALUE klass;
+     const rb_data_type_t *type;
+     uint32_t magic;
+     size_t header;
+     int argc;
+     VALUE *argv;
+{
+  struct barrier_ds *b;
+  uint32_t *hdr;
+  VALUE dst, v_shm, v_offset, v_parties;
+  size_t offset = 0, size;
+  uint32_t parties;
+
+  rb_scan_args (argc, argv, "12", &v_shm, &v_offset, &v_parties);
+  if (!NIL_P (v_offset))
+    offset = NUM2SIZET (v_offset);
+
+  dst = TypedData_Make_Struct (klass, struct barrier_ds, type, b);
+  region_init (&b->region, v_shm, offset, header);
+  hdr = (uint32_t *)region_ptr (&b->region);
+
+  if (ATOMIC_LOAD_ACQ (&hdr[0]) != magic)
+    {
+      if (NIL_P (v_parties))
+	rb_raise (cError, "no %s", rb_class2name (klass));
+      parties = sync_parties (v_parties);
+      size = header + IPC_ALIGN ((size_t)parties * 4, 8);
+      region_init (&b->region, v_shm, offset, size);
+      memset (hdr, 0, size);
+      hdr[1] = parties;
+      if (magic == LATCH_MAGIC)
+	((struct latch_header *)hdr)->count = parties;
+      ATOMIC_STORE_REL (&hdr[0], magic);
+    }
+
+  b->parties = hdr[1];
+  /* the header is shared memory: check it before trusting it */
+  if (!b->parties || b->parties > SYNC_MAX_PARTIES)
+    rb_raise (cError, "corrupt header");
+  region_init (&b->region, v_shm, offset,
+	       header + IPC_ALIGN ((size_t)b->parties * 4, 8));
+
+  return dst;
+}
+
+static struct barrier_header *
+get_barrier (obj, b)
+     VALUE obj;
+     struct barrier_ds **b;
+{
+  TypedData_Get_Struct (obj, struct barrier_ds, &barrier_data_type, *b);
+  return (struct barrier_header *)region_ptr (&(*b)->region);
+}
+
+static struct latch_header *
+get_latch (obj, b)
+     VALUE obj;
+     struct barrier_ds **b;
+{
+  TypedData_Get_Struct (obj, struct barrier_ds, &latch_data_type, *b);
+  return (struct latch_header *)region_ptr (&(*b)->region);
+}
+
+static uint32_t
+sync_index (b, v_index)
+     struct barrier_ds *b;
+     VALUE v_index;
+{
+  uint32_t index = NUM2UINT (v_index);
 
-  rb_scan_args (argc, argv, "21", &v_type, &v_buf, &v_flags);
-  if (!NIL_P (v_flags))
-    flags = NUM2INT (v_flags);
-  
-  len = RSTRING_LEN(v_buf);
-  buf = RSTRING_PTR(v_buf);
+  if (index >= b->parties)
+    rb_raise (rb_eIndexError, "party %u outside of %u", index, b->parties);
+  return index;
+}
 
-  msgp = (struct msgbuf *) ALLOCA_N (char, sizeof (long) + len);
-  msgp->mtype = NUM2LONG (v_type);
-  memcpy (msgp->mtext, buf, len);
+/* Return the parties whose slot is not +val+. */
 
-  msgid = get_ipcid (obj);
+static VALUE
+sync_late (slots, parties, val)
+     uint32_t *slots;
+     uint32_t parties, val;
+{
+  VALUE ary = rb_ary_new ();
+  uint32_t i;
 
-  nowait = flags & IPC_NOWAIT;
-  if (!rb_thread_alone()) flags |= IPC_NOWAIT;
+  for (i = 0; i < parties; i++)
+    if (ATOMIC_LOAD (&slots[i]) != val)
+      rb_ary_push (ary, UINT2NUM (i));
+  return ary;
+}
 
- retry:
-  TRAP_BEG;
-  error = msgsnd (msgid->id, msgp, len, flags);
-  TRAP_END;
-  if (error == -1)
-    {
-      switch (errno)
-	{
-	case EINTR:
-	    goto retry;
-	case EWOULDBLOCK:
-#if EAGAIN != EWOULDBLOCK
-	case EAGAIN:
-#endif
-	    if (!nowait)
-	      {
-		rb_thread_polling ();
-		goto retry;
-	      }
-	}
-      rb_sys_fail ("msgsnd(2)");
-    }
+/* The count of sleepers is given back even if the wait raises. */
 
-  return obj;
+struct sync_sleep_arg {
+  struct shm_region *region;
+  uint32_t *word, val, *sleepers;
+  uint64_t deadline;
+  int ok;
+};
+
+static VALUE
+sync_sleep_run (ptr)
+     VALUE ptr;
+{
+  struct sync_sleep_arg *a = (struct sync_sleep_arg *)ptr;
+
+  if (ATOMIC_LOAD (a->word) == a->val)
+    a->ok = ipc_wait (a->region->shmid, a->word, a->val, a->deadline);
+  return Qnil;
+}
+
+static VALUE
+sync_sleep_done (ptr)
+     VALUE ptr;
+{
+  struct sync_sleep_arg *a = (struct sync_sleep_arg *)ptr;
+
+  ATOMIC_FETCH_ADD (a->sleepers, -1);
+  return Qnil;
+}
+
+/*
+ * Sleep on +word+ while it is +val+, counted in +sleepers+. Return 0
+ * once +deadline+ has passed.
+ */
+
+static int
+sync_sleep (region, word, val, sleepers, deadline)
+     struct shm_region *region;
+     uint32_t *word, val, *sleepers;
+     uint64_t deadline;
+{
+  struct sync_sleep_arg a;
+
+  a.region = region;
+  a.word = word;
+  a.val = val;
+  a.sleepers = sleepers;
+  a.deadline = deadline;
+  a.ok = 1;
+  ATOMIC_FETCH_ADD (sleepers, 1);
+  ATOMIC_FENCE ();
+  rb_ensure (sync_sleep_run, (VALUE)&a, sync_sleep_done, (VALUE)&a);
+  return a.ok;
+}
+
+static void
+sync_wake (word, sleepers)
+     uint32_t *word, *sleepers;
+{
+  ATOMIC_FENCE ();
+  if (ATOMIC_LOAD (sleepers))
+    ipc_futex_wake (word);
 }
 
 /*
  * call-seq:
- *   recv(mtype, msgsz, msgflg = 0) ->  MessageQueue
+ *   Barrier.bytesize(parties) -> Integer
  *
- * Receive up to +msgsz+ bytes of the next message of type +mtype+
- * with flags +msgflg+. Return self. See msgop(2).
+ * Return the number of bytes of shared memory used by a Barrier of
+ * +parties+ processes.
  */
 
 static VALUE
-rb_msg_recv (argc, argv, obj)
+rb_barrier_s_bytesize (klass, v_parties)
+     VALUE klass, v_parties;
+{
+  return SIZET2NUM (BARRIER_BYTESIZE (sync_parties (v_parties)));
+}
+
+/*
+ * call-seq:
+ *   Barrier.new(shm, offset = 0, parties = nil) -> Barrier
+ *
+ * Return the Barrier stored in the attached SharedMemory +shm+ at
+ * +offset+. If +parties+ is given and there is no barrier there yet,
+ * set one up for that many processes; otherwise use the existing
+ * one.
+ */
+
+static VALUE
+rb_barrier_s_new (argc, argv, klass)
      int argc;
-     VALUE *argv, obj;
+     VALUE *argv, klass;
 {
-  VALUE v_type, v_len, v_flags;
-  int flags = 0, nowait;
-  struct msgbuf *msgp;
-  struct ipcid_ds *msgid;
-  long type;
-  size_t rlen, len;
-  VALUE ret;
+  return sync_new (klass, &barrier_data_type, BARRIER_MAGIC,
+		   sizeof (struct barrier_header), argc, argv);
+}
 
-  rb_scan_args (argc, argv, "21", &v_type, &v_len, &v_flags);
-  type = NUM2LONG (v_type);
-  len = NUM2INT (v_len);
-  if (!NIL_P (v_flags))
-    flags = NUM2INT (v_flags);
+/*
+ * call-seq:
+ *   wait(index, timeout = nil) -> true or false
+ *
+ * Arrive at the barrier as party +index+, from 0 to parties less 1,
+ * and wait for every other party to arrive. Return true in the one
+ * process that arrived last, false in the others; the barrier is then
+ * ready for the next phase. After +timeout+ seconds, take the arrival
+ * back and raise TimeoutError, naming the parties that have not
+ * arrived.
+ */
 
-  msgp = (struct msgbuf *) ALLOCA_N (char, sizeof (long) + len);
-  msgid = get_ipcid (obj);
+/*
+ * Wait for the generation after +gen+, until the deadline; an
+ * interrupt may raise out of it, after which the arrival is taken
+ * back as on timeout.
+ */
+
+struct barrier_wait_arg {
+  VALUE obj;
+  VALUE v_timeout;
+  uint32_t gen;
+  int opened;
+};
 
-  nowait = flags & IPC_NOWAIT;
-  if (!rb_thread_alone()) flags |= IPC_NOWAIT;
+static VALUE
+barrier_wait_run (ptr)
+     VALUE ptr;
+{
+  struct barrier_wait_arg *a = (struct barrier_wait_arg *)ptr;
+  struct barrier_ds *b;
+  struct barrier_header *hdr = get_barrier (a->obj, &b);
+  uint64_t deadline = 0;
+  uint32_t g;
 
- retry:
-  TRAP_BEG;
-  rlen = msgrcv (msgid->id, msgp, len, type, flags);
-  TRAP_END;
-  if (rlen == (size_t)-1)
+  for (;;)
     {
-      switch (errno)
+      g = ATOMIC_LOAD_ACQ (&hdr->generation);
+      if ((int32_t)(g - a->gen) > 0)
 	{
-	case EINTR:
-	    goto retry;
-	case ENOMSG:
-	case EWOULDBLOCK:
-#if EAGAIN != EWOULDBLOCK
-	case EAGAIN:
-#endif
-	    if (!nowait)
-	      {
-		rb_thread_polling ();
-		goto retry;
-	      }
+	  a->opened = 1;
+	  return Qnil;
 	}
-      rb_sys_fail ("msgrcv(2)");
+      if (!deadline)
+	deadline = ipc_deadline (ipc_timeout_ns (a->v_timeout));
+      if (!sync_sleep (&b->region, &hdr->generation, g, &hdr->sleepers,
+		       deadline))
+	return Qnil;
+      hdr = get_barrier (a->obj, &b);
     }
+}
 
-  ret = rb_str_new (msgp->mtext, rlen);
-  return ret;
+/*
+ * Take the arrival of party +index+ in +gen+ back, unless the barrier
+ * opened meanwhile; return whether it did.
+ */
+
+static int
+barrier_withdraw (hdr, gen, index)
+     struct barrier_header *hdr;
+     uint32_t gen, index;
+{
+  uint64_t state;
+
+  do
+    {
+      state = ATOMIC_LOAD (&hdr->state);
+      if ((uint32_t)(state >> 32) != gen)
+	return 0;
+    }
+  while (!ATOMIC_CAS (&hdr->state, state, state - 1));
+  ATOMIC_STORE (&SYNC_SLOTS (hdr)[index], gen);
+  return 1;
 }
 
-static void
-sem_stat (semid)
-     struct ipcid_ds *semid;
+static VALUE
+rb_barrier_wait (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
 {
-  union semun arg;
+  struct barrier_ds *b;
+  struct barrier_header *hdr;
+  struct barrier_wait_arg a;
+  VALUE v_index, v_timeout, late;
+  uint64_t state, next;
+  uint32_t index, gen, *slots;
+  int tag = 0;
+
+  rb_scan_args (argc, argv, "11", &v_index, &v_timeout);
+  hdr = get_barrier (obj, &b);
+  index = sync_index (b, v_index);
+  slots = SYNC_SLOTS (hdr);
+
+  do
+    {
+      state = ATOMIC_LOAD (&hdr->state);
+      gen = (uint32_t)(state >> 32);
+      ATOMIC_STORE (&slots[index], gen + 1);
+      if ((uint32_t)state + 1 >= b->parties)
+	next = (uint64_t)(gen + 1) << 32;
+      else
+	next = state + 1;
+    }
+  while (!ATOMIC_CAS (&hdr->state, state, next));
 
-  arg.buf = &semid->semstat;
-  if (semctl (semid->id, 0, IPC_STAT, arg) == -1)
-    rb_sys_fail ("semctl(2)");
+  if (!(uint32_t)next)
+    {
+      ATOMIC_STORE_REL (&hdr->generation, gen + 1);
+      sync_wake (&hdr->generation, &hdr->sleepers);
+      return Qtrue;
+    }
+
+  a.obj = obj;
+  a.v_timeout = v_timeout;
+  a.gen = gen;
+  a.opened = 0;
+  rb_protect (barrier_wait_run, (VALUE)&a, &tag);
+  if (a.opened)
+    return Qfalse;
+  if (tag)
+    {
+      /* not if it was detached under us */
+      if (b->region.shmid->data)
+	barrier_withdraw (get_barrier (obj, &b), gen, index);
+      rb_jump_tag (tag);
+    }
+
+  hdr = get_barrier (obj, &b);
+  slots = SYNC_SLOTS (hdr);
+  late = sync_late (slots, b->parties, gen + 1);
+  if (!barrier_withdraw (hdr, gen, index))
+    return Qfalse;
+  rb_raise (cTimeoutError, "barrier timed out, late: %"PRIsVALUE, late);
+  return Qnil;			/* not reached */
 }
 
-static struct ipc_perm *
-sem_perm (semid)
-     struct ipcid_ds *semid;
+/*
+ * call-seq:
+ *   late -> Array
+ *
+ * Return the indexes of the parties that have not arrived in the
+ * current phase.
+ */
+
+static VALUE
+rb_barrier_late (obj)
+     VALUE obj;
 {
-  return &semid->semstat.sem_perm;
+  struct barrier_ds *b;
+  struct barrier_header *hdr = get_barrier (obj, &b);
+  uint32_t gen = (uint32_t)(ATOMIC_LOAD (&hdr->state) >> 32);
+
+  return sync_late (SYNC_SLOTS (hdr), b->parties, gen + 1);
 }
 
-static void
-sem_rmid (semid)
-     struct ipcid_ds *semid;
+/*
+ * call-seq:
+ *   waiting -> Integer
+ *
+ * Return the number of parties that have arrived in the current
+ * phase.
+ */
+
+static VALUE
+rb_barrier_waiting (obj)
+     VALUE obj;
 {
-  if (semid->id < 0)
-    rb_raise (cError, "already removed");
-  if (semctl (semid->id, 0, IPC_RMID, 0) == -1)
-    rb_sys_fail ("semctl(2)");
-  semid->id = -1;
+  struct barrier_ds *b;
+
+  return UINT2NUM ((uint32_t)ATOMIC_LOAD (&get_barrier (obj, &b)->state));
 }
 
 /*
  * call-seq:
- *   Semaphore.new(key, nsems, semflg = 0) -> Semaphore
+ *   generation -> Integer
  *
- * Create a new Semaphore object encapsulating the semaphore
- * set identified by +key+. +nsems+ is the number of semaphores
- * in the set, and +semflg+ is a bitwise OR selected from
- * IPC_CREAT and IPC_EXCL. See semget(2).
+ * Return the number of phases completed, modulo 2**32.
  */
 
 static VALUE
-rb_sem_s_new (argc, argv, klass)
+rb_barrier_generation (obj)
+     VALUE obj;
+{
+  struct barrier_ds *b;
+
+  return UINT2NUM ((uint32_t)(ATOMIC_LOAD (&get_barrier (obj, &b)->state)
+			      >> 32));
+}
+
+/*
+ * call-seq:
+ *   parties -> Integer
+ *
+ * Return the number of processes the barrier waits for.
+ */
+
+static VALUE
+rb_barrier_parties (obj)
+     VALUE obj;
+{
+  struct barrier_ds *b;
+
+  TypedData_Get_Struct (obj, struct barrier_ds, &barrier_data_type, b);
+  return UINT2NUM (b->parties);
+}
+
+/*
+ * call-seq:
+ *   CountDownLatch.bytesize(count) -> Integer
+ *
+ * Return the number of bytes of shared memory used by a
+ * CountDownLatch of +count+.
+ */
+
+static VALUE
+rb_latch_s_bytesize (klass, v_count)
+     VALUE klass, v_count;
+{
+  return SIZET2NUM (LATCH_BYTESIZE (sync_parties (v_count)));
+}
+
+/*
+ * call-seq:
+ *   CountDownLatch.new(shm, offset = 0, count = nil) -> CountDownLatch
+ *
+ * Return the CountDownLatch stored in the attached SharedMemory +shm+
+ * at +offset+. If +count+ is given and there is no latch there yet,
+ * set one up that opens after +count+ count-downs; otherwise use the
+ * existing one. A latch opens once and stays open.
+ */
+
+static VALUE
+rb_latch_s_new (argc, argv, klass)
      int argc;
      VALUE *argv, klass;
 {
-  struct ipcid_ds *semid;
-  VALUE dst, v_key, v_nsems, v_semflg;
-  int nsems = 0;
+  return sync_new (klass, &latch_data_type, LATCH_MAGIC,
+		   sizeof (struct latch_header), argc, argv);
+}
 
-  dst = Data_Make_Struct (klass, struct ipcid_ds, NULL, free, semid);
-  rb_scan_args (argc, argv, "12", &v_key, &v_nsems, &v_semflg);
-  if (!NIL_P (v_nsems))
-    nsems = NUM2INT (v_nsems);
-  if (!NIL_P (v_semflg))
-    semid->flags = NUM2INT (v_semflg);
-  semid->id = semget ((key_t)NUM2INT (v_key), nsems, semid->flags);
-  if (semid->id == -1)
-    rb_sys_fail ("semget(2)");
-  semid->stat = sem_stat;
-  semid->perm = sem_perm;
-  semid->rmid = sem_rmid;
+/*
+ * call-seq:
+ *   count_down(index = nil) -> Integer
+ *
+ * Count down by one, and wake the waiting processes if that opens the
+ * latch. Given the +index+ of the party counting down, from 0 to count
+ * less 1, count down only the first time, and remember it for late.
+ * Return the count left.
+ */
 
-  return dst;
+static VALUE
+rb_latch_count_down (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct barrier_ds *b;
+  struct latch_header *hdr;
+  VALUE v_index;
+  uint32_t count;
+
+  rb_scan_args (argc, argv, "01", &v_index);
+  hdr = get_latch (obj, &b);
+  if (!NIL_P (v_index)
+      && !ATOMIC_CAS (&SYNC_SLOTS (hdr)[sync_index (b, v_index)], 0, 1))
+    return UINT2NUM (ATOMIC_LOAD (&hdr->count));
+
+  do
+    if (!(count = ATOMIC_LOAD (&hdr->count)))
+      return INT2FIX (0);
+  while (!ATOMIC_CAS (&hdr->count, count, count - 1));
+
+  if (count == 1)
+    sync_wake (&hdr->count, &hdr->sleepers);
+  return UINT2NUM (count - 1);
 }
 
-#define Check_Valid_Semnum(n, semid)		\
-  if (n > semid->semstat.sem_nsems)		\
-    rb_raise (cError, "invalid semnum")
+/*
+ * call-seq:
+ *   wait(timeout = nil) -> CountDownLatch
+ *
+ * Wait for the latch to open. After +timeout+ seconds, raise
+ * TimeoutError, naming the parties that have not counted down if
+ * count_down was given indexes.
+ */
+
+static VALUE
+rb_latch_wait (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
+{
+  struct barrier_ds *b;
+  struct latch_header *hdr;
+  VALUE v_timeout, late;
+  uint64_t deadline = 0;
+  uint32_t count;
+
+  rb_scan_args (argc, argv, "01", &v_timeout);
+  hdr = get_latch (obj, &b);
+  while ((count = ATOMIC_LOAD_ACQ (&hdr->count)))
+    {
+      if (!deadline)
+	deadline = ipc_deadline (ipc_timeout_ns (v_timeout));
+      if (!sync_sleep (&b->region, &hdr->count, count, &hdr->sleepers,
+		       deadline))
+	{
+	  late = sync_late (SYNC_SLOTS (hdr), b->parties, 1);
+	  if (RARRAY_LEN (late) == (long)b->parties)
+	    rb_raise (cTimeoutError, "latch timed out, %u to go", count);
+	  rb_raise (cTimeoutError, "latch timed out, late: %"PRIsVALUE, late);
+	}
+      hdr = get_latch (obj, &b);
+    }
+  return obj;
+}
 
 /*
  * call-seq:
- *   to_a -> Array
+ *   count -> Integer
  *
- * Return values for the semaphore set as an array. See semctl(2).
+ * Return the count left before the latch opens.
  */
 
 static VALUE
-rb_sem_to_a (obj)
+rb_latch_count (obj)
      VALUE obj;
 {
-  struct ipcid_ds *semid;
-  int i, nsems;
-  VALUE dst;
-  union semun arg;
+  struct barrier_ds *b;
+
+  return UINT2NUM (ATOMIC_LOAD (&get_latch (obj, &b)->count));
+}
+
+/*
+ * call-seq:
+ *   late -> Array
+ *
+ * Return the indexes of the parties that have not counted down.
+ */
+
+static VALUE
+rb_latch_late (obj)
+     VALUE obj;
+{
+  struct barrier_ds *b;
+  struct latch_header *hdr = get_latch (obj, &b);
+
+  return sync_late (SYNC_SLOTS (hdr), b->parties, 1);
+}
+
+/*
+ * ShardedQueue: one logical queue spread over several SysV message
+ * queues, each with its own kernel lock.  Senders pick a shard by
+ * key, for per-key ordering, or in turn; receivers take from their
+ * own shard first and steal from the others when it is empty.
+ * Keys are hashed with CRC32C, which unlike Object#hash is the same
+ * in every process.
+ */
+
+#define SHARDED_MAX 1024
+
+struct sharded_ds {
+  VALUE queues;			/* frozen Array of MessageQueue */
+  long n;
+  long affinity;
+  int steal;
+  unsigned long next;		/* round robin */
+  unsigned long stolen;
+  unsigned long *sent;
+  unsigned long *received;
+};
+
+static void
+sharded_mark (q)
+     struct sharded_ds *q;
+{
+  ipc_gc_mark (q->queues);
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+sharded_compact (q)
+     struct sharded_ds *q;
+{
+  q->queues = ipc_gc_location (q->queues);
+}
+#endif
+
+static void
+sharded_free (q)
+     struct sharded_ds *q;
+{
+  xfree (q->sent);
+  xfree (q);
+}
+
+static size_t
+sharded_memsize (ptr)
+     const void *ptr;
+{
+  const struct sharded_ds *q = ptr;
+
+  return sizeof (*q) + 2 * q->n * sizeof (unsigned long);
+}
 
-  semid = get_ipcid_and_stat (obj);
-  nsems = semid->semstat.sem_nsems;
-  arg.array = (unsigned short int *) ALLOCA_N (unsigned short int, nsems);
+static const rb_data_type_t sharded_data_type = {
+  "SystemVIPC::ShardedQueue",
+  { (void (*) (void *))sharded_mark, (void (*) (void *))sharded_free,
+    sharded_memsize, IPC_DCOMPACT ((void (*) (void *))sharded_compact), },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
 
-  semctl (semid->id, 0, GETALL, arg);
+static struct sharded_ds *
+get_sharded (obj)
+     VALUE obj;
+{
+  struct sharded_ds *q;
 
-  dst = rb_ary_new ();
-  for (i = 0; i < nsems; i++)
-    rb_ary_push (dst, INT2FIX (arg.array[i]));
+  TypedData_Get_Struct (obj, struct sharded_ds, &sharded_data_type, q);
+  return q;
+}
 
-  return dst;
+static struct ipcid_ds *
+sharded_queue (q, i)
+     struct sharded_ds *q;
+     long i;
+{
+  return get_ipcid (rb_ary_entry (q->queues, i));
 }
 
 /*
  * call-seq:
- *   set_all(array) -> Semaphore
+ *   ShardedQueue.new(queues, opts = {}) -> ShardedQueue
  *
- * Set all values of a semaphore to corresponding values from
- * +array+. Return self. See semctl(2).
+ * Return a queue spread over +queues+, an Array of MessageQueue that
+ * every process must give in the same order. Receive first from shard
+ * <tt>opts[:shard]</tt>, by default the process id modulo the number
+ * of shards; with <tt>opts[:steal]</tt> false, never from another.
  */
 
 static VALUE
-rb_sem_set_all (obj, ary)
-     VALUE obj, ary;
+rb_sharded_s_new (argc, argv, klass)
+     int argc;
+     VALUE *argv, klass;
 {
-  struct ipcid_ds *semid;
-  union semun arg;
-  int i, nsems;
+  struct sharded_ds *q;
+  VALUE dst, v_queues, v_opts, v;
+  long i;
+
+  rb_scan_args (argc, argv, "11", &v_queues, &v_opts);
+  Check_Type (v_queues, T_ARRAY);
+  if (!NIL_P (v_opts))
+    Check_Type (v_opts, T_HASH);
+  if (!RARRAY_LEN (v_queues) || RARRAY_LEN (v_queues) > SHARDED_MAX)
+    rb_raise (cError, "invalid number of shards");
+  v_queues = rb_ary_dup (v_queues);
+  for (i = 0; i < RARRAY_LEN (v_queues); i++)
+    rb_check_typeddata (rb_ary_entry (v_queues, i), &msg_data_type);
+  rb_obj_freeze (v_queues);
+
+  dst = TypedData_Make_Struct (klass, struct sharded_ds,
+			       &sharded_data_type, q);
+  q->queues = v_queues;
+  q->n = RARRAY_LEN (v_queues);
+  q->sent = ALLOC_N (unsigned long, 2 * q->n);
+  MEMZERO (q->sent, unsigned long, 2 * q->n);
+  q->received = q->sent + q->n;
+  q->affinity = ipc_getpid () % q->n;
+  if (!NIL_P (v = xfer_opt (v_opts, "shard")))
+    q->affinity = NUM2LONG (v);
+  if (q->affinity < 0 || q->affinity >= q->n)
+    rb_raise (rb_eIndexError, "shard %ld outside of %ld", q->affinity, q->n);
+  q->steal = !RTEST (rb_equal (xfer_opt (v_opts, "steal"), Qfalse));
 
-  semid = get_ipcid_and_stat (obj);
-  nsems = semid->semstat.sem_nsems;
+  return dst;
+}
 
-  if (RARRAY(ary)->len != nsems)
-    rb_raise (cError, "doesn't match with semnum");
+/*
+ * Hash of a String or Integer key that is the same in every process,
+ * for routing keys to shards or stripes.
+ */
 
-  arg.array = (unsigned short int *) ALLOCA_N (unsigned short int, nsems);
-  for (i = 0; i < nsems; i++)
-    arg.array[i] = NUM2INT (RARRAY(ary)->ptr[i]);
-  semctl (semid->id, 0, SETALL, arg);
+static uint32_t
+ipc_key_hash (v_key)
+     VALUE v_key;
+{
+  uint64_t k;
 
-  return obj;
+  if (RB_TYPE_P (v_key, T_STRING))
+    return crc32c (0, RSTRING_PTR (v_key), RSTRING_LEN (v_key));
+  k = (uint64_t)NUM2LL (v_key);
+  return crc32c (0, (const char *)&k, sizeof (k));
+}
+
+static long
+sharded_route (q, v_key)
+     struct sharded_ds *q;
+     VALUE v_key;
+{
+  return ipc_key_hash (v_key) % q->n;
 }
 
 /*
- * call-seq: value(semnum) -> Fixnum
+ * call-seq:
+ *   shard(key) -> Integer
  *
- * Return the value of semaphore +semnum+. See semctl(2).
+ * Return the shard that messages sent with +key+, an Integer or a
+ * String, go to.
  */
 
 static VALUE
-rb_sem_value (obj, v_pos)
-     VALUE obj, v_pos;
+rb_sharded_shard (obj, v_key)
+     VALUE obj, v_key;
 {
-  struct ipcid_ds *semid;
-  int pos;
-  int value;
-
-  semid = get_ipcid_and_stat (obj);
-  pos = NUM2INT (v_pos);
-  Check_Valid_Semnum (pos, semid);
-  value = semctl (semid->id, pos, GETVAL, 0);
-  if (value == -1)
-    rb_sys_fail ("semctl(2)");
-  return INT2FIX (value);
+  return LONG2NUM (sharded_route (get_sharded (obj), v_key));
 }
 
 /*
- * call-seq: set_value(semnum, value) -> Semaphore
- *
- * Set the value of semaphore +semnum+ to +value+. Return self. See
- * semctl(2).
+ * Make one msgsnd or msgrcv of +c+ on shard +i+, without waiting
+ * unless +wait+. Return the result, with errno set when it is -1.
  */
 
-static VALUE
-rb_sem_set_value (obj, v_pos, v_value)
-     VALUE obj, v_pos, v_value;
+static long
+sharded_call (q, i, c, wait)
+     struct sharded_ds *q;
+     long i;
+     struct ipc_call *c;
+     int wait;
 {
-  struct ipcid_ds *semid;
-  int pos;
-  union semun arg;
-
-  semid = get_ipcid_and_stat (obj);
-  pos = NUM2INT (v_pos);
-  Check_Valid_Semnum (pos, semid);
-  arg.val = NUM2INT(v_value);
-  if (semctl (semid->id, pos, SETVAL, arg) == -1)
-    rb_sys_fail ("semctl(2)");
-  return obj;
+  int flags = c->flags;
+  uint64_t t0;
+  long ret;
+
+  c->ipcid = sharded_queue (q, i);
+  if (!wait)
+    c->flags |= IPC_NOWAIT;
+  c->nowait = c->flags & IPC_NOWAIT;
+  t0 = IPC_STATS_BEGIN (c->ipcid);
+  ret = ipc_call (c);
+  c->flags = flags;
+  if (ret != -1)
+    IPC_STATS_END (c->ipcid, c->fn == call_msgsnd ? c->len : (size_t)ret, t0);
+  return ret;
 }
 
 /*
  * call-seq:
- *   n_count(semnum) -> Fixnum
+ *   send(mtype, mtext, key = nil, msgflg = 0) -> ShardedQueue
  *
- * Return the number of processes waiting for the value semaphore
- * +semnum+ to increase. See semctl(2).
- *
- * *Note*: Ruby threads waiting for a semaphore do not increment
- * this counter. In a multi-threaded program, the SystemVIPC
- * module emulates waiting by repeatedly calling the underlying
- * semop(2) with the IPC_NOWAIT flag set and sleeping between calls.
+ * Send message +mtext+ of type +mtype+. With a +key+, send it to the
+ * shard of the key, so that messages of one key stay in order;
+ * otherwise to the next shard with room, in turn, and wait on the
+ * first one if all are full and +msgflg+ lacks IPC_NOWAIT.
  */
 
 static VALUE
-rb_sem_ncnt (obj, v_pos)
-     VALUE obj, v_pos;
+rb_sharded_send (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
 {
-  struct ipcid_ds *semid;
-  int ncnt, pos;
+  struct sharded_ds *q = get_sharded (obj);
+  VALUE v_type, v_buf, v_key, v_flags;
+  struct msgbuf *msgp;
+  struct ipc_call c;
+  long i, start;
+  size_t len;
 
-  semid = get_ipcid_and_stat (obj);
-  pos = NUM2INT (v_pos);
-  Check_Valid_Semnum (pos, semid);
-  ncnt = semctl (semid->id, pos, GETNCNT, 0);
-  if (ncnt == -1)
-    rb_sys_fail ("semctl(2)");
-  return INT2FIX (ncnt);
+  rb_scan_args (argc, argv, "22", &v_type, &v_buf, &v_key, &v_flags);
+  StringValue (v_buf);
+  len = RSTRING_LEN (v_buf);
+  msgp = (struct msgbuf *) ALLOCA_N (char, sizeof (long) + len);
+  msgp->mtype = NUM2LONG (v_type);
+  memcpy (msgp->mtext, RSTRING_PTR (v_buf), len);
+
+  MEMZERO (&c, struct ipc_call, 1);
+  c.fn = call_msgsnd;
+  c.buf = msgp;
+  c.len = len;
+  c.flags = NIL_P (v_flags) ? 0 : NUM2INT (v_flags);
+
+  if (!NIL_P (v_key))
+    start = i = sharded_route (q, v_key);
+  else
+    {
+      start = q->next++ % q->n;
+      for (i = start; ; )
+	{
+	  if (sharded_call (q, i, &c, 0) != -1)
+	    goto sent;
+	  if (!IPC_WOULD_BLOCK (errno))
+	    rb_sys_fail ("msgsnd(2)");
+	  if ((i = (i + 1) % q->n) == start)
+	    break;
+	}
+    }
+  if (sharded_call (q, i, &c, !(c.flags & IPC_NOWAIT)) == -1)
+    rb_sys_fail ("msgsnd(2)");
+
+ sent:
+  q->sent[i]++;
+  return obj;
 }
 
 /*
  * call-seq:
- *   z_count(semnum) -> Fixnum
- *
- * Return the number of processes waiting for the value semaphore
- * +semnum+ to become zero. See semctl(2).
+ *   recv(mtype, msgsz, msgflg = 0, timeout = nil) -> String
  *
- * *Note*: Ruby threads waiting for a semaphore do not increment
- * this counter. In a multi-threaded program, the SystemVIPC
- * module emulates waiting by repeatedly calling the underlying
- * semop(2) with the IPC_NOWAIT flag set and sleeping between calls.
+ * Receive up to +msgsz+ bytes of the next message of type +mtype+,
+ * from this process's shard if it has one, else from the first other
+ * shard that has. When none has, fail as msgrcv(2) does if +msgflg+
+ * has IPC_NOWAIT; otherwise look again after a pause growing from
+ * 16us to 1ms, for at most +timeout+ seconds, then raise
+ * TimeoutError. SysV queues cannot be waited on together, hence the
+ * polling, but a receiver with a single shard waits in msgrcv.
  */
 
 static VALUE
-rb_sem_zcnt (obj, v_pos)
-     VALUE obj, v_pos;
+rb_sharded_recv (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
 {
-  struct ipcid_ds *semid;
-  int zcnt, pos;
+  struct sharded_ds *q = get_sharded (obj);
+  VALUE v_type, v_len, v_flags, v_timeout;
+  struct msgbuf *msgp;
+  struct ipc_call c;
+  uint64_t deadline, nap = IPC_BACKOFF_MIN;
+  long i, k, ret, shards;
+  size_t len;
 
-  semid = get_ipcid_and_stat (obj);
-  pos = NUM2INT (v_pos);
-  Check_Valid_Semnum (pos, semid);
-  zcnt = semctl (semid->id, pos, GETZCNT, 0);
-  if (zcnt == -1)
-    rb_sys_fail ("semctl(2)");
-  return INT2FIX (zcnt);
+  rb_scan_args (argc, argv, "22", &v_type, &v_len, &v_flags, &v_timeout);
+  len = NUM2SIZET (v_len);
+  msgp = (struct msgbuf *) ALLOCA_N (char, sizeof (long) + len);
+
+  MEMZERO (&c, struct ipc_call, 1);
+  c.fn = call_msgrcv;
+  c.buf = msgp;
+  c.len = len;
+  c.type = NUM2LONG (v_type);
+  c.flags = NIL_P (v_flags) ? 0 : NUM2INT (v_flags);
+  shards = q->steal ? q->n : 1;
+  deadline = ipc_deadline (ipc_timeout_ns (v_timeout));
+
+  if (shards == 1 && !(c.flags & IPC_NOWAIT))
+    {
+      c.expires = msg_expires (v_timeout);
+      i = q->affinity;
+      if ((ret = sharded_call (q, i, &c, 1)) == -1)
+	{
+	  if (errno == ETIMEDOUT)
+	    rb_raise (cTimeoutError, "no message");
+	  rb_sys_fail ("msgrcv(2)");
+	}
+      goto received;
+    }
+
+  for (;;)
+    {
+      for (k = 0; k < shards; k++)
+	{
+	  i = (q->affinity + k) % q->n;
+	  if ((ret = sharded_call (q, i, &c, 0)) != -1)
+	    {
+	      q->stolen += k != 0;
+	      goto received;
+	    }
+	  if (!IPC_WOULD_BLOCK (errno))
+	    rb_sys_fail ("msgrcv(2)");
+	}
+      if (c.flags & IPC_NOWAIT)
+	rb_sys_fail ("msgrcv(2)");
+      if (!ipc_backoff (&nap, deadline))
+	rb_raise (cTimeoutError, "no message");
+    }
+
+ received:
+  q->received[i]++;
+  return rb_str_new (msgp->mtext, ret);
 }
 
 /*
  * call-seq:
- *   pid(semnum) -> Fixnum
+ *   queues -> Array
  *
- * Return the PID of the process that executed the last semop()
- * call for semaphore +semnum+. See semctl(2).
+ * Return the MessageQueue of every shard.
  */
 
 static VALUE
-rb_sem_pid (obj, v_pos)
-     VALUE obj, v_pos;
+rb_sharded_queues (obj)
+     VALUE obj;
 {
-  struct ipcid_ds *semid;
-  int pid, pos;
-
-  semid = get_ipcid_and_stat (obj);
-  pos = NUM2INT (v_pos);
-  Check_Valid_Semnum (pos, semid);
-  pid = semctl (semid->id, pos, GETPID, 0);
-  if (pid == -1)
-    rb_sys_fail ("semctl(2)");
-  return INT2FIX (pid);
+  return get_sharded (obj)->queues;
 }
 
 /*
  * call-seq:
- *   size -> Fixnum
+ *   affinity -> Integer
  *
- * Return the number of semaphores in the set.  See semctl(2).
+ * Return the shard this handle receives from first.
  */
 
 static VALUE
-rb_sem_size (obj)
+rb_sharded_affinity (obj)
      VALUE obj;
 {
-  struct ipcid_ds *semid;
-  semid = get_ipcid_and_stat (obj);
-  return INT2FIX (semid->semstat.sem_nsems);
+  return LONG2NUM (get_sharded (obj)->affinity);
 }
 
 /*
  * call-seq:
- *   apply(array) -> Semaphore
+ *   stats -> Hash
  *
- * Apply an +array+ of SemaphoreOperation elements.  See semop(2).
+ * Return the messages sent and received through this handle, by
+ * shard, how many of them came from another shard than its own, and
+ * the number of messages queued in all shards right now.
  */
 
 static VALUE
-rb_sem_apply (obj, ary)
-     VALUE obj, ary;
+rb_sharded_stats (obj)
+     VALUE obj;
 {
-  struct ipcid_ds *semid;
-  struct sembuf *array;
-  int nsops, i, nsems, error, nowait = 0;
-
-  semid = get_ipcid_and_stat (obj);
-  nsems = semid->semstat.sem_nsems;
-  nsops = RARRAY(ary)->len;
-  array = (struct sembuf *) ALLOCA_N (struct sembuf, nsems);
-  for (i = 0; i < nsops; i++)
-    {
-      struct sembuf *op;
-      Data_Get_Struct (RARRAY(ary)->ptr[i], struct sembuf, op);
-      nowait = nowait || (op->sem_flg & IPC_NOWAIT);
-      if (!rb_thread_alone()) op->sem_flg |= IPC_NOWAIT;
-      memcpy (&array[i], op, sizeof (struct sembuf));
-      Check_Valid_Semnum (array[i].sem_num, semid);
-    }
-      
- retry:
-  TRAP_BEG;
-  error = semop (semid->id, array, nsops);
-  TRAP_END;
-  if (error == -1)
+  struct sharded_ds *q = get_sharded (obj);
+  struct ipcid_ds *msgid;
+  union ipc_stat st;
+  VALUE hash = rb_hash_new (), sent, received;
+  unsigned long qnum = 0;
+  long i;
+
+  sent = rb_ary_new2 (q->n);
+  received = rb_ary_new2 (q->n);
+  for (i = 0; i < q->n; i++)
     {
-      switch (errno)
-	{
-	case EINTR:
-	    goto retry;
-	case EWOULDBLOCK:
-#if EAGAIN != EWOULDBLOCK
-	case EAGAIN:
-#endif
-	  if (!nowait)
-	    {
-	      rb_thread_polling ();
-	      goto retry;
-	    }
-	}
-	rb_sys_fail ("semop(2)");
+      rb_ary_push (sent, ULONG2NUM (q->sent[i]));
+      rb_ary_push (received, ULONG2NUM (q->received[i]));
+      msgid = sharded_queue (q, i);
+      msgid->stat (msgid, &st);
+      qnum += st.msgstat.msg_qnum;
     }
-
-  return obj;
+  rb_hash_aset (hash, ID2SYM (rb_intern ("sent")), sent);
+  rb_hash_aset (hash, ID2SYM (rb_intern ("received")), received);
+  rb_hash_aset (hash, ID2SYM (rb_intern ("stolen")), ULONG2NUM (q->stolen));
+  rb_hash_aset (hash, ID2SYM (rb_intern ("qnum")), ULONG2NUM (qnum));
+  return hash;
 }
 
+/*
+ * LockTable: locks on any number of keys, hashed onto stripes, the
+ * semaphores of one or more sets.  The keys of a transaction are
+ * taken together, sorted by stripe, with one semop per set and the
+ * sets in order, so that two transactions never wait on each other
+ * in a cycle.
+ */
+
+#define LOCK_TABLE_MAX 1024
+#define LOCK_TABLE_MAX_KEYS 4096
+
+struct lock_table_ds {
+  VALUE sems;			/* frozen Array of Semaphore */
+  long n;
+  long stripes;
+  long *base;			/* first stripe of each set */
+  short sem_flg;
+};
+
+/* The stripes of a set of keys, while they are being held. */
+
+struct lock_table_held {
+  struct lock_table_ds *t;
+  long n;
+  long *s;
+  struct sembuf *ops;
+  short *flg;
+};
+
 static void
-shm_stat (shmid)
-     struct ipcid_ds *shmid;
+lock_table_mark (t)
+     struct lock_table_ds *t;
 {
-  if (shmctl (shmid->id, IPC_STAT, &shmid->shmstat) == -1)
-    rb_sys_fail ("shmctl(2)");
+  ipc_gc_mark (t->sems);
 }
 
-static struct ipc_perm *
-shm_perm (shmid)
-     struct ipcid_ds *shmid;
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void
+lock_table_compact (t)
+     struct lock_table_ds *t;
 {
-  return &shmid->shmstat.shm_perm;
+  t->sems = ipc_gc_location (t->sems);
 }
+#endif
 
 static void
-shm_rmid (shmid)
-     struct ipcid_ds *shmid;
+lock_table_free (t)
+     struct lock_table_ds *t;
 {
-  if (shmid->id < 0)
-    rb_raise (cError, "already removed");
-  if (shmctl (shmid->id, IPC_RMID, 0) == -1)
-    rb_sys_fail ("shmctl(2)");
-  shmid->id = -1;
+  xfree (t->base);
+  xfree (t);
 }
 
-/*
- * call-seq:
- *   SharedMemory.new(key, size = 0, shmflg = 0) -> SharedMemory
- *
- * Return a SharedMemory object encapsulating the
- * shared memory segment associated with +key+. See shmget(2).
- */
-
-static VALUE
-rb_shm_s_new (argc, argv, klass)
-     int argc;
-     VALUE *argv, klass;
+static size_t
+lock_table_memsize (ptr)
+     const void *ptr;
 {
-  struct ipcid_ds *shmid;
-  VALUE dst, v_key, v_size, v_shmflg;
-  int size = 0;
-
-  dst = Data_Make_Struct (klass, struct ipcid_ds, NULL, free, shmid);
-  rb_scan_args (argc, argv, "12", &v_key, &v_size, &v_shmflg);
-  if (!NIL_P (v_size))
-    size = NUM2INT (v_size);
-  if (!NIL_P (v_shmflg))
-    shmid->flags = NUM2INT (v_shmflg);
-  shmid->id = shmget ((key_t)NUM2INT (v_key), size, shmid->flags);
-  if (shmid->id == -1)
-    rb_sys_fail ("shmget(2)");
-  shmid->stat = shm_stat;
-  shmid->perm = shm_perm;
-  shmid->rmid = shm_rmid;
+  const struct lock_table_ds *t = ptr;
 
-  return dst;
+  return sizeof (*t) + (t->n + 1) * sizeof (long);
 }
 
-/*
- * call-seq:
- *   attach(shmflg = 0) -> SharedMemory
- *
- * Attach the shared memory segment. See shmat(2).
- */
+static const rb_data_type_t lock_table_data_type = {
+  "SystemVIPC::LockTable",
+  { (void (*) (void *))lock_table_mark, (void (*) (void *))lock_table_free,
+    lock_table_memsize,
+    IPC_DCOMPACT ((void (*) (void *))lock_table_compact), },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
 
-static VALUE
-rb_shm_attach (argc, argv, obj)
-     int argc;
-     VALUE *argv, obj;
+static struct lock_table_ds *
+get_lock_table (obj)
+     VALUE obj;
 {
-  VALUE v_flags;
-  struct ipcid_ds *shmid;
-  int flags = 0;
-  void *data;
-
-  shmid = get_ipcid (obj);
-  if (shmid->data)
-    rb_raise (cError, "already attached");
-
-  rb_scan_args (argc, argv, "01", &v_flags);
-  if (!NIL_P (v_flags))
-    flags = NUM2INT (v_flags);
-
-  data = shmat (shmid->id, 0, flags);
-  if (data == (void*)-1)
-    rb_sys_fail ("shmat(2)");
-  shmid->data = data;
+  struct lock_table_ds *t;
 
-  return obj;
+  TypedData_Get_Struct (obj, struct lock_table_ds, &lock_table_data_type, t);
+  return t;
 }
 
-/*
- * call-seq:
- *   detach -> SharedMemory
- *
- * Detach the shared memory segment. See shmdt(2).
- */
-
-static VALUE
-rb_shm_detach (obj)
-     VALUE obj;
+static struct ipcid_ds *
+lock_table_sem (t, i)
+     struct lock_table_ds *t;
+     long i;
 {
-  struct ipcid_ds *shmid;
+  return get_ipcid (rb_ary_entry (t->sems, i));
+}
 
-  shmid = get_ipcid (obj);
-  if (!shmid->data)
-    rb_raise (cError, "already detached");
+/* Return the set that holds stripe +s+. */
 
-  if (shmdt (shmid->data) == -1)
-    rb_sys_fail ("shmdt(2)");
-  shmid->data = NULL;
+static long
+lock_table_set (t, s)
+     struct lock_table_ds *t;
+     long s;
+{
+  long lo = 0, hi = t->n - 1, mid;
 
-  return obj;
+  while (lo < hi)
+    {
+      mid = (lo + hi + 1) / 2;
+      if (t->base[mid] <= s)
+	lo = mid;
+      else
+	hi = mid - 1;
+    }
+  return lo;
 }
 
-#define Check_Valid_Shm_Segsz(n, shmid)		\
-  if (n > shmid->shmstat.shm_segsz)		\
-    rb_raise (cError, "invalid shm_segsz")
-
 /*
  * call-seq:
- *   read(len = 0, offset = 0) -> String
+ *   LockTable.new(sems, opts = {}) -> LockTable
  *
- * Read +len+ bytes from the shared memory segment starting at
- * optional +offset+.
+ * Return a table of locks striped over every semaphore of +sems+, a
+ * Semaphore or an Array of Semaphore that every process must give in
+ * the same order. Each semaphore must have been set to 1, see #reset.
+ * Locks are taken with SEM_UNDO, so that the kernel gives them back
+ * if the process dies holding them, unless <tt>opts[:undo]</tt> is
+ * false.
  */
 
 static VALUE
-rb_shm_read (argc, argv, obj)
+rb_lock_table_s_new (argc, argv, klass)
      int argc;
-     VALUE *argv, obj;
+     VALUE *argv, klass;
 {
-  struct ipcid_ds *shmid;
-  VALUE v_len, v_offset;
-  int len, offset = 0;
-
-  shmid = get_ipcid (obj);
-  if (!shmid->data)
-    rb_raise (cError, "detached memory");
-  shmid->stat (shmid);
-
-  len = shmid->shmstat.shm_segsz;
+  struct lock_table_ds *t;
+  union ipc_stat st;
+  VALUE dst, v_sems, v_opts;
+  long i;
+
+  rb_scan_args (argc, argv, "11", &v_sems, &v_opts);
+  if (!RB_TYPE_P (v_sems, T_ARRAY))
+    v_sems = rb_ary_new3 (1, v_sems);
+  if (!NIL_P (v_opts))
+    Check_Type (v_opts, T_HASH);
+  if (!RARRAY_LEN (v_sems) || RARRAY_LEN (v_sems) > LOCK_TABLE_MAX)
+    rb_raise (cError, "invalid number of semaphore sets");
+  v_sems = rb_ary_dup (v_sems);
+  for (i = 0; i < RARRAY_LEN (v_sems); i++)
+    rb_check_typeddata (rb_ary_entry (v_sems, i), &sem_data_type);
+  rb_obj_freeze (v_sems);
+
+  dst = TypedData_Make_Struct (klass, struct lock_table_ds,
+			       &lock_table_data_type, t);
+  t->sems = v_sems;
+  t->base = ALLOC_N (long, RARRAY_LEN (v_sems) + 1);
+  t->n = RARRAY_LEN (v_sems);
+  t->base[0] = 0;
+  for (i = 0; i < t->n; i++)
+    t->base[i + 1] = t->base[i]
+      + (get_ipcid_and_stat (rb_ary_entry (v_sems, i), &st),
+	 st.semstat.sem_nsems);
+  t->stripes = t->base[t->n];
+  t->sem_flg = RTEST (rb_equal (xfer_opt (v_opts, "undo"), Qfalse))
+    ? 0 : SEM_UNDO;
 
-  rb_scan_args (argc, argv, "11", &v_len, &v_offset);
-  if (!NIL_P (v_len))
-    len = NUM2INT (v_len);
-  if (!NIL_P (v_offset))
-    offset = NUM2INT (v_offset);
-  Check_Valid_Shm_Segsz (len + offset, shmid);
+  return dst;
+}
 
-  return rb_str_new (shmid->data + offset, len);
+static long
+lock_table_stripe (t, v_key)
+     struct lock_table_ds *t;
+     VALUE v_key;
+{
+  return ipc_key_hash (v_key) % t->stripes;
 }
 
 /*
  * call-seq:
- *   write(buf, offset = 0) -> SharedMemory
+ *   stripe(key) -> Integer
  *
- * Write data from +buf+ to the shared memory segment at
- * optional +offset+ offset.
+ * Return the stripe that guards +key+, an Integer or a String,
+ * counting the semaphores of all sets in order.
  */
 
 static VALUE
-rb_shm_write (argc, argv, obj)
-     int argc;
-     VALUE *argv, obj;
+rb_lock_table_stripe (obj, v_key)
+     VALUE obj, v_key;
 {
-  struct ipcid_ds *shmid;
-  int i, len, offset = 0;
-  char *buf;
-  VALUE v_buf;
-
-  shmid = get_ipcid (obj);
-  if (!shmid->data)
-    rb_raise (cError, "detached memory");
-  shmid->stat (shmid);
+  return LONG2NUM (lock_table_stripe (get_lock_table (obj), v_key));
+}
 
-  v_buf = argv[0];
+static int
+lock_table_cmp (a, b)
+     const void *a, *b;
+{
+  long x = *(const long *)a, y = *(const long *)b;
 
-  if (argc == 2)
-    offset = NUM2INT (argv[1]);
+  return (x > y) - (x < y);
+}
 
-  len = RSTRING_LEN(v_buf);
-  Check_Valid_Shm_Segsz (len + offset, shmid);
+/* Fill +h+, whose arrays have room for every key, for +v_keys+. */
 
-  buf = shmid->data + offset;
+static void
+lock_table_hold (h, v_keys)
+     struct lock_table_held *h;
+     VALUE v_keys;
+{
+  struct lock_table_ds *t = h->t;
+  long i, n = 0, set;
+
+  for (i = 0; i < h->n; i++)
+    h->s[i] = lock_table_stripe (t, rb_ary_entry (v_keys, i));
+  qsort (h->s, h->n, sizeof (long), lock_table_cmp);
+  for (i = 0; i < h->n; i++)
+    if (!n || h->s[i] != h->s[n - 1])
+      h->s[n++] = h->s[i];
+  h->n = n;
+  for (i = 0; i < n; i++)
+    {
+      set = lock_table_set (t, h->s[i]);
+      h->ops[i].sem_num = h->s[i] - t->base[set];
+      h->flg[i] = t->sem_flg;
+    }
+}
 
-  for (i = 0; i < len; i++)
-    *buf++ = RSTRING_PTR(v_buf)[i];
+static long
+lock_table_keys (v_keys)
+     VALUE v_keys;
+{
+  long n = RARRAY_LEN (v_keys);
 
-  return obj;
+  if (n > LOCK_TABLE_MAX_KEYS)
+    rb_raise (cError, "too many keys");
+  return n;
 }
 
 /*
- * call-seq:
- *   size -> Fixnum
- *
- * Return the size of the shared memory segment.
+ * Fill +h+ for +v_keys+, with its arrays on the caller's stack, which
+ * is why the keys are bounded.
  */
 
-static VALUE
-rb_shm_size (obj)
-     VALUE obj;
-{
-  struct ipcid_ds *shmid;
-  shmid = get_ipcid_and_stat (obj);
-  return INT2FIX (shmid->shmstat.shm_segsz);
-}
+#define LOCK_TABLE_HOLD(h, obj, v_keys) do {		\
+    if (!RB_TYPE_P ((v_keys), T_ARRAY))			\
+      (v_keys) = rb_ary_new3 (1, (v_keys));		\
+    (h).t = get_lock_table (obj);			\
+    (h).n = lock_table_keys (v_keys);			\
+    (h).s = ALLOCA_N (long, (h).n);			\
+    (h).ops = ALLOCA_N (struct sembuf, (h).n);		\
+    (h).flg = ALLOCA_N (short, (h).n);			\
+    lock_table_hold (&(h), (v_keys));			\
+  } while (0)
 
 /*
- * call-seq:
- *   SemaphoreOperation.new(pos, value, flags = 0) -> SemaphoreOperation
- *
- * Create a new SemaphoreOperation. +pos+ is an index identifying
- * a particular semaphore within a semaphore set. +value+ is the
- * value to added or subtracted from the semaphore. +flags+ is a
- * bitwise OR selected from IPC_NOWAIT and SEM_UNDO. See semop(2).
+ * One semop of lock_table_apply: the stripes of the set of stripe
+ * +i+ of +h+, up to +j+.  The ipc_call stays in the struct, so that
+ * when an interrupt raises out of it the caller can tell whether the
+ * semop had already taken them.
  */
 
+struct lock_table_step {
+  struct lock_table_held *h;
+  long i, j;
+  int delta;
+  uint64_t expires;
+  struct ipc_call c;
+  long ret;
+  int err;
+};
+
 static VALUE
-rb_semop_s_new (argc, argv, klass)
-     int argc;
-     VALUE *argv, klass;
+lock_table_step_run (ptr)
+     VALUE ptr;
 {
-  struct sembuf *op;
-  VALUE dst, v_pos, v_value, v_flags;
-
-  dst = Data_Make_Struct (klass, struct sembuf, NULL, free, op);
-  rb_scan_args (argc, argv, "21", &v_pos, &v_value, &v_flags);
-  op->sem_num = NUM2INT (v_pos);
-  op->sem_op = NUM2INT (v_value);
-  if (!NIL_P (v_flags))
-    op->sem_flg = NUM2INT (v_flags);
-
-  return dst;
+  struct lock_table_step *a = (struct lock_table_step *)ptr;
+  struct lock_table_held *h = a->h;
+  struct ipcid_ds *semid;
+  long set;
+  uint64_t t0;
+
+  set = lock_table_set (h->t, h->s[a->i]);
+  for (a->j = a->i; a->j < h->n && h->s[a->j] < h->t->base[set + 1]; a->j++)
+    h->ops[a->j].sem_op = a->delta;
+  semid = lock_table_sem (h->t, set);
+
+  a->c.ipcid = semid;
+  a->c.fn = call_semop;
+  a->c.buf = h->ops + a->i;
+  a->c.len = a->j - a->i;
+  a->c.sem_flg = h->flg + a->i;
+  a->c.nowait = a->delta > 0;
+  a->c.expires = a->delta > 0 ? 0 : a->expires;
+
+  t0 = IPC_STATS_BEGIN (semid);
+  a->ret = ipc_call (&a->c);
+  a->err = errno;
+  if (a->ret != -1)
+    IPC_STATS_END (semid, 0, t0);
+  return Qnil;
 }
 
 /*
- * call-seq:
- *   pos -> Fixnum
- *
- * Return the operation semaphore position. See semop(2).
+ * Apply +delta+ to the stripes of +h+, one semop per set, in set
+ * order. When taking them fails, or an interrupt raises meanwhile,
+ * give back the sets already taken. Return 0, or -1 and errno.
  */
 
-static VALUE
-rb_semop_pos (obj)
-     VALUE obj;
+static int
+lock_table_apply (h, delta, expires)
+     struct lock_table_held *h;
+     int delta;
+     uint64_t expires;
 {
-  struct sembuf *op;
-
-  Data_Get_Struct (obj, struct sembuf, op);
-  return INT2FIX (op->sem_num);
+  struct lock_table_held done;
+  struct lock_table_step a;
+  long i, taken;
+  int tag = 0;
+
+  a.h = h;
+  a.delta = delta;
+  a.expires = expires;
+  for (i = 0; i < h->n; i = a.j)
+    {
+      a.i = a.j = i;
+      a.ret = -1;
+      MEMZERO (&a.c, struct ipc_call, 1);
+      a.c.ret = -1;
+      if (delta < 0)
+	rb_protect (lock_table_step_run, (VALUE)&a, &tag);
+      else
+	lock_table_step_run ((VALUE)&a);
+      if (!tag && a.ret != -1)
+	continue;
+
+      /* the semop of a raise may have run to completion */
+      taken = tag && a.c.ret != -1 ? a.j : i;
+      if (delta < 0 && taken)
+	{
+	  done = *h;
+	  done.n = taken;
+	  lock_table_apply (&done, -delta, 0);
+	}
+      if (tag)
+	rb_jump_tag (tag);
+      errno = a.err;
+      return -1;
+    }
+  return 0;
 }
 
-/*
- * call-seq:
- *   value -> Fixnum
- *
- * Return the operation value. See semop(2).
- */
-
-static VALUE
-rb_semop_value (obj)
-     VALUE obj;
+static void
+lock_table_lock (h, v_timeout)
+     struct lock_table_held *h;
+     VALUE v_timeout;
 {
-  struct sembuf *op;
-
-  Data_Get_Struct (obj, struct sembuf, op);
-  return INT2FIX (op->sem_op);
+  if (lock_table_apply (h, -1, msg_expires (v_timeout)) == -1)
+    {
+      if (errno == ETIMEDOUT)
+	rb_raise (cTimeoutError, "locks not acquired");
+      rb_sys_fail ("semop(2)");
+    }
 }
 
-/*
- * call-seq:
- *   flags -> Fixnum
- *
- * Return the operation flags. See semop(2).
- */
-
 static VALUE
-rb_semop_flags (obj)
-     VALUE obj;
+lock_table_unlock (ptr)
+     VALUE ptr;
 {
-  struct sembuf *op;
-
-  Data_Get_Struct (obj, struct sembuf, op);
-  return INT2FIX (op->sem_flg);
+  if (lock_table_apply ((struct lock_table_held *)ptr, 1, 0) == -1)
+    rb_sys_fail ("semop(2)");
+  return Qnil;
 }
 
-/* call-seq:
- *   Permission.new(ipcobject) -> Permission
+/*
+ * call-seq:
+ *   lock(keys, timeout = nil) -> LockTable
  *
- * Create a Permission object for +ipcobject+.
+ * Take the locks of +keys+, a key or an Array of keys, all at once:
+ * the stripes of each set in one semop(2), at most SEMOPM of them,
+ * of at most 4096 keys. Wait at most +timeout+ seconds, then give back any lock already
+ * taken and raise TimeoutError. Take every key of a transaction in
+ * one call; taking more while holding some can deadlock.
  */
 
 static VALUE
-rb_perm_s_new (klass, v_ipcid)
-     VALUE klass, v_ipcid;
+rb_lock_table_lock (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
 {
-  struct ipcid_ds *ipcid;
+  struct lock_table_held h;
+  VALUE v_keys, v_timeout;
 
-  Data_Get_Struct (v_ipcid, struct ipcid_ds, ipcid);
-  ipcid->stat (ipcid);
-
-  return Data_Wrap_Struct (klass, NULL, NULL, ipcid->perm (ipcid));
+  rb_scan_args (argc, argv, "11", &v_keys, &v_timeout);
+  LOCK_TABLE_HOLD (h, obj, v_keys);
+  lock_table_lock (&h, v_timeout);
+  return obj;
 }
 
 /*
  * call-seq:
- *   cuid -> Fixnum
+ *   unlock(keys) -> LockTable
  *
- * Return effective UID of creator.
+ * Give back the locks of +keys+, taken with #lock.
  */
 
 static VALUE
-rb_perm_cuid (obj)
-     VALUE obj;
+rb_lock_table_unlock (obj, v_keys)
+     VALUE obj, v_keys;
 {
-  struct ipc_perm *perm;
+  struct lock_table_held h;
 
-  Data_Get_Struct (obj, struct ipc_perm, perm);
-  return INT2FIX (perm->cuid);
+  LOCK_TABLE_HOLD (h, obj, v_keys);
+  lock_table_unlock ((VALUE)&h);
+  return obj;
 }
 
 /*
  * call-seq:
- *   cgid -> Fixnum
+ *   synchronize(keys, timeout = nil) { ... } -> obj
  *
- * Return effective GID of creator.
+ * Take the locks of +keys+ as #lock does, run the block and give them
+ * back, even if the block raises. Return the value of the block.
  */
 
 static VALUE
-rb_perm_cgid (obj)
-     VALUE obj;
+rb_lock_table_synchronize (argc, argv, obj)
+     int argc;
+     VALUE *argv, obj;
 {
-  struct ipc_perm *perm;
-
-  Data_Get_Struct (obj, struct ipc_perm, perm);
-  return INT2FIX (perm->cgid);
+  struct lock_table_held h;
+  VALUE v_keys, v_timeout;
+
+  rb_scan_args (argc, argv, "11", &v_keys, &v_timeout);
+  rb_need_block ();
+  LOCK_TABLE_HOLD (h, obj, v_keys);
+  lock_table_lock (&h, v_timeout);
+  return rb_ensure (rb_yield, obj, lock_table_unlock, (VALUE)&h);
 }
 
 /*
  * call-seq:
- *   uid -> Fixnum
+ *   reset -> LockTable
  *
- * Return effective UID of owner.
+ * Set every stripe to 1, unlocked. Only call it while no process
+ * holds or waits for a lock.
  */
 
 static VALUE
-rb_perm_uid (obj)
+rb_lock_table_reset (obj)
      VALUE obj;
 {
-  struct ipc_perm *perm;
-
-  Data_Get_Struct (obj, struct ipc_perm, perm);
-  return INT2FIX (perm->uid);
+  struct lock_table_ds *t = get_lock_table (obj);
+  struct ipcid_ds *semid;
+  union semun arg;
+  long i, k, nsems = 0;
+
+  for (i = 0; i < t->n; i++)
+    if (nsems < t->base[i + 1] - t->base[i])
+      nsems = t->base[i + 1] - t->base[i];
+  arg.array = ALLOCA_N (unsigned short int, nsems);
+  for (k = 0; k < nsems; k++)
+    arg.array[k] = 1;
+  for (i = 0; i < t->n; i++)
+    {
+      semid = lock_table_sem (t, i);
+      if (ipc_semctl (semid->id, 0, SETALL, &arg) == -1)
+	rb_sys_fail ("semctl(2)");
+    }
+  return obj;
 }
 
 /*
  * call-seq:
- *   gid -> Fixnum
+ *   stripes -> Integer
  *
- * Return effective GID of owner.
+ * Return the number of stripes, the semaphores of all sets.
  */
 
 static VALUE
-rb_perm_gid (obj)
+rb_lock_table_stripes (obj)
      VALUE obj;
 {
-  struct ipc_perm *perm;
-
-  Data_Get_Struct (obj, struct ipc_perm, perm);
-  return INT2FIX (perm->gid);
+  return LONG2NUM (get_lock_table (obj)->stripes);
 }
 
 /*
  * call-seq:
- *   mode -> Fixnum
+ *   semaphores -> Array
  *
- * Return mode bits.
+ * Return the Semaphore sets of the table.
  */
 
 static VALUE
-rb_perm_mode (obj)
+rb_lock_table_semaphores (obj)
      VALUE obj;
 {
-  struct ipc_perm *perm;
-
-  Data_Get_Struct (obj, struct ipc_perm, perm);
-  return INT2FIX (perm->mode);
+  return get_lock_table (obj)->sems;
 }
 
 /*
@@ -1161,10 +12074,247 @@ rb_perm_mode (obj)
  *
  *     data = sh.read(100);
  *
+ * Search and compare in place, without reading the segment out:
+ *
+ *     off = sh.index('needle', :offset => 4096)
+ *     sum = sh.checksum
+ *     sh.diff_ranges(saved).each { |off, len| ... }
+ *
+ * Update it under a lock, semaphore 0 of +sm+ set to 1, in a single
+ * call that takes the lock, copies and gives it back:
+ *
+ *     sh.locked_write(sm, 0, record, 4096, :undo => true)
+ *     hits = sh.locked_increment(sm, 0, 64)
+ *     sh.synchronize(sm, 0, :timeout => 1) { ... }
+ *
  * Detach shared memory:
  *
  *     sh.detach
  *
+ * === Snapshots
+ *
+ * Publish a value from one process:
+ *
+ *     snap = Snapshot.new(sh, 0, 4096)
+ *     snap.publish(table)
+ *
+ * Read the latest value from any number of others, without locks:
+ *
+ *     table = Snapshot.new(sh).read
+ *
+ * === Broadcast
+ *
+ * Set up a 1 MiB ring and publish to every subscriber at once:
+ *
+ *     bc = Broadcast.new(sh, 0, 1 << 20)
+ *     bc.publish('event')
+ *
+ * In each subscriber, read everything published since the last call:
+ *
+ *     sub = Broadcast.new(sh).subscribe
+ *     events = sub.read
+ *
+ * === Saving segments
+ *
+ * Keep a segment across reboots; later saves only write what changed:
+ *
+ *     sh.save('/var/cache/app.shm')
+ *     sh = SharedMemory.restore('/var/cache/app.shm', key)
+ *
+ * === Ractors
+ *
+ * Frozen MessageQueue, Semaphore and SharedMemory objects, with their
+ * POSIX counterparts, can be shared between Ractors; settings such as
+ * statistics and attachment must be made before freezing, and removal
+ * takes a handle that is not frozen. Or pass the identifier and
+ * reopen:
+ *
+ *     mq = Ractor.make_shareable(mq)
+ *     Ractor.new(mq) { |q| q.recv(1, 100) }
+ *     Ractor.new(sh.id) { |id| SharedMemory.for_id(id).attach }
+ *
+ * === Busy polling
+ *
+ * Where a millisecond matters more than a CPU, spin before blocking,
+ * on a core of its own:
+ *
+ *     SystemVIPC.set_affinity([3])
+ *     mq.enable_busy_poll(10000, 50)     # at most 10000 turns or 50 us
+ *     mq.recv(1, 100)
+ *
+ * === Bitmaps and Bloom filters
+ *
+ * Bits any process sets and tests with atomic operations, and a Bloom
+ * filter to drop duplicates seen by any worker:
+ *
+ *     bloom = SharedBloomFilter.new(sh, 0, 10 * expected_keys)
+ *     handle(event) if bloom.add(event.id)     # true the first time
+ *     bloom.include_many(ids)                  # => [true, false, ...]
+ *
+ * === Metrics
+ *
+ * Counters, gauges and histograms every worker updates without
+ * locks, and a scraper reads summed up:
+ *
+ *     metrics = Metrics.new(sh, 0, :metrics => 64, :processes => 32)
+ *     requests = metrics.counter('requests')
+ *     latency = metrics.histogram('latency', [0.001, 0.01, 0.1, 1])
+ *     requests.increment
+ *     latency.observe(elapsed)
+ *     Metrics.new(sh).snapshot   # => {"requests" => 1234, ...}
+ *
+ * === RPC
+ *
+ * Requests and replies over a MessageQueue, with many requests
+ * outstanding at once and a deadline for each:
+ *
+ *     RPC::Server.new(mq, :batch => 32).serve { |body| handle(body) }
+ *
+ *     client = RPC::Client.new(mq)
+ *     client.call('ping', 0.5)                   # => reply or TimeoutError
+ *     ids = bodies.map { |b| client.request(b, 1) }
+ *     replies = ids.map { |id| client.response(id) }
+ *
+ * Bodies longer than <tt>:msgmax</tt> go through an arena of shared
+ * memory given as <tt>:arena</tt> to both sides. Under heavy
+ * pipelining, give the replies a queue of their own with
+ * <tt>:replies</tt>, so that a queue full of requests cannot hold
+ * them up. MessageQueue#send and #recv take a timeout too; as SysV
+ * queues have no timed operations, such waits poll.
+ *
+ * === Task pools
+ *
+ * Work stealing between worker processes, each with a deque of 64-bit
+ * tasks in shared memory, for instance offsets of records:
+ *
+ *     pool = TaskPool.new(sh, 0, :workers => 8, :capacity => 4096)
+ *     seed = pool.worker(0)
+ *     jobs.each { |j| seed.push(j) }
+ *     8.times do |i|
+ *       fork do
+ *         w = pool.worker(i)
+ *         while task = w.pop
+ *           work(task) { |more| w.push(more) }
+ *         end
+ *       end
+ *     end
+ *     pool.close
+ *
+ * A worker takes its own tasks newest first and steals the oldest of
+ * others when it runs out; pop returns nil when all work is done.
+ *
+ * === Shared structs
+ *
+ * Lay records out once and read and write their fields in place,
+ * with no offsets to keep track of nor Strings to unpack:
+ *
+ *     Stat = SharedStruct.define(:pid => :int32, :count => :uint64,
+ *                                :name => [:char, 16])
+ *     stats = Stat.new(sh, 0, 64)
+ *     stats[i].count = stats.count(i) + 1
+ *
+ * Pass <tt>:cacheline => true</tt> to give each element a cache line
+ * of its own.
+ *
+ * === Barriers and latches
+ *
+ * Hold N worker processes at the end of each phase until all of
+ * them get there, phase after phase:
+ *
+ *     barrier = Barrier.new(sh, 0, 8)
+ *     8.times do |i|
+ *       fork do
+ *         phases.each { |ph| ph.run(i); barrier.wait(i, 60) }
+ *       end
+ *     end
+ *
+ * On timeout, wait raises TimeoutError with the parties still
+ * missing. A CountDownLatch opens once, for instance when every
+ * worker is ready:
+ *
+ *     ready = CountDownLatch.new(sh, 4096, 8)
+ *     ready.count_down(i)     # in worker i
+ *     ready.wait(10)          # in the parent
+ *
+ * === Sharded queues
+ *
+ * One busy queue serializes every sender and receiver on its lock. A
+ * ShardedQueue spreads the traffic over several queues:
+ *
+ *     queues = (0...4).map { |i| MessageQueue.new(key + i, IPC_CREAT | 0660) }
+ *     sq = ShardedQueue.new(queues, :shard => worker_id)
+ *     sq.send(1, job, job_id)     # same job_id, same queue
+ *     sq.recv(0, 8192)            # own queue first, then steals
+ *
+ * Keys are hashed with CRC32C, so every process routes a key to the
+ * same queue. Without a key, messages go round robin. Messages keep
+ * their order within a queue only.
+ *
+ * === Lock tables
+ *
+ * A LockTable guards any number of records with the semaphores of a
+ * few sets, each key hashed onto one of them:
+ *
+ *     sems = (0...4).map { |i| Semaphore.new(key + i, 250, IPC_CREAT | 0660) }
+ *     locks = LockTable.new(sems)
+ *     locks.reset                  # once, by the creator
+ *     locks.synchronize([from, to], 5) { transfer(from, to) }
+ *
+ * The locks of a transaction are taken together, one semop(2) per
+ * set in a fixed order, so transactions cannot deadlock. Keys that
+ * share a stripe also share a lock.
+ *
+ * === POSIX IPC
+ *
+ * The same classes under SystemVIPC::POSIX use mq_open(3), sem_init(3)
+ * and shm_open(3) where they exist, with names instead of keys:
+ *
+ *     mq = SystemVIPC::POSIX::MessageQueue.new('/app', IPC_CREAT | 0660)
+ *     mq.send(prio, 'hello')
+ *     sh = SystemVIPC::POSIX::SharedMemory.new('/app', 4096, IPC_CREAT | 0660)
+ *
+ * Messages are received by priority, not by type. The posix_ cases of
+ * bench/bench_sysvipc compare both backends.
+ *
+ * === Statistics
+ *
+ * Count operations, bytes, retries and latencies of one object:
+ *
+ *     mq.enable_stats
+ *     mq.stats    # => {:ops => 2, :bytes => 14, :histogram => [...], ...}
+ *
+ * Or of every object created afterwards, summed over the process:
+ *
+ *     SystemVIPC.enable_stats
+ *     SystemVIPC.stats
+ *
+ * === Tracing
+ *
+ * Where <tt>sys/sdt.h</tt> is installed (systemtap-sdt-dev or
+ * systemtap-sdt-devel), the module carries USDT probes of provider
+ * +sysvipc+, which cost a nop each until a tracer attaches:
+ *
+ * msgsnd__entry, msgrcv__entry, semop__entry::
+ *   id, message type or first semaphore number, bytes or operations
+ * msgsnd__return, msgrcv__return, semop__return::
+ *   the same, then retries and errno
+ * msgctl__entry, shmctl__entry, semctl__entry::
+ *   id, semaphore number for semctl, command
+ * msgctl__return, shmctl__return, semctl__return::
+ *   the same, then result and errno
+ * shmat__entry, shmat__return::
+ *   id, then flags or address and errno
+ * shmdt__entry, shmdt__return::
+ *   id, then address or errno
+ *
+ * Operations are timed from entry to return, spinning and waiting
+ * included. For instance, the latency of msgrcv per queue:
+ *
+ *     bpftrace -p PID -e '
+ *       usdt:sysvipc.so:sysvipc:msgrcv__entry { @t[tid] = nsecs }
+ *       usdt:sysvipc.so:sysvipc:msgrcv__return /@t[tid]/ {
+ *         @us[arg0] = hist((nsecs - @t[tid]) / 1000); delete(@t[tid]) }'
+ *
  * == Installation
  *
  * 1. <tt>ruby extconf.rb</tt>
@@ -1174,18 +12324,53 @@ rb_perm_mode (obj)
  * == Testing
  *
  * 1. <tt>./test_sysvipc</tt>
+ *
+ * == Benchmarks
+ *
+ * 1. <tt>bench/bench_sysvipc -o after.json -c before.json</tt>
+ * 2. <tt>cc -O2 -o rawipc bench/rawipc.c && ./rawipc -o raw.json</tt>
+ *
+ * Both write one JSON record per case, the second one for the bare
+ * system calls.
  */
 
 void Init_sysvipc ()
 {
   VALUE mSystemVIPC, cPermission, cIPCObject, cSemaphoreOparation;
   VALUE cMessageQueue, cSemaphore, cSharedMemory;
+  VALUE cSnapshot, cBroadcast, cSubscriber, cSharedBitmap, cSharedBloomFilter;
+  VALUE cMetrics, cCounter, cGauge, cHistogram;
+  VALUE mRPC, cRPCClient, cRPCServer;
+  VALUE cTaskPool, cTaskPoolWorker;
+  VALUE cSharedStruct;
+  VALUE cBarrier, cLatch, cShardedQueue, cLockTable;
+  VALUE mPOSIX, cPOSIXMessageQueue, cPOSIXSemaphore, cPOSIXSharedMemory;
+
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  rb_ext_ractor_safe (1);
+#endif
+  crc32c_init ();
+  bitmap_init ();
+  copy_init ();
+#ifdef HAVE_PTHREAD_H
+  pthread_atfork (NULL, NULL, ipc_atfork_child);
+#endif
 
   mSystemVIPC = rb_define_module ("SystemVIPC");
   rb_define_module_function (mSystemVIPC, "ftok", rb_ftok, 2);
+  rb_define_module_function (mSystemVIPC, "stats", rb_ipc_s_stats, 0);
+  rb_define_module_function (mSystemVIPC, "enable_stats",
+			     rb_ipc_s_enable_stats, 0);
+  rb_define_module_function (mSystemVIPC, "disable_stats",
+			     rb_ipc_s_disable_stats, 0);
+  rb_define_module_function (mSystemVIPC, "set_affinity",
+			     rb_ipc_s_set_affinity, -1);
+  rb_define_module_function (mSystemVIPC, "affinity",
+			     rb_ipc_s_affinity, -1);
 
   cPermission =
     rb_define_class_under (mSystemVIPC, "Permission", rb_cObject);
+  rb_undef_alloc_func (cPermission);
   rb_define_singleton_method (cPermission, "new", rb_perm_s_new, 1);
   rb_define_method (cPermission, "cuid", rb_perm_cuid, 0);
   rb_define_method (cPermission, "cgid", rb_perm_cgid, 0);
@@ -1196,10 +12381,20 @@ void Init_sysvipc ()
   cIPCObject =
     rb_define_class_under (mSystemVIPC, "IPCObject", rb_cObject);
   rb_define_method (cIPCObject, "remove", rb_ipc_remove, 0);
+  rb_define_method (cIPCObject, "enable_stats", rb_ipc_enable_stats, 0);
+  rb_define_method (cIPCObject, "disable_stats", rb_ipc_disable_stats, 0);
+  rb_define_method (cIPCObject, "stats", rb_ipc_stats, 0);
+  rb_define_method (cIPCObject, "enable_busy_poll",
+		    rb_ipc_enable_busy_poll, -1);
+  rb_define_method (cIPCObject, "disable_busy_poll",
+		    rb_ipc_disable_busy_poll, 0);
+  rb_define_method (cIPCObject, "busy_poll", rb_ipc_busy_poll, 0);
+  rb_undef_alloc_func (cIPCObject);
   rb_undef_method (CLASS_OF (cIPCObject), "new");
 
   cSemaphoreOparation =
     rb_define_class_under (mSystemVIPC, "SemaphoreOperation", rb_cObject);
+  rb_undef_alloc_func (cSemaphoreOparation);
   rb_define_singleton_method (cSemaphoreOparation, "new", rb_semop_s_new, -1);
   rb_define_method (cSemaphoreOparation, "pos", rb_semop_pos, 0);
   rb_define_method (cSemaphoreOparation, "value", rb_semop_value, 0);
@@ -1207,16 +12402,24 @@ void Init_sysvipc ()
 
   cError =
     rb_define_class_under (mSystemVIPC, "Error", rb_eStandardError);
+  cTimeoutError =
+    rb_define_class_under (mSystemVIPC, "TimeoutError", cError);
 
   cMessageQueue =
     rb_define_class_under (mSystemVIPC, "MessageQueue", cIPCObject);
+  rb_undef_alloc_func (cMessageQueue);
   rb_define_singleton_method (cMessageQueue, "new", rb_msg_s_new, -1);
+  rb_define_singleton_method (cMessageQueue, "for_id", rb_msg_s_for_id, 1);
+  rb_define_method (cMessageQueue, "id", rb_ipc_id, 0);
   rb_define_method (cMessageQueue, "send", rb_msg_send, -1);
   rb_define_method (cMessageQueue, "recv", rb_msg_recv, -1);
 
   cSemaphore =
     rb_define_class_under (mSystemVIPC, "Semaphore", cIPCObject);
+  rb_undef_alloc_func (cSemaphore);
   rb_define_singleton_method (cSemaphore, "new", rb_sem_s_new, -1);
+  rb_define_singleton_method (cSemaphore, "for_id", rb_sem_s_for_id, 1);
+  rb_define_method (cSemaphore, "id", rb_ipc_id, 0);
   rb_define_method (cSemaphore, "to_a", rb_sem_to_a, 0);
   rb_define_method (cSemaphore, "set_all", rb_sem_set_all, 1);
   rb_define_method (cSemaphore, "value", rb_sem_value, 1);
@@ -1224,18 +12427,282 @@ void Init_sysvipc ()
   rb_define_method (cSemaphore, "n_count", rb_sem_ncnt, 1);
   rb_define_method (cSemaphore, "z_count", rb_sem_zcnt, 1);
   rb_define_method (cSemaphore, "pid", rb_sem_pid, 1);
-  rb_define_method (cSemaphore, "apply", rb_sem_apply, 1);
+  rb_define_method (cSemaphore, "apply", rb_sem_apply, -1);
   rb_define_method (cSemaphore, "size", rb_sem_size, 0);
 
   cSharedMemory =
     rb_define_class_under (mSystemVIPC, "SharedMemory", cIPCObject);
+  rb_undef_alloc_func (cSharedMemory);
   rb_define_singleton_method (cSharedMemory, "new", rb_shm_s_new, -1);
+  rb_define_singleton_method (cSharedMemory, "for_id", rb_shm_s_for_id, 1);
+  rb_define_method (cSharedMemory, "id", rb_ipc_id, 0);
   rb_define_method (cSharedMemory, "attach", rb_shm_attach, -1);
   rb_define_method (cSharedMemory, "detach", rb_shm_detach, 0);
   rb_define_method (cSharedMemory, "read", rb_shm_read, -1);
   rb_define_method (cSharedMemory, "write", rb_shm_write, -1);
+  rb_define_method (cSharedMemory, "read_into", rb_shm_read_into, -1);
+  rb_define_method (cSharedMemory, "each_chunk", rb_shm_each_chunk, -1);
+  rb_define_method (cSharedMemory, "fill", rb_shm_fill, -1);
+  rb_define_method (cSharedMemory, "copy_threads=",
+		    rb_shm_set_copy_threads, 1);
+  rb_define_method (cSharedMemory, "copy_threads", rb_shm_copy_threads, 0);
+  rb_define_method (cSharedMemory, "index", rb_shm_index, -1);
+  rb_define_method (cSharedMemory, "compare", rb_shm_compare, -1);
+  rb_define_method (cSharedMemory, "checksum", rb_shm_checksum, -1);
+  rb_define_method (cSharedMemory, "diff_ranges", rb_shm_diff_ranges, -1);
+  rb_define_method (cSharedMemory, "synchronize", rb_shm_synchronize, -1);
+  rb_define_method (cSharedMemory, "locked_read", rb_shm_locked_read, -1);
+  rb_define_method (cSharedMemory, "locked_write", rb_shm_locked_write, -1);
+  rb_define_method (cSharedMemory, "locked_swap", rb_shm_locked_swap, -1);
+  rb_define_method (cSharedMemory, "locked_increment",
+		    rb_shm_locked_increment, -1);
+  rb_define_method (cSharedMemory, "load_from", rb_shm_load_from, -1);
+  rb_define_method (cSharedMemory, "dump_to", rb_shm_dump_to, -1);
+  rb_define_method (cSharedMemory, "save", rb_shm_save, -1);
+  rb_define_singleton_method (cSharedMemory, "restore", rb_shm_s_restore, -1);
   rb_define_method (cSharedMemory, "size", rb_shm_size, 0);
 
+  mPOSIX = rb_define_module_under (mSystemVIPC, "POSIX");
+#ifdef HAVE_MQ_OPEN
+  cPOSIXMessageQueue =
+    rb_define_class_under (mPOSIX, "MessageQueue", cIPCObject);
+  rb_undef_alloc_func (cPOSIXMessageQueue);
+  rb_define_singleton_method (cPOSIXMessageQueue, "new", rb_pmq_s_new, -1);
+  rb_define_method (cPOSIXMessageQueue, "send", rb_pmq_send, -1);
+  rb_define_method (cPOSIXMessageQueue, "recv", rb_pmq_recv, -1);
+  rb_define_method (cPOSIXMessageQueue, "fileno", rb_pmq_fileno, 0);
+#endif
+#if defined(HAVE_SHM_OPEN) && defined(HAVE_SEM_INIT)
+  cPOSIXSemaphore =
+    rb_define_class_under (mPOSIX, "Semaphore", cIPCObject);
+  rb_undef_alloc_func (cPOSIXSemaphore);
+  rb_define_singleton_method (cPOSIXSemaphore, "new", rb_psem_s_new, -1);
+  rb_define_method (cPOSIXSemaphore, "to_a", rb_psem_to_a, 0);
+  rb_define_method (cPOSIXSemaphore, "set_all", rb_psem_set_all, 1);
+  rb_define_method (cPOSIXSemaphore, "value", rb_psem_value, 1);
+  rb_define_method (cPOSIXSemaphore, "set_value", rb_psem_set_value, 2);
+  rb_define_method (cPOSIXSemaphore, "n_count", rb_psem_notimplement, 1);
+  rb_define_method (cPOSIXSemaphore, "z_count", rb_psem_notimplement, 1);
+  rb_define_method (cPOSIXSemaphore, "pid", rb_psem_notimplement, 1);
+  rb_define_method (cPOSIXSemaphore, "apply", rb_psem_apply, -1);
+  rb_define_method (cPOSIXSemaphore, "size", rb_psem_size, 0);
+#endif
+#ifdef HAVE_SHM_OPEN
+  cPOSIXSharedMemory =
+    rb_define_class_under (mPOSIX, "SharedMemory", cSharedMemory);
+  rb_undef_alloc_func (cPOSIXSharedMemory);
+  rb_define_singleton_method (cPOSIXSharedMemory, "new", rb_pshm_s_new, -1);
+  rb_undef_method (rb_singleton_class (cPOSIXSharedMemory), "for_id");
+  rb_undef_method (cPOSIXSharedMemory, "id");
+  rb_define_method (cPOSIXSharedMemory, "attach", rb_pshm_attach, -1);
+  rb_define_method (cPOSIXSharedMemory, "detach", rb_pshm_detach, 0);
+#endif
+
+  cSnapshot =
+    rb_define_class_under (mSystemVIPC, "Snapshot", rb_cObject);
+  rb_undef_alloc_func (cSnapshot);
+  rb_define_singleton_method (cSnapshot, "new", rb_snapshot_s_new, -1);
+  rb_define_singleton_method (cSnapshot, "bytesize",
+			      rb_snapshot_s_bytesize, 1);
+  rb_define_method (cSnapshot, "publish", rb_snapshot_publish, 1);
+  rb_define_method (cSnapshot, "read", rb_snapshot_read, 0);
+  rb_define_method (cSnapshot, "read_with_version",
+		    rb_snapshot_read_with_version, 0);
+  rb_define_method (cSnapshot, "version", rb_snapshot_version, 0);
+  rb_define_method (cSnapshot, "capacity", rb_snapshot_capacity, 0);
+
+  cBroadcast =
+    rb_define_class_under (mSystemVIPC, "Broadcast", rb_cObject);
+  rb_undef_alloc_func (cBroadcast);
+  rb_define_singleton_method (cBroadcast, "new", rb_broadcast_s_new, -1);
+  rb_define_singleton_method (cBroadcast, "bytesize",
+			      rb_broadcast_s_bytesize, -1);
+  rb_define_method (cBroadcast, "publish", rb_broadcast_publish, -1);
+  rb_define_method (cBroadcast, "subscribe", rb_broadcast_subscribe, -1);
+  rb_define_method (cBroadcast, "subscribers", rb_broadcast_subscribers, 0);
+  rb_define_method (cBroadcast, "slow_subscribers",
+		    rb_broadcast_slow_subscribers, 1);
+  rb_define_method (cBroadcast, "capacity", rb_broadcast_capacity, 0);
+
+  cSubscriber =
+    rb_define_class_under (cBroadcast, "Subscriber", rb_cObject);
+  rb_undef_alloc_func (cSubscriber);
+  rb_undef_method (CLASS_OF (cSubscriber), "new");
+  rb_define_method (cSubscriber, "read", rb_subscriber_read, -1);
+  rb_define_method (cSubscriber, "lost", rb_subscriber_lost, 0);
+  rb_define_method (cSubscriber, "lag", rb_subscriber_lag, 0);
+  rb_define_method (cSubscriber, "index", rb_subscriber_index, 0);
+  rb_define_method (cSubscriber, "close", rb_subscriber_close, 0);
+
+  cSharedBitmap =
+    rb_define_class_under (mSystemVIPC, "SharedBitmap", rb_cObject);
+  rb_undef_alloc_func (cSharedBitmap);
+  rb_define_singleton_method (cSharedBitmap, "new", rb_bitmap_s_new, -1);
+  rb_define_singleton_method (cSharedBitmap, "bytesize",
+			      rb_bitmap_s_bytesize, 1);
+  rb_define_method (cSharedBitmap, "set", rb_bitmap_set, 1);
+  rb_define_method (cSharedBitmap, "clear", rb_bitmap_clear, 1);
+  rb_define_method (cSharedBitmap, "[]", rb_bitmap_aref, 1);
+  rb_define_method (cSharedBitmap, "set_many", rb_bitmap_set_many, 1);
+  rb_define_method (cSharedBitmap, "test_many", rb_bitmap_test_many, 1);
+  rb_define_method (cSharedBitmap, "count", rb_bitmap_count, 0);
+  rb_define_method (cSharedBitmap, "union!", rb_bitmap_union_bang, 1);
+  rb_define_method (cSharedBitmap, "intersect!", rb_bitmap_intersect_bang, 1);
+  rb_define_method (cSharedBitmap, "union_count", rb_bitmap_union_count, 1);
+  rb_define_method (cSharedBitmap, "intersection_count",
+		    rb_bitmap_intersection_count, 1);
+  rb_define_method (cSharedBitmap, "clear_all", rb_bitmap_clear_all, 0);
+  rb_define_method (cSharedBitmap, "size", rb_bitmap_size, 0);
+
+  cSharedBloomFilter =
+    rb_define_class_under (mSystemVIPC, "SharedBloomFilter", rb_cObject);
+  rb_undef_alloc_func (cSharedBloomFilter);
+  rb_define_singleton_method (cSharedBloomFilter, "new", rb_bloom_s_new, -1);
+  rb_define_singleton_method (cSharedBloomFilter, "bytesize",
+			      rb_bloom_s_bytesize, 1);
+  rb_define_method (cSharedBloomFilter, "add", rb_bloom_add, 1);
+  rb_define_method (cSharedBloomFilter, "include?", rb_bloom_include_p, 1);
+  rb_define_method (cSharedBloomFilter, "add_many", rb_bloom_add_many, 1);
+  rb_define_method (cSharedBloomFilter, "include_many",
+		    rb_bloom_include_many, 1);
+  rb_define_method (cSharedBloomFilter, "hashes", rb_bloom_hashes, 0);
+  rb_define_method (cSharedBloomFilter, "count", rb_bitmap_count, 0);
+  rb_define_method (cSharedBloomFilter, "union!", rb_bitmap_union_bang, 1);
+  rb_define_method (cSharedBloomFilter, "intersect!",
+		    rb_bitmap_intersect_bang, 1);
+  rb_define_method (cSharedBloomFilter, "union_count",
+		    rb_bitmap_union_count, 1);
+  rb_define_method (cSharedBloomFilter, "intersection_count",
+		    rb_bitmap_intersection_count, 1);
+  rb_define_method (cSharedBloomFilter, "clear_all", rb_bitmap_clear_all, 0);
+  rb_define_method (cSharedBloomFilter, "size", rb_bitmap_size, 0);
+
+  cMetrics = rb_define_class_under (mSystemVIPC, "Metrics", rb_cObject);
+  rb_undef_alloc_func (cMetrics);
+  rb_define_singleton_method (cMetrics, "new", rb_metrics_s_new, -1);
+  rb_define_singleton_method (cMetrics, "bytesize",
+			      rb_metrics_s_bytesize, -1);
+  rb_define_method (cMetrics, "counter", rb_metrics_counter, 1);
+  rb_define_method (cMetrics, "gauge", rb_metrics_gauge, 1);
+  rb_define_method (cMetrics, "histogram", rb_metrics_histogram, 2);
+  rb_define_method (cMetrics, "snapshot", rb_metrics_snapshot, 0);
+
+  cCounter = rb_define_class_under (cMetrics, "Counter", rb_cObject);
+  rb_undef_alloc_func (cCounter);
+  rb_undef_method (CLASS_OF (cCounter), "new");
+  rb_define_method (cCounter, "increment", rb_counter_increment, -1);
+
+  cGauge = rb_define_class_under (cMetrics, "Gauge", rb_cObject);
+  rb_undef_alloc_func (cGauge);
+  rb_undef_method (CLASS_OF (cGauge), "new");
+  rb_define_method (cGauge, "set", rb_gauge_set, 1);
+  rb_define_method (cGauge, "add", rb_gauge_add, 1);
+
+  cHistogram = rb_define_class_under (cMetrics, "Histogram", rb_cObject);
+  rb_undef_alloc_func (cHistogram);
+  rb_undef_method (CLASS_OF (cHistogram), "new");
+  rb_define_method (cHistogram, "observe", rb_histogram_observe, 1);
+
+  mRPC = rb_define_module_under (mSystemVIPC, "RPC");
+  rb_define_module_function (mRPC, "arena_bytesize",
+			     rb_rpc_s_arena_bytesize, -1);
+  cRemoteError = rb_define_class_under (mRPC, "RemoteError", cError);
+
+  cRPCClient = rb_define_class_under (mRPC, "Client", rb_cObject);
+  rb_undef_alloc_func (cRPCClient);
+  rb_define_singleton_method (cRPCClient, "new", rb_rpc_client_s_new, -1);
+  rb_define_method (cRPCClient, "request", rb_rpc_request, -1);
+  rb_define_method (cRPCClient, "response", rb_rpc_response, -1);
+  rb_define_method (cRPCClient, "call", rb_rpc_call, -1);
+  rb_define_method (cRPCClient, "outstanding", rb_rpc_outstanding, 0);
+
+  cRPCServer = rb_define_class_under (mRPC, "Server", rb_cObject);
+  rb_undef_alloc_func (cRPCServer);
+  rb_define_singleton_method (cRPCServer, "new", rb_rpc_server_s_new, -1);
+  rb_define_method (cRPCServer, "serve_once", rb_rpc_serve_once, -1);
+  rb_define_method (cRPCServer, "serve", rb_rpc_serve, 0);
+  rb_define_method (cRPCServer, "expired", rb_rpc_expired, 0);
+
+  cTaskPool = rb_define_class_under (mSystemVIPC, "TaskPool", rb_cObject);
+  rb_undef_alloc_func (cTaskPool);
+  rb_define_singleton_method (cTaskPool, "new", rb_taskpool_s_new, -1);
+  rb_define_singleton_method (cTaskPool, "bytesize",
+			      rb_taskpool_s_bytesize, -1);
+  rb_define_method (cTaskPool, "worker", rb_taskpool_worker, 1);
+  rb_define_method (cTaskPool, "close", rb_taskpool_close, 0);
+  rb_define_method (cTaskPool, "done?", rb_taskpool_done_p, 0);
+  rb_define_method (cTaskPool, "size", rb_taskpool_size, 0);
+
+  cTaskPoolWorker = rb_define_class_under (cTaskPool, "Worker", rb_cObject);
+  rb_undef_alloc_func (cTaskPoolWorker);
+  rb_undef_method (CLASS_OF (cTaskPoolWorker), "new");
+  rb_define_method (cTaskPoolWorker, "push", rb_taskpool_push, 1);
+  rb_define_method (cTaskPoolWorker, "pop", rb_taskpool_pop, -1);
+  rb_define_method (cTaskPoolWorker, "index", rb_taskpool_index, 0);
+  rb_define_method (cTaskPoolWorker, "steals", rb_taskpool_steals, 0);
+
+  cBarrier = rb_define_class_under (mSystemVIPC, "Barrier", rb_cObject);
+  rb_undef_alloc_func (cBarrier);
+  rb_define_singleton_method (cBarrier, "new", rb_barrier_s_new, -1);
+  rb_define_singleton_method (cBarrier, "bytesize", rb_barrier_s_bytesize, 1);
+  rb_define_method (cBarrier, "wait", rb_barrier_wait, -1);
+  rb_define_method (cBarrier, "late", rb_barrier_late, 0);
+  rb_define_method (cBarrier, "waiting", rb_barrier_waiting, 0);
+  rb_define_method (cBarrier, "generation", rb_barrier_generation, 0);
+  rb_define_method (cBarrier, "parties", rb_barrier_parties, 0);
+
+  cLatch = rb_define_class_under (mSystemVIPC, "CountDownLatch", rb_cObject);
+  rb_undef_alloc_func (cLatch);
+  rb_define_singleton_method (cLatch, "new", rb_latch_s_new, -1);
+  rb_define_singleton_method (cLatch, "bytesize", rb_latch_s_bytesize, 1);
+  rb_define_method (cLatch, "count_down", rb_latch_count_down, -1);
+  rb_define_method (cLatch, "wait", rb_latch_wait, -1);
+  rb_define_method (cLatch, "count", rb_latch_count, 0);
+  rb_define_method (cLatch, "late", rb_latch_late, 0);
+
+  cShardedQueue = rb_define_class_under (mSystemVIPC, "ShardedQueue",
+					 rb_cObject);
+  rb_undef_alloc_func (cShardedQueue);
+  rb_define_singleton_method (cShardedQueue, "new", rb_sharded_s_new, -1);
+  rb_define_method (cShardedQueue, "send", rb_sharded_send, -1);
+  rb_define_method (cShardedQueue, "recv", rb_sharded_recv, -1);
+  rb_define_method (cShardedQueue, "shard", rb_sharded_shard, 1);
+  rb_define_method (cShardedQueue, "queues", rb_sharded_queues, 0);
+  rb_define_method (cShardedQueue, "affinity", rb_sharded_affinity, 0);
+  rb_define_method (cShardedQueue, "stats", rb_sharded_stats, 0);
+
+  cLockTable = rb_define_class_under (mSystemVIPC, "LockTable", rb_cObject);
+  rb_undef_alloc_func (cLockTable);
+  rb_define_singleton_method (cLockTable, "new", rb_lock_table_s_new, -1);
+  rb_define_method (cLockTable, "lock", rb_lock_table_lock, -1);
+  rb_define_method (cLockTable, "unlock", rb_lock_table_unlock, 1);
+  rb_define_method (cLockTable, "synchronize", rb_lock_table_synchronize, -1);
+  rb_define_method (cLockTable, "stripe", rb_lock_table_stripe, 1);
+  rb_define_method (cLockTable, "stripes", rb_lock_table_stripes, 0);
+  rb_define_method (cLockTable, "semaphores", rb_lock_table_semaphores, 0);
+  rb_define_method (cLockTable, "reset", rb_lock_table_reset, 0);
+
+  id_sstruct_layout = rb_intern ("__layout__");
+  cSharedStruct = rb_define_class_under (mSystemVIPC, "SharedStruct",
+					 rb_cObject);
+  rb_undef_alloc_func (cSharedStruct);
+  rb_define_singleton_method (cSharedStruct, "define",
+			      rb_sstruct_s_define, -1);
+  rb_define_singleton_method (cSharedStruct, "new", rb_sstruct_s_new, -1);
+  rb_define_singleton_method (cSharedStruct, "bytesize",
+			      rb_sstruct_s_bytesize, -1);
+  rb_define_singleton_method (cSharedStruct, "alignment",
+			      rb_sstruct_s_alignment, 0);
+  rb_define_singleton_method (cSharedStruct, "members",
+			      rb_sstruct_s_members, 0);
+  rb_define_singleton_method (cSharedStruct, "offsetof",
+			      rb_sstruct_s_offsetof, 1);
+  rb_define_method (cSharedStruct, "[]", rb_sstruct_aref, 1);
+  rb_define_method (cSharedStruct, "size", rb_sstruct_size, 0);
+  rb_define_method (cSharedStruct, "offset", rb_sstruct_offset, 0);
+  rb_define_method (cSharedStruct, "each", rb_sstruct_each, 0);
+  rb_define_method (cSharedStruct, "to_h", rb_sstruct_to_h, -1);
+
   rb_define_const (mSystemVIPC, "IPC_PRIVATE", INT2FIX (IPC_PRIVATE));
   rb_define_const (mSystemVIPC, "IPC_CREAT", INT2FIX (IPC_CREAT));
   rb_define_const (mSystemVIPC, "IPC_EXCL", INT2FIX (IPC_EXCL));